@@ -26,10 +26,17 @@ extern "C" {
 
 typedef size_t (* jpg_out_cb)(void * arg, size_t index, const void* data, size_t len);
 
+typedef struct {
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+} jpg_rect_t;
+
 /**
  * @brief Convert image buffer to JPEG
  *
- * @param src       Source buffer in RGB565, RGB888, YUYV or GRAYSCALE format
+ * @param src       Source buffer in RGB565, RGB888, YUYV, GRAYSCALE or JPEG format
  * @param src_len   Length in bytes of the source buffer
  * @param width     Width in pixels of the source image
  * @param height    Height in pixels of the source image
@@ -57,7 +64,7 @@ bool frame2jpg_cb(camera_fb_t * fb, uint8_t quality, jpg_out_cb cb, void * arg);
 /**
  * @brief Convert image buffer to JPEG buffer
  *
- * @param src       Source buffer in RGB565, RGB888, YUYV or GRAYSCALE format
+ * @param src       Source buffer in RGB565, RGB888, YUYV, GRAYSCALE or JPEG format
  * @param src_len   Length in bytes of the source buffer
  * @param width     Width in pixels of the source image
  * @param height    Height in pixels of the source image
@@ -83,6 +90,78 @@ bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixf
  */
 bool frame2jpg(camera_fb_t * fb, uint8_t quality, uint8_t ** out, size_t * out_len);
 
+/**
+ * @brief Requantize a baseline JPEG to a lower quality without decoding it to pixels
+ *
+ * The scan is decoded only as far as the quantized DCT coefficients, which are
+ * scaled to the tables fmt2jpg() uses at the given quality and Huffman coded
+ * again. There is no IDCT, DCT or colour conversion. Table entries that are
+ * already coarser in the source are kept.
+ *
+ * @param src       Source JPEG, baseline with 8 bit samples and a single scan
+ * @param src_len   Length in bytes of the source
+ * @param quality   JPEG quality of the resulting image
+ * @param cp        Callback to be called to write the bytes of the output JPEG
+ * @param arg       Pointer to be passed to the callback
+ *
+ * @return true on success
+ */
+bool jpg2jpg_cb(const uint8_t *src, size_t src_len, uint8_t quality, jpg_out_cb cb, void * arg);
+
+/**
+ * @brief Requantize a baseline JPEG to a lower quality into a new buffer
+ *
+ * @param src       Source JPEG, baseline with 8 bit samples and a single scan
+ * @param src_len   Length in bytes of the source
+ * @param quality   JPEG quality of the resulting image
+ * @param out       Pointer to be populated with the address of the resulting buffer.
+ *                  You MUST free the pointer once you are done with it.
+ * @param out_len   Pointer to be populated with the length of the output buffer
+ *
+ * @return true on success
+ */
+bool jpg2jpg(const uint8_t *src, size_t src_len, uint8_t quality, uint8_t ** out, size_t * out_len);
+
+/**
+ * @brief Crop a baseline JPEG without decoding it to pixels
+ *
+ * Only whole MCUs can be cut out, so the rectangle is widened to MCU
+ * boundaries (16x8 pixels for 4:2:2 camera frames). The kept coefficients
+ * are copied unchanged, so each kept block decodes to the same pixels as
+ * in the source.
+ *
+ * @param src       Source JPEG, baseline with 8 bit samples and a single scan
+ * @param src_len   Length in bytes of the source
+ * @param rect      Area to keep, in pixels. Updated to the area actually kept.
+ * @param out       Pointer to be populated with the address of the resulting buffer.
+ *                  You MUST free the pointer once you are done with it.
+ * @param out_len   Pointer to be populated with the length of the output buffer
+ *
+ * @return true on success
+ */
+bool jpg_crop(const uint8_t *src, size_t src_len, jpg_rect_t *rect, uint8_t ** out, size_t * out_len);
+
+/**
+ * @brief Luminance DC coefficients of a baseline JPEG, one per 8x8 block
+ *
+ * The scan is entropy decoded and every coefficient but the luminance DC
+ * is dropped, so the result is a 1/8 scale thumbnail of the image: each
+ * value is 8 times its block's mean less 128 (-1024 to 1016), whatever the
+ * quality the image was coded at.
+ * Blocks are in raster order, including the padding blocks that fill the
+ * last MCU row and column.
+ *
+ * @param src       Source JPEG, baseline with 8 bit samples and a single scan
+ * @param src_len   Length in bytes of the source
+ * @param dc        Buffer for the DC values
+ * @param max       Number of values dc can hold
+ * @param w         Pointer to be populated with the number of blocks across
+ * @param h         Pointer to be populated with the number of blocks down
+ *
+ * @return true on success, false also if the blocks do not fit in dc
+ */
+bool jpg_dc_luma(const uint8_t *src, size_t src_len, int16_t *dc, size_t max, uint16_t *w, uint16_t *h);
+
 /**
  * @brief Convert image buffer to BMP buffer
  *
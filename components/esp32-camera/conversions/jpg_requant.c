@@ -0,0 +1,906 @@
+// Copyright 2015-2025 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Coefficient domain JPEG requantization and lossless cropping.
+//
+// The scan is Huffman decoded to quantized DCT coefficients, each coefficient
+// is rescaled from the source table to a coarser one and the result is
+// Huffman coded again with the standard tables. A crop keeps only the MCUs
+// inside a rectangle, with the DC predictors recomputed along the new rows.
+// The luminance DC map skips every block and only keeps its DC value.
+// Pixels are never reconstructed. Huffman decoding follows tjpgd (canonical tables with a
+// lookup for short codes), the output side follows jpge (standard tables,
+// 24 bit bit buffer, 0xFF stuffing). Quantization tables are kept in zigzag
+// order throughout, as they are stored in DQT and as coefficients arrive.
+
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include "img_converters.h"
+#include "esp_heap_caps.h"
+#include "sdkconfig.h"
+
+#if defined(ARDUINO_ARCH_ESP32) && defined(CONFIG_ARDUHAL_ESP_LOG)
+#include "esp32-hal-log.h"
+#define TAG ""
+#else
+#include "esp_log.h"
+static const char* TAG = "jpg_requant";
+#endif
+
+#define M_SOF0  0xC0
+#define M_SOF1  0xC1
+#define M_DHT   0xC4
+#define M_RST0  0xD0
+#define M_SOI   0xD8
+#define M_EOI   0xD9
+#define M_SOS   0xDA
+#define M_DQT   0xDB
+#define M_DRI   0xDD
+
+#define MAX_COMPONENTS  4
+#define HUFF_LUT_BITS   9       // Codes up to this long are decoded with one lookup
+#define OUT_BUF_SIZE    512
+
+// Standard tables from ITU T.81 Annex K, as used by jpge. Quantization
+// tables are in zigzag order.
+static const uint8_t std_lum_quant[64] = { 16,11,12,14,12,10,16,14,13,14,18,17,16,19,24,40,26,24,22,22,24,49,35,37,29,40,58,51,61,60,57,51,56,55,64,72,92,78,64,68,87,69,55,56,80,109,81,87,95,98,103,104,103,62,77,113,121,112,100,120,92,101,103,99 };
+static const uint8_t std_croma_quant[64] = { 17,18,18,24,21,24,47,26,26,47,99,66,56,66,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99 };
+static const uint8_t dc_lum_bits[17] = { 0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0 };
+static const uint8_t dc_chroma_bits[17] = { 0,0,3,1,1,1,1,1,1,1,1,1,0,0,0,0,0 };
+static const uint8_t dc_val[12] = { 0,1,2,3,4,5,6,7,8,9,10,11 };
+static const uint8_t ac_lum_bits[17] = { 0,0,2,1,3,3,2,4,3,5,5,4,4,0,0,1,0x7d };
+static const uint8_t ac_lum_val[162] = {
+    0x01,0x02,0x03,0x00,0x04,0x11,0x05,0x12,0x21,0x31,0x41,0x06,0x13,0x51,0x61,0x07,0x22,0x71,0x14,0x32,0x81,0x91,0xa1,0x08,0x23,0x42,0xb1,0xc1,0x15,0x52,0xd1,0xf0,
+    0x24,0x33,0x62,0x72,0x82,0x09,0x0a,0x16,0x17,0x18,0x19,0x1a,0x25,0x26,0x27,0x28,0x29,0x2a,0x34,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,0x49,
+    0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x83,0x84,0x85,0x86,0x87,0x88,0x89,
+    0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,0xc4,0xc5,
+    0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe1,0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf1,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
+    0xf9,0xfa
+};
+static const uint8_t ac_chroma_bits[17] = { 0,0,2,1,2,4,4,3,4,7,5,4,4,0,1,2,0x77 };
+static const uint8_t ac_chroma_val[162] = {
+    0x00,0x01,0x02,0x03,0x11,0x04,0x05,0x21,0x31,0x06,0x12,0x41,0x51,0x07,0x61,0x71,0x13,0x22,0x32,0x81,0x08,0x14,0x42,0x91,0xa1,0xb1,0xc1,0x09,0x23,0x33,0x52,0xf0,
+    0x15,0x62,0x72,0xd1,0x0a,0x16,0x24,0x34,0xe1,0x25,0xf1,0x17,0x18,0x19,0x1a,0x26,0x27,0x28,0x29,0x2a,0x35,0x36,0x37,0x38,0x39,0x3a,0x43,0x44,0x45,0x46,0x47,0x48,
+    0x49,0x4a,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5a,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6a,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7a,0x82,0x83,0x84,0x85,0x86,0x87,
+    0x88,0x89,0x8a,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9a,0xa2,0xa3,0xa4,0xa5,0xa6,0xa7,0xa8,0xa9,0xaa,0xb2,0xb3,0xb4,0xb5,0xb6,0xb7,0xb8,0xb9,0xba,0xc2,0xc3,
+    0xc4,0xc5,0xc6,0xc7,0xc8,0xc9,0xca,0xd2,0xd3,0xd4,0xd5,0xd6,0xd7,0xd8,0xd9,0xda,0xe2,0xe3,0xe4,0xe5,0xe6,0xe7,0xe8,0xe9,0xea,0xf2,0xf3,0xf4,0xf5,0xf6,0xf7,0xf8,
+    0xf9,0xfa
+};
+
+typedef struct {
+    uint16_t lut[1 << HUFF_LUT_BITS];   // Code length << 8 | symbol, 0 for longer codes
+    int32_t maxcode[17];                // Largest code of each length, -1 if none
+    int32_t valptr[17];                 // Index in val of a code of each length, minus the code
+    uint8_t val[256];
+    bool loaded;
+} huff_dec_t;
+
+typedef struct {
+    uint16_t code[256];
+    uint8_t size[256];                  // 0 if the table has no code for the symbol
+} huff_enc_t;
+
+typedef struct {
+    uint8_t id;
+    uint8_t h, v;
+    uint8_t tq;
+    uint8_t td, ta;                     // Source Huffman tables
+    int dc_in;                          // DC predictors, source and output
+    int dc_out;
+} component_t;
+
+typedef struct {
+    // Input
+    const uint8_t *p;
+    const uint8_t *end;
+    uint32_t bit_buf;                   // Left aligned
+    int bits;
+    bool marker;                        // Reached a marker, reading zeros
+    int padded;                         // Zero bytes read at a marker or the end
+    // Output
+    jpg_out_cb cb;
+    void *arg;
+    size_t index;
+    uint8_t out[OUT_BUF_SIZE];
+    size_t out_len;
+    uint32_t out_bits;
+    int out_count;
+    bool ok;
+    // Tables
+    uint8_t quality;
+    uint32_t q_mul[4][64];              // q_src / q_out, 16.16
+    uint8_t q_dc[4];                    // Source DC quantizers
+    bool q_loaded[4];
+    huff_dec_t dc_dec[2];
+    huff_dec_t ac_dec[2];
+    huff_enc_t dc_enc[2];
+    huff_enc_t ac_enc[2];
+    // Frame
+    uint16_t width, height;
+    uint8_t hmax, vmax;
+    int ncomp;
+    component_t comp[MAX_COMPONENTS];
+    uint16_t restart;
+    // Crop, in MCUs; x1 == 0 keeps the whole frame
+    jpg_rect_t *rect;
+    uint16_t crop_x0, crop_y0, crop_x1, crop_y1;
+    // Luminance DC map instead of an output image, when dc_map is set
+    int16_t *dc_map;
+    size_t dc_max;
+    uint16_t dc_w, dc_h;
+} requant_t;
+
+static void *_malloc(size_t size)
+{
+    void * res = malloc(size);
+    if(res) {
+        return res;
+    }
+
+    // check if SPIRAM is enabled and is allocatable
+#if ((CONFIG_SPIRAM || CONFIG_SPIRAM_SUPPORT) && (CONFIG_SPIRAM_USE_CAPS_ALLOC || CONFIG_SPIRAM_USE_MALLOC))
+    return heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#endif
+    return NULL;
+}
+
+static bool huff_build_dec(huff_dec_t *h, const uint8_t *bits, const uint8_t *val)
+{
+    memset(h->lut, 0, sizeof(h->lut));
+    int32_t code = 0;
+    int k = 0;
+    for(int l = 1; l <= 16; l++) {
+        h->valptr[l] = k - code;
+        for(int i = 0; i < bits[l]; i++, k++, code++) {
+            if(code >= (1 << l)) {
+                return false;
+            }
+            h->val[k] = val[k];
+            if(l <= HUFF_LUT_BITS) {
+                int shift = HUFF_LUT_BITS - l;
+                for(int j = code << shift; j < (code + 1) << shift; j++) {
+                    h->lut[j] = l << 8 | val[k];
+                }
+            }
+        }
+        h->maxcode[l] = bits[l] ? code - 1 : -1;
+        code <<= 1;
+    }
+    h->loaded = true;
+    return true;
+}
+
+static void huff_build_enc(huff_enc_t *h, const uint8_t *bits, const uint8_t *val)
+{
+    memset(h->size, 0, sizeof(h->size));
+    uint16_t code = 0;
+    int k = 0;
+    for(int l = 1; l <= 16; l++) {
+        for(int i = 0; i < bits[l]; i++, k++) {
+            h->code[val[k]] = code++;
+            h->size[val[k]] = l;
+        }
+        code <<= 1;
+    }
+}
+
+static inline void fill_bits(requant_t *r)
+{
+    while(r->bits <= 24) {
+        uint32_t b = 0;
+        if(!r->marker && r->p < r->end) {
+            b = *r->p;
+            if(b != 0xFF) {
+                r->p++;
+            } else if(r->p + 1 < r->end && r->p[1] == 0) {
+                r->p += 2;
+            } else {
+                // Stop in front of the marker and pad with zeros
+                r->marker = true;
+                b = 0;
+                r->padded++;
+            }
+        } else {
+            r->padded++;
+        }
+        r->bit_buf |= b << (24 - r->bits);
+        r->bits += 8;
+    }
+}
+
+// Whether the decoder has used padding, i.e. the data ended inside the scan
+// or restart interval. Unused padding is what is left in the bit buffer.
+static inline bool ran_short(requant_t *r)
+{
+    return r->padded * 8 > r->bits;
+}
+
+static inline uint32_t get_bits(requant_t *r, int n)
+{
+    uint32_t v = r->bit_buf >> (32 - n);
+    r->bit_buf <<= n;
+    r->bits -= n;
+    return v;
+}
+
+static inline int huff_decode(requant_t *r, const huff_dec_t *h)
+{
+    fill_bits(r);
+    uint16_t e = h->lut[r->bit_buf >> (32 - HUFF_LUT_BITS)];
+    if(e) {
+        get_bits(r, e >> 8);
+        return e & 0xFF;
+    }
+    for(int l = HUFF_LUT_BITS + 1; l <= 16; l++) {
+        int32_t code = r->bit_buf >> (32 - l);
+        if(code <= h->maxcode[l]) {
+            get_bits(r, l);
+            return h->val[h->valptr[l] + code];
+        }
+    }
+    return -1;
+}
+
+// Read an s bit magnitude category value
+static inline int receive_extend(requant_t *r, int s)
+{
+    fill_bits(r);
+    int v = get_bits(r, s);
+    return v < (1 << (s - 1)) ? v - (1 << s) + 1 : v;
+}
+
+static void flush_out(requant_t *r)
+{
+    if(r->out_len && r->ok) {
+        if(r->cb(r->arg, r->index, r->out, r->out_len) != r->out_len) {
+            r->ok = false;
+        }
+        r->index += r->out_len;
+    }
+    r->out_len = 0;
+}
+
+static inline void emit_byte(requant_t *r, uint8_t b)
+{
+    r->out[r->out_len++] = b;
+    if(r->out_len == OUT_BUF_SIZE) {
+        flush_out(r);
+    }
+}
+
+static void emit_bytes(requant_t *r, const uint8_t *data, size_t len)
+{
+    while(len--) {
+        emit_byte(r, *data++);
+    }
+}
+
+static void emit_marker(requant_t *r, uint8_t marker, uint16_t len)
+{
+    emit_byte(r, 0xFF);
+    emit_byte(r, marker);
+    if(len) {
+        emit_byte(r, len >> 8);
+        emit_byte(r, len & 0xFF);
+    }
+}
+
+static inline void put_bits(requant_t *r, uint32_t bits, int len)
+{
+    r->out_bits |= bits << (24 - (r->out_count += len));
+    while(r->out_count >= 8) {
+        uint8_t c = (r->out_bits >> 16) & 0xFF;
+        emit_byte(r, c);
+        if(c == 0xFF) {
+            emit_byte(r, 0);
+        }
+        r->out_bits <<= 8;
+        r->out_count -= 8;
+    }
+}
+
+// Pad the entropy coded segment to a byte with one bits
+static void flush_bits(requant_t *r)
+{
+    put_bits(r, 0x7F, 7);
+    r->out_bits = 0;
+    r->out_count = 0;
+}
+
+static inline int bit_length(int v)
+{
+    return v ? 32 - __builtin_clz(v) : 0;
+}
+
+static inline int requantize(int v, uint32_t mul)
+{
+    if(v < 0) {
+        return -(int)(((uint32_t)-v * mul + 0x8000) >> 16);
+    }
+    return (int)(((uint32_t)v * mul + 0x8000) >> 16);
+}
+
+static inline bool put_value(requant_t *r, const huff_enc_t *h, int run, int v)
+{
+    int a = v < 0 ? -v : v;
+    int n = bit_length(a);
+    uint8_t sym = run << 4 | n;
+    if(!h->size[sym]) {
+        return false;
+    }
+    put_bits(r, h->code[sym], h->size[sym]);
+    if(n) {
+        put_bits(r, (v < 0 ? v - 1 : v) & ((1 << n) - 1), n);
+    }
+    return true;
+}
+
+static bool requant_block(requant_t *r, component_t *c)
+{
+    const huff_dec_t *dc_dec = &r->dc_dec[c->td];
+    const huff_dec_t *ac_dec = &r->ac_dec[c->ta];
+    const huff_enc_t *dc_enc = &r->dc_enc[c != r->comp];
+    const huff_enc_t *ac_enc = &r->ac_enc[c != r->comp];
+    const uint32_t *mul = r->q_mul[c->tq];
+
+    int s = huff_decode(r, dc_dec);
+    if(s < 0 || s > 11) {
+        return false;
+    }
+    if(s) {
+        c->dc_in += receive_extend(r, s);
+    }
+    int dc = requantize(c->dc_in, mul[0]);
+    if(!put_value(r, dc_enc, 0, dc - c->dc_out)) {
+        return false;
+    }
+    c->dc_out = dc;
+
+    int run = 0;
+    int last = 0;
+    for(int k = 1; k < 64; k++) {
+        int rs = huff_decode(r, ac_dec);
+        if(rs < 0) {
+            return false;
+        }
+        s = rs & 15;
+        if(!s) {
+            if(rs != 0xF0) {
+                break;
+            }
+            k += 15;
+            run += 16;
+            continue;
+        }
+        k += rs >> 4;
+        run += rs >> 4;
+        if(k > 63) {
+            return false;
+        }
+        int v = requantize(receive_extend(r, s), mul[k]);
+        if(!v) {
+            run++;
+            continue;
+        }
+        for(; run >= 16; run -= 16) {
+            put_value(r, ac_enc, 15, 0);
+        }
+        if(!put_value(r, ac_enc, run, v)) {
+            return false;
+        }
+        run = 0;
+        last = k;
+    }
+    if(last < 63) {
+        put_value(r, ac_enc, 0, 0);
+    }
+    return true;
+}
+
+// Decode a block outside the crop, only keeping the DC predictor
+static bool skip_block(requant_t *r, component_t *c)
+{
+    const huff_dec_t *ac_dec = &r->ac_dec[c->ta];
+
+    int s = huff_decode(r, &r->dc_dec[c->td]);
+    if(s < 0 || s > 11) {
+        return false;
+    }
+    if(s) {
+        c->dc_in += receive_extend(r, s);
+    }
+    for(int k = 1; k < 64; k++) {
+        int rs = huff_decode(r, ac_dec);
+        if(rs < 0) {
+            return false;
+        }
+        s = rs & 15;
+        if(!s) {
+            if(rs != 0xF0) {
+                break;
+            }
+            k += 15;
+            continue;
+        }
+        k += rs >> 4;
+        fill_bits(r);
+        get_bits(r, s);
+    }
+    return true;
+}
+
+// Skip the RSTn marker at the end of a restart interval
+static bool next_interval(requant_t *r)
+{
+    fill_bits(r);
+    if(ran_short(r) || !r->marker || r->p + 1 >= r->end || (r->p[1] & 0xF8) != M_RST0) {
+        return false;
+    }
+    r->p += 2;
+    r->marker = false;
+    r->padded = 0;
+    r->bit_buf = 0;
+    r->bits = 0;
+    return true;
+}
+
+static bool requant_scan(requant_t *r, component_t **scan, int ns)
+{
+    int mcus_x = (r->width + 8 * r->hmax - 1) / (8 * r->hmax);
+    int mcus_y = (r->height + 8 * r->vmax - 1) / (8 * r->vmax);
+    int mcus = mcus_x * mcus_y;
+    bool crop = r->crop_x1 != 0;
+
+    if(r->dc_map) {
+        r->dc_w = mcus_x * r->comp[0].h;
+        r->dc_h = mcus_y * r->comp[0].v;
+        if((size_t)r->dc_w * r->dc_h > r->dc_max) {
+            ESP_LOGE(TAG, "DC map of %ux%u blocks does not fit", r->dc_w, r->dc_h);
+            return false;
+        }
+    }
+
+    for(int m = 0; m < mcus; m++) {
+        if(r->restart && m && m % r->restart == 0) {
+            if(!next_interval(r)) {
+                ESP_LOGE(TAG, "Missing restart marker at MCU %d", m);
+                return false;
+            }
+            // A crop is written as one interval
+            if(!crop) {
+                flush_bits(r);
+                emit_marker(r, M_RST0 + (m / r->restart - 1) % 8, 0);
+            }
+            for(int i = 0; i < ns; i++) {
+                scan[i]->dc_in = 0;
+                if(!crop) {
+                    scan[i]->dc_out = 0;
+                }
+            }
+        }
+        int x = m % mcus_x;
+        int y = m / mcus_x;
+        bool keep = !r->dc_map &&
+                    (!crop || (x >= r->crop_x0 && x < r->crop_x1 && y >= r->crop_y0 && y < r->crop_y1));
+        for(int i = 0; i < ns; i++) {
+            int blocks = scan[i]->h * scan[i]->v;
+            for(int b = 0; b < blocks; b++) {
+                if(!(keep ? requant_block(r, scan[i]) : skip_block(r, scan[i]))) {
+                    ESP_LOGE(TAG, "Bad entropy data at MCU %d", m);
+                    return false;
+                }
+                if(r->dc_map && scan[i] == r->comp) {
+                    int bx = x * scan[i]->h + b % scan[i]->h;
+                    int by = y * scan[i]->v + b / scan[i]->h;
+                    r->dc_map[by * r->dc_w + bx] = scan[i]->dc_in * r->q_dc[scan[i]->tq];
+                }
+            }
+        }
+        if(!r->ok) {
+            return false;
+        }
+    }
+    flush_bits(r);
+    if(ran_short(r)) {
+        ESP_LOGE(TAG, "Scan data ends early");
+        return false;
+    }
+
+    // Continue behind the scan data
+    fill_bits(r);
+    return r->marker || r->p >= r->end;
+}
+
+// Quantization tables: the source table is kept and the output table is the
+// standard one at the requested quality, but never finer than the source.
+static bool parse_dqt(requant_t *r, const uint8_t *seg, size_t len)
+{
+    uint8_t out[64 + 1];
+    int32_t scale = r->quality < 50 ? 5000 / r->quality : 200 - r->quality * 2;
+
+    while(len >= 65) {
+        uint8_t id = seg[0] & 0x0F;
+        if(seg[0] >> 4 || id > 3) {
+            ESP_LOGE(TAG, "Only 8 bit quantization tables are supported");
+            return false;
+        }
+        const uint8_t *std = id ? std_croma_quant : std_lum_quant;
+        out[0] = id;
+        for(int k = 0; k < 64; k++) {
+            int32_t q = (std[k] * scale + 50) / 100;
+            q = q < 1 ? 1 : (q > 255 ? 255 : q);
+            uint8_t src = seg[1 + k] ? seg[1 + k] : 1;
+            if(q < src) {
+                q = src;
+            }
+            r->q_mul[id][k] = ((uint32_t)src << 16) / q;
+            out[1 + k] = q;
+        }
+        r->q_dc[id] = seg[1] ? seg[1] : 1;
+        r->q_loaded[id] = true;
+        emit_marker(r, M_DQT, 2 + sizeof(out));
+        emit_bytes(r, out, sizeof(out));
+        seg += 65;
+        len -= 65;
+    }
+    return len == 0;
+}
+
+static bool parse_dht(requant_t *r, const uint8_t *seg, size_t len)
+{
+    while(len >= 17) {
+        uint8_t tc = seg[0] >> 4;
+        uint8_t th = seg[0] & 0x0F;
+        int count = 0;
+        for(int l = 1; l <= 16; l++) {
+            count += seg[l];
+        }
+        if(tc > 1 || th > 1 || count > 256 || len < 17 + (size_t)count) {
+            ESP_LOGE(TAG, "Unsupported Huffman table %02x", seg[0]);
+            return false;
+        }
+        // DHT lists counts from length 1; the builders index them from 1
+        uint8_t bits[17];
+        bits[0] = 0;
+        memcpy(bits + 1, seg + 1, 16);
+        huff_dec_t *h = tc ? &r->ac_dec[th] : &r->dc_dec[th];
+        if(!huff_build_dec(h, bits, seg + 17)) {
+            return false;
+        }
+        seg += 17 + count;
+        len -= 17 + count;
+    }
+    return len == 0;
+}
+
+static bool parse_sof(requant_t *r, const uint8_t *seg, size_t len)
+{
+    if(len < 6 || seg[0] != 8) {
+        ESP_LOGE(TAG, "Only 8 bit samples are supported");
+        return false;
+    }
+    r->height = seg[1] << 8 | seg[2];
+    r->width = seg[3] << 8 | seg[4];
+    r->ncomp = seg[5];
+    if(!r->width || !r->height || !r->ncomp || r->ncomp > MAX_COMPONENTS || len < 6 + 3 * (size_t)r->ncomp) {
+        return false;
+    }
+    r->hmax = r->vmax = 1;
+    for(int i = 0; i < r->ncomp; i++) {
+        component_t *c = &r->comp[i];
+        c->id = seg[6 + 3 * i];
+        c->h = seg[7 + 3 * i] >> 4;
+        c->v = seg[7 + 3 * i] & 0x0F;
+        c->tq = seg[8 + 3 * i] & 3;
+        if(!c->h || !c->v || c->h > 2 || c->v > 2) {
+            ESP_LOGE(TAG, "Unsupported sampling %ux%u", c->h, c->v);
+            return false;
+        }
+        if(r->ncomp == 1) {
+            // A lone component is not interleaved: its MCU is one block
+            c->h = c->v = 1;
+        }
+        r->hmax = c->h > r->hmax ? c->h : r->hmax;
+        r->vmax = c->v > r->vmax ? c->v : r->vmax;
+    }
+    if(r->rect) {
+        // Widen the rectangle to whole MCUs
+        jpg_rect_t *rect = r->rect;
+        int mcu_w = 8 * r->hmax;
+        int mcu_h = 8 * r->vmax;
+        if(!rect->w || !rect->h || rect->x >= r->width || rect->y >= r->height) {
+            ESP_LOGE(TAG, "Crop outside the %ux%u frame", r->width, r->height);
+            return false;
+        }
+        int x1 = rect->x + rect->w < r->width ? rect->x + rect->w : r->width;
+        int y1 = rect->y + rect->h < r->height ? rect->y + rect->h : r->height;
+        r->crop_x0 = rect->x / mcu_w;
+        r->crop_y0 = rect->y / mcu_h;
+        r->crop_x1 = (x1 + mcu_w - 1) / mcu_w;
+        r->crop_y1 = (y1 + mcu_h - 1) / mcu_h;
+        rect->x = r->crop_x0 * mcu_w;
+        rect->y = r->crop_y0 * mcu_h;
+        rect->w = (r->crop_x1 * mcu_w < r->width ? r->crop_x1 * mcu_w : r->width) - rect->x;
+        rect->h = (r->crop_y1 * mcu_h < r->height ? r->crop_y1 * mcu_h : r->height) - rect->y;
+    }
+    return true;
+}
+
+// Writes the standard Huffman tables and the scan header, then the scan
+static bool do_scan(requant_t *r, const uint8_t *seg, size_t len)
+{
+    int ns = seg[0];
+    if(!r->ncomp || ns != r->ncomp || len != 4 + 2 * (size_t)ns) {
+        // A single scan has to carry every component
+        ESP_LOGE(TAG, "Only single scan baseline images are supported");
+        return false;
+    }
+    component_t *scan[MAX_COMPONENTS];
+    for(int i = 0; i < ns; i++) {
+        component_t *c = NULL;
+        for(int j = 0; j < r->ncomp; j++) {
+            if(r->comp[j].id == seg[1 + 2 * i]) {
+                c = &r->comp[j];
+            }
+        }
+        if(!c) {
+            return false;
+        }
+        c->td = seg[2 + 2 * i] >> 4;
+        c->ta = seg[2 + 2 * i] & 0x0F;
+        if(c->td > 1 || c->ta > 1 || !r->dc_dec[c->td].loaded || !r->ac_dec[c->ta].loaded || !r->q_loaded[c->tq]) {
+            ESP_LOGE(TAG, "Scan uses a missing table");
+            return false;
+        }
+        c->dc_in = c->dc_out = 0;
+        scan[i] = c;
+    }
+
+    int tables = r->ncomp > 1 ? 2 : 1;
+    for(int i = 0; i < tables; i++) {
+        const uint8_t *dc_bits = i ? dc_chroma_bits : dc_lum_bits;
+        const uint8_t *ac_bits = i ? ac_chroma_bits : ac_lum_bits;
+        emit_marker(r, M_DHT, 2 + 1 + 16 + sizeof(dc_val));
+        emit_byte(r, i);
+        emit_bytes(r, dc_bits + 1, 16);
+        emit_bytes(r, dc_val, sizeof(dc_val));
+        emit_marker(r, M_DHT, 2 + 1 + 16 + sizeof(ac_lum_val));
+        emit_byte(r, 0x10 | i);
+        emit_bytes(r, ac_bits + 1, 16);
+        emit_bytes(r, i ? ac_chroma_val : ac_lum_val, sizeof(ac_lum_val));
+    }
+
+    // The first component codes with the luminance tables, the rest with chrominance
+    emit_marker(r, M_SOS, 2 + len);
+    emit_byte(r, ns);
+    for(int i = 0; i < ns; i++) {
+        emit_byte(r, scan[i]->id);
+        emit_byte(r, scan[i] == r->comp ? 0x00 : 0x11);
+    }
+    emit_bytes(r, seg + 1 + 2 * ns, 3);
+
+    r->bit_buf = 0;
+    r->bits = 0;
+    r->marker = false;
+    r->padded = 0;
+    r->out_bits = 0;
+    r->out_count = 0;
+    return requant_scan(r, scan, ns);
+}
+
+static bool requant_image(requant_t *r)
+{
+    huff_build_enc(&r->dc_enc[0], dc_lum_bits, dc_val);
+    huff_build_enc(&r->dc_enc[1], dc_chroma_bits, dc_val);
+    huff_build_enc(&r->ac_enc[0], ac_lum_bits, ac_lum_val);
+    huff_build_enc(&r->ac_enc[1], ac_chroma_bits, ac_chroma_val);
+
+    if(r->end - r->p < 4 || r->p[0] != 0xFF || r->p[1] != M_SOI) {
+        ESP_LOGE(TAG, "Not a JPEG");
+        return false;
+    }
+    r->p += 2;
+    emit_marker(r, M_SOI, 0);
+
+    bool scanned = false;
+    while(r->p + 2 <= r->end) {
+        if(r->p[0] != 0xFF) {
+            return false;
+        }
+        uint8_t marker = r->p[1];
+        r->p += 2;
+        if(marker == 0xFF) {
+            // Fill byte
+            r->p--;
+            continue;
+        }
+        if(marker == M_EOI) {
+            break;
+        }
+        if(r->p + 2 > r->end) {
+            return false;
+        }
+        size_t len = r->p[0] << 8 | r->p[1];
+        if(len < 2 || r->p + len > r->end) {
+            return false;
+        }
+        const uint8_t *seg = r->p + 2;
+        r->p += len;
+        len -= 2;
+
+        bool ok = true;
+        switch(marker) {
+        case M_DQT:
+            ok = parse_dqt(r, seg, len);
+            break;
+        case M_DHT:
+            ok = parse_dht(r, seg, len);
+            break;
+        case M_SOF0:
+        case M_SOF1:
+            ok = parse_sof(r, seg, len);
+            if(ok) {
+                uint16_t w = r->rect ? r->rect->w : r->width;
+                uint16_t h = r->rect ? r->rect->h : r->height;
+                emit_marker(r, marker, len + 2);
+                emit_byte(r, seg[0]);
+                emit_byte(r, h >> 8);
+                emit_byte(r, h & 0xFF);
+                emit_byte(r, w >> 8);
+                emit_byte(r, w & 0xFF);
+                emit_bytes(r, seg + 5, len - 5);
+            }
+            break;
+        case M_SOS:
+            ok = !scanned && do_scan(r, seg, len);
+            scanned = true;
+            break;
+        case M_DRI:
+            r->restart = len >= 2 ? (seg[0] << 8 | seg[1]) : 0;
+            if(!r->rect) {
+                emit_marker(r, marker, len + 2);
+                emit_bytes(r, seg, len);
+            }
+            break;
+        default:
+            if((marker & 0xF0) == 0xC0 && marker != M_DHT && marker != 0xC8 && marker != 0xCC) {
+                ESP_LOGE(TAG, "Only baseline JPEG is supported (SOF %02x)", marker);
+                return false;
+            }
+            // APPn, COM and the like go through as they are
+            emit_marker(r, marker, len + 2);
+            emit_bytes(r, seg, len);
+            break;
+        }
+        if(!ok) {
+            return false;
+        }
+    }
+    if(!scanned) {
+        return false;
+    }
+    emit_marker(r, M_EOI, 0);
+    flush_out(r);
+    return r->ok;
+}
+
+static requant_t *requant_new(const uint8_t *src, size_t src_len, uint8_t quality, jpg_out_cb cb, void * arg)
+{
+    requant_t *r = (requant_t *)_malloc(sizeof(requant_t));
+    if(!r) {
+        ESP_LOGE(TAG, "Requantizer malloc failed");
+        return NULL;
+    }
+    memset(r, 0, sizeof(*r));
+    r->p = src;
+    r->end = src + src_len;
+    r->cb = cb;
+    r->arg = arg;
+    r->ok = true;
+    r->quality = quality ? (quality > 100 ? 100 : quality) : 1;
+    return r;
+}
+
+static bool transcode(const uint8_t *src, size_t src_len, uint8_t quality, jpg_rect_t *rect, jpg_out_cb cb, void * arg)
+{
+    requant_t *r = requant_new(src, src_len, quality, cb, arg);
+    if(!r) {
+        return false;
+    }
+    r->rect = rect;
+
+    bool ok = requant_image(r);
+    free(r);
+    return ok;
+}
+
+bool jpg2jpg_cb(const uint8_t *src, size_t src_len, uint8_t quality, jpg_out_cb cb, void * arg)
+{
+    return transcode(src, src_len, quality, NULL, cb, arg);
+}
+
+typedef struct {
+    uint8_t *buf;
+    size_t max_len;
+    size_t len;
+} jpg_buf_t;
+
+static size_t buf_write(void * arg, size_t index, const void* data, size_t len)
+{
+    jpg_buf_t *out = (jpg_buf_t *)arg;
+    if(len > out->max_len - out->len) {
+        return 0;
+    }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+    return len;
+}
+
+static bool transcode_buf(const uint8_t *src, size_t src_len, uint8_t quality, jpg_rect_t *rect, uint8_t ** out, size_t * out_len)
+{
+    // Coefficients only get smaller. With a source coded with the standard
+    // Huffman tables, as the camera's are, the output fits in its size plus
+    // the tables.
+    jpg_buf_t jpg = {
+        .max_len = src_len + 1024,
+    };
+    jpg.buf = (uint8_t *)_malloc(jpg.max_len);
+    if(!jpg.buf) {
+        ESP_LOGE(TAG, "JPG buffer malloc failed");
+        return false;
+    }
+    if(!transcode(src, src_len, quality, rect, buf_write, &jpg)) {
+        free(jpg.buf);
+        return false;
+    }
+    // A crop is usually a fraction of the frame
+    uint8_t *shrunk = (uint8_t *)realloc(jpg.buf, jpg.len);
+    *out = shrunk ? shrunk : jpg.buf;
+    *out_len = jpg.len;
+    return true;
+}
+
+bool jpg2jpg(const uint8_t *src, size_t src_len, uint8_t quality, uint8_t ** out, size_t * out_len)
+{
+    return transcode_buf(src, src_len, quality, NULL, out, out_len);
+}
+
+bool jpg_crop(const uint8_t *src, size_t src_len, jpg_rect_t *rect, uint8_t ** out, size_t * out_len)
+{
+    // Quality 100 keeps every source table as it is
+    return transcode_buf(src, src_len, 100, rect, out, out_len);
+}
+
+// The headers are still written out; they go nowhere
+static size_t null_write(void * arg, size_t index, const void* data, size_t len)
+{
+    return len;
+}
+
+bool jpg_dc_luma(const uint8_t *src, size_t src_len, int16_t *dc, size_t max, uint16_t *w, uint16_t *h)
+{
+    requant_t *r = requant_new(src, src_len, 100, null_write, NULL);
+    if(!r) {
+        return false;
+    }
+    r->dc_map = dc;
+    r->dc_max = max;
+
+    bool ok = requant_image(r) && r->dc_w;
+    *w = r->dc_w;
+    *h = r->dc_h;
+    free(r);
+    return ok;
+}
@@ -153,7 +153,7 @@ public:
         index += ocb(oarg, index, data, len);
         return true;
     }
-    virtual size_t get_size() const
+    virtual jpge::uint get_size() const
     {
         return index;
     }
@@ -161,6 +161,9 @@ public:
 
 bool fmt2jpg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpg_out_cb cb, void * arg)
 {
+    if(format == PIXFORMAT_JPEG) {
+        return jpg2jpg_cb(src, src_len, quality, cb, arg);
+    }
     callback_stream dst_stream(cb, arg);
     return convert_image(src, width, height, format, quality, &dst_stream);
 }
@@ -199,7 +202,7 @@ public:
         return true;
     }
 
-    virtual size_t get_size() const
+    virtual jpge::uint get_size() const
     {
         return index;
     }
@@ -207,6 +210,10 @@ public:
 
 bool fmt2jpg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t ** out, size_t * out_len)
 {
+    if(format == PIXFORMAT_JPEG) {
+        return jpg2jpg(src, src_len, quality, out, out_len);
+    }
+
     //todo: allocate proper buffer for holding JPEG data
     //this should be enough for CIF frame size
     int jpg_buf_len = 128*1024;
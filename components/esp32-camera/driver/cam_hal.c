@@ -20,6 +20,7 @@
 #include "freertos/task.h"
 #include "ll_cam.h"
 #include "cam_hal.h"
+#include "cam_frame_ref.h"
 
 #if (ESP_IDF_VERSION_MAJOR == 3) && (ESP_IDF_VERSION_MINOR == 3)
 #include "rom/ets_sys.h"
@@ -64,6 +65,13 @@ static cam_obj_t *cam_obj = NULL;
 static volatile bool g_psram_dma_mode = CAMERA_PSRAM_DMA_ENABLED;
 static portMUX_TYPE g_psram_dma_lock = portMUX_INITIALIZER_UNLOCKED;
 
+/* Optional trace hook; read once per event so it can be swapped at runtime */
+static camera_trace_cb_t s_trace_cb = NULL;
+#define CAM_TRACE(ev, arg) do { \
+    camera_trace_cb_t _cb = s_trace_cb; \
+    if (_cb) { _cb((ev), (uint32_t)(arg)); } \
+} while (0)
+
 /* At top of cam_hal.c – one switch for noisy ISR prints */
 #ifndef CAM_LOG_SPAM_EVERY_FRAME
 #define CAM_LOG_SPAM_EVERY_FRAME 0   /* set to 1 to restore old behaviour */
@@ -129,6 +137,31 @@ static inline void cam_drop_psram_cache(void *addr, size_t len)
 #define CAM_WARN_THROTTLE(counter, first) do { (void)(counter); } while (0)
 #endif
 
+/* Pipeline counters, see esp_camera_get_stats(). Written from the DMA ISR,
+ * cam_task and whichever task calls cam_take(), so updates are atomic. */
+static DRAM_ATTR camera_stats_t s_stats;
+
+#define CAM_STAT_INC(field) __atomic_fetch_add(&s_stats.field, 1, __ATOMIC_RELAXED)
+
+#define CAM_STAT_PEAK(field, value) cam_stat_peak(&s_stats.field, (value))
+
+/* Count and trace a discarded frame. The count doubles as the throttle for
+ * the console warning: printed on the first drop and every 100th after. */
+#if CONFIG_LOG_DEFAULT_LEVEL >= 2
+#define CAM_DROP(reason, msg) do { \
+    uint32_t _n = __atomic_add_fetch(&s_stats.frames_dropped[(reason)], 1, __ATOMIC_RELAXED); \
+    CAM_TRACE(CAMERA_TRACE_FRAME_DROP, (reason)); \
+    if (_n == 1 || _n % 100 == 0) { \
+        ESP_CAMERA_ETS_PRINTF(DRAM_STR("cam_hal: %s (%u dropped)\r\n"), DRAM_STR(msg), (unsigned)_n); \
+    } \
+} while (0)
+#else
+#define CAM_DROP(reason, msg) do { \
+    __atomic_fetch_add(&s_stats.frames_dropped[(reason)], 1, __ATOMIC_RELAXED); \
+    CAM_TRACE(CAMERA_TRACE_FRAME_DROP, (reason)); \
+} while (0)
+#endif
+
 /* JPEG markers (byte-order independent). */
 static const uint8_t JPEG_SOI_MARKER[] = {0xFF, 0xD8, 0xFF}; /* SOI = FF D8 FF */
 #define JPEG_SOI_MARKER_LEN (3)
@@ -142,12 +175,10 @@ static inline size_t eoi_probe_window(size_t half, size_t frame_len)
     return w > frame_len ? frame_len : w;
 }
 
+/* Callers count and report the miss, see CAM_DROP() */
 static int cam_verify_jpeg_soi(const uint8_t *inbuf, uint32_t length)
 {
-    static uint16_t warn_soi_miss_cnt = 0;
     if (length < JPEG_SOI_MARKER_LEN) {
-        CAM_WARN_THROTTLE(warn_soi_miss_cnt,
-                          "NO-SOI - JPEG start marker missing (len < 3b)");
         return -1;
     }
 
@@ -158,8 +189,6 @@ static int cam_verify_jpeg_soi(const uint8_t *inbuf, uint32_t length)
         }
     }
 
-    CAM_WARN_THROTTLE(warn_soi_miss_cnt,
-                      "NO-SOI - JPEG start marker missing");
     return -1;
 }
 
@@ -235,12 +264,17 @@ static bool cam_get_next_frame(int * frame_pos)
 static bool cam_start_frame(int * frame_pos)
 {
     if (cam_get_next_frame(frame_pos)) {
+        // The EOF interrupt stays off until ll_cam_start(), so the ISR can't
+        // tag an event while these change
+        cam_obj->dma_gen++;
+        cam_obj->dma_eof_seq = 0;
         if(ll_cam_start(cam_obj, *frame_pos)){
             // Vsync the frame manually
             ll_cam_do_vsync(cam_obj);
             uint64_t us = (uint64_t)esp_timer_get_time();
             cam_obj->frames[*frame_pos].fb.timestamp.tv_sec = us / 1000000UL;
             cam_obj->frames[*frame_pos].fb.timestamp.tv_usec = us % 1000000UL;
+            CAM_TRACE(CAMERA_TRACE_FRAME_START, *frame_pos);
             return true;
         }
     }
@@ -249,16 +283,35 @@ static bool cam_start_frame(int * frame_pos)
 
 void IRAM_ATTR ll_cam_send_event(cam_obj_t *cam, cam_event_t cam_event, BaseType_t * HPTaskAwoken)
 {
-    if (xQueueSendFromISR(cam->event_queue, (void *)&cam_event, HPTaskAwoken) != pdTRUE) {
+    cam_event_rec_t *rec = cam_event_ring_reserve(&cam->events);
+    if (!rec) {
         ll_cam_stop(cam);
         cam->state = CAM_STATE_IDLE;
 #if CAM_LOG_SPAM_EVERY_FRAME
         ESP_DRAM_LOGD(TAG, "EV-%s-OVF", cam_event==CAM_IN_SUC_EOF_EVENT ? "EOF" : "VSYNC");
-#else
-        static uint16_t ovf_cnt = 0;
-        CAM_WARN_THROTTLE(ovf_cnt,
-                          cam_event==CAM_IN_SUC_EOF_EVENT ? "EV-EOF-OVF" : "EV-VSYNC-OVF");
 #endif
+        if (cam_event == CAM_IN_SUC_EOF_EVENT) {
+            CAM_DROP(CAMERA_DROP_EVENT_OVF, "EV-EOF-OVF");
+        } else {
+            CAM_DROP(CAMERA_DROP_EVENT_OVF, "EV-VSYNC-OVF");
+        }
+        return;
+    }
+
+    rec->type = cam_event;
+    rec->gen = cam->dma_gen;
+    rec->eof_seq = cam->dma_eof_seq;
+    if (cam_event == CAM_IN_SUC_EOF_EVENT) {
+        cam->dma_eof_seq++;
+    }
+    CAM_STAT_PEAK(event_queue_peak, cam_event_ring_publish(&cam->events));
+
+    // Wake cam_task every time. The ISR may run on the other core, so
+    // cam_task can drain the ring and block between any check made here and
+    // the publish above; a skipped wake-up would then strand the ring until
+    // it overflows and stops capture.
+    if (cam->task_handle) {
+        vTaskNotifyGiveFromISR(cam->task_handle, HPTaskAwoken);
     }
 }
 
@@ -269,11 +322,17 @@ static void cam_task(void *arg)
     int frame_pos = 0;
     cam_obj->state = CAM_STATE_IDLE;
     cam_event_t cam_event = 0;
+    cam_event_rec_t ev;
 
-    xQueueReset(cam_obj->event_queue);
+    // Discard whatever the ISR posted before the task existed
+    cam_event_ring_discard(&cam_obj->events);
 
     while (1) {
-        xQueueReceive(cam_obj->event_queue, (void *)&cam_event, portMAX_DELAY);
+        if (!cam_event_ring_pop(&cam_obj->events, &ev)) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        cam_event = ev.type;
         DBG_PIN_SET(1);
         switch (cam_obj->state) {
 
@@ -294,16 +353,30 @@ static void cam_task(void *arg)
                 size_t pixels_per_dma = (cam_obj->dma_half_buffer_size * cam_obj->fb_bytes_per_pixel) / (cam_obj->dma_bytes_per_item * cam_obj->in_bytes_per_pixel);
 
                 if (cam_event == CAM_IN_SUC_EOF_EVENT) {
+                    if (ev.gen != cam_obj->dma_gen) {
+                        // Posted before the DMA was restarted for this frame
+                        continue;
+                    }
                     if(!cam_obj->psram_mode){
                         if (cam_obj->fb_size < (frame_buffer_event->len + pixels_per_dma)) {
-                            ESP_CAMERA_ETS_PRINTF(DRAM_STR("cam_hal: FB-OVF\r\n"));
+                            CAM_DROP(CAMERA_DROP_FB_OVF, "FB-OVF");
                             ll_cam_stop(cam_obj);
                             continue;
                         }
                         frame_buffer_event->len += ll_cam_memcpy(cam_obj,
                             &frame_buffer_event->buf[frame_buffer_event->len],
-                            &cam_obj->dma_buffer[(cnt % cam_obj->dma_half_buffer_cnt) * cam_obj->dma_half_buffer_size],
+                            &cam_obj->dma_buffer[(ev.eof_seq % cam_obj->dma_half_buffer_cnt) * cam_obj->dma_half_buffer_size],
                             cam_obj->dma_half_buffer_size);
+                        // The DMA cycles through dma_half_buffer_cnt half buffers. If it
+                        // got that far past this event, it was overwriting the half
+                        // buffer while we copied it
+                        uint16_t lag = cam_obj->dma_eof_seq - ev.eof_seq;
+                        if (lag >= cam_obj->dma_half_buffer_cnt) {
+                            CAM_DROP(CAMERA_DROP_DMA_OVERRUN, "DMA-OVERRUN");
+                            ll_cam_stop(cam_obj);
+                            cam_obj->state = CAM_STATE_IDLE;
+                            continue;
+                        }
                     } else {
                         // stop if the next DMA copy would exceed the framebuffer slot
                         // size, since we're called only after the copy occurs
@@ -311,7 +384,7 @@ static void cam_task(void *arg)
                         // by one DMA operation, as we can't predict here, if the next
                         // cam event will be a VSYNC
                         if (cnt + 1 >= cam_obj->frame_copy_cnt) {
-                            ESP_CAMERA_ETS_PRINTF(DRAM_STR("cam_hal: DMA overflow\r\n"));
+                            CAM_DROP(CAMERA_DROP_DMA_OVF, "DMA overflow");
                             ll_cam_stop(cam_obj);
                             cam_obj->state = CAM_STATE_IDLE;
                             continue;
@@ -334,13 +407,10 @@ static void cam_task(void *arg)
                             memcpy(soi_probe, frame_buffer_event->buf, probe_len);
                             int soi_off = cam_verify_jpeg_soi(soi_probe, probe_len);
                             if (soi_off != 0) {
-                                static uint16_t warn_psram_soi_cnt = 0;
                                 if (soi_off > 0) {
-                                    CAM_WARN_THROTTLE(warn_psram_soi_cnt,
-                                                      "NO-SOI - JPEG start marker not at pos 0 (PSRAM)");
+                                    CAM_DROP(CAMERA_DROP_NO_SOI, "NO-SOI - JPEG start marker not at pos 0 (PSRAM)");
                                 } else {
-                                    CAM_WARN_THROTTLE(warn_psram_soi_cnt,
-                                                      "NO-SOI - JPEG start marker missing (PSRAM)");
+                                    CAM_DROP(CAMERA_DROP_NO_SOI, "NO-SOI - JPEG start marker missing (PSRAM)");
                                 }
                                 ll_cam_stop(cam_obj);
                                 cam_obj->state = CAM_STATE_IDLE;
@@ -349,13 +419,10 @@ static void cam_task(void *arg)
                         } else {
                             int soi_off = cam_verify_jpeg_soi(frame_buffer_event->buf, frame_buffer_event->len);
                             if (soi_off != 0) {
-                                static uint16_t warn_soi_bad_cnt = 0;
                                 if (soi_off > 0) {
-                                    CAM_WARN_THROTTLE(warn_soi_bad_cnt,
-                                                      "NO-SOI - JPEG start marker not at pos 0");
+                                    CAM_DROP(CAMERA_DROP_NO_SOI, "NO-SOI - JPEG start marker not at pos 0");
                                 } else {
-                                    CAM_WARN_THROTTLE(warn_soi_bad_cnt,
-                                                      "NO-SOI - JPEG start marker missing");
+                                    CAM_DROP(CAMERA_DROP_NO_SOI, "NO-SOI - JPEG start marker missing");
                                 }
                                 ll_cam_stop(cam_obj);
                                 cam_obj->state = CAM_STATE_IDLE;
@@ -371,10 +438,13 @@ static void cam_task(void *arg)
                     ll_cam_stop(cam_obj);
 
                     if (cnt || !cam_obj->jpeg_mode || cam_obj->psram_mode) {
+                        CAM_STAT_INC(frames_captured);
                         if (cam_obj->jpeg_mode) {
                             if (!cam_obj->psram_mode) {
                                 if (cam_obj->fb_size < (frame_buffer_event->len + pixels_per_dma)) {
-                                    ESP_CAMERA_ETS_PRINTF(DRAM_STR("cam_hal: FB-OVF\r\n"));
+                                    /* The tail is lost, so cam_take() drops the frame as NO-EOI */
+                                    static uint16_t warn_tail_ovf_cnt = 0;
+                                    CAM_WARN_THROTTLE(warn_tail_ovf_cnt, "FB-OVF - JPEG tail truncated");
                                     cnt--;
                                 } else {
                                     frame_buffer_event->len += ll_cam_memcpy(cam_obj,
@@ -397,7 +467,7 @@ static void cam_task(void *arg)
                         } else if (!cam_obj->jpeg_mode) {
                             if (frame_buffer_event->len != cam_obj->fb_size) {
                                 cam_obj->frames[frame_pos].en = 1;
-                                ESP_CAMERA_ETS_PRINTF(DRAM_STR("cam_hal: FB-SIZE: %u != %u\r\n"), frame_buffer_event->len, (unsigned) cam_obj->fb_size);
+                                CAM_DROP(CAMERA_DROP_FB_SIZE, "FB-SIZE - raw frame length mismatch");
                             }
                         }
                         //send frame
@@ -408,16 +478,21 @@ static void cam_task(void *arg)
                                 //push the new frame to the end of the queue
                                 if (xQueueSend(cam_obj->frame_buffer_queue, (void *)&frame_buffer_event, 0) != pdTRUE) {
                                     cam_obj->frames[frame_pos].en = 1;
-                                    ESP_CAMERA_ETS_PRINTF(DRAM_STR("cam_hal: FBQ-SND\r\n"));
+                                    CAM_DROP(CAMERA_DROP_FBQ_FULL, "FBQ-SND");
                                 }
                                 //free the popped buffer
                                 cam_give(fb2);
+                                CAM_STAT_INC(frames_replaced);
                             } else {
                                 //queue is full and we could not pop a frame from it
                                 cam_obj->frames[frame_pos].en = 1;
-                                ESP_CAMERA_ETS_PRINTF(DRAM_STR("cam_hal: FBQ-RCV\r\n"));
+                                CAM_DROP(CAMERA_DROP_FBQ_FULL, "FBQ-RCV");
                             }
                         }
+                        if (!cam_obj->frames[frame_pos].en) {
+                            CAM_STAT_PEAK(fb_queue_peak, uxQueueMessagesWaiting(cam_obj->frame_buffer_queue));
+                            CAM_TRACE(CAMERA_TRACE_FRAME_DONE, frame_buffer_event->len);
+                        }
                     }
 
                     if(!cam_start_frame(&frame_pos)){
@@ -598,12 +673,7 @@ esp_err_t cam_config(const camera_config_t *config, framesize_t frame_size, uint
     ret = cam_dma_config(config);
     CAM_CHECK_GOTO(ret == ESP_OK, "cam_dma_config failed", err);
 
-    size_t queue_size = cam_obj->dma_half_buffer_cnt - 1;
-    if (queue_size == 0) {
-        queue_size = 1;
-    }
-    cam_obj->event_queue = xQueueCreate(queue_size, sizeof(cam_event_t));
-    CAM_CHECK_GOTO(cam_obj->event_queue != NULL, "event_queue create failed", err);
+    cam_event_ring_reset(&cam_obj->events);
 
     size_t frame_buffer_queue_len = cam_obj->frame_cnt;
     if (config->grab_mode == CAMERA_GRAB_LATEST && cam_obj->frame_cnt > 1) {
@@ -642,9 +712,6 @@ esp_err_t cam_deinit(void)
     if (cam_obj->task_handle) {
         vTaskDelete(cam_obj->task_handle);
     }
-    if (cam_obj->event_queue) {
-        vQueueDelete(cam_obj->event_queue);
-    }
     if (cam_obj->frame_buffer_queue) {
         vQueueDelete(cam_obj->frame_buffer_queue);
     }
@@ -683,6 +750,23 @@ void cam_start(void)
     ll_cam_vsync_intr_enable(cam_obj, true);
 }
 
+/* Account for a frame handed to the application */
+static void cam_record_delivery(const camera_fb_t *fb)
+{
+    int64_t start_us = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+    uint32_t ms = (uint32_t)((esp_timer_get_time() - start_us) / 1000);
+    size_t bucket = 0;
+    while (bucket < CAMERA_LATENCY_BUCKETS - 1 && ms >= CAMERA_LATENCY_BUCKET_MS(bucket)) {
+        bucket++;
+    }
+
+    CAM_STAT_INC(frames_delivered);
+    CAM_STAT_INC(latency_hist[bucket]);
+    __atomic_fetch_add(&s_stats.latency_total_ms, ms, __ATOMIC_RELAXED);
+    CAM_STAT_PEAK(latency_max_ms, ms);
+    CAM_TRACE(CAMERA_TRACE_FB_GET, fb->len);
+}
+
 camera_fb_t *cam_take(TickType_t timeout)
 {
     camera_fb_t *dma_buffer = NULL;
@@ -694,8 +778,6 @@ camera_fb_t *cam_take(TickType_t timeout)
     /* throttle repeated NULL frame warnings */
     static uint16_t warn_null_cnt = 0;
 #endif
-    /* throttle repeated NO-EOI warnings */
-    static uint16_t warn_eoi_miss_cnt = 0;
 
     for (;;)
     {
@@ -761,13 +843,14 @@ camera_fb_t *cam_take(TickType_t timeout)
                     /* DMA may bypass cache, ensure full frame is visible */
                     cam_drop_psram_cache(dma_buffer->buf, dma_buffer->len);
                 }
+                cam_record_delivery(dma_buffer);
+                ((cam_frame_t *)dma_buffer)->refs = 1;
                 return dma_buffer;
             }
 
 skip_eoi_check:
 
-            CAM_WARN_THROTTLE(warn_eoi_miss_cnt,
-                              "NO-EOI - JPEG end marker missing");
+            CAM_DROP(CAMERA_DROP_NO_EOI, "NO-EOI - JPEG end marker missing");
             cam_give(dma_buffer);
             continue; /* wait for another frame */
         } else if (cam_obj->psram_mode &&
@@ -781,31 +864,81 @@ skip_eoi_check:
             cam_drop_psram_cache(dma_buffer->buf, dma_buffer->len);
         }
 
+        cam_record_delivery(dma_buffer);
+        ((cam_frame_t *)dma_buffer)->refs = 1;
         return dma_buffer;
     }
 }
 
+/* Map a frame buffer back to its slot, NULL if it isn't one of ours */
+static cam_frame_t *cam_frame_of(camera_fb_t *fb)
+{
+    uintptr_t off = (uintptr_t)fb - (uintptr_t)cam_obj->frames;
+    if (!fb || off % sizeof(cam_frame_t) != 0 || off / sizeof(cam_frame_t) >= cam_obj->frame_cnt) {
+        return NULL;
+    }
+    return (cam_frame_t *)fb;
+}
+
 void cam_give(camera_fb_t *dma_buffer)
 {
-    for (int x = 0; x < cam_obj->frame_cnt; x++) {
-        if (&cam_obj->frames[x].fb == dma_buffer) {
-            cam_obj->frames[x].en = 1;
-            break;
-        }
+    cam_frame_t *frame = cam_frame_of(dma_buffer);
+    if (frame) {
+        frame->refs = 0;
+        frame->en = 1;
     }
 }
 
 void cam_give_all(void) {
     for (int x = 0; x < cam_obj->frame_cnt; x++) {
+        cam_obj->frames[x].refs = 0;
         cam_obj->frames[x].en = 1;
     }
 }
 
+bool cam_retain(camera_fb_t *fb)
+{
+    cam_frame_t *frame = cam_frame_of(fb);
+    return frame && cam_frame_ref_retain(&frame->refs);
+}
+
+void cam_release(camera_fb_t *fb)
+{
+    cam_frame_t *frame = cam_frame_of(fb);
+    if (!frame) {
+        return;
+    }
+    uint32_t refs = cam_frame_ref_release(&frame->refs);
+    if (refs == 0) {
+        ESP_LOGW(TAG, "Frame %p released more often than retained", fb);
+    } else if (refs == 1) {
+        /* Last reader is done, hand the slot back to the DMA */
+        frame->en = 1;
+    }
+}
+
 bool cam_get_available_frames(void)
 {
     return 0 < uxQueueMessagesWaiting(cam_obj->frame_buffer_queue);
 }
 
+bool cam_frame_fits(framesize_t frame_size)
+{
+    if (!cam_obj || frame_size >= FRAMESIZE_INVALID) {
+        return false;
+    }
+    size_t pixels = (size_t)resolution[frame_size].width * resolution[frame_size].height;
+    if (!cam_obj->jpeg_mode) {
+        // Raw frames must fill the buffer exactly, see FB-SIZE in cam_task()
+        return pixels == (size_t)cam_obj->width * cam_obj->height;
+    }
+#ifdef CONFIG_CAMERA_JPEG_MODE_FRAME_SIZE_AUTO
+    return pixels / 5 <= cam_obj->recv_size;
+#else
+    return true;
+#endif
+}
+
 void cam_set_psram_mode(bool enable)
 {
     portENTER_CRITICAL(&g_psram_dma_lock);
@@ -817,3 +950,25 @@ bool cam_get_psram_mode(void)
 {
     return g_psram_dma_mode;
 }
+
+void cam_set_trace_cb(camera_trace_cb_t cb)
+{
+    s_trace_cb = cb;
+}
+
+void cam_get_stats(camera_stats_t *out)
+{
+    /* Aligned 32-bit reads are atomic, so every counter is consistent even
+     * though the set as a whole is a best-effort snapshot */
+    memcpy(out, &s_stats, sizeof(*out));
+    if (cam_obj && cam_obj->frame_buffer_queue) {
+        out->fb_queue_len = uxQueueMessagesWaiting(cam_obj->frame_buffer_queue) +
+                            uxQueueSpacesAvailable(cam_obj->frame_buffer_queue);
+        out->event_queue_len = CAM_EVENT_RING_LEN;
+    }
+}
+
+void cam_reset_stats(void)
+{
+    memset(&s_stats, 0, sizeof(s_stats));
+}
@@ -20,6 +20,7 @@
 #include "freertos/task.h"
 #include "driver/gpio.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "nvs.h"
 #include "sensor.h"
@@ -90,6 +91,7 @@ static const char *TAG = "camera";
 typedef struct {
     sensor_t sensor;
     camera_fb_t fb;
+    int64_t mode_switch_us; // Frames started before this carry the previous mode
 } camera_state_t;
 
 static const char *CAMERA_SENSOR_NVS_KEY = "sensor";
@@ -164,6 +166,74 @@ static const sensor_func_t g_sensors[] = {
 #endif
 };
 
+#if CONFIG_SCCB_FAST_MODE
+#define SCCB_FAST_MODE_FREQ 400000
+#define SCCB_FAST_MODE_CHECKS 3
+
+/**
+ * Flip a few bits of a register that the sensor reset rewrites anyway, read
+ * them back, and put the old value back. False for sensors without a known
+ * scratch register, so they are never declared fast.
+ */
+static bool camera_sccb_write_check(uint8_t slv_addr, uint16_t pid)
+{
+    for (int i = 0; i < SCCB_FAST_MODE_CHECKS; i++) {
+        uint8_t old, back;
+        switch (pid) {
+        case OV2640_PID:
+            // Bank select, reachable from either bank
+            old = SCCB_Read(slv_addr, 0xFF);
+            if (SCCB_Write(slv_addr, 0xFF, old ^ 0x01)) {
+                return false;
+            }
+            back = SCCB_Read(slv_addr, 0xFF);
+            if (SCCB_Write(slv_addr, 0xFF, old) || back != (old ^ 0x01) || SCCB_Read(slv_addr, 0xFF) != old) {
+                return false;
+            }
+            break;
+        case OV3660_PID:
+        case OV5640_PID:
+            // AEC stable range, high limit
+            old = SCCB_Read16(slv_addr, 0x3a0f);
+            if (SCCB_Write16(slv_addr, 0x3a0f, old ^ 0x55)) {
+                return false;
+            }
+            back = SCCB_Read16(slv_addr, 0x3a0f);
+            if (SCCB_Write16(slv_addr, 0x3a0f, old) || back != (uint8_t)(old ^ 0x55) ||
+                SCCB_Read16(slv_addr, 0x3a0f) != old) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Raise the SCCB clock and keep it only if the sensor still reads back its
+ * ID and what was written to it
+ */
+static void camera_sccb_fast_mode(const sensor_func_t *sensor, uint8_t slv_addr, uint16_t pid)
+{
+    if (CONFIG_SCCB_CLK_FREQ >= SCCB_FAST_MODE_FREQ || SCCB_SetClock(SCCB_FAST_MODE_FREQ) != ESP_OK) {
+        return;
+    }
+    bool ok = true;
+    for (int i = 0; ok && i < SCCB_FAST_MODE_CHECKS; i++) {
+        sensor_id_t id = { 0 };
+        ok = sensor->detect(slv_addr, &id) == pid;
+    }
+    if (!ok || !camera_sccb_write_check(slv_addr, pid)) {
+        ESP_LOGW(TAG, "Sensor unreliable at %d Hz SCCB, staying at %d Hz", SCCB_FAST_MODE_FREQ, CONFIG_SCCB_CLK_FREQ);
+        SCCB_SetClock(CONFIG_SCCB_CLK_FREQ);
+        return;
+    }
+    ESP_LOGI(TAG, "SCCB clock raised to %d Hz", SCCB_FAST_MODE_FREQ);
+}
+#endif
+
 static esp_err_t camera_probe(const camera_config_t *config, camera_model_t *out_camera_model)
 {
     esp_err_t ret = ESP_OK;
@@ -255,6 +325,9 @@ static esp_err_t camera_probe(const camera_config_t *config, camera_model_t *out
                 if (NULL != info) {
                     *out_camera_model = info->model;
                     ESP_LOGI(TAG, "Detected %s camera", info->name);
+#if CONFIG_SCCB_FAST_MODE
+                    camera_sccb_fast_mode(&g_sensors[i], slv_addr, id->PID);
+#endif
                     g_sensors[i].init(&s_state->sensor);
                     break;
                 }
@@ -384,14 +457,20 @@ esp_err_t esp_camera_deinit()
     return ret;
 }
 
-#define FB_GET_TIMEOUT (4000 / portTICK_PERIOD_MS)
+#define FB_GET_TIMEOUT_MS 4000
 
-camera_fb_t *esp_camera_fb_get()
+camera_fb_t *esp_camera_fb_acquire(uint32_t timeout_ms)
 {
     if (s_state == NULL) {
         return NULL;
     }
-    camera_fb_t *fb = cam_take(FB_GET_TIMEOUT);
+    TickType_t timeout = pdMS_TO_TICKS(timeout_ms);
+    camera_fb_t *fb = cam_take(timeout);
+    //drop frames that were already being captured when the mode changed
+    while (fb && (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec < s_state->mode_switch_us) {
+        cam_give(fb);
+        fb = cam_take(timeout);
+    }
     //set the frame properties
     if (fb) {
         fb->width = resolution[s_state->sensor.status.framesize].width;
@@ -401,12 +480,30 @@ camera_fb_t *esp_camera_fb_get()
     return fb;
 }
 
-void esp_camera_fb_return(camera_fb_t *fb)
+camera_fb_t *esp_camera_fb_get()
+{
+    return esp_camera_fb_acquire(FB_GET_TIMEOUT_MS);
+}
+
+esp_err_t esp_camera_fb_retain(camera_fb_t *fb)
+{
+    if (s_state == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    return cam_retain(fb) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+void esp_camera_fb_release(camera_fb_t *fb)
 {
     if (s_state == NULL) {
         return;
     }
-    cam_give(fb);
+    cam_release(fb);
+}
+
+void esp_camera_fb_return(camera_fb_t *fb)
+{
+    esp_camera_fb_release(fb);
 }
 
 sensor_t *esp_camera_sensor_get()
@@ -535,6 +632,41 @@ esp_err_t esp_camera_reconfigure(const camera_config_t *config)
     return esp_camera_init(&s_saved_config);
 }
 
+esp_err_t esp_camera_switch_mode(framesize_t frame_size)
+{
+    if (s_state == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (frame_size >= FRAMESIZE_INVALID) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    sensor_t *s = &s_state->sensor;
+    if (frame_size == s->status.framesize) {
+        return ESP_OK;
+    }
+
+    int64_t start = esp_timer_get_time();
+    if (!cam_frame_fits(frame_size)) {
+        ESP_LOGW(TAG, "%ux%u does not fit the frame buffers, reconfiguring",
+                 resolution[frame_size].width, resolution[frame_size].height);
+        camera_config_t config = s_saved_config;
+        config.frame_size = frame_size;
+        esp_err_t err = esp_camera_reconfigure(&config);
+        if (err != ESP_OK) {
+            return err;
+        }
+    } else {
+        if (s->set_framesize(s, frame_size) != 0) {
+            ESP_LOGE(TAG, "Failed to set frame size");
+            return ESP_ERR_CAMERA_FAILED_TO_SET_FRAME_SIZE;
+        }
+        s_state->mode_switch_us = esp_timer_get_time();
+    }
+    ESP_LOGI(TAG, "Switched to %ux%u in %lld us", resolution[frame_size].width,
+             resolution[frame_size].height, (long long)(esp_timer_get_time() - start));
+    return ESP_OK;
+}
+
 esp_err_t esp_camera_set_psram_mode(bool enable)
 {
     cam_set_psram_mode(enable);
@@ -548,3 +680,25 @@ bool esp_camera_get_psram_mode(void)
 {
     return cam_get_psram_mode();
 }
+
+void esp_camera_set_trace_cb(camera_trace_cb_t cb)
+{
+    cam_set_trace_cb(cb);
+}
+
+esp_err_t esp_camera_get_stats(camera_stats_t *out)
+{
+    if (out == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (s_state == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    cam_get_stats(out);
+    return ESP_OK;
+}
+
+void esp_camera_reset_stats(void)
+{
+    cam_reset_stats();
+}
@@ -169,6 +169,66 @@ typedef struct {
     struct timeval timestamp;   /*!< Timestamp since boot of the first DMA buffer of the frame */
 } camera_fb_t;
 
+/**
+ * @brief Frame pipeline events reported to the trace hook
+ */
+typedef enum {
+    CAMERA_TRACE_FRAME_START,   /*!< VSYNC armed DMA for a new frame, arg: frame slot */
+    CAMERA_TRACE_FRAME_DONE,    /*!< Frame queued for the application, arg: length in bytes */
+    CAMERA_TRACE_FRAME_DROP,    /*!< Frame discarded by the driver, arg: camera_drop_reason_t */
+    CAMERA_TRACE_FB_GET,        /*!< cam_take() handed a frame out, arg: length in bytes */
+    CAMERA_TRACE_MAX,
+} camera_trace_event_t;
+
+/**
+ * @brief Why the driver discarded a frame
+ */
+typedef enum {
+    CAMERA_DROP_EVENT_OVF,      /*!< ISR event ring was full */
+    CAMERA_DROP_FB_OVF,         /*!< Frame larger than the frame buffer */
+    CAMERA_DROP_DMA_OVF,        /*!< Frame larger than the PSRAM DMA slot */
+    CAMERA_DROP_NO_SOI,         /*!< JPEG start marker missing */
+    CAMERA_DROP_NO_EOI,         /*!< JPEG end marker missing */
+    CAMERA_DROP_FB_SIZE,        /*!< Raw frame shorter or longer than expected */
+    CAMERA_DROP_FBQ_FULL,       /*!< No room in the frame queue */
+    CAMERA_DROP_DMA_OVERRUN,    /*!< DMA overwrote a half buffer before it was copied */
+    CAMERA_DROP_MAX,
+} camera_drop_reason_t;
+
+/**
+ * @brief Number of buckets in camera_stats_t::latency_hist
+ *
+ * Bucket i counts frames delivered within CAMERA_LATENCY_BUCKET_MS(i) of the
+ * start of their DMA transfer; the last bucket counts everything slower.
+ */
+#define CAMERA_LATENCY_BUCKETS 8
+#define CAMERA_LATENCY_BUCKET_MS(i) (25u << (i))
+
+/**
+ * @brief Frame pipeline counters, see esp_camera_get_stats()
+ *
+ * Counters run from boot (or the last esp_camera_reset_stats()) and survive
+ * esp_camera_reconfigure().
+ */
+typedef struct {
+    uint32_t frames_captured;                   /*!< Frames the DMA finished */
+    uint32_t frames_delivered;                  /*!< Frames returned by esp_camera_fb_get() */
+    uint32_t frames_replaced;                   /*!< Queued frames discarded for a newer one (CAMERA_GRAB_LATEST) */
+    uint32_t frames_dropped[CAMERA_DROP_MAX];   /*!< Frames discarded, by camera_drop_reason_t */
+    uint32_t fb_queue_len;                      /*!< Capacity of the frame queue */
+    uint32_t fb_queue_peak;                     /*!< Most frames ever waiting in the frame queue */
+    uint32_t event_queue_len;                   /*!< Capacity of the ISR event ring */
+    uint32_t event_queue_peak;                  /*!< Most events ever waiting in the ISR event ring */
+    uint32_t latency_hist[CAMERA_LATENCY_BUCKETS]; /*!< DMA start to delivery latency histogram */
+    uint32_t latency_max_ms;                    /*!< Slowest delivery */
+    uint32_t latency_total_ms;                  /*!< Sum of all delivery latencies */
+} camera_stats_t;
+
+/**
+ * @brief Trace hook, see esp_camera_set_trace_cb()
+ */
+typedef void (*camera_trace_cb_t)(camera_trace_event_t event, uint32_t arg);
+
 #define ESP_ERR_CAMERA_BASE 0x20000
 #define ESP_ERR_CAMERA_NOT_DETECTED             (ESP_ERR_CAMERA_BASE + 1)
 #define ESP_ERR_CAMERA_FAILED_TO_SET_FRAME_SIZE (ESP_ERR_CAMERA_BASE + 2)
@@ -207,9 +267,47 @@ esp_err_t esp_camera_deinit(void);
  */
 camera_fb_t* esp_camera_fb_get(void);
 
+/**
+ * @brief Obtain a frame buffer, waiting at most timeout_ms for one.
+ *
+ * Same as esp_camera_fb_get() with a caller-chosen timeout. The frame comes
+ * with one reference owned by the caller.
+ *
+ * @param timeout_ms    How long to wait for a frame
+ *
+ * @return pointer to the frame buffer, NULL on timeout
+ */
+camera_fb_t* esp_camera_fb_acquire(uint32_t timeout_ms);
+
+/**
+ * @brief Take another reference to a frame the caller already holds.
+ *
+ * Lets several consumers (upload, recording, analysis) share one frame
+ * without copying it. Each reference is dropped with esp_camera_fb_release();
+ * the buffer goes back to the driver when the last one is.
+ *
+ * @param fb    Frame obtained from esp_camera_fb_get() or esp_camera_fb_acquire()
+ *
+ * @return
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if fb is not a frame currently held by the application
+ *      - ESP_ERR_INVALID_STATE if the driver hasn't been initialized yet
+ */
+esp_err_t esp_camera_fb_retain(camera_fb_t * fb);
+
+/**
+ * @brief Drop one reference to a frame buffer.
+ *
+ * @param fb    Pointer to the frame buffer
+ */
+void esp_camera_fb_release(camera_fb_t * fb);
+
 /**
  * @brief Return the frame buffer to be reused again.
  *
+ * Equivalent to esp_camera_fb_release(); the buffer is reused once every
+ * reference taken with esp_camera_fb_retain() has been dropped as well.
+ *
  * @param fb    Pointer to the frame buffer
  */
 void esp_camera_fb_return(camera_fb_t * fb);
@@ -267,6 +365,51 @@ esp_err_t esp_camera_set_psram_mode(bool enable);
  */
 esp_err_t esp_camera_reconfigure(const camera_config_t *config);
 
+/**
+ * @brief Switch to another frame size without reinitializing the driver.
+ *
+ * When the allocated frame buffers can hold the new frame size, only the sensor
+ * registers that differ between the two modes are rewritten and the DMA and
+ * buffers stay as they are. Frames captured before the switch are discarded by
+ * esp_camera_fb_get(). Otherwise the camera is reconfigured with the new size.
+ *
+ * @param frame_size  Target frame size
+ * @return
+ * - ESP_OK on success
+ * - ESP_ERR_INVALID_STATE if the camera is not initialized
+ * - ESP_ERR_INVALID_ARG if frame_size is out of range
+ * - ESP_ERR_CAMERA_FAILED_TO_SET_FRAME_SIZE if the sensor rejected the size
+ * - Propagated error from esp_camera_reconfigure() when buffers had to be reallocated
+ */
+esp_err_t esp_camera_switch_mode(framesize_t frame_size);
+
+/**
+ * @brief Read the frame pipeline counters.
+ *
+ * @param out  Filled with a snapshot of the counters
+ * @return
+ * - ESP_OK on success
+ * - ESP_ERR_INVALID_ARG if out is NULL
+ * - ESP_ERR_INVALID_STATE if the camera is not initialized
+ */
+esp_err_t esp_camera_get_stats(camera_stats_t *out);
+
+/**
+ * @brief Zero the frame pipeline counters, including the high-water marks.
+ */
+void esp_camera_reset_stats(void);
+
+/**
+ * @brief Install a hook that sees every frame pipeline event.
+ *
+ * The hook runs in the camera task and, for CAMERA_DROP_EVENT_OVF, in the
+ * DMA interrupt, so it must be placed in IRAM and must not block. Pass NULL
+ * to remove it.
+ *
+ * @param cb  Hook to call, or NULL
+ */
+void esp_camera_set_trace_cb(camera_trace_cb_t cb);
+
 /**
  * @brief Get current PSRAM DMA mode state.
  *
@@ -0,0 +1,86 @@
+// Copyright 2010-2020 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Single producer (ISR) / single consumer (cam_task) event ring. The ISR
+// only writes head, the task only writes tail. Kept free of driver types so
+// the host tests run the same code.
+
+// Ring depth, power of two
+#define CAM_EVENT_RING_LEN  (64)
+
+// Called from the ISR, which may live in IRAM, so never an out-of-line copy
+#define CAM_EVENT_RING_INLINE static inline __attribute__((always_inline))
+
+typedef struct {
+    uint8_t type;       // cam_event_t
+    uint8_t gen;        // DMA restart the event was raised under
+    uint16_t eof_seq;   // EOFs since that restart, this one excluded
+} cam_event_rec_t;
+
+typedef struct {
+    cam_event_rec_t rec[CAM_EVENT_RING_LEN];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+} cam_event_ring_t;
+
+// Slot for the next event, NULL when the ring is full. Producer only; the
+// event is not seen until cam_event_ring_publish().
+CAM_EVENT_RING_INLINE cam_event_rec_t *cam_event_ring_reserve(cam_event_ring_t *r)
+{
+    uint32_t head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= CAM_EVENT_RING_LEN) {
+        return NULL;
+    }
+    return &r->rec[head & (CAM_EVENT_RING_LEN - 1)];
+}
+
+// Hand the reserved event to the consumer. Returns the events queued
+// afterwards. The consumer may have emptied the ring and gone to sleep at
+// any point before this, so the producer must wake it after every publish.
+CAM_EVENT_RING_INLINE uint32_t cam_event_ring_publish(cam_event_ring_t *r)
+{
+    uint32_t head = r->head + 1;
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+    return head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+// Oldest event into ev; false when the ring is empty. Consumer only.
+CAM_EVENT_RING_INLINE bool cam_event_ring_pop(cam_event_ring_t *r, cam_event_rec_t *ev)
+{
+    uint32_t tail = r->tail;
+    if (tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *ev = r->rec[tail & (CAM_EVENT_RING_LEN - 1)];
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Drop everything queued so far. Consumer only.
+CAM_EVENT_RING_INLINE void cam_event_ring_discard(cam_event_ring_t *r)
+{
+    __atomic_store_n(&r->tail, __atomic_load_n(&r->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+// Empty the ring while neither side runs
+CAM_EVENT_RING_INLINE void cam_event_ring_reset(cam_event_ring_t *r)
+{
+    r->head = 0;
+    r->tail = 0;
+}
@@ -0,0 +1,61 @@
+// Copyright 2010-2020 Espressif Systems (Shanghai) PTE LTD
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Frame reference counts and pipeline high-water marks. Both are updated
+// from several tasks at once, and the peaks from the DMA ISR too. Kept
+// free of driver types so the host tests run the same code.
+
+#define CAM_FRAME_REF_INLINE static inline __attribute__((always_inline))
+
+// Take one more reference. Fails on a frame nobody holds: its slot may
+// already be refilling.
+CAM_FRAME_REF_INLINE bool cam_frame_ref_retain(uint32_t *refs)
+{
+    uint32_t n = __atomic_load_n(refs, __ATOMIC_RELAXED);
+    do {
+        if (n == 0) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(refs, &n, n + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
+
+// Drop one reference. Returns the count before the drop: 1 when this was
+// the last one and the slot goes back to the DMA, 0 when there was none
+// to drop.
+CAM_FRAME_REF_INLINE uint32_t cam_frame_ref_release(uint32_t *refs)
+{
+    uint32_t n = __atomic_load_n(refs, __ATOMIC_RELAXED);
+    do {
+        if (n == 0) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(refs, &n, n - 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    return n;
+}
+
+// Raise a high-water mark to value. A plain compare and store could let a
+// smaller value written on one core overwrite a larger one from the other.
+CAM_FRAME_REF_INLINE void cam_stat_peak(uint32_t *peak, uint32_t value)
+{
+    uint32_t n = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (value > n &&
+           !__atomic_compare_exchange_n(peak, &n, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
@@ -57,8 +57,20 @@ void cam_give(camera_fb_t *dma_buffer);
 
 void cam_give_all(void);
 
+bool cam_retain(camera_fb_t *fb);
+
+void cam_release(camera_fb_t *fb);
+
 bool cam_get_available_frames(void);
 
+bool cam_frame_fits(framesize_t frame_size);
+
+void cam_set_trace_cb(camera_trace_cb_t cb);
+
+void cam_get_stats(camera_stats_t *out);
+
+void cam_reset_stats(void);
+
 void cam_set_psram_mode(bool enable);
 bool cam_get_psram_mode(void);
 
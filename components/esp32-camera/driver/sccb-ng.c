@@ -59,6 +59,7 @@ static device_t devices[MAX_DEVICES];
 static uint8_t device_count = 0;
 static int sccb_i2c_port;
 static bool sccb_owns_i2c_port;
+static uint32_t sccb_freq = SCCB_FREQ;
 
 i2c_master_dev_handle_t *get_handle_from_address(uint8_t slv_addr)
 {
@@ -96,7 +97,7 @@ int SCCB_Install_Device(uint8_t slv_addr)
     i2c_device_config_t dev_cfg = {
         .dev_addr_length = I2C_ADDR_BIT_LEN_7,
         .device_address = slv_addr, // not yet set
-        .scl_speed_hz = SCCB_FREQ,
+        .scl_speed_hz = sccb_freq,
     };
 
     ret = i2c_master_bus_add_device(bus_handle, &dev_cfg, &(devices[device_count].dev_handle));
@@ -119,6 +120,7 @@ int SCCB_Init(int pin_sda, int pin_scl)
 
     sccb_i2c_port = SCCB_I2C_PORT_DEFAULT;
     sccb_owns_i2c_port = true;
+    sccb_freq = SCCB_FREQ;
     ESP_LOGI(TAG, "sccb_i2c_port=%d", sccb_i2c_port);
 
     i2c_master_bus_config_t i2c_mst_config = {
@@ -332,3 +334,121 @@ int SCCB_Write_Addr16_Val16(uint8_t slv_addr, uint16_t reg, uint16_t data)
     }
     return ret == ESP_OK ? 0 : -1;
 }
+
+/*
+ * The new driver has no way to chain independent register writes into one
+ * transaction, so batches are sent as consecutive transmits; this still saves
+ * the per-write device lookup.
+ */
+int SCCB_WriteBatch(uint8_t slv_addr, const uint8_t (*regs)[2], size_t count)
+{
+    i2c_master_dev_handle_t *handle = get_handle_from_address(slv_addr);
+    if (!handle)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        esp_err_t ret = i2c_master_transmit(*handle, regs[i], 2, TIMEOUT_MS);
+        if (ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "SCCB_WriteBatch Failed addr:0x%02x, reg:0x%02x, data:0x%02x, ret:%d", slv_addr, regs[i][0], regs[i][1], ret);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int SCCB_WriteBatch16(uint8_t slv_addr, const uint16_t (*regs)[2], size_t count)
+{
+    i2c_master_dev_handle_t *handle = get_handle_from_address(slv_addr);
+    if (!handle)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint8_t tx_buffer[3];
+        tx_buffer[0] = regs[i][0] >> 8;
+        tx_buffer[1] = regs[i][0] & 0x00ff;
+        tx_buffer[2] = regs[i][1] & 0x00ff;
+
+        esp_err_t ret = i2c_master_transmit(*handle, tx_buffer, 3, TIMEOUT_MS);
+        if (ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "W [%04x]=%02x fail\n", regs[i][0], regs[i][1]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ Re-register one device at freq_hz. If it was removed but cannot be added at the new clock, it is
+ added back at old_hz, so its handle never points at a freed device.
+*/
+static esp_err_t device_set_clock(i2c_master_bus_handle_t bus_handle, device_t *dev, uint32_t freq_hz, uint32_t old_hz)
+{
+    esp_err_t ret = i2c_master_bus_rm_device(dev->dev_handle);
+    if (ret != ESP_OK)
+    {
+        // Still registered as it was
+        return ret;
+    }
+    i2c_device_config_t dev_cfg = {
+        .dev_addr_length = I2C_ADDR_BIT_LEN_7,
+        .device_address = dev->address,
+        .scl_speed_hz = freq_hz,
+    };
+    ret = i2c_master_bus_add_device(bus_handle, &dev_cfg, &(dev->dev_handle));
+    if (ret != ESP_OK)
+    {
+        dev_cfg.scl_speed_hz = old_hz;
+        if (i2c_master_bus_add_device(bus_handle, &dev_cfg, &(dev->dev_handle)) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "lost SCCB device 0x%02x", dev->address);
+            dev->dev_handle = NULL;
+        }
+    }
+    return ret;
+}
+
+int SCCB_SetClock(uint32_t freq_hz)
+{
+    if (!sccb_owns_i2c_port)
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+
+    // The clock is a per-device setting in the new driver, so re-add every device
+    i2c_master_bus_handle_t bus_handle;
+    esp_err_t ret = i2c_master_get_bus_handle(sccb_i2c_port, &bus_handle);
+    if (ret != ESP_OK)
+    {
+        return ret;
+    }
+
+    uint8_t i;
+    for (i = 0; i < device_count; i++)
+    {
+        ret = device_set_clock(bus_handle, &devices[i], freq_hz, sccb_freq);
+        if (ret != ESP_OK)
+        {
+            ESP_LOGE(TAG, "failed to set SCCB clock for device 0x%02x: %s", devices[i].address, esp_err_to_name(ret));
+            break;
+        }
+    }
+    if (ret != ESP_OK)
+    {
+        // Devices already moved go back, so every device keeps the clock sccb_freq says
+        while (i--)
+        {
+            device_set_clock(bus_handle, &devices[i], sccb_freq, freq_hz);
+        }
+        return ret;
+    }
+    sccb_freq = freq_hz;
+    return ESP_OK;
+}
@@ -44,33 +44,53 @@ const int SCCB_I2C_PORT_DEFAULT = 1;
 const int SCCB_I2C_PORT_DEFAULT = 0;
 #endif
 
+#define SCCB_BATCH_MAX          32                    /*!< Register writes per I2C transaction in SCCB_WriteBatch*/
+
 static int sccb_i2c_port;
 static bool sccb_owns_i2c_port;
+static int sccb_pin_sda = -1;
+static int sccb_pin_scl = -1;
+
+static esp_err_t sccb_param_config(uint32_t freq_hz)
+{
+    i2c_config_t conf;
+    memset(&conf, 0, sizeof(i2c_config_t));
+
+    conf.mode = I2C_MODE_MASTER;
+    conf.sda_io_num = sccb_pin_sda;
+    conf.sda_pullup_en = GPIO_PULLUP_ENABLE;
+    conf.scl_io_num = sccb_pin_scl;
+    conf.scl_pullup_en = GPIO_PULLUP_ENABLE;
+    conf.master.clk_speed = freq_hz;
+
+    return i2c_param_config(sccb_i2c_port, &conf);
+}
 
 int SCCB_Init(int pin_sda, int pin_scl)
 {
     ESP_LOGI(TAG, "pin_sda %d pin_scl %d", pin_sda, pin_scl);
-    i2c_config_t conf;
     esp_err_t ret;
 
-    memset(&conf, 0, sizeof(i2c_config_t));
-
     sccb_i2c_port = SCCB_I2C_PORT_DEFAULT;
     sccb_owns_i2c_port = true;
+    sccb_pin_sda = pin_sda;
+    sccb_pin_scl = pin_scl;
     ESP_LOGI(TAG, "sccb_i2c_port=%d", sccb_i2c_port);
 
-    conf.mode = I2C_MODE_MASTER;
-    conf.sda_io_num = pin_sda;
-    conf.sda_pullup_en = GPIO_PULLUP_ENABLE;
-    conf.scl_io_num = pin_scl;
-    conf.scl_pullup_en = GPIO_PULLUP_ENABLE;
-    conf.master.clk_speed = SCCB_FREQ;
-
-    if ((ret =  i2c_param_config(sccb_i2c_port, &conf)) != ESP_OK) {
+    if ((ret = sccb_param_config(SCCB_FREQ)) != ESP_OK) {
         return ret;
     }
 
-    return i2c_driver_install(sccb_i2c_port, conf.mode, 0, 0, 0);
+    return i2c_driver_install(sccb_i2c_port, I2C_MODE_MASTER, 0, 0, 0);
+}
+
+int SCCB_SetClock(uint32_t freq_hz)
+{
+    if (!sccb_owns_i2c_port) {
+        // Someone else configured the port, leave its timing alone
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    return sccb_param_config(freq_hz);
 }
 
 int SCCB_Use_Port(int i2c_num) { // sccb use an already initialized I2C port
@@ -146,6 +166,64 @@ int SCCB_Write(uint8_t slv_addr, uint8_t reg, uint8_t data)
     return ret == ESP_OK ? 0 : -1;
 }
 
+/*
+ * Writes are chained with repeated STARTs inside one command link, so the
+ * sensor still sees one complete write cycle per register but the driver
+ * round trip (command link, semaphore, interrupt) is paid once per batch.
+ * A batch that fails is retried one register at a time.
+ */
+static int sccb_write_batch(uint8_t slv_addr, const void *regs, size_t count, bool addr16)
+{
+    const uint8_t (*regs8)[2] = regs;
+    const uint16_t (*regs16)[2] = regs;
+
+    for (size_t done = 0; done < count; ) {
+        size_t n = count - done;
+        if (n > SCCB_BATCH_MAX) {
+            n = SCCB_BATCH_MAX;
+        }
+        i2c_cmd_handle_t cmd = i2c_cmd_link_create();
+        for (size_t i = done; i < done + n; i++) {
+            i2c_master_start(cmd);
+            i2c_master_write_byte(cmd, ( slv_addr << 1 ) | WRITE_BIT, ACK_CHECK_EN);
+            if (addr16) {
+                i2c_master_write_byte(cmd, regs16[i][0] >> 8, ACK_CHECK_EN);
+                i2c_master_write_byte(cmd, regs16[i][0] & 0xFF, ACK_CHECK_EN);
+                i2c_master_write_byte(cmd, regs16[i][1] & 0xFF, ACK_CHECK_EN);
+            } else {
+                i2c_master_write_byte(cmd, regs8[i][0], ACK_CHECK_EN);
+                i2c_master_write_byte(cmd, regs8[i][1], ACK_CHECK_EN);
+            }
+        }
+        i2c_master_stop(cmd);
+        esp_err_t ret = i2c_master_cmd_begin(sccb_i2c_port, cmd, 1000 / portTICK_RATE_MS);
+        i2c_cmd_link_delete(cmd);
+
+        if (ret != ESP_OK) {
+            ESP_LOGW(TAG, "Batch of %u writes failed (%d), retrying one by one", (unsigned)n, ret);
+            for (size_t i = done; i < done + n; i++) {
+                int res = addr16 ? SCCB_Write16(slv_addr, regs16[i][0], regs16[i][1])
+                                 : SCCB_Write(slv_addr, regs8[i][0], regs8[i][1]);
+                if (res) {
+                    return res;
+                }
+            }
+        }
+        done += n;
+    }
+    return 0;
+}
+
+int SCCB_WriteBatch(uint8_t slv_addr, const uint8_t (*regs)[2], size_t count)
+{
+    return sccb_write_batch(slv_addr, regs, count, false);
+}
+
+int SCCB_WriteBatch16(uint8_t slv_addr, const uint16_t (*regs)[2], size_t count)
+{
+    return sccb_write_batch(slv_addr, regs, count, true);
+}
+
 uint8_t SCCB_Read16(uint8_t slv_addr, uint16_t reg)
 {
     uint8_t data=0;
@@ -35,28 +35,130 @@ static int set_bank(sensor_t *sensor, ov2640_bank_t bank)
     return res;
 }
 
+#ifndef OV2640_REG_CACHE
+#define OV2640_REG_CACHE 1  // 0 writes every table entry, as the host test's reference
+#endif
+
+/*
+ * Shadow copy of every register value written since the last reset.
+ * Resolution changes replay whole tables (mode, window, JPEG setup) of which
+ * only a fraction differs between two modes, so writes that would not change
+ * the register are skipped. Registers that trigger an action or that the
+ * sensor updates by itself are always written.
+ */
+static struct {
+    uint8_t value[BANK_MAX][256];
+    uint32_t valid[BANK_MAX][256 / 32];
+    uint32_t written;
+    uint32_t skipped;
+} reg_cache;
+
+static void reg_cache_invalidate(void)
+{
+    memset(reg_cache.valid, 0, sizeof(reg_cache.valid));
+}
+
+static bool reg_is_volatile(ov2640_bank_t bank, uint8_t reg)
+{
+    if (bank == BANK_DSP) {
+        return reg == RESET || reg == R_BYPASS;
+    }
+    // COM7 holds the soft reset bit, the rest are driven by AEC/AGC
+    return reg == COM7 || reg == GAIN || reg == AEC || reg == REG04 || reg == REG45;
+}
+
+static void reg_cache_store(ov2640_bank_t bank, uint8_t reg, uint8_t value)
+{
+    if (bank < BANK_MAX) {
+        reg_cache.value[bank][reg] = value;
+        reg_cache.valid[bank][reg / 32] |= 1U << (reg % 32);
+    }
+}
+
+static bool reg_cache_hit(ov2640_bank_t bank, uint8_t reg, uint8_t value)
+{
+    return OV2640_REG_CACHE
+        && bank < BANK_MAX
+        && (reg_cache.valid[bank][reg / 32] & (1U << (reg % 32)))
+        && reg_cache.value[bank][reg] == value
+        && !reg_is_volatile(bank, reg);
+}
+
+// Write a register in the currently selected bank unless it already holds value
+static int write_cached(sensor_t *sensor, uint8_t reg, uint8_t value)
+{
+    ov2640_bank_t bank = reg_bank;
+    if (reg_cache_hit(bank, reg, value)) {
+        reg_cache.skipped++;
+        return 0;
+    }
+    int res = SCCB_Write(sensor->slv_addr, reg, value);
+    if (!res) {
+        reg_cache_store(bank, reg, value);
+        reg_cache.written++;
+    }
+    return res;
+}
+
+#define WRITE_BATCH_MAX 32
+
+// Send the queued writes; on failure the cached bank and registers are unknown
+static int flush_batch(sensor_t *sensor, uint8_t (*batch)[2], size_t *count)
+{
+    int res = 0;
+    if (*count) {
+        res = SCCB_WriteBatch(sensor->slv_addr, (const uint8_t (*)[2])batch, *count);
+        if (res) {
+            reg_bank = BANK_MAX;
+            reg_cache_invalidate();
+        } else {
+            reg_cache.written += *count;
+        }
+        *count = 0;
+    }
+    return res;
+}
+
+// Write a register table, bank switches included, in as few SCCB transactions
+// as possible, leaving out registers that already hold the wanted value
 static int write_regs(sensor_t *sensor, const uint8_t (*regs)[2])
 {
+    uint8_t batch[WRITE_BATCH_MAX][2];
+    size_t count = 0;
     int i=0, res = 0;
     while (regs[i][0]) {
-        if (regs[i][0] == BANK_SEL) {
-            res = set_bank(sensor, regs[i][1]);
+        uint8_t reg = regs[i][0];
+        uint8_t value = regs[i][1];
+        if (reg == BANK_SEL && value == reg_bank) {
+            // Already selected
+        } else if (reg != BANK_SEL && reg_cache_hit(reg_bank, reg, value)) {
+            reg_cache.skipped++;
         } else {
-            res = SCCB_Write(sensor->slv_addr, regs[i][0], regs[i][1]);
+            batch[count][0] = reg;
+            batch[count][1] = value;
+            count++;
+            if (reg == BANK_SEL) {
+                reg_bank = value;
+            } else {
+                reg_cache_store(reg_bank, reg, value);
+            }
+            if (count == WRITE_BATCH_MAX) {
+                res = flush_batch(sensor, batch, &count);
+            }
         }
         if (res) {
             return res;
         }
         i++;
     }
-    return res;
+    return flush_batch(sensor, batch, &count);
 }
 
 static int write_reg(sensor_t *sensor, ov2640_bank_t bank, uint8_t reg, uint8_t value)
 {
     int ret = set_bank(sensor, bank);
     if(!ret) {
-        ret = SCCB_Write(sensor->slv_addr, reg, value);
+        ret = write_cached(sensor, reg, value);
     }
     return ret;
 }
@@ -73,6 +175,9 @@ static int set_reg_bits(sensor_t *sensor, uint8_t bank, uint8_t reg, uint8_t off
     c_value = SCCB_Read(sensor->slv_addr, reg);
     new_value = (c_value & ~(mask << offset)) | ((value & mask) << offset);
     ret = SCCB_Write(sensor->slv_addr, reg, new_value);
+    if (!ret) {
+        reg_cache_store(bank, reg, new_value);
+    }
     return ret;
 }
 
@@ -102,6 +207,7 @@ static int reset(sensor_t *sensor)
 {
     int ret = 0;
     WRITE_REG_OR_RETURN(BANK_SENSOR, COM7, COM7_SRST);
+    reg_cache_invalidate();
     vTaskDelay(10 / portTICK_PERIOD_MS);
     WRITE_REGS_OR_RETURN(ov2640_settings_cif);
     return ret;
@@ -219,11 +325,11 @@ static int set_framesize(sensor_t *sensor, framesize_t framesize)
     uint16_t offset_x = ratio_table[ratio].offset_x;
     uint16_t offset_y = ratio_table[ratio].offset_y;
     ov2640_sensor_mode_t mode = OV2640_MODE_UXGA;
+    uint32_t written = reg_cache.written;
+    uint32_t skipped = reg_cache.skipped;
 
     sensor->status.framesize = framesize;
 
-
-
     if (framesize <= FRAMESIZE_CIF) {
         mode = OV2640_MODE_CIF;
         max_x /= 4;
@@ -242,6 +348,8 @@ static int set_framesize(sensor_t *sensor, framesize_t framesize)
     }
 
     ret = set_window(sensor, mode, offset_x, offset_y, max_x, max_y, w, h);
+    ESP_LOGD(TAG, "Frame size %ux%u: %u registers written, %u unchanged", w, h,
+             (unsigned)(reg_cache.written - written), (unsigned)(reg_cache.skipped - skipped));
     return ret;
 }
 
@@ -565,6 +673,9 @@ int esp32_camera_ov2640_detect(int slv_addr, sensor_id_t *id)
 
 int esp32_camera_ov2640_init(sensor_t *sensor)
 {
+    // detect() selects banks behind set_bank()'s back
+    reg_bank = BANK_MAX;
+    reg_cache_invalidate();
     sensor->reset = reset;
     sensor->init_status = init_status;
     sensor->set_pixformat = set_pixformat;
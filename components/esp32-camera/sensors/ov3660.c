@@ -99,10 +99,21 @@ static int write_regs(uint8_t slv_addr, const uint16_t (*regs)[2])
     while (!ret && regs[i][0] != REGLIST_TAIL) {
         if (regs[i][0] == REG_DLY) {
             vTaskDelay(regs[i][1] / portTICK_PERIOD_MS);
+            i++;
         } else {
+#ifndef REG_DEBUG_ON
+            // Everything up to the next delay goes out as one batch
+            int n = 0;
+            while (regs[i + n][0] != REGLIST_TAIL && regs[i + n][0] != REG_DLY) {
+                n++;
+            }
+            ret = SCCB_WriteBatch16(slv_addr, &regs[i], n);
+            i += n;
+#else
             ret = write_reg(slv_addr, regs[i][0], regs[i][1]);
+            i++;
+#endif
         }
-        i++;
     }
     return ret;
 }
@@ -34,6 +34,7 @@
 #include "freertos/queue.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
+#include "cam_event_ring.h"
 
 #if __has_include("esp_private/periph_ctrl.h")
 # include "esp_private/periph_ctrl.h"
@@ -86,8 +87,9 @@ typedef enum {
 } cam_state_t;
 
 typedef struct {
-    camera_fb_t fb;
+    camera_fb_t fb;     // First member, so a camera_fb_t * maps straight to its slot
     uint8_t en;
+    uint32_t refs;      // Application references, the slot is reused when this drops to 0
     //for RGB/YUV modes
     lldesc_t *dma;
     size_t fb_offset;
@@ -108,7 +110,9 @@ typedef struct {
 
     cam_frame_t *frames;
 
-    QueueHandle_t event_queue;
+    cam_event_ring_t events;        // ISR -> cam_task
+    volatile uint16_t dma_eof_seq;  // EOFs since the last ll_cam_start()
+    volatile uint8_t dma_gen;       // Bumped on every ll_cam_start()
     QueueHandle_t frame_buffer_queue;
     TaskHandle_t task_handle;
     intr_handle_t cam_intr_handle;
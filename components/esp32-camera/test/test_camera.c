@@ -1,8 +1,10 @@
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "unity.h"
 #include <mbedtls/base64.h>
 #include "esp_log.h"
@@ -345,6 +347,165 @@ TEST_CASE("Camera driver performance test", "[camera]")
     camera_performance_test(20 * 1000000, 16);
 }
 
+TEST_CASE("Camera driver JPEG mode switch test", "[camera]")
+{
+    static const framesize_t modes[] = {FRAMESIZE_SVGA, FRAMESIZE_UXGA, FRAMESIZE_XGA, FRAMESIZE_UXGA};
+    TEST_ESP_OK(init_camera(20000000, PIXFORMAT_JPEG, FRAMESIZE_UXGA, 2, SIOD_GPIO_NUM, -1));
+    vTaskDelay(500 / portTICK_RATE_MS);
+
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        uint64_t t1 = esp_timer_get_time();
+        TEST_ESP_OK(esp_camera_switch_mode(modes[i]));
+        uint64_t t2 = esp_timer_get_time();
+        camera_fb_t *pic = esp_camera_fb_get();
+        uint64_t t3 = esp_timer_get_time();
+        TEST_ASSERT_NOT_NULL(pic);
+        ESP_LOGI(TAG, "%d x %d: switch %llu us, first frame after %llu us, size: %u",
+                 pic->width, pic->height, t2 - t1, t3 - t2, pic->len);
+        TEST_ASSERT_EQUAL(resolution[modes[i]].width, pic->width);
+        esp_camera_fb_return(pic);
+    }
+
+    TEST_ESP_OK(esp_camera_deinit());
+}
+
+TEST_CASE("Camera driver pipeline stats test", "[camera]")
+{
+    camera_stats_t st;
+    TEST_ESP_OK(init_camera(20000000, PIXFORMAT_JPEG, FRAMESIZE_VGA, 2, SIOD_GPIO_NUM, -1));
+    vTaskDelay(500 / portTICK_RATE_MS);
+    esp_camera_reset_stats();
+
+    for (int i = 0; i < 10; i++) {
+        camera_fb_t *pic = esp_camera_fb_get();
+        TEST_ASSERT_NOT_NULL(pic);
+        esp_camera_fb_return(pic);
+    }
+    TEST_ESP_OK(esp_camera_get_stats(&st));
+
+    uint32_t hist_total = 0;
+    for (int i = 0; i < CAMERA_LATENCY_BUCKETS; i++) {
+        hist_total += st.latency_hist[i];
+    }
+    uint32_t dropped = 0;
+    for (int i = 0; i < CAMERA_DROP_MAX; i++) {
+        dropped += st.frames_dropped[i];
+    }
+    ESP_LOGI(TAG, "captured %u delivered %u replaced %u dropped %u, fbq peak %u/%u, evq peak %u/%u, latency max %u ms",
+             st.frames_captured, st.frames_delivered, st.frames_replaced, dropped,
+             st.fb_queue_peak, st.fb_queue_len, st.event_queue_peak, st.event_queue_len, st.latency_max_ms);
+
+    TEST_ASSERT_EQUAL_UINT32(10, st.frames_delivered);
+    TEST_ASSERT_EQUAL_UINT32(st.frames_delivered, hist_total);
+    // Up to fb_count frames captured before the reset can be delivered after it
+    TEST_ASSERT_GREATER_OR_EQUAL_UINT32(st.frames_delivered, st.frames_captured + 2);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(st.fb_queue_len, st.fb_queue_peak);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT32(st.event_queue_len, st.event_queue_peak);
+
+    esp_camera_reset_stats();
+    TEST_ESP_OK(esp_camera_get_stats(&st));
+    TEST_ASSERT_EQUAL_UINT32(0, st.frames_delivered);
+
+    TEST_ESP_OK(esp_camera_deinit());
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, esp_camera_get_stats(&st));
+}
+
+
+#define FB_CONSUMERS 3
+
+typedef struct {
+    camera_fb_t *fb;
+    uint32_t hold_ms;
+    bool intact;
+    SemaphoreHandle_t done;
+} fb_consumer_t;
+
+static uint32_t fb_checksum(const camera_fb_t *fb)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < fb->len; i++) {
+        sum = sum * 31 + fb->buf[i];
+    }
+    return sum;
+}
+
+static void fb_consumer_task(void *arg)
+{
+    fb_consumer_t *c = (fb_consumer_t *)arg;
+    uint32_t before = fb_checksum(c->fb);
+    vTaskDelay(c->hold_ms / portTICK_RATE_MS);
+    c->intact = fb_checksum(c->fb) == before;
+    esp_camera_fb_release(c->fb);
+    xSemaphoreGive(c->done);
+    vTaskDelete(NULL);
+}
+
+TEST_CASE("Camera driver shared frame test", "[camera]")
+{
+    TEST_ESP_OK(init_camera(20000000, PIXFORMAT_JPEG, FRAMESIZE_VGA, 2, SIOD_GPIO_NUM, -1));
+    vTaskDelay(500 / portTICK_RATE_MS);
+
+    camera_fb_t *pic = esp_camera_fb_acquire(1000);
+    TEST_ASSERT_NOT_NULL(pic);
+    camera_fb_t *held = pic;
+
+    // Copy avoidance: what handing the frame to each consumer costs
+    uint64_t t1 = esp_timer_get_time();
+    for (int i = 0; i < FB_CONSUMERS; i++) {
+        uint8_t *copy = malloc(pic->len);
+        TEST_ASSERT_NOT_NULL(copy);
+        memcpy(copy, pic->buf, pic->len);
+        free(copy);
+    }
+    uint64_t t2 = esp_timer_get_time();
+    for (int i = 0; i < FB_CONSUMERS; i++) {
+        TEST_ESP_OK(esp_camera_fb_retain(pic));
+        esp_camera_fb_release(pic);
+    }
+    uint64_t t3 = esp_timer_get_time();
+    ESP_LOGI(TAG, "%d consumers, %u byte frame: copy %llu us, retain %llu us",
+             FB_CONSUMERS, pic->len, t2 - t1, t3 - t2);
+    TEST_ASSERT_LESS_THAN(t2 - t1, t3 - t2);
+
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(FB_CONSUMERS, 0);
+    TEST_ASSERT_NOT_NULL(done);
+    fb_consumer_t consumers[FB_CONSUMERS];
+    for (int i = 0; i < FB_CONSUMERS; i++) {
+        consumers[i] = (fb_consumer_t) {
+            .fb = pic, .hold_ms = 100 * (i + 1), .intact = false, .done = done,
+        };
+        TEST_ESP_OK(esp_camera_fb_retain(pic));
+        TEST_ASSERT_EQUAL(pdPASS, xTaskCreate(fb_consumer_task, "fb_consumer", 2048, &consumers[i], 5, NULL));
+    }
+    esp_camera_fb_release(pic);
+
+    // Keep the driver capturing into the other slot while the frame is shared
+    int captured = 0;
+    while (uxSemaphoreGetCount(done) < FB_CONSUMERS) {
+        camera_fb_t *other = esp_camera_fb_get();
+        TEST_ASSERT_NOT_NULL(other);
+        captured++;
+        esp_camera_fb_return(other);
+    }
+    for (int i = 0; i < FB_CONSUMERS; i++) {
+        TEST_ASSERT_TRUE(consumers[i].intact);
+    }
+    TEST_ASSERT_GREATER_THAN(0, captured);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, esp_camera_fb_retain(held));
+
+    // Once the last consumer let go, the slot is filled again
+    bool reused = false;
+    for (int i = 0; i < 4 && !reused; i++) {
+        pic = esp_camera_fb_get();
+        TEST_ASSERT_NOT_NULL(pic);
+        reused = pic == held;
+        esp_camera_fb_return(pic);
+    }
+    TEST_ASSERT_TRUE(reused);
+
+    vSemaphoreDelete(done);
+    TEST_ESP_OK(esp_camera_deinit());
+}
 
 static void print_rgb565_img(uint8_t *img, int width, int height)
 {
@@ -527,6 +688,146 @@ TEST_CASE("Conversions image 480x320 jpeg decode test", "[camera]")
     img_jpeg_decode_test(2, 0);
 }
 
+TEST_CASE("Conversions jpeg requantize test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_outside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_outside_jpeg_end");
+    size_t length = img_end - img_start;
+
+    // Same quality as the source: only the Huffman coding is redone
+    uint8_t *out = NULL;
+    size_t out_len = 0;
+    TEST_ASSERT_TRUE(jpg2jpg(img_start, length, 100, &out, &out_len));
+    TEST_ASSERT_EQUAL(length, out_len);
+    free(out);
+
+    uint64_t t1 = esp_timer_get_time();
+    TEST_ASSERT_TRUE(jpg2jpg(img_start, length, 50, &out, &out_len));
+    uint64_t t_requant = esp_timer_get_time() - t1;
+    TEST_ASSERT_LESS_THAN(length / 2, out_len);
+
+    esp_jpeg_image_cfg_t cfg = {
+        .indata = out,
+        .indata_size = out_len,
+        .out_format = JPEG_IMAGE_FORMAT_RGB888,
+    };
+    esp_jpeg_image_output_t img;
+    TEST_ESP_OK(esp_jpeg_get_image_info(&cfg, &img));
+    TEST_ASSERT_EQUAL(480, img.width);
+    TEST_ASSERT_EQUAL(320, img.height);
+    uint8_t *rgb_buf = heap_caps_malloc(img.output_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(rgb_buf);
+    cfg.outbuf = rgb_buf;
+    cfg.outbuf_size = img.output_len;
+    TEST_ESP_OK(esp_jpeg_decode(&cfg, &img));
+    heap_caps_free(rgb_buf);
+
+    printf("requantized %u -> %u bytes in %.2f ms\n", (unsigned)length, (unsigned)out_len, t_requant / 1000.0f);
+    free(out);
+}
+
+static uint8_t *decode_rgb888(const uint8_t *jpg, size_t len, esp_jpeg_image_output_t *img)
+{
+    esp_jpeg_image_cfg_t cfg = {
+        .indata = (uint8_t *)jpg,
+        .indata_size = len,
+        .out_format = JPEG_IMAGE_FORMAT_RGB888,
+    };
+    TEST_ESP_OK(esp_jpeg_get_image_info(&cfg, img));
+    uint8_t *rgb_buf = heap_caps_malloc(img->output_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    TEST_ASSERT_NOT_NULL(rgb_buf);
+    cfg.outbuf = rgb_buf;
+    cfg.outbuf_size = img->output_len;
+    TEST_ESP_OK(esp_jpeg_decode(&cfg, img));
+    return rgb_buf;
+}
+
+TEST_CASE("Conversions jpeg crop test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_outside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_outside_jpeg_end");
+    size_t length = img_end - img_start;
+
+    // Widened to the 16x16 MCUs of the 4:2:0 picture
+    jpg_rect_t rect = { .x = 100, .y = 50, .w = 200, .h = 100 };
+    uint8_t *out = NULL;
+    size_t out_len = 0;
+    uint64_t t1 = esp_timer_get_time();
+    TEST_ASSERT_TRUE(jpg_crop(img_start, length, &rect, &out, &out_len));
+    uint64_t t_crop = esp_timer_get_time() - t1;
+    TEST_ASSERT_EQUAL(96, rect.x);
+    TEST_ASSERT_EQUAL(48, rect.y);
+    TEST_ASSERT_EQUAL(208, rect.w);
+    TEST_ASSERT_EQUAL(112, rect.h);
+
+    // Same pixels as the area of the decoded source
+    esp_jpeg_image_output_t full, crop;
+    uint8_t *full_rgb = decode_rgb888(img_start, length, &full);
+    uint8_t *crop_rgb = decode_rgb888(out, out_len, &crop);
+    TEST_ASSERT_EQUAL(rect.w, crop.width);
+    TEST_ASSERT_EQUAL(rect.h, crop.height);
+    for (int y = 0; y < rect.h; y++) {
+        TEST_ASSERT_EQUAL_MEMORY(full_rgb + ((rect.y + y) * full.width + rect.x) * 3,
+                                 crop_rgb + y * rect.w * 3, rect.w * 3);
+    }
+    heap_caps_free(full_rgb);
+    heap_caps_free(crop_rgb);
+
+    printf("cropped %u -> %u bytes in %.2f ms\n", (unsigned)length, (unsigned)out_len, t_crop / 1000.0f);
+    free(out);
+}
+
+TEST_CASE("Conversions jpeg luminance DC map test", "[camera]")
+{
+    extern const uint8_t img_start[] asm("_binary_test_outside_jpeg_start");
+    extern const uint8_t img_end[]   asm("_binary_test_outside_jpeg_end");
+    size_t length = img_end - img_start;
+
+    const size_t max = 60 * 40;
+    int16_t *dc = malloc(max * sizeof(int16_t));
+    int16_t *dc_q30 = malloc(max * sizeof(int16_t));
+    TEST_ASSERT_NOT_NULL(dc);
+    TEST_ASSERT_NOT_NULL(dc_q30);
+    uint16_t w = 0, h = 0;
+    TEST_ASSERT_FALSE(jpg_dc_luma(img_start, length, dc, max - 1, &w, &h));
+    uint64_t t1 = esp_timer_get_time();
+    TEST_ASSERT_TRUE(jpg_dc_luma(img_start, length, dc, max, &w, &h));
+    uint64_t t_dc = esp_timer_get_time() - t1;
+    TEST_ASSERT_EQUAL(60, w);
+    TEST_ASSERT_EQUAL(40, h);
+
+    // Each value is the mean luminance of its decoded block
+    esp_jpeg_image_output_t img;
+    uint8_t *rgb = decode_rgb888(img_start, length, &img);
+    for (int by = 0; by < h; by++) {
+        for (int bx = 0; bx < w; bx++) {
+            int sum = 0;
+            for (int y = 0; y < 8; y++) {
+                const uint8_t *p = rgb + ((by * 8 + y) * img.width + bx * 8) * 3;
+                for (int x = 0; x < 8; x++, p += 3) {
+                    sum += (299 * p[0] + 587 * p[1] + 114 * p[2]) / 1000;
+                }
+            }
+            TEST_ASSERT_INT_WITHIN(4, sum / 64, 128 + dc[by * w + bx] / 8);
+        }
+    }
+    heap_caps_free(rgb);
+
+    // And hardly depends on the quality
+    uint8_t *out = NULL;
+    size_t out_len = 0;
+    TEST_ASSERT_TRUE(jpg2jpg(img_start, length, 30, &out, &out_len));
+    TEST_ASSERT_TRUE(jpg_dc_luma(out, out_len, dc_q30, max, &w, &h));
+    for (int i = 0; i < max; i++) {
+        TEST_ASSERT_INT_WITHIN(16, dc[i], dc_q30[i]);
+    }
+    free(out);
+    free(dc);
+    free(dc_q30);
+
+    printf("DC map of %u bytes in %.2f ms\n", (unsigned)length, t_dc / 1000.0f);
+}
+
 TEST_CASE("Camera driver uses an i2c port initialized by other devices test", "[camera]")
 {
     TEST_ESP_OK(i2c_master_init(I2C_MASTER_NUM));
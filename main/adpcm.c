@@ -0,0 +1,171 @@
+#include <stdbool.h>
+#include <string.h>
+#include "adpcm.h"
+
+static const int16_t step_table[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767,
+};
+
+static const int8_t index_table[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8,
+};
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    put_le16(p, v & 0xFFFF);
+    put_le16(p + 2, v >> 16);
+}
+
+// Move the predictor and step by one code, exactly as a decoder will
+static void step(int32_t *predictor, int8_t *index, uint8_t code)
+{
+    int32_t s = step_table[*index];
+    int32_t delta = s >> 3;
+    if (code & 4) delta += s;
+    if (code & 2) delta += s >> 1;
+    if (code & 1) delta += s >> 2;
+    int32_t p = *predictor + (code & 8 ? -delta : delta);
+    *predictor = p > 32767 ? 32767 : p < -32768 ? -32768 : p;
+    int i = *index + index_table[code];
+    *index = i < 0 ? 0 : i > 88 ? 88 : i;
+}
+
+// The standard quantizer: the code whose range holds x
+static uint8_t nearest(int32_t predictor, int8_t index, int32_t x)
+{
+    int32_t s = step_table[index];
+    int32_t diff = x - predictor;
+    uint8_t code = 0;
+    if (diff < 0) {
+        code = 8;
+        diff = -diff;
+    }
+    if (diff >= s) {
+        code |= 4;
+        diff -= s;
+    }
+    if (diff >= s >> 1) {
+        code |= 2;
+        diff -= s >> 1;
+    }
+    if (diff >= s >> 2) {
+        code |= 1;
+    }
+    return code;
+}
+
+// Code for x; with next given, the one of its sign that minimises the
+// squared error over both samples. Smaller codes than the quantizer's only
+// shrink the step further and never win, so they are not tried.
+static uint8_t encode_sample(adpcm_encoder_t *enc, int16_t x, const int16_t *next)
+{
+    uint8_t code = nearest(enc->predictor, enc->index, x);
+#if ADPCM_LOOKAHEAD
+    if (next) {
+        int64_t best = INT64_MAX;
+        uint8_t sign = code & 8;
+        for (uint8_t m = code & 7; m < 8; m++) {
+            int32_t p1 = enc->predictor;
+            int8_t i1 = enc->index;
+            step(&p1, &i1, sign | m);
+            int32_t p2 = p1;
+            int8_t i2 = i1;
+            step(&p2, &i2, nearest(p1, i1, *next));
+            int64_t e = (int64_t)(x - p1) * (x - p1) + (int64_t)(*next - p2) * (*next - p2);
+            if (e < best) {
+                best = e;
+                code = sign | m;
+            }
+        }
+    }
+#endif
+    step(&enc->predictor, &enc->index, code);
+    return code;
+}
+
+void adpcm_init(adpcm_encoder_t *enc)
+{
+    memset(enc, 0, sizeof(*enc));
+}
+
+void adpcm_begin_block(adpcm_encoder_t *enc, uint8_t *out)
+{
+    enc->out = out;
+    enc->pos = 0;
+}
+
+size_t adpcm_encode(adpcm_encoder_t *enc, const int16_t *pcm, size_t n)
+{
+    size_t i = 0;
+    // The first sample goes out whole and resets the predictor, the step
+    // index carries over
+    if (n && enc->pos == 0) {
+        enc->predictor = pcm[0];
+        put_le16(enc->out, (uint16_t)pcm[0]);
+        enc->out[2] = enc->index;
+        enc->out[3] = 0;
+        enc->pos = 1;
+        i = 1;
+    }
+    for (; i < n && enc->pos < ADPCM_BLOCK_SAMPLES; i++) {
+        // The last sample of a block has nothing after it in the block
+        bool last = i + 1 == n || enc->pos + 1 == ADPCM_BLOCK_SAMPLES;
+        uint8_t code = encode_sample(enc, pcm[i], last ? NULL : &pcm[i + 1]);
+        // Two codes per byte, the earlier one in the low nibble
+        uint8_t *b = &enc->out[4 + (enc->pos - 1) / 2];
+        if ((enc->pos - 1) & 1) {
+            *b |= code << 4;
+        } else {
+            *b = code;
+        }
+        enc->pos++;
+    }
+    return i;
+}
+
+void adpcm_wav_header(uint8_t *out, uint32_t rate, uint32_t blocks)
+{
+    uint32_t data = blocks * ADPCM_BLOCK_BYTES;
+    memcpy(out, "RIFF", 4);
+    put_le32(out + 4, ADPCM_WAV_HEADER - 8 + data);
+    memcpy(out + 8, "WAVEfmt ", 8);
+    put_le32(out + 16, 20);
+    put_le16(out + 20, 0x11);                       // WAVE_FORMAT_IMA_ADPCM
+    put_le16(out + 22, 1);
+    put_le32(out + 24, rate);
+    put_le32(out + 28, rate * ADPCM_BLOCK_BYTES / ADPCM_BLOCK_SAMPLES);
+    put_le16(out + 32, ADPCM_BLOCK_BYTES);
+    put_le16(out + 34, 4);
+    put_le16(out + 36, 2);                          // Extra format bytes
+    put_le16(out + 38, ADPCM_BLOCK_SAMPLES);
+    memcpy(out + 40, "fact", 4);
+    put_le32(out + 44, 4);
+    put_le32(out + 48, blocks * ADPCM_BLOCK_SAMPLES);
+    memcpy(out + 52, "data", 4);
+    put_le32(out + 56, data);
+}
+
+void adpcm_decode_block(const uint8_t *in, int16_t *pcm)
+{
+    int32_t predictor = (int16_t)(in[0] | in[1] << 8);
+    int8_t index = in[2] > 88 ? 88 : in[2];
+    pcm[0] = predictor;
+    for (int i = 1; i < ADPCM_BLOCK_SAMPLES; i++) {
+        uint8_t b = in[4 + (i - 1) / 2];
+        step(&predictor, &index, (i - 1) & 1 ? b >> 4 : b & 0x0F);
+        pcm[i] = predictor;
+    }
+}
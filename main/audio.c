@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_attr.h"
+#include "esp_heap_caps.h"
+#include "driver/i2s_std.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "audio.h"
+
+static const char *TAG = "audio";
+
+#define AUDIO_STACK         3072
+#define AUDIO_PRIORITY      6       // Above the bot, so the ring never backs up
+// A read that sees nothing for this long means the mic is missing
+#define READ_TIMEOUT_MS     100
+// 32-bit slots carry 24 bits MSB first. Summing a pair at this shift is
+// their mean at 14: 12 dB above the top 16 bits, as the mic is quiet
+#define SAMPLE_SHIFT        15
+// Blocks in the voiced share reported by /sound test
+#define VOICED_WINDOW       (1000 / CRY_BLOCK_MS)
+// Weight of the newest sample in the smoothed load, in 1/8ths
+#define EWMA_NEW            1
+// One slot more than a clip: the block being written is not part of it
+#define RING_SLOTS          (AUDIO_CLIP_BLOCKS + 1)
+#define CLIP_AFTER_BLOCKS   (AUDIO_CLIP_AFTER_MS / CRY_BLOCK_MS)
+
+static i2s_chan_handle_t rx;
+static TaskHandle_t task;
+static SemaphoreHandle_t lock;
+static audio_alert_cb_t alert_cb;
+static audio_clip_cb_t clip_cb;
+static volatile bool enabled;
+static volatile uint8_t sensitivity = CRY_SENSITIVITY_DEFAULT;
+static volatile uint32_t overruns;
+static audio_stats_t stats;         // Under lock
+static uint64_t voiced_bits;        // Last VOICED_WINDOW blocks, audio task only
+
+// Both buffers are only touched by the audio task
+static int32_t raw[CRY_BLOCK * 2];
+static int16_t block[CRY_BLOCK];
+static cry_detector_t detector;
+
+// Clip ring, audio task only, and the clip handed out
+static uint8_t *ring;
+static adpcm_encoder_t encoder;
+static uint16_t ring_head;          // Slot being written
+static uint16_t ring_blocks;        // Complete blocks behind it
+static uint16_t clip_countdown;     // Blocks until the clip is taken
+static uint8_t *clip;
+static volatile bool clip_busy;
+
+static bool IRAM_ATTR on_overflow(i2s_chan_handle_t handle, i2s_event_data_t *event, void *ctx)
+{
+    overruns++;
+    return false;
+}
+
+// Two capture samples to one: the mean is a crude low-pass, enough with
+// the cry band far below the new Nyquist
+static void decimate(void)
+{
+    for (int n = 0; n < CRY_BLOCK; n++) {
+        int32_t s = (raw[2 * n] >> SAMPLE_SHIFT) + (raw[2 * n + 1] >> SAMPLE_SHIFT);
+        block[n] = s > 32767 ? 32767 : s < -32768 ? -32768 : s;
+    }
+}
+
+static void record_start(void)
+{
+    adpcm_init(&encoder);
+    ring_head = 0;
+    ring_blocks = 0;
+    clip_countdown = 0;
+    adpcm_begin_block(&encoder, ring);
+}
+
+// Encode straight into the ring; the oldest block gives way
+static void record(const int16_t *pcm, size_t n)
+{
+    while (n) {
+        if (encoder.pos == ADPCM_BLOCK_SAMPLES) {
+            ring_head = (ring_head + 1) % RING_SLOTS;
+            if (ring_blocks < AUDIO_CLIP_BLOCKS) {
+                ring_blocks++;
+            }
+            adpcm_begin_block(&encoder, ring + ring_head * ADPCM_BLOCK_BYTES);
+        }
+        size_t used = adpcm_encode(&encoder, pcm, n);
+        pcm += used;
+        n -= used;
+    }
+}
+
+// Lay the complete blocks out oldest first behind a WAV header
+static size_t take_clip(void)
+{
+    uint8_t *out = clip + ADPCM_WAV_HEADER;
+    uint16_t slot = (ring_head + RING_SLOTS - ring_blocks) % RING_SLOTS;
+    for (uint16_t i = 0; i < ring_blocks; i++) {
+        memcpy(out, ring + slot * ADPCM_BLOCK_BYTES, ADPCM_BLOCK_BYTES);
+        out += ADPCM_BLOCK_BYTES;
+        slot = (slot + 1) % RING_SLOTS;
+    }
+    adpcm_wav_header(clip, CRY_SAMPLE_RATE, ring_blocks);
+    return out - clip;
+}
+
+static void update_stats(const cry_block_t *f, bool alert, uint32_t load)
+{
+    voiced_bits = (voiced_bits << 1) | f->voiced;
+    uint64_t window = voiced_bits & ((1ULL << VOICED_WINDOW) - 1);
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    stats.level_db = cry_log_to_db(f->level);
+    stats.tone_db = cry_log_to_db(f->tone);
+    stats.floor_db = cry_log_to_db(f->floor);
+    stats.voiced_pct = __builtin_popcountll(window) * 100 / VOICED_WINDOW;
+    stats.alerts += alert;
+    stats.load_permille = stats.load_permille ?
+        (stats.load_permille * (8 - EWMA_NEW) + load * EWMA_NEW) / 8 : load;
+    xSemaphoreGive(lock);
+}
+
+static void audio_task(void *arg)
+{
+    bool running = false;
+    bool missing = false;
+    while (1) {
+        // The channel is only switched here, never under a pending read
+        if (enabled != running) {
+            running = enabled;
+            if (running) {
+                cry_init(&detector, sensitivity);
+                voiced_bits = 0;
+                if (ring) {
+                    record_start();
+                }
+                i2s_channel_enable(rx);
+                ESP_LOGI(TAG, "Cry detection on");
+            } else {
+                i2s_channel_disable(rx);
+                ESP_LOGI(TAG, "Cry detection off");
+            }
+        }
+        if (!running) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        size_t got = 0;
+        esp_err_t err = i2s_channel_read(rx, raw, sizeof(raw), &got, pdMS_TO_TICKS(READ_TIMEOUT_MS));
+        if (err != ESP_OK || got != sizeof(raw)) {
+            if (!missing) {
+                ESP_LOGW(TAG, "No audio from the microphone");
+                missing = true;
+            }
+            continue;
+        }
+        missing = false;
+
+        int64_t start = esp_timer_get_time();
+        if (detector.sensitivity != sensitivity) {
+            cry_set_sensitivity(&detector, sensitivity);
+        }
+        decimate();
+        bool alert = cry_process(&detector, block);
+        if (ring) {
+            record(block, CRY_BLOCK);
+        }
+        uint32_t load = (esp_timer_get_time() - start) * 1000 / (CRY_BLOCK_MS * 1000);
+        update_stats(cry_last_block(&detector), alert, load);
+
+        // Before the alert below, which would otherwise count its own block
+        if (clip_countdown && --clip_countdown == 0) {
+            if (clip_busy) {
+                ESP_LOGW(TAG, "Previous clip still uploading, no clip");
+            } else {
+                clip_busy = true;
+                size_t len = take_clip();
+                xSemaphoreTake(lock, portMAX_DELAY);
+                stats.clips++;
+                xSemaphoreGive(lock);
+                clip_cb(clip, len);
+            }
+        }
+        if (alert) {
+            ESP_LOGI(TAG, "Cry detected");
+            if (alert_cb) {
+                alert_cb();
+            }
+            if (ring && clip_cb && !clip_countdown) {
+                clip_countdown = CLIP_AFTER_BLOCKS;
+            }
+        }
+    }
+}
+
+esp_err_t audio_start(audio_alert_cb_t on_alert, audio_clip_cb_t on_clip)
+{
+    i2s_chan_config_t chan_cfg = I2S_CHANNEL_DEFAULT_CONFIG(I2S_NUM_1, I2S_ROLE_MASTER);
+    chan_cfg.dma_desc_num = AUDIO_DMA_BUFFERS;
+    chan_cfg.dma_frame_num = CRY_BLOCK * 2;
+    esp_err_t err = i2s_new_channel(&chan_cfg, NULL, &rx);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "I2S channel failed: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    i2s_std_config_t std_cfg = {
+        .clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG(AUDIO_CAPTURE_RATE),
+        .slot_cfg = I2S_STD_PHILIPS_SLOT_DEFAULT_CONFIG(I2S_DATA_BIT_WIDTH_32BIT, I2S_SLOT_MODE_MONO),
+        .gpio_cfg = {
+            .mclk = I2S_GPIO_UNUSED,
+            .bclk = AUDIO_PIN_BCLK,
+            .ws = AUDIO_PIN_WS,
+            .dout = I2S_GPIO_UNUSED,
+            .din = AUDIO_PIN_DIN,
+        },
+    };
+    std_cfg.slot_cfg.slot_mask = I2S_STD_SLOT_LEFT;
+    i2s_event_callbacks_t cbs = { .on_recv_q_ovf = on_overflow };
+    err = i2s_channel_init_std_mode(rx, &std_cfg);
+    if (err == ESP_OK) {
+        err = i2s_channel_register_event_callback(rx, &cbs, NULL);
+    }
+    lock = xSemaphoreCreateMutex();
+    if (err != ESP_OK || !lock) {
+        ESP_LOGE(TAG, "I2S setup failed: %s", esp_err_to_name(err));
+        i2s_del_channel(rx);
+        rx = NULL;
+        return err != ESP_OK ? err : ESP_ERR_NO_MEM;
+    }
+
+    alert_cb = on_alert;
+    clip_cb = on_clip;
+    ring = heap_caps_malloc(RING_SLOTS * ADPCM_BLOCK_BYTES, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    clip = heap_caps_malloc(AUDIO_CLIP_MAX, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!ring || !clip) {
+        ESP_LOGW(TAG, "No PSRAM for audio clips");
+        free(ring);
+        free(clip);
+        ring = NULL;
+        clip = NULL;
+    }
+    if (xTaskCreate(audio_task, "audio_task", AUDIO_STACK, NULL, AUDIO_PRIORITY, &task) != pdPASS) {
+        i2s_del_channel(rx);
+        rx = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void audio_clip_release(void)
+{
+    clip_busy = false;
+}
+
+void audio_set_enabled(bool on)
+{
+    enabled = on;
+    if (task) {
+        xTaskNotifyGive(task);
+    }
+}
+
+bool audio_enabled(void)
+{
+    return enabled;
+}
+
+void audio_set_sensitivity(uint8_t s)
+{
+    sensitivity = s < 1 ? 1 : s > 10 ? 10 : s;
+}
+
+void audio_get_stats(audio_stats_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    if (lock) {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        *out = stats;
+        xSemaphoreGive(lock);
+    }
+    out->enabled = enabled;
+    out->sensitivity = sensitivity;
+    out->overruns = overruns;
+}
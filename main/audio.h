@@ -0,0 +1,80 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "cry.h"
+#include "adpcm.h"
+
+// Nursery microphone and cry detection.
+//
+// The camera owns I2S0, the only peripheral that can DMA the ESP32's ADC,
+// and the header pins left free on the AI-Thinker board are all ADC2, which
+// Wi-Fi blocks. So the microphone is an I2S MEMS part (INMP441 or similar,
+// L/R to GND) on I2S1. The driver's DMA ring fills in the background; one
+// task drains it a block at a time, takes the 24-bit samples down to 16
+// bits and 16 kHz down to CRY_SAMPLE_RATE, and runs the detector in cry.h
+// on a static buffer. Nothing is allocated after audio_start().
+//
+// While detection runs, the audio is also kept as IMA-ADPCM (4 bits a
+// sample) in a PSRAM ring of AUDIO_CLIP_MS. A clip is taken
+// AUDIO_CLIP_AFTER_MS after an alert, so it holds the crying that raised
+// it: the ring's blocks are copied in order behind a WAV header into a
+// buffer sized once at start, about 20 KB where 8 kHz PCM would take 80.
+//
+// Pins: SD card 1-bit mode keeps 2, 14 and 15 and GPIO4 drives the flash
+// LED, so the mic takes 12 and 13 and the serial RX line. GPIO12 is a
+// strapping pin, but the mic's SCK is an input, so it is not pulled high
+// at reset.
+
+#define AUDIO_PIN_BCLK      12
+#define AUDIO_PIN_WS        13
+#define AUDIO_PIN_DIN       3
+#define AUDIO_CAPTURE_RATE  (CRY_SAMPLE_RATE * 2)
+// 4 x 25 ms in the DMA ring before samples are lost
+#define AUDIO_DMA_BUFFERS   4
+
+#define AUDIO_CLIP_MS       5000
+#define AUDIO_CLIP_AFTER_MS 2000
+#define AUDIO_CLIP_BLOCKS   ((AUDIO_CLIP_MS * CRY_SAMPLE_RATE / 1000 + ADPCM_BLOCK_SAMPLES - 1) / ADPCM_BLOCK_SAMPLES)
+#define AUDIO_CLIP_MAX      (ADPCM_WAV_HEADER + AUDIO_CLIP_BLOCKS * ADPCM_BLOCK_BYTES)
+
+// Called on the audio task when the detector raises an alert
+typedef void (*audio_alert_cb_t)(void);
+
+// Called on the audio task with a WAV clip, which stays untouched until
+// audio_clip_release(); no other clip is taken meanwhile
+typedef void (*audio_clip_cb_t)(const uint8_t *wav, size_t len);
+
+typedef struct {
+    bool enabled;
+    uint8_t sensitivity;
+    int level_db;           // Last block, dB of full scale
+    int tone_db;            // Strongest cry band bin in the last block
+    int floor_db;           // Noise floor the tone is judged against
+    uint8_t voiced_pct;     // Blocks that looked like a cry, last second
+    uint32_t alerts;
+    uint32_t clips;         // Clips handed out
+    uint32_t overruns;      // DMA ring overflows: blocks lost
+    uint32_t load_permille; // Smoothed processing time per block of audio
+} audio_stats_t;
+
+// Set up I2S1 and the audio task, detection off. Without PSRAM for the
+// clip buffers detection still runs, on_clip is never called.
+esp_err_t audio_start(audio_alert_cb_t on_alert, audio_clip_cb_t on_clip);
+
+void audio_clip_release(void);
+
+// Start or stop capture; the detector starts over each time
+void audio_set_enabled(bool enabled);
+
+bool audio_enabled(void);
+
+// 1 = least sensitive, 10 = most
+void audio_set_sensitivity(uint8_t sensitivity);
+
+void audio_get_stats(audio_stats_t *out);
+
+#endif // AUDIO_H
@@ -0,0 +1,125 @@
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+#include "boot.h"
+
+static const char *TAG = "boot";
+
+#define BOOT_STAGE_PRIORITY 5
+
+typedef struct {
+    const boot_stage_t *stage;
+    uint32_t bit;
+    esp_err_t result;
+    int64_t ready_us;
+    int64_t done_us;
+} stage_state_t;
+
+static EventGroupHandle_t boot_group;
+static stage_state_t states[BOOT_MAX_STAGES];
+static size_t stage_count;
+static int64_t start_us;
+
+// Caller has waited for bits, so every stage in it has a final result
+static bool stages_succeeded(uint32_t bits)
+{
+    for (size_t i = 0; i < stage_count; i++) {
+        if ((bits & states[i].bit) && states[i].result != ESP_OK) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void stage_task(void *arg)
+{
+    stage_state_t *st = arg;
+    const boot_stage_t *stage = st->stage;
+
+    if (stage->requires) {
+        xEventGroupWaitBits(boot_group, stage->requires, pdFALSE, pdTRUE, portMAX_DELAY);
+    }
+    st->ready_us = esp_timer_get_time();
+
+    if (stages_succeeded(stage->requires)) {
+        st->result = stage->run();
+    } else {
+        ESP_LOGW(TAG, "Skipping %s, a dependency failed", stage->name);
+        st->result = ESP_ERR_INVALID_STATE;
+    }
+    st->done_us = esp_timer_get_time();
+
+    ESP_LOGI(TAG, "[PERF] %s %s: ready at %lld ms, took %lld ms",
+             stage->name, st->result == ESP_OK ? "done" : esp_err_to_name(st->result),
+             (st->ready_us - start_us) / 1000, (st->done_us - st->ready_us) / 1000);
+
+    xEventGroupSetBits(boot_group, st->bit);
+    vTaskDelete(NULL);
+}
+
+esp_err_t boot_start(const boot_stage_t *stages, size_t count)
+{
+    if (boot_group || count == 0 || count > BOOT_MAX_STAGES) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    boot_group = xEventGroupCreate();
+    if (!boot_group) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    start_us = esp_timer_get_time();
+    stage_count = count;
+    for (size_t i = 0; i < count; i++) {
+        states[i] = (stage_state_t) {
+            .stage = &stages[i],
+            .bit = BOOT_BIT(i),
+            .result = ESP_ERR_INVALID_STATE,
+        };
+    }
+
+    // Create every task before any can finish so dependents see consistent state
+    for (size_t i = 0; i < count; i++) {
+        if (xTaskCreate(stage_task, stages[i].name, stages[i].stack_size, &states[i],
+                        BOOT_STAGE_PRIORITY, NULL) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to start stage %s", stages[i].name);
+            states[i].done_us = esp_timer_get_time();
+            xEventGroupSetBits(boot_group, states[i].bit);
+        }
+    }
+    return ESP_OK;
+}
+
+bool boot_wait(uint32_t bits, TickType_t timeout)
+{
+    if (!boot_group) {
+        return false;
+    }
+    EventBits_t got = xEventGroupWaitBits(boot_group, bits, pdFALSE, pdTRUE, timeout);
+    if ((got & bits) != bits) {
+        return false;
+    }
+    return stages_succeeded(bits);
+}
+
+bool boot_get_status(size_t index, boot_stage_status_t *out)
+{
+    if (index >= stage_count) {
+        return false;
+    }
+    const stage_state_t *st = &states[index];
+    bool done = boot_group && (xEventGroupGetBits(boot_group) & st->bit);
+    *out = (boot_stage_status_t) {
+        .name = st->stage->name,
+        .result = st->result,
+        .done = done,
+        .ready_ms = st->ready_us ? (st->ready_us - start_us) / 1000 : -1,
+        .done_ms = done ? (st->done_us - start_us) / 1000 : -1,
+    };
+    return true;
+}
+
+size_t boot_stage_count(void)
+{
+    return stage_count;
+}
@@ -0,0 +1,51 @@
+#ifndef BOOT_H
+#define BOOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+// Boot orchestrator.
+//
+// Each stage runs in its own task as soon as the stages it requires have
+// finished, so independent work (camera probe, Wi-Fi association) overlaps
+// instead of running back to back. A stage whose dependency failed is
+// skipped and reported as failed itself, so waiters never hang.
+
+#define BOOT_MAX_STAGES 8
+
+// Completion bit of the stage at index i in the table given to boot_start()
+#define BOOT_BIT(i) (1u << (i))
+
+typedef esp_err_t (*boot_stage_fn_t)(void);
+
+typedef struct {
+    const char *name;
+    boot_stage_fn_t run;
+    uint32_t requires;      // BOOT_BIT()s of the stages that must succeed first
+    uint32_t stack_size;
+} boot_stage_t;
+
+typedef struct {
+    const char *name;
+    esp_err_t result;       // ESP_ERR_INVALID_STATE when skipped
+    bool done;
+    int64_t ready_ms;       // Dependencies met, relative to boot_start()
+    int64_t done_ms;        // Stage finished, relative to boot_start()
+} boot_stage_status_t;
+
+// Start every stage of the table. The table must stay valid while booting.
+esp_err_t boot_start(const boot_stage_t *stages, size_t count);
+
+// Wait until all stages in bits have finished. Returns true only if they
+// all succeeded.
+bool boot_wait(uint32_t bits, TickType_t timeout);
+
+// Snapshot of one stage's progress; returns false for an unknown index.
+bool boot_get_status(size_t index, boot_stage_status_t *out);
+
+size_t boot_stage_count(void);
+
+#endif // BOOT_H
@@ -0,0 +1,198 @@
+#include <string.h>
+#include "cry.h"
+
+// 2cos(2*pi*k/CRY_BLOCK) in Q14 for k = 2..15: 80-200 Hz, then 240-600 Hz
+static const int32_t coeff[CRY_LOW_BINS + CRY_BAND_BINS] = {
+    32703, 32623, 32510, 32365,
+    32188, 31979, 31739, 31467, 31164, 30831, 30467, 30073, 29649, 29197,
+};
+
+#define DB(x)               ((x) * 25600 / 301)
+// Share of the block's energy the cry band must hold, in percent
+#define BAND_MIN_PCT        10
+// Strongest band bin against the band's mean, and against the adult range
+#define PEAK_RATIO          3
+#define LOW_RATIO           2
+// A burst is held: its blocks stay this close to its loudest one, where a
+// plucked note decays and a syllable swells and fades
+#define STEADY_DROP         DB(6)
+// Noise floor: never below the mic's own noise, and rising by one unit
+// (0.024 dB) per quiet block, about 1 dB/s
+#define FLOOR_MIN           DB(-90)
+#define FLOOR_RISE          1
+#define WINDOW_BLOCKS       (CRY_WINDOW_MS / CRY_BLOCK_MS)
+#define HOLDOFF_BLOCKS      (CRY_HOLDOFF_MS / CRY_BLOCK_MS)
+#define LOG_ZERO            (-64 * 256)
+
+// log2(v) in Q8; the fraction is the mantissa taken as linear, within 0.09
+static cry_log_t log2_q8(uint64_t v)
+{
+    if (!v) {
+        return LOG_ZERO;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    uint32_t frac = msb >= 8 ? (uint32_t)(v >> (msb - 8)) : (uint32_t)(v << (8 - msb));
+    return (msb << 8) + (frac & 0xFF);
+}
+
+int cry_log_to_db(cry_log_t v)
+{
+    // 3.0103 dB per unit of log2 power
+    return v * 30103 / 256 / 10000;
+}
+
+void cry_set_sensitivity(cry_detector_t *d, uint8_t sensitivity)
+{
+    d->sensitivity = sensitivity < 1 ? 1 : sensitivity > 10 ? 10 : sensitivity;
+}
+
+void cry_init(cry_detector_t *d, uint8_t sensitivity)
+{
+    memset(d, 0, sizeof(*d));
+    cry_set_sensitivity(d, sensitivity);
+}
+
+const cry_block_t *cry_last_block(const cry_detector_t *d)
+{
+    return &d->last;
+}
+
+// Goertzel power of one bin over the block: |X(k)|^2, the square of N/2
+// times the amplitude for a sine on the bin
+static uint64_t goertzel(const int16_t *x, int32_t c)
+{
+    int32_t s1 = 0;
+    int32_t s2 = 0;
+    for (int n = 0; n < CRY_BLOCK; n++) {
+        int32_t s = x[n] + (int32_t)(((int64_t)c * s1) >> 14) - s2;
+        s2 = s1;
+        s1 = s;
+    }
+    int64_t p = (int64_t)s1 * s1 + (int64_t)s2 * s2 - (((int64_t)c * s1) >> 14) * s2;
+    return p > 0 ? p : 0;
+}
+
+// A burst ended at the current block. Returns true if it completes an alert.
+static bool end_burst(cry_detector_t *d)
+{
+    bool counts = d->steady_max >= CRY_BURST_MIN_BLOCKS && d->pitch_max - d->pitch_min >= CRY_PITCH_SPAN;
+    d->run = 0;
+    d->gap = 0;
+    if (!counts) {
+        return false;
+    }
+    memmove(d->bursts, d->bursts + 1, sizeof(d->bursts) - sizeof(d->bursts[0]));
+    d->bursts[CRY_BURSTS - 1] = d->blocks;
+    if (d->burst_count < CRY_BURSTS) {
+        d->burst_count++;
+    }
+    if (d->burst_count < CRY_BURSTS || d->blocks - d->bursts[0] > WINDOW_BLOCKS) {
+        return false;
+    }
+    d->burst_count = 0;
+    if (d->alerted && d->blocks - d->last_alert < HOLDOFF_BLOCKS) {
+        return false;
+    }
+    d->alerted = true;
+    d->last_alert = d->blocks;
+    return true;
+}
+
+bool cry_process(cry_detector_t *d, int16_t *samples)
+{
+    // DC out with a one-pole high-pass (about 5 Hz), energy on the way
+    uint64_t energy = 0;
+    for (int n = 0; n < CRY_BLOCK; n++) {
+        d->dc += samples[n] - (d->dc >> 8);
+        int32_t y = samples[n] - (d->dc >> 8);
+        y = y > 32767 ? 32767 : y < -32768 ? -32768 : y;
+        samples[n] = y;
+        energy += (int64_t)y * y;
+    }
+
+    uint64_t band = 0;
+    uint64_t peak = 0;
+    uint64_t low = 0;
+    uint8_t peak_bin = 0;
+    for (int b = 0; b < CRY_LOW_BINS + CRY_BAND_BINS; b++) {
+        uint64_t p = goertzel(samples, coeff[b]);
+        if (b < CRY_LOW_BINS) {
+            low = p > low ? p : low;
+            continue;
+        }
+        band += p;
+        if (p > peak) {
+            peak = p;
+            peak_bin = b - CRY_LOW_BINS;
+        }
+    }
+
+    cry_block_t *f = &d->last;
+    // Mean power against a full-scale square: log2(E / N / 2^30)
+    f->level = log2_q8(energy) - log2_q8(CRY_BLOCK) - 30 * 256;
+    // The strongest bin as the power of a sine: peak / (N/2)^2 / 2, same scale
+    f->tone = log2_q8(peak) - 2 * log2_q8(CRY_BLOCK / 2) - 31 * 256;
+    // A sine on a bin gives band = E * N / 2
+    uint64_t scale = energy * CRY_BLOCK;
+    uint64_t pct = scale ? band * 200 / scale : 0;
+    f->band_pct = pct > 100 ? 100 : pct;
+    f->peak_bin = peak_bin;
+
+    // The floor is kept on the tone level: a cry's fundamental stands much
+    // further out of the noise in its own bin than in the whole band
+    if (!d->floor_set) {
+        d->floor = f->tone;
+        d->floor_set = true;
+    }
+    cry_log_t threshold = DB(27 - 2 * d->sensitivity);
+    f->voiced = f->tone - d->floor >= threshold &&
+                f->band_pct >= BAND_MIN_PCT &&
+                peak * CRY_BAND_BINS >= PEAK_RATIO * band &&
+                peak >= LOW_RATIO * low;
+
+    // The floor follows quiet blocks down quickly and creeps up otherwise,
+    // so a new steady noise is absorbed but a cry is not
+    if (f->tone < d->floor) {
+        d->floor += (f->tone - d->floor) / 4;
+    } else if (!f->voiced) {
+        d->floor += FLOOR_RISE;
+    }
+    if (d->floor < FLOOR_MIN) {
+        d->floor = FLOOR_MIN;
+    }
+    f->floor = d->floor;
+
+    d->blocks++;
+    bool alert = false;
+    if (f->voiced) {
+        // A cry glides; a jump in pitch is a new note or syllable
+        if (d->run && (peak_bin > d->pitch_last + CRY_PITCH_JUMP ||
+                       peak_bin + CRY_PITCH_JUMP < d->pitch_last)) {
+            alert = end_burst(d);
+        }
+        if (!d->run) {
+            d->pitch_min = d->pitch_max = peak_bin;
+            d->loudest = f->tone;
+            d->steady = d->steady_max = 0;
+        }
+        if (f->tone > d->loudest) {
+            d->loudest = f->tone;
+        }
+        if (d->gap || f->tone < d->loudest - STEADY_DROP) {
+            d->steady = 0;
+        }
+        if (++d->steady > d->steady_max) {
+            d->steady_max = d->steady;
+        }
+        d->pitch_min = peak_bin < d->pitch_min ? peak_bin : d->pitch_min;
+        d->pitch_max = peak_bin > d->pitch_max ? peak_bin : d->pitch_max;
+        d->pitch_last = peak_bin;
+        d->gap = 0;
+        if (++d->run >= CRY_BURST_MAX_BLOCKS) {
+            alert |= end_burst(d);
+        }
+    } else if (d->run && ++d->gap > CRY_BRIDGE_BLOCKS) {
+        alert = end_burst(d);
+    }
+    return alert;
+}
@@ -0,0 +1,95 @@
+#ifndef CRY_H
+#define CRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Cry detector for 8 kHz mono audio, in fixed point.
+//
+// Audio comes in blocks of CRY_BLOCK samples (25 ms). Each block gets its
+// energy and a Goertzel bank: one bin every 40 Hz over 240-600 Hz, where a
+// baby's cry has its fundamental, and 80-200 Hz, where an adult voice has
+// it. A block is voiced when its strongest cry band bin stands out of that
+// bin's tracked noise floor, the band holds a fair share of the energy,
+// peaked rather than flat, and beats the adult range. Voiced blocks form
+// bursts, with gaps up to CRY_BRIDGE_BLOCKS bridged. A burst counts when it
+// holds its level long enough, which plucked notes and syllables do not,
+// and its pitch glides, which a beeping appliance does not; a jump in pitch
+// starts a new burst. CRY_BURSTS bursts inside CRY_WINDOW_MS make an alert.
+//
+// Everything is integer arithmetic on state held by the caller, so the
+// same code runs on the audio task and on recorded WAV files.
+
+#define CRY_SAMPLE_RATE         8000
+#define CRY_BLOCK               200     // 25 ms, 40 Hz bins
+#define CRY_BLOCK_MS            (CRY_BLOCK * 1000 / CRY_SAMPLE_RATE)
+#define CRY_BAND_BINS           10      // 240-600 Hz
+#define CRY_LOW_BINS            4       // 80-200 Hz
+
+// Burst length and gap, in blocks
+#define CRY_BURST_MIN_BLOCKS    10      // 250 ms held
+#define CRY_BURST_MAX_BLOCKS    120     // A longer wail counts every 3 s
+#define CRY_BRIDGE_BLOCKS       3
+// Pitch range a burst must cover, in bins
+#define CRY_PITCH_SPAN          2
+// Largest pitch step between blocks inside a burst, in bins
+#define CRY_PITCH_JUMP          2
+#define CRY_BURSTS              3
+#define CRY_WINDOW_MS           10000
+// No second alert this soon after one
+#define CRY_HOLDOFF_MS          60000
+
+#define CRY_SENSITIVITY_DEFAULT 5       // 1-10
+
+// Log2 in Q8, the unit every level below is kept in; 6.02 dB per 256
+typedef int32_t cry_log_t;
+
+// Per-block features, for tests and the level report
+typedef struct {
+    cry_log_t level;        // Mean power, log2 Q8 of full scale squared (<= 0)
+    cry_log_t tone;         // Strongest cry band bin as the power of a sine
+    cry_log_t floor;        // Noise floor of tone
+    uint8_t band_pct;       // Share of the energy in the cry band bins
+    uint8_t peak_bin;       // Strongest cry band bin, 0 = 240 Hz
+    bool voiced;
+} cry_block_t;
+
+typedef struct {
+    uint8_t sensitivity;
+    int32_t dc;             // High-pass state, Q8
+    int16_t last_in;
+    cry_log_t floor;
+    bool floor_set;
+    uint16_t run;           // Blocks in the current burst
+    uint16_t steady;        // Unbroken blocks near its loudest
+    uint16_t steady_max;
+    cry_log_t loudest;
+    uint8_t gap;            // Unvoiced blocks since its last voiced one
+    uint8_t pitch_min;
+    uint8_t pitch_max;
+    uint8_t pitch_last;
+    uint32_t blocks;        // Blocks processed, the detector's clock
+    uint32_t bursts[CRY_BURSTS];    // Block at which recent bursts ended
+    uint8_t burst_count;
+    uint32_t last_alert;
+    bool alerted;
+    cry_block_t last;
+} cry_detector_t;
+
+void cry_init(cry_detector_t *d, uint8_t sensitivity);
+
+// 1 = least sensitive, 10 = most
+void cry_set_sensitivity(cry_detector_t *d, uint8_t sensitivity);
+
+// Process one block of CRY_BLOCK samples in place (the DC is taken out).
+// Returns true when it completes a cry alert.
+bool cry_process(cry_detector_t *d, int16_t *samples);
+
+// Features of the last block
+const cry_block_t *cry_last_block(const cry_detector_t *d);
+
+// Level in dB of full scale, for a cry_log_t
+int cry_log_to_db(cry_log_t v);
+
+#endif // CRY_H
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <string.h>
+#include "exif.h"
+
+#define TIFF_ASCII      2
+#define TIFF_SHORT      3
+#define TIFF_LONG       4
+#define TIFF_UNDEFINED  7
+
+#define TAG_IMAGE_DESCRIPTION   0x010E
+#define TAG_MAKE                0x010F
+#define TAG_MODEL               0x0110
+#define TAG_DATE_TIME           0x0132
+#define TAG_EXIF_IFD            0x8769
+#define TAG_ISO_SPEED           0x8827
+#define TAG_EXIF_VERSION        0x9000
+#define TAG_DATE_TIME_ORIGINAL  0x9003
+#define TAG_OFFSET_TIME_ORIGINAL 0x9011
+#define TAG_FLASH               0x9209
+#define TAG_SUBSEC_TIME_ORIGINAL 0x9291
+#define TAG_PIXEL_X_DIMENSION   0xA002
+#define TAG_PIXEL_Y_DIMENSION   0xA003
+
+// Header before the TIFF structure: marker, length and "Exif\0\0"
+#define APP1_HEADER_LEN 10
+
+typedef struct {
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    const void *data;       // ASCII or UNDEFINED bytes; NULL for a number
+    uint32_t value;
+} exif_entry_t;
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    size_t pos;
+    const uint8_t *tiff;    // Offsets count from the TIFF header
+} exif_writer_t;
+
+static void put_bytes(exif_writer_t *w, const void *data, size_t len)
+{
+    if (w->pos + len <= w->size) {
+        memcpy(w->buf + w->pos, data, len);
+    }
+    w->pos += len;
+}
+
+// Big-endian ("MM"), like the JPEG around it
+static void put16(exif_writer_t *w, uint16_t v)
+{
+    uint8_t b[2] = { v >> 8, v & 0xFF };
+    put_bytes(w, b, 2);
+}
+
+static void put32(exif_writer_t *w, uint32_t v)
+{
+    uint8_t b[4] = { v >> 24, (v >> 16) & 0xFF, (v >> 8) & 0xFF, v & 0xFF };
+    put_bytes(w, b, 4);
+}
+
+static bool out_of_line(const exif_entry_t *e)
+{
+    return e->data && e->count > 4;
+}
+
+// Bytes taken by an IFD and the values stored after it
+static size_t ifd_size(const exif_entry_t *entries, size_t n)
+{
+    size_t size = 2 + n * 12 + 4;
+    for (size_t i = 0; i < n; i++) {
+        if (out_of_line(&entries[i])) {
+            size += (entries[i].count + 1) & ~1u;
+        }
+    }
+    return size;
+}
+
+// Write an IFD followed by the values that do not fit in its entries.
+// Entries must be sorted by tag.
+static void put_ifd(exif_writer_t *w, const exif_entry_t *entries, size_t n)
+{
+    uint32_t data_offset = (w->buf + w->pos - w->tiff) + 2 + n * 12 + 4;
+    put16(w, n);
+    for (size_t i = 0; i < n; i++) {
+        const exif_entry_t *e = &entries[i];
+        put16(w, e->tag);
+        put16(w, e->type);
+        put32(w, e->count);
+        if (out_of_line(e)) {
+            put32(w, data_offset);
+            data_offset += (e->count + 1) & ~1u;
+        } else if (e->data) {
+            uint8_t value[4] = { 0 };
+            memcpy(value, e->data, e->count);
+            put_bytes(w, value, 4);
+        } else if (e->type == TIFF_SHORT) {
+            put16(w, e->value);
+            put16(w, 0);
+        } else {
+            put32(w, e->value);
+        }
+    }
+    put32(w, 0);    // No next IFD
+    for (size_t i = 0; i < n; i++) {
+        if (out_of_line(&entries[i])) {
+            put_bytes(w, entries[i].data, entries[i].count);
+            if (entries[i].count & 1) {
+                put_bytes(w, "", 1);
+            }
+        }
+    }
+}
+
+#define ASCII(tag, str) { tag, TIFF_ASCII, sizeof(str), str, 0 }
+#define NUMBER(tag, type, v) { tag, type, 1, NULL, v }
+
+size_t exif_build(const exif_info_t *info, uint8_t *buf, size_t size)
+{
+    static const char make[] = "Espressif";
+    static const char model[] = "ESP32-CAM OV2640";
+    char date[20];
+    char subsec[4];
+    char description[48];
+    bool dated = info->time != 0;
+    if (dated) {
+        struct tm tm;
+        gmtime_r(&info->time, &tm);
+        strftime(date, sizeof(date), "%Y:%m:%d %H:%M:%S", &tm);
+        snprintf(subsec, sizeof(subsec), "%03u", info->msec % 1000);
+    }
+    snprintf(description, sizeof(description), "Exposure %u rows, gain %u.%02ux",
+             info->exposure_lines, info->gain_x16 / 16, info->gain_x16 % 16 * 100 / 16);
+    bool exposed = info->exposure_lines != 0;
+
+    exif_entry_t ifd0[5];
+    size_t n0 = 0;
+    if (exposed) {
+        ifd0[n0++] = (exif_entry_t) { TAG_IMAGE_DESCRIPTION, TIFF_ASCII, strlen(description) + 1, description, 0 };
+    }
+    ifd0[n0++] = (exif_entry_t) ASCII(TAG_MAKE, make);
+    ifd0[n0++] = (exif_entry_t) ASCII(TAG_MODEL, model);
+    if (dated) {
+        ifd0[n0++] = (exif_entry_t) ASCII(TAG_DATE_TIME, date);
+    }
+    ifd0[n0++] = (exif_entry_t) NUMBER(TAG_EXIF_IFD, TIFF_LONG, 0);
+
+    exif_entry_t sub[9];
+    size_t n1 = 0;
+    if (exposed) {
+        // Base sensitivity taken as ISO 100 at 1x gain
+        sub[n1++] = (exif_entry_t) NUMBER(TAG_ISO_SPEED, TIFF_SHORT, info->gain_x16 * 100 / 16);
+    }
+    sub[n1++] = (exif_entry_t) { TAG_EXIF_VERSION, TIFF_UNDEFINED, 4, "0232", 0 };
+    if (dated) {
+        sub[n1++] = (exif_entry_t) ASCII(TAG_DATE_TIME_ORIGINAL, date);
+        sub[n1++] = (exif_entry_t) ASCII(TAG_OFFSET_TIME_ORIGINAL, "+00:00");
+    }
+    // Fired, or "did not fire, compulsory flash suppression"
+    sub[n1++] = (exif_entry_t) NUMBER(TAG_FLASH, TIFF_SHORT, info->flash ? 0x09 : 0x10);
+    if (dated) {
+        sub[n1++] = (exif_entry_t) { TAG_SUBSEC_TIME_ORIGINAL, TIFF_ASCII, sizeof(subsec), subsec, 0 };
+    }
+    sub[n1++] = (exif_entry_t) NUMBER(TAG_PIXEL_X_DIMENSION, TIFF_SHORT, info->width);
+    sub[n1++] = (exif_entry_t) NUMBER(TAG_PIXEL_Y_DIMENSION, TIFF_SHORT, info->height);
+
+    // The Exif IFD follows IFD0 and its values
+    ifd0[n0 - 1].value = 8 + ifd_size(ifd0, n0);
+    size_t len = APP1_HEADER_LEN + 8 + ifd_size(ifd0, n0) + ifd_size(sub, n1);
+    if (len > size) {
+        return 0;
+    }
+
+    exif_writer_t w = { .buf = buf, .size = size, .tiff = buf + APP1_HEADER_LEN };
+    put16(&w, 0xFFE1);
+    put16(&w, len - 2);
+    put_bytes(&w, "Exif\0", 6);
+    put_bytes(&w, "MM", 2);
+    put16(&w, 42);
+    put32(&w, 8);
+    put_ifd(&w, ifd0, n0);
+    put_ifd(&w, sub, n1);
+    return w.pos;
+}
@@ -0,0 +1,33 @@
+#ifndef EXIF_H
+#define EXIF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+// Minimal EXIF APP1 segment for camera frames.
+//
+// Capture time, frame size, flash and the sensor's exposure state. The
+// OV2640 reports exposure in sensor rows, whose duration depends on the
+// clock setup, so it goes into ImageDescription as rows and gain rather
+// than into ExposureTime; the gain also gives ISOSpeedRatings.
+
+// Largest segment exif_build() writes
+#define EXIF_MAX_BYTES 384
+
+typedef struct {
+    time_t time;                // Wall time of the capture (UTC), 0 if unknown
+    uint16_t msec;              // and its milliseconds
+    uint16_t width;
+    uint16_t height;
+    uint16_t exposure_lines;    // 0 if the sensor state was not read
+    uint16_t gain_x16;          // Analog gain, 16 = 1x
+    bool flash;
+} exif_info_t;
+
+// Write a complete APP1 segment, marker included, to be placed right after
+// SOI. Returns its length, 0 if it does not fit in size.
+size_t exif_build(const exif_info_t *info, uint8_t *buf, size_t size);
+
+#endif // EXIF_H
@@ -0,0 +1,256 @@
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_camera.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "trace.h"
+#include "exposure.h"
+
+static const char *TAG = "exposure";
+
+// OV2640 sensor bank registers; get_reg() takes the bank from bit 8
+#define REG_GAIN        0x100   // AGC gain
+#define REG_REG04       0x104   // Bits 1:0 = exposure[1:0]
+#define REG_AEC         0x110   // Exposure[9:2]
+#define REG_AEW         0x124   // AEC stable window, upper luma
+#define REG_AEB         0x125   // AEC stable window, lower luma
+#define REG_YAVG        0x12F   // Mean luma of the last frame
+#define REG_REG45       0x145   // Bits 5:0 = exposure[15:10]
+
+// Weight of the newest run in the flash model, in 1/4ths
+#define MODEL_NEW       1
+
+// 1/sensitivity the flash adds, 0 until a run has settled
+static float flash_term;
+
+static const char *const state_names[] = {
+    [EXPOSURE_WAIT]      = "waiting",
+    [EXPOSURE_STABLE]    = "stable",
+    [EXPOSURE_PINNED]    = "pinned",
+    [EXPOSURE_TIMEOUT]   = "timeout",
+    [EXPOSURE_PREDICTED] = "predicted",
+};
+
+// GAIN is (bit7+1)(bit6+1)(bit5+1)(bit4+1)(1 + bits[3:0]/16)
+static uint16_t gain_from_reg(uint8_t reg)
+{
+    uint16_t gain = 16 + (reg & 0x0F);
+    for (int bit = 4; bit < 8; bit++) {
+        if (reg & (1 << bit)) {
+            gain *= 2;
+        }
+    }
+    return gain;
+}
+
+static uint8_t gain_to_reg(uint32_t gain_x16)
+{
+    uint8_t reg = 0;
+    for (int bit = 4; bit < 8 && gain_x16 >= 32; bit++) {
+        reg |= 1 << bit;
+        gain_x16 /= 2;
+    }
+    return reg | (gain_x16 > 31 ? 0x0F : gain_x16 - 16);
+}
+
+uint32_t exposure_sensitivity(const exposure_sample_t *s)
+{
+    return (uint32_t)s->lines * s->gain_x16 / 16;
+}
+
+static bool same_sample(const exposure_sample_t *a, const exposure_sample_t *b)
+{
+    return a->lines == b->lines && a->gain_x16 == b->gain_x16 &&
+           abs(a->luma - b->luma) <= EXPOSURE_LUMA_TOLERANCE;
+}
+
+void exposure_tracker_init(exposure_tracker_t *t, uint8_t low, uint8_t high,
+                           const exposure_sample_t *start)
+{
+    t->low = low;
+    t->high = high;
+    t->start = *start;
+    t->last = *start;
+    t->steady_since = start->frame;
+    t->steady_ms = 0;
+    t->moved = false;
+}
+
+exposure_state_t exposure_tracker_step(exposure_tracker_t *t, const exposure_sample_t *s,
+                                       uint32_t elapsed_ms)
+{
+    if (!same_sample(s, &t->last)) {
+        t->steady_since = s->frame;
+        t->steady_ms = elapsed_ms;
+    }
+    if (!same_sample(s, &t->start)) {
+        t->moved = true;
+    }
+    t->last = *s;
+
+    uint32_t steady = s->frame - t->steady_since;
+    bool in_window = s->luma >= t->low && s->luma <= t->high;
+    if (t->moved) {
+        if (in_window && steady >= EXPOSURE_STEADY_FRAMES) {
+            return EXPOSURE_STABLE;
+        }
+        // The AEC changes something every frame until it is in the window,
+        // unless exposure and gain are at their limits
+        if (!in_window && steady >= 2 * EXPOSURE_STEADY_FRAMES) {
+            return EXPOSURE_PINNED;
+        }
+    } else if (s->frame - t->start.frame >= EXPOSURE_MIN_FRAMES) {
+        return in_window ? EXPOSURE_STABLE : EXPOSURE_PINNED;
+    }
+    return elapsed_ms >= EXPOSURE_TIMEOUT_MS ? EXPOSURE_TIMEOUT : EXPOSURE_WAIT;
+}
+
+bool exposure_supported(sensor_t *sensor)
+{
+    return sensor && sensor->id.PID == OV2640_PID && sensor->get_reg && sensor->set_reg;
+}
+
+esp_err_t exposure_read(sensor_t *sensor, exposure_sample_t *out)
+{
+    int luma = sensor->get_reg(sensor, REG_YAVG, 0xFF);
+    int gain = sensor->get_reg(sensor, REG_GAIN, 0xFF);
+    int high = sensor->get_reg(sensor, REG_REG45, 0x3F);
+    int mid = sensor->get_reg(sensor, REG_AEC, 0xFF);
+    int low = sensor->get_reg(sensor, REG_REG04, 0x03);
+    if (luma < 0 || gain < 0 || high < 0 || mid < 0 || low < 0) {
+        return ESP_FAIL;
+    }
+    camera_stats_t stats;
+    esp_camera_get_stats(&stats);
+
+    out->luma = luma;
+    out->lines = high << 10 | mid << 2 | low;
+    out->gain_x16 = gain_from_reg(gain);
+    out->frame = stats.frames_captured;
+    return ESP_OK;
+}
+
+// Hold the sensor at the exposure the model expects under the flash.
+// Returns false if there is no model yet.
+static bool seed(sensor_t *sensor, const exposure_sample_t *ambient)
+{
+    uint32_t before = exposure_sensitivity(ambient);
+    if (flash_term <= 0 || before == 0) {
+        return false;
+    }
+    uint32_t predicted = (uint32_t)(1.0f / (1.0f / before + flash_term));
+    if (predicted == 0) {
+        predicted = 1;
+    }
+    // Exposure first, gain only for what the ambient exposure time can't give
+    uint32_t lines = predicted < ambient->lines ? predicted : ambient->lines;
+    uint32_t gain_x16 = predicted * 16 / lines;
+    sensor->set_exposure_ctrl(sensor, 0);
+    sensor->set_gain_ctrl(sensor, 0);
+    sensor->set_reg(sensor, REG_REG45, 0x3F, lines >> 10);
+    sensor->set_reg(sensor, REG_AEC, 0xFF, lines >> 2);
+    sensor->set_reg(sensor, REG_REG04, 0x03, lines);
+    sensor->set_reg(sensor, REG_GAIN, 0xFF, gain_to_reg(gain_x16));
+    ESP_LOGI(TAG, "Predicted %u lines, gain %u/16 (ambient %u lines, gain %u/16)",
+             (unsigned)lines, (unsigned)gain_x16, ambient->lines, ambient->gain_x16);
+    return true;
+}
+
+// Fold one settled run into the flash model
+static void learn(const exposure_sample_t *ambient, const exposure_sample_t *settled)
+{
+    uint32_t before = exposure_sensitivity(ambient);
+    uint32_t after = exposure_sensitivity(settled);
+    if (before == 0 || after == 0) {
+        return;
+    }
+    float term = 1.0f / after - 1.0f / before;
+    if (term <= 0) {
+        return;
+    }
+    flash_term = flash_term > 0 ? (flash_term * (4 - MODEL_NEW) + term * MODEL_NEW) / 4 : term;
+}
+
+int64_t exposure_wait_flash(sensor_t *sensor, const exposure_sample_t *ambient)
+{
+    int64_t start = esp_timer_get_time();
+    int low = sensor->get_reg(sensor, REG_AEB, 0xFF);
+    int high = sensor->get_reg(sensor, REG_AEW, 0xFF);
+    // The ambient sample only tells how much light there is if the AEC had
+    // it in the window; a pinned AEC says nothing about the flash
+    bool ambient_ok = ambient->luma >= low && ambient->luma <= high;
+
+    int aec = sensor->status.aec;
+    int agc = sensor->status.agc;
+    bool seeded = EXPOSURE_SEED && ambient_ok && seed(sensor, ambient);
+    int64_t seeded_us = esp_timer_get_time();
+
+    exposure_tracker_t t;
+    exposure_sample_t s;
+    exposure_state_t state = EXPOSURE_WAIT;
+    if (low < 0 || high < low || exposure_read(sensor, &s) != ESP_OK) {
+        ESP_LOGW(TAG, "Sensor state unreadable, falling back to a fixed delay");
+        if (seeded) {
+            sensor->set_exposure_ctrl(sensor, aec);
+            sensor->set_gain_ctrl(sensor, agc);
+        }
+        vTaskDelay(pdMS_TO_TICKS(EXPOSURE_TIMEOUT_MS));
+        return 0;
+    }
+    exposure_tracker_init(&t, low, high, &s);
+    uint32_t seed_frame = s.frame;
+
+    uint32_t elapsed_ms = 0;
+    while (state == EXPOSURE_WAIT) {
+        vTaskDelay(pdMS_TO_TICKS(EXPOSURE_POLL_MS));
+        elapsed_ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+        if (exposure_read(sensor, &s) != ESP_OK) {
+            if (elapsed_ms >= EXPOSURE_TIMEOUT_MS) {
+                state = EXPOSURE_TIMEOUT;
+            }
+            continue;
+        }
+        if (!seeded) {
+            state = exposure_tracker_step(&t, &s, elapsed_ms);
+            continue;
+        }
+        // The frame running while the prediction was written may have part
+        // of the old exposure; the one after it is the first fully under
+        // the flash at the predicted exposure
+        if (s.frame - seed_frame < 2) {
+            if (elapsed_ms >= EXPOSURE_TIMEOUT_MS) {
+                state = EXPOSURE_TIMEOUT;
+            }
+            continue;
+        }
+        seeded = false;
+        sensor->set_exposure_ctrl(sensor, aec);
+        sensor->set_gain_ctrl(sensor, agc);
+        if (s.luma >= low && s.luma <= high) {
+            t.last = s;
+            t.steady_ms = (uint32_t)((seeded_us - start) / 1000);
+            state = EXPOSURE_PREDICTED;
+        } else {
+            // Missed: the AEC takes over from the prediction
+            exposure_tracker_init(&t, low, high, &s);
+            t.steady_ms = elapsed_ms;
+        }
+    }
+    if (seeded) {
+        sensor->set_exposure_ctrl(sensor, aec);
+        sensor->set_gain_ctrl(sensor, agc);
+    }
+
+    trace_instant(TRACE_EXPOSURE, state);
+    ESP_LOGI(TAG, "%s after %u ms: luma %u (window %d-%d), %u lines, gain %u/16",
+             state_names[state], (unsigned)elapsed_ms, t.last.luma, low, high,
+             t.last.lines, t.last.gain_x16);
+    if (state == EXPOSURE_TIMEOUT) {
+        return 0;
+    }
+    if (state == EXPOSURE_STABLE && ambient_ok) {
+        learn(ambient, &t.last);
+    }
+    return start + (int64_t)t.steady_ms * 1000;
+}
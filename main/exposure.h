@@ -0,0 +1,85 @@
+#ifndef EXPOSURE_H
+#define EXPOSURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "sensor.h"
+
+// Flash exposure settling.
+//
+// Instead of a fixed delay after the flash LED turns on, the OV2640's own
+// auto exposure state is polled over SCCB: the mean luma of the last frame
+// (YAVG), the exposure line count and the AGC gain. Capture is allowed once
+// the luma sits inside the sensor's AEC target window and exposure and gain
+// have stopped moving across whole frames, or once the AEC has pinned at a
+// limit. Steadiness is counted in frames the driver captured, so it holds at
+// every frame size. EXPOSURE_TIMEOUT_MS, the old fixed delay, stays the
+// upper bound.
+//
+// Exposure times luminance is what the AEC holds constant, so the flash adds
+// a fixed amount to 1/sensitivity whatever the ambient light. That amount is
+// learnt from every run that settles. Later runs hold the sensor at the
+// predicted exposure as the flash comes on, and if the first frame exposed
+// entirely under the flash lands in the window it is taken straight away;
+// otherwise the AEC takes over from the prediction.
+
+#define EXPOSURE_POLL_MS        20
+// Luma, exposure and gain unchanged over this many new frames
+#define EXPOSURE_STEADY_FRAMES  2
+// If nothing has moved after this many frames the flash makes no difference
+#define EXPOSURE_MIN_FRAMES     3
+#define EXPOSURE_TIMEOUT_MS     800
+// Luma change below this is sensor noise
+#define EXPOSURE_LUMA_TOLERANCE 2
+// Try the learnt prediction before handing over to the AEC
+#define EXPOSURE_SEED           1
+
+typedef struct {
+    uint8_t luma;           // YAVG, mean luma of the last frame
+    uint16_t lines;         // Exposure time in rows
+    uint16_t gain_x16;      // Analog gain, 16 = 1x
+    uint32_t frame;         // Frames the driver had captured when sampled
+} exposure_sample_t;
+
+typedef enum {
+    EXPOSURE_WAIT,
+    EXPOSURE_STABLE,        // Luma in the AEC window and steady
+    EXPOSURE_PINNED,        // Steady outside the window: AEC at a limit
+    EXPOSURE_TIMEOUT,
+    EXPOSURE_PREDICTED,     // First frame at the predicted exposure was in the window
+} exposure_state_t;
+
+// Convergence detector, fed one sample per poll. Pure, so it can be
+// replayed on recorded register traces.
+typedef struct {
+    uint8_t low;            // AEC window, from AEB/AEW
+    uint8_t high;
+    exposure_sample_t start;
+    exposure_sample_t last;
+    uint32_t steady_since;  // Frame count when the values last changed
+    uint32_t steady_ms;     // and the time, from the start of the wait
+    bool moved;             // Something changed since the flash went on
+} exposure_tracker_t;
+
+// start is the first sample with the flash on (after any seeding)
+void exposure_tracker_init(exposure_tracker_t *t, uint8_t low, uint8_t high,
+                           const exposure_sample_t *start);
+
+exposure_state_t exposure_tracker_step(exposure_tracker_t *t, const exposure_sample_t *s,
+                                       uint32_t elapsed_ms);
+
+// Exposure lines times gain, in rows at 1x
+uint32_t exposure_sensitivity(const exposure_sample_t *s);
+
+// Only the OV2640 register layout is known
+bool exposure_supported(sensor_t *sensor);
+
+esp_err_t exposure_read(sensor_t *sensor, exposure_sample_t *out);
+
+// Call right after the flash turned on, with the sample taken just before.
+// Returns once exposure has settled under the flash with the esp_timer time
+// from which frames are exposed for it, or 0 after the timeout.
+int64_t exposure_wait_flash(sensor_t *sensor, const exposure_sample_t *ambient);
+
+#endif // EXPOSURE_H
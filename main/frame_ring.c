@@ -0,0 +1,299 @@
+#include <string.h>
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include "frame_ring.h"
+
+static const char *TAG = "frame_ring";
+
+static inline frame_ring_slot_t *slot_at(frame_ring_t *ring, uint32_t i)
+{
+    return &ring->slots[(ring->head + i) % ring->slot_count];
+}
+
+// Drop the oldest frame. Caller holds the lock and has checked it is not pinned.
+static void evict_oldest(frame_ring_t *ring)
+{
+    frame_ring_slot_t *s = slot_at(ring, 0);
+    ring->stats.bytes -= s->len;
+    ring->head = (ring->head + 1) % ring->slot_count;
+    ring->count--;
+    ring->stats.evicted++;
+}
+
+// Find a contiguous region of len bytes without evicting anything.
+// The used region runs from the oldest frame to the end of the newest one and
+// may wrap once around the end of the arena.
+static bool find_space(frame_ring_t *ring, size_t len, uint32_t *offset)
+{
+    if (ring->count == 0) {
+        *offset = 0;
+        return len <= ring->arena_size;
+    }
+    if (ring->count == ring->slot_count) {
+        return false;
+    }
+
+    const frame_ring_slot_t *oldest = slot_at(ring, 0);
+    const frame_ring_slot_t *newest = slot_at(ring, ring->count - 1);
+    uint32_t tail = oldest->offset;
+    uint32_t end = newest->offset + newest->len;
+
+    if (newest->offset >= tail) {
+        // Not wrapped: free space after the newest frame, then before the oldest
+        if (ring->arena_size - end >= len) {
+            *offset = end;
+            return true;
+        }
+        if (tail >= len) {
+            *offset = 0;
+            return true;
+        }
+        return false;
+    }
+
+    // Wrapped: the only free space is between the newest and the oldest frame
+    if (tail - end >= len) {
+        *offset = end;
+        return true;
+    }
+    return false;
+}
+
+esp_err_t frame_ring_init(frame_ring_t *ring, size_t budget_bytes, uint32_t window_ms)
+{
+    memset(ring, 0, sizeof(*ring));
+
+    ring->arena = heap_caps_malloc(budget_bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!ring->arena) {
+        ESP_LOGW(TAG, "No PSRAM for %u byte ring, trying internal RAM", (unsigned)budget_bytes);
+        ring->arena = heap_caps_malloc(budget_bytes, MALLOC_CAP_8BIT);
+    }
+    if (!ring->arena) {
+        ESP_LOGE(TAG, "Failed to allocate %u byte ring", (unsigned)budget_bytes);
+        return ESP_ERR_NO_MEM;
+    }
+
+    ring->slot_count = budget_bytes / FRAME_RING_MIN_FRAME_BYTES;
+    if (ring->slot_count < 2) {
+        ring->slot_count = 2;
+    }
+    // Slot table is small and touched on every append, keep it in internal RAM
+    ring->slots = heap_caps_calloc(ring->slot_count, sizeof(frame_ring_slot_t),
+                                   MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    ring->lock = xSemaphoreCreateMutex();
+    if (!ring->slots || !ring->lock) {
+        frame_ring_deinit(ring);
+        return ESP_ERR_NO_MEM;
+    }
+
+    ring->arena_size = budget_bytes;
+    ring->window_us = (int64_t)window_ms * 1000;
+    ring->stats.capacity = budget_bytes;
+    ring->stats.slot_capacity = ring->slot_count;
+
+    ESP_LOGI(TAG, "Ring ready: %u bytes, %u slots, %u ms window",
+             (unsigned)budget_bytes, (unsigned)ring->slot_count, (unsigned)window_ms);
+    return ESP_OK;
+}
+
+void frame_ring_deinit(frame_ring_t *ring)
+{
+    if (ring->lock) {
+        vSemaphoreDelete(ring->lock);
+    }
+    free(ring->slots);
+    free(ring->arena);
+    memset(ring, 0, sizeof(*ring));
+}
+
+esp_err_t frame_ring_append(frame_ring_t *ring, const camera_fb_t *fb)
+{
+    if (!ring->lock) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!fb || !fb->buf || fb->len == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    int64_t ts = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+    if (ts == 0) {
+        ts = esp_timer_get_time();
+    }
+
+    xSemaphoreTake(ring->lock, portMAX_DELAY);
+
+    if (fb->len > ring->arena_size) {
+        ring->stats.rejected++;
+        xSemaphoreGive(ring->lock);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Age out frames that fell outside the pre-event window
+    while (ring->count > 0 && !ring->pinned && slot_at(ring, 0)->timestamp_us < ts - ring->window_us) {
+        evict_oldest(ring);
+    }
+
+    uint32_t offset;
+    while (!find_space(ring, fb->len, &offset)) {
+        if (ring->count == 0 || ring->pinned) {
+            ring->stats.rejected++;
+            xSemaphoreGive(ring->lock);
+            return ESP_ERR_NO_MEM;
+        }
+        evict_oldest(ring);
+    }
+
+    memcpy(ring->arena + offset, fb->buf, fb->len);
+
+    frame_ring_slot_t *s = slot_at(ring, ring->count);
+    s->offset = offset;
+    s->len = fb->len;
+    s->width = fb->width;
+    s->height = fb->height;
+    s->timestamp_us = ts;
+    s->seq = ring->next_seq++;
+    ring->count++;
+
+    ring->stats.appended++;
+    ring->stats.bytes += fb->len;
+    if (ring->stats.bytes > ring->stats.peak_bytes) {
+        ring->stats.peak_bytes = ring->stats.bytes;
+    }
+
+    xSemaphoreGive(ring->lock);
+    return ESP_OK;
+}
+
+// Pin everything stored now; new frames can still be appended into free
+// space but the pinned ones stay where they are until the last flush
+// holding them calls unpin_frames(). Nothing is evicted while any flush is
+// out, so a later one pins the same oldest frames and perhaps newer ones.
+static uint32_t pin_frames(frame_ring_t *ring, uint32_t *first)
+{
+    xSemaphoreTake(ring->lock, portMAX_DELAY);
+    uint32_t n = ring->count;
+    *first = ring->head;
+    ring->pin_refs++;
+    if (n > ring->pinned) {
+        ring->pinned = n;
+    }
+    xSemaphoreGive(ring->lock);
+    return n;
+}
+
+static void unpin_frames(frame_ring_t *ring, size_t flushed)
+{
+    xSemaphoreTake(ring->lock, portMAX_DELAY);
+    if (--ring->pin_refs == 0) {
+        ring->pinned = 0;
+    }
+    ring->stats.flushed += flushed;
+    xSemaphoreGive(ring->lock);
+}
+
+// Describe a pinned slot as a frame buffer pointing into the arena
+static void slot_to_fb(const frame_ring_t *ring, const frame_ring_slot_t *s, camera_fb_t *fb)
+{
+    *fb = (camera_fb_t) {
+        .buf = ring->arena + s->offset,
+        .len = s->len,
+        .width = s->width,
+        .height = s->height,
+        .format = PIXFORMAT_JPEG,
+        .timestamp = {
+            .tv_sec = s->timestamp_us / 1000000,
+            .tv_usec = s->timestamp_us % 1000000,
+        },
+    };
+}
+
+size_t frame_ring_flush(frame_ring_t *ring, int64_t since_us, frame_ring_sink_t sink, void *ctx)
+{
+    if (!ring->lock) {
+        return 0;
+    }
+
+    uint32_t first;
+    uint32_t n = pin_frames(ring, &first);
+
+    size_t sent = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        const frame_ring_slot_t *s = &ring->slots[(first + i) % ring->slot_count];
+        if (s->timestamp_us < since_us) {
+            continue;
+        }
+        camera_fb_t frame;
+        slot_to_fb(ring, s, &frame);
+        if (sink(&frame, ctx) != ESP_OK) {
+            break;
+        }
+        sent++;
+    }
+
+    unpin_frames(ring, sent);
+    return sent;
+}
+
+size_t frame_ring_flush_batch(frame_ring_t *ring, int64_t since_us, size_t batch,
+                              frame_ring_batch_sink_t sink, void *ctx)
+{
+    if (!ring->lock) {
+        return 0;
+    }
+    if (batch == 0 || batch > FRAME_RING_MAX_BATCH) {
+        batch = FRAME_RING_MAX_BATCH;
+    }
+
+    camera_fb_t frames[FRAME_RING_MAX_BATCH];
+    const camera_fb_t *ptrs[FRAME_RING_MAX_BATCH];
+    uint32_t first;
+    uint32_t n = pin_frames(ring, &first);
+
+    size_t sent = 0;
+    size_t pending = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        const frame_ring_slot_t *s = &ring->slots[(first + i) % ring->slot_count];
+        if (s->timestamp_us < since_us) {
+            continue;
+        }
+        slot_to_fb(ring, s, &frames[pending]);
+        ptrs[pending] = &frames[pending];
+        pending++;
+        if (pending == batch || i == n - 1) {
+            if (sink(ptrs, pending, ctx) != ESP_OK) {
+                pending = 0;
+                break;
+            }
+            sent += pending;
+            pending = 0;
+        }
+    }
+
+    unpin_frames(ring, sent);
+    return sent;
+}
+
+void frame_ring_clear(frame_ring_t *ring)
+{
+    if (!ring->lock) {
+        return;
+    }
+    xSemaphoreTake(ring->lock, portMAX_DELAY);
+    while (ring->count > 0 && !ring->pinned) {
+        evict_oldest(ring);
+    }
+    xSemaphoreGive(ring->lock);
+}
+
+void frame_ring_get_stats(frame_ring_t *ring, frame_ring_stats_t *out)
+{
+    if (!ring->lock) {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    xSemaphoreTake(ring->lock, portMAX_DELAY);
+    *out = ring->stats;
+    out->frames = ring->count;
+    xSemaphoreGive(ring->lock);
+}
@@ -0,0 +1,94 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_camera.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+
+// Pre-event ring buffer for JPEG frames.
+//
+// Frames are copied once into a single PSRAM arena and kept contiguous, so a
+// stored frame can be handed to the uploader as a camera_fb_t that points
+// straight into the arena. Append and eviction are O(1); the only
+// allocations happen in frame_ring_init().
+
+// Largest batch handed to a batch sink in one call
+#define FRAME_RING_MAX_BATCH 10
+
+// Smallest frame size assumed when deriving the slot count from the budget
+#define FRAME_RING_MIN_FRAME_BYTES 4096
+
+typedef struct {
+    uint32_t offset;        // Start of the JPEG data inside the arena
+    uint32_t len;           // JPEG length in bytes
+    uint16_t width;
+    uint16_t height;
+    int64_t timestamp_us;   // Capture time (esp_timer clock)
+    uint32_t seq;           // Monotonic frame number
+} frame_ring_slot_t;
+
+typedef struct {
+    uint32_t appended;      // Frames accepted into the ring
+    uint32_t evicted;       // Frames dropped to make room or aged out
+    uint32_t rejected;      // Frames too large, or blocked by a flush in progress
+    uint32_t flushed;       // Frames handed to a sink
+    uint32_t frames;        // Frames currently stored
+    size_t bytes;           // Bytes currently stored
+    size_t peak_bytes;      // High-water mark of stored bytes
+    size_t capacity;        // Arena size in bytes
+    uint32_t slot_capacity; // Maximum number of frames
+} frame_ring_stats_t;
+
+typedef struct {
+    uint8_t *arena;
+    size_t arena_size;
+    frame_ring_slot_t *slots;
+    uint32_t slot_count;
+    uint32_t head;          // Index of the oldest frame
+    uint32_t count;
+    uint32_t pinned;        // Oldest frames held by flushes in progress; nothing is evicted while set
+    uint32_t pin_refs;      // Flushes in progress
+    uint32_t next_seq;
+    int64_t window_us;      // Frames older than this are aged out on append
+    SemaphoreHandle_t lock;
+    frame_ring_stats_t stats;
+} frame_ring_t;
+
+// Called once per stored frame during a flush. The frame points into the
+// ring arena and is only valid for the duration of the call.
+typedef esp_err_t (*frame_ring_sink_t)(const camera_fb_t *frame, void *ctx);
+
+// Called with up to FRAME_RING_MAX_BATCH frames at once, same lifetime rules.
+typedef esp_err_t (*frame_ring_batch_sink_t)(const camera_fb_t *const *frames, size_t count, void *ctx);
+
+// Allocate a ring holding at most budget_bytes of JPEG data (in PSRAM when
+// available) covering the last window_ms milliseconds of frames.
+esp_err_t frame_ring_init(frame_ring_t *ring, size_t budget_bytes, uint32_t window_ms);
+
+void frame_ring_deinit(frame_ring_t *ring);
+
+// All functions below are safe to call on a ring whose init failed; they
+// then store nothing and report empty statistics.
+
+// Copy a frame into the ring, evicting the oldest frames as needed.
+esp_err_t frame_ring_append(frame_ring_t *ring, const camera_fb_t *fb);
+
+// Hand every frame captured at or after since_us to the sink, oldest first,
+// without copying. Appends continue while flushing but cannot evict the
+// frames being flushed. Returns the number of frames the sink accepted.
+size_t frame_ring_flush(frame_ring_t *ring, int64_t since_us, frame_ring_sink_t sink, void *ctx);
+
+// Same as frame_ring_flush() but hands frames over in groups of up to
+// batch frames, e.g. one sendMediaGroup request per group.
+size_t frame_ring_flush_batch(frame_ring_t *ring, int64_t since_us, size_t batch,
+                              frame_ring_batch_sink_t sink, void *ctx);
+
+// Drop all stored frames.
+void frame_ring_clear(frame_ring_t *ring);
+
+void frame_ring_get_stats(frame_ring_t *ring, frame_ring_stats_t *out);
+
+#endif // FRAME_RING_H
@@ -0,0 +1,407 @@
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "frame_store.h"
+
+#define ENTRY_SIZE          16
+#define AVIF_HASINDEX       0x10
+#define AVIIF_KEYFRAME      0x10
+
+static uint8_t *put_le16(uint8_t *p, uint16_t v)
+{
+    p[0] = v & 0xFF;
+    p[1] = v >> 8;
+    return p + 2;
+}
+
+static uint8_t *put_le32(uint8_t *p, uint32_t v)
+{
+    put_le16(p, v & 0xFFFF);
+    return put_le16(p + 2, v >> 16);
+}
+
+static uint8_t *put_fourcc(uint8_t *p, const char *cc)
+{
+    memcpy(p, cc, 4);
+    return p + 4;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// A frame's chunk: header, JPEG, a pad byte to keep chunks on even offsets
+static uint32_t chunk_size(uint32_t len)
+{
+    return FRAME_STORE_CHUNK_HDR + len + (len & 1);
+}
+
+static bool read_entry(FILE *index, uint32_t i, frame_store_entry_t *e)
+{
+    uint8_t raw[ENTRY_SIZE];
+    if (fseek(index, (long)i * ENTRY_SIZE, SEEK_SET) != 0 || fread(raw, ENTRY_SIZE, 1, index) != 1) {
+        return false;
+    }
+    e->offset = get_le32(raw);
+    e->len = get_le32(raw + 4);
+    e->time = get_le32(raw + 8);
+    e->width = raw[12] | raw[13] << 8;
+    e->height = raw[14] | raw[15] << 8;
+    return true;
+}
+
+// Written with fsync in between, so the data of an indexed frame is on the
+// card; the last frame's chunk header is still checked, in case the card
+// lost a write the FAT layer thought done
+static bool last_chunk_ok(frame_store_t *s, const frame_store_entry_t *e)
+{
+    uint8_t hdr[FRAME_STORE_CHUNK_HDR];
+    return fseek(s->data, e->offset, SEEK_SET) == 0 &&
+           fread(hdr, sizeof(hdr), 1, s->data) == 1 &&
+           memcmp(hdr, "00dc", 4) == 0 && get_le32(hdr + 4) == e->len;
+}
+
+static FILE *open_rw(const char *path)
+{
+    FILE *f = fopen(path, "r+b");
+    return f ? f : fopen(path, "w+b");
+}
+
+esp_err_t frame_store_open(frame_store_t *s, const char *dir, uint32_t capacity)
+{
+    memset(s, 0, sizeof(*s));
+    snprintf(s->data_path, sizeof(s->data_path), "%s/" FRAME_STORE_DATA, dir);
+    snprintf(s->index_path, sizeof(s->index_path), "%s/" FRAME_STORE_INDEX, dir);
+    s->data = open_rw(s->data_path);
+    s->index = open_rw(s->index_path);
+    if (!s->data || !s->index) {
+        frame_store_close(s);
+        return ESP_FAIL;
+    }
+
+    // Writing the last byte has the FAT layer allocate every cluster now
+    if (fseek(s->data, 0, SEEK_END) != 0) {
+        frame_store_close(s);
+        return ESP_FAIL;
+    }
+    long size = ftell(s->data);
+    if (size < (long)capacity) {
+        if (fseek(s->data, capacity - 1, SEEK_SET) != 0 || fputc(0, s->data) == EOF ||
+            fflush(s->data) != 0) {
+            frame_store_close(s);
+            return ESP_ERR_NO_MEM;
+        }
+        size = capacity;
+    }
+    s->capacity = size;
+
+    // Keep the frames that chain on from each other inside the data file
+    frame_store_entry_t e;
+    frame_store_entry_t last = {0};
+    while (read_entry(s->index, s->frames, &e) && e.len && e.offset == s->used &&
+           e.offset + chunk_size(e.len) <= s->capacity) {
+        last = e;
+        s->used = e.offset + chunk_size(e.len);
+        s->frames++;
+    }
+    if (s->frames && !last_chunk_ok(s, &last)) {
+        s->frames--;
+        s->used = last.offset;
+    }
+    fseek(s->index, 0, SEEK_END);
+    long index_size = ftell(s->index);
+    if (index_size != (long)s->frames * ENTRY_SIZE) {
+        s->dropped = (index_size - s->frames * ENTRY_SIZE + ENTRY_SIZE - 1) / ENTRY_SIZE;
+        fflush(s->index);
+        if (ftruncate(fileno(s->index), (off_t)s->frames * ENTRY_SIZE) != 0) {
+            frame_store_close(s);
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+void frame_store_close(frame_store_t *s)
+{
+    if (s->data) {
+        fclose(s->data);
+    }
+    if (s->index) {
+        fclose(s->index);
+    }
+    s->data = NULL;
+    s->index = NULL;
+}
+
+// Data first, then its index entry, each synced, so an entry never points
+// at a frame that is not on the card
+esp_err_t frame_store_append(frame_store_t *s, const uint8_t *jpeg, size_t len,
+                             uint16_t width, uint16_t height, uint32_t time)
+{
+    if (!s->data) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (!len || s->used + (uint64_t)chunk_size(len) > s->capacity) {
+        return ESP_ERR_NO_MEM;
+    }
+    uint8_t hdr[FRAME_STORE_CHUNK_HDR];
+    put_le32(put_fourcc(hdr, "00dc"), len);
+    if (fseek(s->data, s->used, SEEK_SET) != 0 ||
+        fwrite(hdr, sizeof(hdr), 1, s->data) != 1 ||
+        fwrite(jpeg, 1, len, s->data) != len ||
+        ((len & 1) && fputc(0, s->data) == EOF) ||
+        fflush(s->data) != 0 || fsync(fileno(s->data)) != 0) {
+        return ESP_FAIL;
+    }
+
+    uint8_t raw[ENTRY_SIZE];
+    uint8_t *p = put_le32(raw, s->used);
+    p = put_le32(p, len);
+    p = put_le32(p, time);
+    p = put_le16(p, width);
+    put_le16(p, height);
+    if (fseek(s->index, (long)s->frames * ENTRY_SIZE, SEEK_SET) != 0 ||
+        fwrite(raw, sizeof(raw), 1, s->index) != 1 ||
+        fflush(s->index) != 0 || fsync(fileno(s->index)) != 0) {
+        return ESP_FAIL;
+    }
+    s->used += chunk_size(len);
+    s->frames++;
+    return ESP_OK;
+}
+
+esp_err_t frame_store_reset(frame_store_t *s)
+{
+    if (!s->index) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    s->frames = 0;
+    s->used = 0;
+    fflush(s->index);
+    return ftruncate(fileno(s->index), 0) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t frame_store_get(frame_store_t *s, uint32_t i, frame_store_entry_t *out)
+{
+    if (!s->index || i >= s->frames) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return read_entry(s->index, i, out) ? ESP_OK : ESP_FAIL;
+}
+
+// Bytes of the frames a video with this step would hold, and their count
+static bool measure(FILE *index, uint32_t frames, uint32_t step, uint64_t *bytes, uint32_t *count,
+                    uint32_t *largest)
+{
+    *bytes = 0;
+    *count = 0;
+    *largest = 0;
+    frame_store_entry_t e;
+    for (uint32_t i = 0; i < frames; i += step) {
+        if (!read_entry(index, i, &e)) {
+            return false;
+        }
+        *bytes += chunk_size(e.len);
+        *count += 1;
+        *largest = e.len > *largest ? e.len : *largest;
+    }
+    return true;
+}
+
+static void build_header(frame_store_avi_t *avi, uint32_t fps, uint32_t largest,
+                         uint16_t width, uint16_t height)
+{
+    uint8_t *p = avi->header;
+    p = put_fourcc(p, "RIFF");
+    p = put_le32(p, avi->size - 8);
+    p = put_fourcc(p, "AVI ");
+
+    p = put_fourcc(p, "LIST");
+    p = put_le32(p, 192);
+    p = put_fourcc(p, "hdrl");
+    p = put_fourcc(p, "avih");
+    p = put_le32(p, 56);
+    p = put_le32(p, 1000000 / fps);             // Microseconds per frame
+    p = put_le32(p, largest * fps);             // Max bytes per second
+    p = put_le32(p, 0);                         // Padding granularity
+    p = put_le32(p, AVIF_HASINDEX);
+    p = put_le32(p, avi->frames);
+    p = put_le32(p, 0);                         // Initial frames
+    p = put_le32(p, 1);                         // Streams
+    p = put_le32(p, largest);                   // Suggested buffer size
+    p = put_le32(p, width);
+    p = put_le32(p, height);
+    memset(p, 0, 16);
+    p += 16;
+
+    p = put_fourcc(p, "LIST");
+    p = put_le32(p, 116);
+    p = put_fourcc(p, "strl");
+    p = put_fourcc(p, "strh");
+    p = put_le32(p, 56);
+    p = put_fourcc(p, "vids");
+    p = put_fourcc(p, "MJPG");
+    p = put_le32(p, 0);                         // Flags
+    p = put_le32(p, 0);                         // Priority, language
+    p = put_le32(p, 0);                         // Initial frames
+    p = put_le32(p, 1);                         // Scale
+    p = put_le32(p, fps);                       // Rate
+    p = put_le32(p, 0);                         // Start
+    p = put_le32(p, avi->frames);               // Length
+    p = put_le32(p, largest);
+    p = put_le32(p, 0xFFFFFFFF);                // Quality: default
+    p = put_le32(p, 0);                         // Sample size: varies
+    p = put_le16(p, 0);
+    p = put_le16(p, 0);
+    p = put_le16(p, width);
+    p = put_le16(p, height);
+    p = put_fourcc(p, "strf");
+    p = put_le32(p, 40);
+    p = put_le32(p, 40);                        // BITMAPINFOHEADER
+    p = put_le32(p, width);
+    p = put_le32(p, height);
+    p = put_le16(p, 1);
+    p = put_le16(p, 24);
+    p = put_fourcc(p, "MJPG");
+    p = put_le32(p, (uint32_t)width * height * 3);
+    memset(p, 0, 16);
+    p += 16;
+
+    p = put_fourcc(p, "LIST");
+    p = put_le32(p, avi->movi_end - (FRAME_STORE_AVI_HEADER - 4));
+    put_fourcc(p, "movi");
+}
+
+esp_err_t frame_store_avi_open(frame_store_avi_t *avi, const frame_store_t *s, uint32_t frames,
+                               uint32_t max_bytes, uint32_t fps)
+{
+    memset(avi, 0, sizeof(*avi));
+    if (!frames || !fps) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    avi->data = fopen(s->data_path, "rb");
+    avi->index = fopen(s->index_path, "rb");
+    if (!avi->data || !avi->index) {
+        frame_store_avi_close(avi);
+        return ESP_FAIL;
+    }
+
+    // Guess the step from the full size, then walk up until it fits
+    uint64_t bytes;
+    uint32_t count;
+    uint32_t largest;
+    uint32_t step = 1;
+    while (true) {
+        if (!measure(avi->index, frames, step, &bytes, &count, &largest)) {
+            frame_store_avi_close(avi);
+            return ESP_FAIL;
+        }
+        uint64_t total = FRAME_STORE_AVI_HEADER + bytes + 8 + (uint64_t)count * ENTRY_SIZE;
+        if (total <= max_bytes) {
+            avi->size = total;
+            break;
+        }
+        if (count == 1) {
+            frame_store_avi_close(avi);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        uint32_t guess = (total + max_bytes - 1) / max_bytes * step;
+        step = guess > step ? guess : step + 1;
+    }
+
+    frame_store_entry_t first;
+    read_entry(avi->index, 0, &first);
+    avi->frames = count;
+    avi->step = step;
+    avi->movi_end = FRAME_STORE_AVI_HEADER + bytes;
+    build_header(avi, fps, largest, first.width, first.height);
+    return ESP_OK;
+}
+
+// One idx1 entry; offsets count from the 'movi' fourcc
+static bool index_entry(frame_store_avi_t *avi, uint32_t j, uint8_t *out)
+{
+    frame_store_entry_t e;
+    if (!read_entry(avi->index, j * avi->step, &e)) {
+        return false;
+    }
+    uint8_t *p = put_fourcc(out, "00dc");
+    p = put_le32(p, AVIIF_KEYFRAME);
+    p = put_le32(p, avi->movi_offset);
+    put_le32(p, e.len);
+    avi->movi_offset += chunk_size(e.len);
+    return true;
+}
+
+int frame_store_avi_read(frame_store_avi_t *avi, uint8_t *buf, size_t size)
+{
+    size_t n = 0;
+    while (n < size && avi->pos < avi->size) {
+        size_t room = size - n;
+        size_t k;
+        if (avi->pos < FRAME_STORE_AVI_HEADER) {
+            k = FRAME_STORE_AVI_HEADER - avi->pos;
+            k = k < room ? k : room;
+            memcpy(buf + n, avi->header + avi->pos, k);
+        } else if (avi->pos < avi->movi_end) {
+            // Stored chunks, copied as they are
+            if (!avi->chunk_left) {
+                frame_store_entry_t e;
+                if (!read_entry(avi->index, avi->frame * avi->step, &e) ||
+                    fseek(avi->data, e.offset, SEEK_SET) != 0) {
+                    return -1;
+                }
+                avi->chunk_left = chunk_size(e.len);
+            }
+            k = avi->chunk_left < room ? avi->chunk_left : room;
+            if (fread(buf + n, 1, k, avi->data) != k) {
+                return -1;
+            }
+            avi->chunk_left -= k;
+            if (!avi->chunk_left) {
+                avi->frame++;
+            }
+        } else {
+            // idx1, built a whole entry at a time
+            uint8_t entry[ENTRY_SIZE];
+            uint32_t at = avi->pos - avi->movi_end;
+            uint32_t skip;
+            if (at < 8) {
+                avi->movi_offset = 4;
+                put_le32(put_fourcc(entry, "idx1"), avi->frames * ENTRY_SIZE);
+                skip = at;
+                k = 8 - at;
+            } else {
+                uint32_t j = (at - 8) / ENTRY_SIZE;
+                skip = (at - 8) % ENTRY_SIZE;
+                uint32_t offset = avi->movi_offset;
+                if (!index_entry(avi, j, entry)) {
+                    return -1;
+                }
+                k = ENTRY_SIZE - skip;
+                if (k > room) {
+                    // Only part of it fits: build it again next time
+                    avi->movi_offset = offset;
+                }
+            }
+            k = k < room ? k : room;
+            memcpy(buf + n, entry + skip, k);
+        }
+        n += k;
+        avi->pos += k;
+    }
+    return n;
+}
+
+void frame_store_avi_close(frame_store_avi_t *avi)
+{
+    if (avi->data) {
+        fclose(avi->data);
+    }
+    if (avi->index) {
+        fclose(avi->index);
+    }
+    avi->data = NULL;
+    avi->index = NULL;
+}
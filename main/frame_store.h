@@ -0,0 +1,89 @@
+#ifndef FRAME_STORE_H
+#define FRAME_STORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// Time-lapse frame store on the SD card, and the AVI made from it.
+//
+// Frames go into one data file allocated to its full size when the store
+// is opened, so appending a frame only writes data and never has to find
+// clusters. Each frame is laid out as the AVI chunk it will become ('00dc',
+// length, JPEG, pad to even), so a video is the stored chunks copied as
+// they are, between a generated header and index; no frame is decoded,
+// re-encoded or held in RAM. The index file takes 16 bytes per frame,
+// written once the frame is on the card. Opening the store checks the
+// index against the data, so a frame cut short by a reset is dropped.
+//
+// Only stdio is used, so the same code runs on a PC.
+
+#define FRAME_STORE_DATA        "TL.BIN"
+#define FRAME_STORE_INDEX       "TL.IDX"
+#define FRAME_STORE_CHUNK_HDR   8
+// Generated AVI header ahead of the first chunk
+#define FRAME_STORE_AVI_HEADER  224
+
+typedef struct {
+    uint32_t offset;        // Of the frame's chunk in the data file
+    uint32_t len;           // JPEG bytes
+    uint32_t time;          // Capture time, Unix seconds, 0 if unknown
+    uint16_t width;
+    uint16_t height;
+} frame_store_entry_t;
+
+typedef struct {
+    char data_path[64];
+    char index_path[64];
+    FILE *data;
+    FILE *index;
+    uint32_t capacity;      // Size of the data file
+    uint32_t used;          // Bytes of complete chunks
+    uint32_t frames;
+    uint32_t dropped;       // Torn frames dropped when the store was opened
+} frame_store_t;
+
+// Open the store in dir, creating or growing the data file to capacity
+esp_err_t frame_store_open(frame_store_t *s, const char *dir, uint32_t capacity);
+
+void frame_store_close(frame_store_t *s);
+
+// Append a frame. ESP_ERR_NO_MEM when the data file is full.
+esp_err_t frame_store_append(frame_store_t *s, const uint8_t *jpeg, size_t len,
+                             uint16_t width, uint16_t height, uint32_t time);
+
+// Forget every frame; the data file keeps its size
+esp_err_t frame_store_reset(frame_store_t *s);
+
+esp_err_t frame_store_get(frame_store_t *s, uint32_t i, frame_store_entry_t *out);
+
+// AVI (Motion JPEG) of the first frames of a store, produced piece by
+// piece. Every step-th frame is taken, the smallest step that keeps the
+// file within max_bytes. Reads go through its own handles, so frames can
+// keep being appended meanwhile.
+typedef struct {
+    FILE *data;
+    FILE *index;
+    uint32_t frames;        // In the video
+    uint32_t step;
+    uint32_t size;          // Of the whole file
+    uint32_t pos;
+    uint32_t movi_end;      // File offset where idx1 starts
+    uint32_t frame;         // Being copied
+    uint32_t chunk_left;    // Bytes of its chunk still to copy
+    uint32_t movi_offset;   // Of the chunk the next idx1 entry points at
+    uint8_t header[FRAME_STORE_AVI_HEADER];
+} frame_store_avi_t;
+
+// frames: how many stored frames to consider, from the store's count
+esp_err_t frame_store_avi_open(frame_store_avi_t *avi, const frame_store_t *s, uint32_t frames,
+                               uint32_t max_bytes, uint32_t fps);
+
+// Next bytes of the file into buf. Returns how many, 0 at the end, -1 on
+// a read error.
+int frame_store_avi_read(frame_store_avi_t *avi, uint8_t *buf, size_t size);
+
+void frame_store_avi_close(frame_store_avi_t *avi);
+
+#endif // FRAME_STORE_H
@@ -11,17 +11,30 @@
 #include "esp_http_client.h"
 #include "esp_timer.h"
 #include "esp_crt_bundle.h"
-#include "esp_sntp.h"
 #include "driver/gpio.h"
 #include <time.h>
+#include <sys/time.h>
 #include "secrets.h"
+#include "frame_ring.h"
+#include "telegram.h"
+#include "quality_ctl.h"
+#include "boot.h"
+#include "timekeep.h"
+#include "trace.h"
+#include "stream_server.h"
+#include "preview.h"
+#include "exposure.h"
+#include "img_converters.h"
+#include "exif.h"
+#include "tg_sched.h"
+#include "outbox.h"
+#include "audio.h"
+#include "timelapse.h"
+#include "phash.h"
 
 // WiFi Configuration (from secrets.h)
 #define WIFI_PASS WIFI_PASSWORD
 
-// Telegram Configuration (from secrets.h)
-#define TELEGRAM_API_URL "https://api.telegram.org/bot" TELEGRAM_BOT_TOKEN
-
 // Camera pins for AI-Thinker ESP32-CAM
 #define CAM_PIN_PWDN    32
 #define CAM_PIN_RESET   -1
@@ -43,13 +56,108 @@
 // LED Flash pin for ESP32-CAM
 #define CAM_PIN_FLASH   4
 
+// Pre-event buffer: keep the last few seconds of frames in PSRAM
+#define PREBUFFER_BUDGET_BYTES  (1536 * 1024)
+#define PREBUFFER_WINDOW_MS     5000
+#define PREBUFFER_INTERVAL_MS   1000
+
+// Burst capture: frames taken back to back and sent as one album
+#define BURST_DEFAULT_FRAMES    5
+#define BURST_BUDGET_BYTES      (1280 * 1024)
+
+// Updates fetched per poll; /photo requests in one batch share a capture
+#define UPDATES_PER_POLL        5
+
+// Offline queue: retry interval while connected, and the requantization
+// quality for frames too big for one outbox record
+#define OUTBOX_RETRY_MS         60000
+#define OUTBOX_FIT_QUALITY      50
+
+// Chats that asked for cry alerts with /sound on
+#define SOUND_MAX_CHATS         4
+#define CRY_ALERT_TEXT          "🔊 Baby crying detected!"
+
+// Time-lapse videos stay under Telegram's 50 MB upload limit
+#define TIMELAPSE_VIDEO_MAX     (49 * 1024 * 1024)
+
+// Repeated photos, by perceptual hash distance to the last full upload:
+// this close it is the same scene and that photo is sent again by file_id,
+// this close it only changed a little and goes up requantized
+#define DEDUP_SAME_BITS         4
+#define DEDUP_SIMILAR_BITS      10
+// A brightness change this big (a light switched on) is never a repeat
+#define DEDUP_LUMA_STEP         8
+// An older upload is not sent again, so small moves show up eventually
+#define DEDUP_MAX_AGE_MS        (15 * 60 * 1000)
+#define DEDUP_QUALITY           30
+
 static const char *TAG = "ESP32-CAM-TELEGRAM";
 static EventGroupHandle_t wifi_event_group;
 static int last_update_id = 0;
 static bool flash_enabled = true;  // Flash mode: enabled by default
+static frame_ring_t prebuffer;
+static bool prebuffer_enabled = false;  // Pre-event capture: off by default
+static bool preview_enabled = true;  // Thumbnail first, full photo replaces it
+static bool dedup_enabled = true;  // Repeats of the last photo are not uploaded again
+
+typedef enum {
+    DEDUP_UPLOAD,
+    DEDUP_SMALLER,
+    DEDUP_REPEAT,
+} dedup_action_t;
+
+// Last photo uploaded at full quality, which later frames are compared to
+static struct {
+    bool valid;
+    phash_t hash;
+    int64_t time_us;            // esp_timer clock
+    char file_id[TELEGRAM_FILE_ID_MAX];
+    uint32_t uploads;           // Photos sent, by what dedup_classify() chose
+    uint32_t smaller;
+    uint32_t repeats;
+} dedup;
+
+// Sensor state when the last photo was captured, for its EXIF
+static struct {
+    struct timeval timestamp;
+    exposure_sample_t exposure;
+    bool exposure_valid;
+    bool flash;
+} last_capture;
+static frame_ring_t burst_ring;
+static esp_ip4_addr_t sta_ip;
+static volatile uint32_t wifi_links;    // Connections made since boot
+
+// Chats that asked for cry alerts. The bot task changes the list; alert and
+// clip jobs run on the scheduler's workers and send to a copy taken when
+// they are submitted.
+typedef struct {
+    char ids[SOUND_MAX_CHATS][OUTBOX_CHAT_ID_MAX];
+    int count;
+} sound_chats_t;
+static sound_chats_t sound_chats;
+static portMUX_TYPE sound_chats_mux = portMUX_INITIALIZER_UNLOCKED;
 
 #define WIFI_CONNECTED_BIT BIT0
 
+// Boot stages, see boot_stages[] at the bottom
+enum {
+    BOOT_STAGE_NVS,
+    BOOT_STAGE_CAMERA,
+    BOOT_STAGE_WIFI,
+    BOOT_STAGE_TIME,
+    BOOT_STAGE_BOT,
+    BOOT_STAGE_STREAM,
+    BOOT_STAGE_AUDIO,
+    BOOT_STAGE_SD,
+};
+
+// Bot commands that capture wait briefly for a camera still being probed
+#define CAMERA_READY_WAIT_MS 5000
+
+// How long the time stage waits for the first SNTP answer before reporting
+#define SNTP_WAIT_MS 20000
+
 // WiFi event handler
 static void wifi_event_handler(void* arg, esp_event_base_t event_base,
                                 int32_t event_id, void* event_data)
@@ -58,15 +166,18 @@ static void wifi_event_handler(void* arg, esp_event_base_t event_base,
         esp_wifi_connect();
     } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
         ESP_LOGI(TAG, "Disconnected from WiFi, reconnecting...");
+        xEventGroupClearBits(wifi_event_group, WIFI_CONNECTED_BIT);
         esp_wifi_connect();
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
         ip_event_got_ip_t* event = (ip_event_got_ip_t*) event_data;
         ESP_LOGI(TAG, "Connected! IP Address:" IPSTR, IP2STR(&event->ip_info.ip));
+        sta_ip = event->ip_info.ip;
         
         // Disable WiFi power save for maximum performance
         esp_wifi_set_ps(WIFI_PS_NONE);
         ESP_LOGI(TAG, "WiFi power save disabled for max throughput");
         
+        wifi_links++;
         xEventGroupSetBits(wifi_event_group, WIFI_CONNECTED_BIT);
     }
 }
@@ -135,10 +246,10 @@ static esp_err_t camera_init(void)
         .ledc_channel = LEDC_CHANNEL_0,
 
         .pixel_format = PIXFORMAT_JPEG,
-        .frame_size = FRAMESIZE_XGA,   // 1024x768 for balance of quality and speed
+        .frame_size = FRAMESIZE_UXGA,  // Allocate for the largest rung; quality_ctl picks the size per capture
         .jpeg_quality = 8,              // Quality 8 produces ~30-50KB images with good detail
-        .fb_count = 1,
-        .grab_mode = CAMERA_GRAB_WHEN_EMPTY,
+        .fb_count = 2,                  // Live view viewers can hold one frame while the other fills
+        .grab_mode = CAMERA_GRAB_LATEST,
     };
 
     esp_err_t err = esp_camera_init(&camera_config);
@@ -177,6 +288,10 @@ static esp_err_t camera_init(void)
         if (s->set_awb_gain) s->set_awb_gain(s, 1);           // Auto white balance gain
         
         ESP_LOGI(TAG, "Camera quality settings optimized");
+
+        // Start at XGA q8 until upload timings say otherwise
+        quality_ctl_init(QUALITY_CTL_DEFAULT_TARGET_MS);
+        quality_ctl_apply(s);
     }
 
     // Initialize flash LED
@@ -195,153 +310,1270 @@ static esp_err_t camera_init(void)
     return ESP_OK;
 }
 
-// Send text message to Telegram
-static esp_err_t telegram_send_message(char *chat_id, const char *text)
+// Keep the pre-event ring filled while enabled
+static void prebuffer_task(void *pvParameters)
 {
-    char url[512];
-    snprintf(url, sizeof(url), TELEGRAM_API_URL "/sendMessage");
+    while (1) {
+        if (prebuffer_enabled) {
+            camera_fb_t *fb = esp_camera_fb_get();
+            if (fb) {
+                frame_ring_append(&prebuffer, fb);
+                esp_camera_fb_return(fb);
+            }
+        }
+        vTaskDelay(pdMS_TO_TICKS(PREBUFFER_INTERVAL_MS));
+    }
+}
 
-    esp_http_client_config_t config = {
-        .url = url,
-        .crt_bundle_attach = esp_crt_bundle_attach,
-        .timeout_ms = 10000,
-    };
+// Upload a group of buffered frames straight out of a ring as one album
+static esp_err_t media_group_sink(const camera_fb_t *const *frames, size_t count, void *ctx)
+{
+    return telegram_send_media_group((const char *)ctx, frames, count);
+}
 
-    esp_http_client_handle_t client = esp_http_client_init(&config);
-    esp_http_client_set_method(client, HTTP_METHOD_POST);
-    esp_http_client_set_header(client, "Content-Type", "application/x-www-form-urlencoded");
+// Album upload queued as bulk work, so it cannot hold up a /photo
+typedef struct {
+    char chat_id[32];
+    frame_ring_t *ring;
+    int64_t since;
+    size_t expected;        // Frames that must all go out, 0 for any
+    const char *failed;     // Reply when they did not
+} album_job_t;
 
-    // URL encode the message and prepare POST data
-    char post_data[1024];
-    snprintf(post_data, sizeof(post_data), "chat_id=%s&text=%s", chat_id, text);
+static volatile bool burst_uploading;   // burst_ring is pinned by an upload
 
-    esp_err_t err = esp_http_client_open(client, strlen(post_data));
+static esp_err_t album_job(void *arg)
+{
+    album_job_t *job = (album_job_t *)arg;
+    size_t sent = frame_ring_flush_batch(job->ring, job->since, TELEGRAM_MEDIA_GROUP_MAX,
+                                         media_group_sink, job->chat_id);
+    if (job->ring == &burst_ring) {
+        trace_end(TRACE_BURST, sent);
+    }
+    return sent > 0 && (!job->expected || sent == job->expected) ? ESP_OK : ESP_FAIL;
+}
+
+static void album_done(void *arg, esp_err_t err)
+{
+    album_job_t *job = (album_job_t *)arg;
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to open HTTP connection for message: %s", esp_err_to_name(err));
-        esp_http_client_cleanup(client);
-        return err;
+        telegram_send_message(job->chat_id, job->failed);
+    }
+    if (job->ring == &burst_ring) {
+        burst_uploading = false;
     }
+    free(job);
+}
 
-    int written = esp_http_client_write(client, post_data, strlen(post_data));
-    if (written < 0) {
-        ESP_LOGE(TAG, "Failed to write message data");
-        esp_http_client_close(client);
-        esp_http_client_cleanup(client);
-        return ESP_FAIL;
+// Trace dump sent as a document in the background
+typedef struct {
+    char chat_id[32];
+    size_t len;
+    uint8_t data[];
+} document_job_t;
+
+static esp_err_t document_job(void *arg)
+{
+    document_job_t *job = (document_job_t *)arg;
+    return telegram_send_document(job->chat_id, "trace.bin", job->data, job->len);
+}
+
+static void document_done(void *arg, esp_err_t err)
+{
+    document_job_t *job = (document_job_t *)arg;
+    if (err != ESP_OK) {
+        telegram_send_message(job->chat_id, "Failed to send trace.");
     }
+    free(job);
+}
 
-    esp_http_client_fetch_headers(client);
-    int status_code = esp_http_client_get_status_code(client);
-    
-    esp_http_client_close(client);
-    esp_http_client_cleanup(client);
+// Queue a bulk upload. A full queue refuses it rather than running it
+// here: a worker may be flushing the same ring, and this task must stay
+// free for commands. ESP_ERR_NO_MEM then, and done is not called.
+static esp_err_t run_bulk(tg_job_fn_t fn, void *arg, tg_job_done_t done)
+{
+    return tg_sched_submit(TG_CLASS_BULK, fn, arg, done);
+}
 
-    if (status_code == 200) {
-        ESP_LOGI(TAG, "Message sent successfully");
-        return ESP_OK;
-    } else {
-        ESP_LOGE(TAG, "Failed to send message, status: %d", status_code);
-        return ESP_FAIL;
+// Reply to a command whose upload could not be queued
+static void reply_not_queued(const char *chat_id, esp_err_t err, const char *failed)
+{
+    telegram_send_message(chat_id, err == ESP_ERR_NO_MEM ? "Too many uploads queued, try again shortly." : failed);
+}
+
+static esp_err_t queue_album(const char *chat_id, frame_ring_t *ring, int64_t since,
+                             size_t expected, const char *failed)
+{
+    album_job_t *job = calloc(1, sizeof(*job));
+    if (!job) {
+        return ESP_ERR_NO_MEM;
     }
+    snprintf(job->chat_id, sizeof(job->chat_id), "%s", chat_id);
+    job->ring = ring;
+    job->since = since;
+    job->expected = expected;
+    job->failed = failed;
+    esp_err_t err = run_bulk(album_job, job, album_done);
+    if (err != ESP_OK) {
+        free(job);
+    }
+    return err;
 }
 
-static esp_err_t telegram_send_photo(char *chat_id, camera_fb_t *fb)
+// Capture commands can arrive before the camera stage has finished or after
+// it failed; tell the user instead of waiting on a capture that cannot happen
+static bool camera_ready(const char *chat_id)
 {
-    char url[512];
-    snprintf(url, sizeof(url), TELEGRAM_API_URL "/sendPhoto");
+    if (boot_wait(BOOT_BIT(BOOT_STAGE_CAMERA), pdMS_TO_TICKS(CAMERA_READY_WAIT_MS))) {
+        return true;
+    }
+    telegram_send_message(chat_id, "Camera is not available. Check the logs and restart.");
+    return false;
+}
 
-    esp_http_client_config_t config = {
-        .url = url,
-        .event_handler = NULL,
-        .crt_bundle_attach = esp_crt_bundle_attach,
-        .timeout_ms = 60000,  // 60 seconds for XGA images (~30-50KB)
+// Report the camera pipeline counters, optionally zeroing them afterwards
+static void send_camera_stats(const char *chat_id, bool reset)
+{
+    static const char *const drop_names[CAMERA_DROP_MAX] = {
+        [CAMERA_DROP_EVENT_OVF]   = "event ring full",
+        [CAMERA_DROP_FB_OVF]      = "frame too big",
+        [CAMERA_DROP_DMA_OVF]     = "DMA slot too small",
+        [CAMERA_DROP_NO_SOI]      = "no JPEG start",
+        [CAMERA_DROP_NO_EOI]      = "no JPEG end",
+        [CAMERA_DROP_FB_SIZE]     = "raw size mismatch",
+        [CAMERA_DROP_FBQ_FULL]    = "frame queue full",
+        [CAMERA_DROP_DMA_OVERRUN] = "DMA overrun",
     };
 
-    esp_http_client_handle_t client = esp_http_client_init(&config);
+    camera_stats_t st;
+    if (esp_camera_get_stats(&st) != ESP_OK) {
+        telegram_send_message(chat_id, "Camera is not available.");
+        return;
+    }
 
-    // Add form data headers
-    esp_http_client_set_header(client, "Content-Type", "multipart/form-data; boundary=----WebKitFormBoundary1234567890");
+    char msg[768];
+    int len = snprintf(msg, sizeof(msg),
+        "Camera pipeline\n"
+        "Captured: %u, delivered: %u, replaced: %u\n"
+        "Frame queue peak: %u/%u, event ring peak: %u/%u\n",
+        (unsigned)st.frames_captured, (unsigned)st.frames_delivered, (unsigned)st.frames_replaced,
+        (unsigned)st.fb_queue_peak, (unsigned)st.fb_queue_len,
+        (unsigned)st.event_queue_peak, (unsigned)st.event_queue_len);
+    for (int i = 0; i < CAMERA_DROP_MAX && len < (int)sizeof(msg); i++) {
+        if (st.frames_dropped[i]) {
+            len += snprintf(msg + len, sizeof(msg) - len, "Dropped (%s): %u\n",
+                drop_names[i], (unsigned)st.frames_dropped[i]);
+        }
+    }
+    if (st.frames_delivered && len < (int)sizeof(msg)) {
+        len += snprintf(msg + len, sizeof(msg) - len, "Latency avg %u ms, max %u ms\n",
+            (unsigned)(st.latency_total_ms / st.frames_delivered), (unsigned)st.latency_max_ms);
+        for (int i = 0; i < CAMERA_LATENCY_BUCKETS && len < (int)sizeof(msg); i++) {
+            if (!st.latency_hist[i]) {
+                continue;
+            }
+            if (i < CAMERA_LATENCY_BUCKETS - 1) {
+                len += snprintf(msg + len, sizeof(msg) - len, "  <%u ms: %u\n",
+                    (unsigned)CAMERA_LATENCY_BUCKET_MS(i), (unsigned)st.latency_hist[i]);
+            } else {
+                len += snprintf(msg + len, sizeof(msg) - len, "  >=%u ms: %u\n",
+                    (unsigned)CAMERA_LATENCY_BUCKET_MS(i - 1), (unsigned)st.latency_hist[i]);
+            }
+        }
+    }
+    if (reset) {
+        esp_camera_reset_stats();
+        if (len < (int)sizeof(msg)) {
+            snprintf(msg + len, sizeof(msg) - len, "(counters reset)");
+        }
+    }
+    telegram_send_message(chat_id, msg);
+}
 
-    // Prepare form data
-    char form_start[512];
-    snprintf(form_start, sizeof(form_start),
-        "------WebKitFormBoundary1234567890\r\n"
-        "Content-Disposition: form-data; name=\"chat_id\"\r\n\r\n"
-        "%s\r\n"
-        "------WebKitFormBoundary1234567890\r\n"
-        "Content-Disposition: form-data; name=\"photo\"; filename=\"photo.jpg\"\r\n"
-        "Content-Type: image/jpeg\r\n\r\n",
-        chat_id);
+// Report the live view address and who is watching
+static void send_stream_status(const char *chat_id)
+{
+    stream_server_stats_t st;
+    stream_server_get_stats(&st);
 
-    char form_end[] = "\r\n------WebKitFormBoundary1234567890--\r\n";
+    char msg[512];
+    int len = snprintf(msg, sizeof(msg),
+        "Live view: http://" IPSTR "/stream (?fps=1-%d)\n"
+        "Viewers: %u of %d, frames published: %u, turned away: %u\n",
+        IP2STR(&sta_ip), STREAM_MAX_FPS, (unsigned)st.clients, STREAM_MAX_CLIENTS,
+        (unsigned)st.published, (unsigned)st.rejected);
+    for (uint32_t i = 0; i < st.clients && len < (int)sizeof(msg); i++) {
+        const stream_client_stats_t *c = &st.client[i];
+        len += snprintf(msg + len, sizeof(msg) - len,
+            "%u fps: sent %u, skipped %u, send %u ms, latency %u ms\n",
+            (unsigned)c->fps, (unsigned)c->sent, (unsigned)c->skipped,
+            (unsigned)c->send_ms, (unsigned)c->latency_ms);
+    }
+    telegram_send_message(chat_id, msg);
+}
 
-    int form_start_len = strlen(form_start);
-    int form_end_len = strlen(form_end);
-    int total_len = form_start_len + fb->len + form_end_len;
-    
-    ESP_LOGI(TAG, "Sending photo: %d bytes (form_start=%d, image=%d, form_end=%d)", 
-             total_len, form_start_len, fb->len, form_end_len);
+// Light the flash and wait until the sensor's exposure has settled under it.
+// Returns the time from which frames are exposed for the flash, 0 if any
+// frame will do.
+static int64_t flash_on(void)
+{
+    sensor_t *s = esp_camera_sensor_get();
+    exposure_sample_t ambient;
+    bool tracked = exposure_supported(s) && exposure_read(s, &ambient) == ESP_OK;
 
-    // Open connection with known content length and stream the body
-    esp_err_t err = esp_http_client_open(client, total_len);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
-        // Retry once after a short delay
-        vTaskDelay(pdMS_TO_TICKS(500));
-        err = esp_http_client_open(client, total_len);
+    gpio_set_level(CAM_PIN_FLASH, 1);
+    trace_begin(TRACE_FLASH, 0);
+    if (!tracked) {
+        vTaskDelay(pdMS_TO_TICKS(EXPOSURE_TIMEOUT_MS));
+        return 0;
+    }
+    return exposure_wait_flash(s, &ambient);
+}
+
+// esp_camera_fb_get() that skips a frame started before ready_us
+static camera_fb_t *capture_after(int64_t ready_us)
+{
+    camera_fb_t *fb = esp_camera_fb_get();
+    if (fb && (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec < ready_us) {
+        esp_camera_fb_return(fb);
+        fb = esp_camera_fb_get();
+    }
+    return fb;
+}
+
+// Remember the sensor state for fb's EXIF; call before the flash goes off
+static void note_capture(const camera_fb_t *fb)
+{
+    sensor_t *s = esp_camera_sensor_get();
+    last_capture.timestamp = fb->timestamp;
+    last_capture.exposure_valid = exposure_supported(s) && exposure_read(s, &last_capture.exposure) == ESP_OK;
+    last_capture.flash = flash_enabled;
+}
+
+// Offset from the esp_timer clock to wall time, 0 while the clock is unset
+static int64_t wall_offset_us(void)
+{
+    timekeep_status_t clock;
+    timekeep_get_status(&clock);
+    if (clock.uncertainty_ms < 0) {
+        return 0;
+    }
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_usec - esp_timer_get_time();
+}
+
+// Metadata provider for photo uploads: EXIF with the capture time and,
+// for the frame note_capture() saw, exposure and flash
+static size_t photo_metadata(const camera_fb_t *fb, uint8_t *buf, size_t size)
+{
+    exif_info_t info = {
+        .width = fb->width,
+        .height = fb->height,
+    };
+    // The frame's timestamp is on the esp_timer clock
+    int64_t offset = wall_offset_us();
+    if (offset) {
+        int64_t wall_us = offset + (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+        info.time = wall_us / 1000000;
+        info.msec = wall_us % 1000000 / 1000;
+    }
+    if (fb->timestamp.tv_sec == last_capture.timestamp.tv_sec &&
+        fb->timestamp.tv_usec == last_capture.timestamp.tv_usec) {
+        if (last_capture.exposure_valid) {
+            info.exposure_lines = last_capture.exposure.lines;
+            info.gain_x16 = last_capture.exposure.gain_x16;
+        }
+        info.flash = last_capture.flash;
+    }
+    return exif_build(&info, buf, size);
+}
+
+// Keep a photo that could not be sent for the next connection. A frame too
+// big for one record is requantized first.
+static esp_err_t queue_photo(const char *chat_id, const camera_fb_t *fb)
+{
+    int64_t offset = wall_offset_us();
+    outbox_item_t item = {
+        .type = OUTBOX_PHOTO,
+        .time_us = offset ? offset + (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec : 0,
+        .width = fb->width,
+        .height = fb->height,
+        .data = fb->buf,
+        .len = fb->len,
+    };
+    snprintf(item.chat_id, sizeof(item.chat_id), "%s", chat_id);
+    uint8_t *smaller = NULL;
+    if (fb->len > outbox_max_payload()) {
+        size_t len;
+        if (!jpg2jpg(fb->buf, fb->len, OUTBOX_FIT_QUALITY, &smaller, &len)) {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        item.data = smaller;
+        item.len = len;
+    }
+    esp_err_t err = outbox_put(&item);
+    free(smaller);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Photo for chat %s queued, %u items waiting", chat_id, (unsigned)outbox_pending());
+    }
+    return err;
+}
+
+// Deliver one outbox batch: photos for a chat go as one album
+static esp_err_t outbox_sink(const outbox_item_t *items, size_t count, void *ctx)
+{
+    if (items[0].type == OUTBOX_MESSAGE) {
+        return telegram_send_message(items[0].chat_id, (const char *)items[0].data);
+    }
+    camera_fb_t fbs[OUTBOX_BATCH_MAX];
+    const camera_fb_t *frames[OUTBOX_BATCH_MAX];
+    int64_t offset = wall_offset_us();
+    for (size_t i = 0; i < count; i++) {
+        // Back on the esp_timer clock, so the EXIF gets the capture time
+        int64_t captured = offset && items[i].time_us > offset ? items[i].time_us - offset : 0;
+        fbs[i] = (camera_fb_t) {
+            .buf = (uint8_t *)items[i].data,
+            .len = items[i].len,
+            .width = items[i].width,
+            .height = items[i].height,
+            .format = PIXFORMAT_JPEG,
+            .timestamp = { .tv_sec = captured / 1000000, .tv_usec = captured % 1000000 },
+        };
+        frames[i] = &fbs[i];
+    }
+    if (count == 1) {
+        return telegram_send_photo(items[0].chat_id, &fbs[0]);
+    }
+    return telegram_send_media_group(items[0].chat_id, frames, count);
+}
+
+static volatile bool outbox_flushing;
+static uint32_t outbox_link;            // wifi_links at the last flush
+static int64_t outbox_attempt_us;
+
+static esp_err_t outbox_job(void *arg)
+{
+    size_t sent = 0;
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = outbox_flush(outbox_sink, NULL, TELEGRAM_MEDIA_GROUP_MAX, &sent);
+    ESP_LOGI(TAG, "Outbox: %u items sent in %lld ms, %u left", (unsigned)sent,
+             (esp_timer_get_time() - start) / 1000, (unsigned)outbox_pending());
+    return err;
+}
+
+static void outbox_done(void *arg, esp_err_t err)
+{
+    outbox_flushing = false;
+}
+
+// Start sending what queued up offline: once per new connection, then
+// every OUTBOX_RETRY_MS while something is left
+static void outbox_kick(void)
+{
+    if (outbox_flushing || !outbox_pending()) {
+        return;
+    }
+    uint32_t link = wifi_links;
+    int64_t now = esp_timer_get_time();
+    if (link == outbox_link && now - outbox_attempt_us < (int64_t)OUTBOX_RETRY_MS * 1000) {
+        return;
+    }
+    outbox_link = link;
+    outbox_attempt_us = now;
+    outbox_flushing = true;
+    if (tg_sched_submit(TG_CLASS_BULK, outbox_job, NULL, outbox_done) != ESP_OK) {
+        outbox_flushing = false;
+    }
+}
+
+// Keep a text that could not be sent for the next connection, with the
+// time it was meant for, since it may arrive much later
+static esp_err_t queue_message(const char *chat_id, const char *text, int64_t at_us)
+{
+    char buf[128];
+    int64_t offset = wall_offset_us();
+    if (offset) {
+        time_t at = (offset + at_us) / 1000000;
+        struct tm tm;
+        localtime_r(&at, &tm);
+        snprintf(buf, sizeof(buf), "%s (%02d:%02d:%02d)", text, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    } else {
+        snprintf(buf, sizeof(buf), "%s", text);
+    }
+    outbox_item_t item = {
+        .type = OUTBOX_MESSAGE,
+        .time_us = offset ? offset + at_us : 0,
+        .data = (const uint8_t *)buf,
+        .len = strlen(buf) + 1,
+    };
+    snprintf(item.chat_id, sizeof(item.chat_id), "%s", chat_id);
+    return outbox_put(&item);
+}
+
+static void sound_chats_copy(sound_chats_t *out)
+{
+    taskENTER_CRITICAL(&sound_chats_mux);
+    *out = sound_chats;
+    taskEXIT_CRITICAL(&sound_chats_mux);
+}
+
+static volatile bool cry_alert_busy;
+static int64_t cry_alert_us;
+static sound_chats_t cry_alert_chats;   // Owned by the alert job while cry_alert_busy
+
+static esp_err_t cry_alert_job(void *arg)
+{
+    for (int i = 0; i < cry_alert_chats.count; i++) {
+        esp_err_t err = telegram_send_message(cry_alert_chats.ids[i], CRY_ALERT_TEXT);
+        if (err != ESP_OK && err != ESP_ERR_INVALID_RESPONSE) {
+            queue_message(cry_alert_chats.ids[i], CRY_ALERT_TEXT, cry_alert_us);
+        }
+    }
+    return ESP_OK;
+}
+
+static void cry_alert_done(void *arg, esp_err_t err)
+{
+    cry_alert_busy = false;
+}
+
+// Runs on the audio task, which must not wait on the network
+static void on_cry(void)
+{
+    if (cry_alert_busy) {
+        return;
+    }
+    cry_alert_busy = true;
+    cry_alert_us = esp_timer_get_time();
+    sound_chats_copy(&cry_alert_chats);
+    if (tg_sched_submit(TG_CLASS_STATUS, cry_alert_job, NULL, cry_alert_done) != ESP_OK) {
+        for (int i = 0; i < cry_alert_chats.count; i++) {
+            queue_message(cry_alert_chats.ids[i], CRY_ALERT_TEXT, cry_alert_us);
+        }
+        cry_alert_busy = false;
+    }
+}
+
+// Owned by the clip job until it releases the clip
+static const uint8_t *cry_clip;
+static size_t cry_clip_len;
+static sound_chats_t cry_clip_chats;
+
+// A failed clip is not kept: the alert itself went out or was queued
+static esp_err_t cry_clip_job(void *arg)
+{
+    for (int i = 0; i < cry_clip_chats.count; i++) {
+        esp_err_t err = telegram_send_document(cry_clip_chats.ids[i], "cry.wav", cry_clip, cry_clip_len);
         if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Retry open failed: %s", esp_err_to_name(err));
-            esp_http_client_cleanup(client);
-            return err;
+            ESP_LOGW(TAG, "Cry clip for chat %s failed: %s", cry_clip_chats.ids[i], esp_err_to_name(err));
         }
     }
-    
-    ESP_LOGI(TAG, "HTTP connection opened, writing data...");
+    return ESP_OK;
+}
 
-    int written = 0;
-    written = esp_http_client_write(client, form_start, form_start_len);
-    if (written < 0) {
-        ESP_LOGE(TAG, "Failed to write form start");
-        esp_http_client_close(client);
-        esp_http_client_cleanup(client);
+static void cry_clip_done(void *arg, esp_err_t err)
+{
+    audio_clip_release();
+}
+
+// Runs on the audio task, like on_cry()
+static void on_cry_clip(const uint8_t *wav, size_t len)
+{
+    cry_clip = wav;
+    cry_clip_len = len;
+    sound_chats_copy(&cry_clip_chats);
+    if (tg_sched_submit(TG_CLASS_BULK, cry_clip_job, NULL, cry_clip_done) != ESP_OK) {
+        audio_clip_release();
+    }
+}
+
+// Edits a copy, so the list is only locked for the two copies
+static void sound_subscribe(const char *chat_id, bool on)
+{
+    sound_chats_t list;
+    sound_chats_copy(&list);
+    int i = 0;
+    while (i < list.count && strcmp(list.ids[i], chat_id) != 0) {
+        i++;
+    }
+    if (on && i == list.count && i < SOUND_MAX_CHATS) {
+        snprintf(list.ids[i], sizeof(list.ids[i]), "%s", chat_id);
+        list.count++;
+    } else if (!on && i < list.count) {
+        memmove(list.ids[i], list.ids[i + 1], (list.count - i - 1) * sizeof(list.ids[0]));
+        list.count--;
+    }
+    taskENTER_CRITICAL(&sound_chats_mux);
+    sound_chats = list;
+    taskEXIT_CRITICAL(&sound_chats_mux);
+    audio_set_enabled(list.count > 0);
+}
+
+static void send_sound_status(const char *chat_id)
+{
+    audio_stats_t st;
+    audio_get_stats(&st);
+    char status[256];
+    snprintf(status, sizeof(status),
+        "Cry detection: %s, sensitivity %u\n"
+        "Level: %d dBFS, cry band: %d dB (floor %d dB)\n"
+        "Cry-like audio in the last second: %u%%\n"
+        "Alerts: %u, clips: %u, lost blocks: %u, CPU: %u.%u%%",
+        st.enabled ? "ON" : "OFF", st.sensitivity,
+        st.level_db, st.tone_db, st.floor_db, st.voiced_pct,
+        (unsigned)st.alerts, (unsigned)st.clips, (unsigned)st.overruns,
+        (unsigned)(st.load_permille / 10), (unsigned)(st.load_permille % 10));
+    telegram_send_message(chat_id, status);
+}
+
+static void send_timelapse_status(const char *chat_id)
+{
+    timelapse_status_t st;
+    timelapse_get_status(&st);
+    char status[256];
+    int len;
+    if (st.running) {
+        len = snprintf(status, sizeof(status), "Time-lapse: ON, a photo every %u min\n",
+            (unsigned)(st.interval_s / 60));
+    } else {
+        len = snprintf(status, sizeof(status), "Time-lapse: OFF%s\n",
+            st.full ? " (SD card store full)" : "");
+    }
+    if (st.frames && st.first_time && st.last_time >= st.first_time) {
+        uint32_t span = st.last_time - st.first_time;
+        len += snprintf(status + len, sizeof(status) - len,
+            "Captured %u photos over %u h %02u min\n",
+            (unsigned)st.frames, (unsigned)(span / 3600), (unsigned)(span % 3600 / 60));
+    } else {
+        len += snprintf(status + len, sizeof(status) - len, "Captured %u photos\n", (unsigned)st.frames);
+    }
+    len += snprintf(status + len, sizeof(status) - len, "SD store: %u of %u MB",
+        (unsigned)(st.used >> 20), (unsigned)(st.capacity >> 20));
+    if (st.failed && len < (int)sizeof(status)) {
+        len += snprintf(status + len, sizeof(status) - len, ", %u shots failed", (unsigned)st.failed);
+    }
+    if (st.dropped && len < (int)sizeof(status)) {
+        snprintf(status + len, sizeof(status) - len, ", %u torn frames dropped", (unsigned)st.dropped);
+    }
+    telegram_send_message(chat_id, status);
+}
+
+// Time-lapse video streamed from the SD card as it uploads
+typedef struct {
+    char chat_id[32];
+} timelapse_job_t;
+
+static int timelapse_reader(void *ctx, uint8_t *buf, size_t size)
+{
+    return timelapse_video_read(buf, size);
+}
+
+static esp_err_t timelapse_job(void *arg)
+{
+    timelapse_job_t *job = (timelapse_job_t *)arg;
+    size_t len;
+    esp_err_t err = timelapse_video_open(TIMELAPSE_VIDEO_MAX, &len);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = telegram_send_document_stream(job->chat_id, "timelapse.avi", len, timelapse_reader, NULL);
+    timelapse_video_close();
+    return err;
+}
+
+static void timelapse_done(void *arg, esp_err_t err)
+{
+    timelapse_job_t *job = (timelapse_job_t *)arg;
+    if (err == ESP_ERR_NOT_FOUND) {
+        telegram_send_message(job->chat_id, "No time-lapse photos yet.");
+    } else if (err == ESP_ERR_INVALID_STATE) {
+        telegram_send_message(job->chat_id, "A time-lapse video is already uploading.");
+    } else if (err != ESP_OK) {
+        telegram_send_message(job->chat_id, "Failed to send time-lapse.");
+    }
+    free(job);
+}
+
+// Capture frames back to back and queue them for upload in a single
+// sendMediaGroup request. ESP_ERR_INVALID_STATE while the last burst is
+// still going out, ESP_ERR_NO_MEM when the upload queue is full.
+static esp_err_t send_burst(const char *chat_id, int count)
+{
+    if (burst_uploading) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    trace_begin(TRACE_BURST, count);
+    frame_ring_clear(&burst_ring);
+
+    // Flush any stale frame so the burst starts from a fresh exposure
+    camera_fb_t *fb = esp_camera_fb_get();
+    if (fb) {
+        esp_camera_fb_return(fb);
+    }
+
+    int64_t ready_us = flash_enabled ? flash_on() : 0;
+
+    int captured = 0;
+    for (int i = 0; i < count; i++) {
+        trace_begin(TRACE_CAPTURE, i);
+        fb = i == 0 ? capture_after(ready_us) : esp_camera_fb_get();
+        trace_end(TRACE_CAPTURE, fb ? fb->len : 0);
+        if (!fb) {
+            break;
+        }
+        // The ring copy lets the single frame buffer go straight back to the driver
+        if (frame_ring_append(&burst_ring, fb) == ESP_OK) {
+            captured++;
+        }
+        esp_camera_fb_return(fb);
+    }
+
+    if (flash_enabled) {
+        gpio_set_level(CAM_PIN_FLASH, 0);
+        trace_end(TRACE_FLASH, 0);
+    }
+    ESP_LOGI(TAG, "Captured %d of %d burst frames", captured, count);
+
+    if (captured == 0) {
+        trace_end(TRACE_BURST, 0);
         return ESP_FAIL;
     }
-    ESP_LOGI(TAG, "Form start written: %d bytes", form_start_len);
 
-    written = esp_http_client_write(client, (const char *)fb->buf, fb->len);
-    if (written < 0) {
-        ESP_LOGE(TAG, "Failed to write image body");
-        esp_http_client_close(client);
-        esp_http_client_cleanup(client);
+    burst_uploading = true;
+    esp_err_t err = queue_album(chat_id, &burst_ring, 0, captured, "Failed to send burst. Please try again.");
+    if (err != ESP_OK) {
+        burst_uploading = false;
+        trace_end(TRACE_BURST, 0);
+    }
+    return err;
+}
+
+// Capture a frame and send the area given in percent of the frame. The crop
+// is cut out of the JPEG without re-encoding, so it keeps the full frame's
+// detail at a fraction of the upload.
+static esp_err_t send_zoom(const char *chat_id, int x, int y, int w, int h)
+{
+    camera_fb_t *stale_fb = esp_camera_fb_get();
+    if (stale_fb) {
+        esp_camera_fb_return(stale_fb);
+    }
+
+    int64_t ready_us = flash_enabled ? flash_on() : 0;
+    trace_begin(TRACE_CAPTURE, 0);
+    camera_fb_t *fb = capture_after(ready_us);
+    trace_end(TRACE_CAPTURE, fb ? fb->len : 0);
+    if (fb) {
+        note_capture(fb);
+    }
+    if (flash_enabled) {
+        gpio_set_level(CAM_PIN_FLASH, 0);
+        trace_end(TRACE_FLASH, 0);
+    }
+    if (!fb) {
         return ESP_FAIL;
     }
-    ESP_LOGI(TAG, "Image data written: %d bytes", fb->len);
 
-    written = esp_http_client_write(client, form_end, form_end_len);
-    if (written < 0) {
-        ESP_LOGE(TAG, "Failed to write form footer");
-        esp_http_client_close(client);
-        esp_http_client_cleanup(client);
+    jpg_rect_t rect = {
+        .x = fb->width * x / 100,
+        .y = fb->height * y / 100,
+        .w = fb->width * w / 100,
+        .h = fb->height * h / 100,
+    };
+    int64_t start = esp_timer_get_time();
+    camera_fb_t crop = {
+        .format = PIXFORMAT_JPEG,
+        .timestamp = fb->timestamp,
+    };
+    bool ok = jpg_crop(fb->buf, fb->len, &rect, &crop.buf, &crop.len);
+    esp_camera_fb_return(fb);
+    if (!ok) {
         return ESP_FAIL;
     }
-    ESP_LOGI(TAG, "Form end written: %d bytes", form_end_len);
-    
-    ESP_LOGI(TAG, "All data written, fetching response headers...");
+    crop.width = rect.w;
+    crop.height = rect.h;
+    ESP_LOGI(TAG, "Zoom %ux%u at %u,%u: %u bytes in %lld ms", rect.w, rect.h, rect.x, rect.y,
+             (unsigned)crop.len, (esp_timer_get_time() - start) / 1000);
+
+    esp_err_t err = telegram_send_photo(chat_id, &crop);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_RESPONSE && queue_photo(chat_id, &crop) == ESP_OK) {
+        err = ESP_OK;
+    }
+    free(crop.buf);
+    return err;
+}
+
+// /photo requests that arrived in the same getUpdates batch
+typedef struct {
+    char chat_ids[UPDATES_PER_POLL][32];
+    size_t count;
+} photo_batch_t;
 
-    // Read response
-    int content_len = esp_http_client_fetch_headers(client);
-    int status_code = esp_http_client_get_status_code(client);
-    ESP_LOGI(TAG, "HTTP Status = %d, content_length = %d", status_code, content_len);
+static void photo_batch_add(photo_batch_t *photos, const char *chat_id)
+{
+    for (size_t i = 0; i < photos->count; i++) {
+        if (strcmp(photos->chat_ids[i], chat_id) == 0) {
+            return;
+        }
+    }
+    if (photos->count < UPDATES_PER_POLL) {
+        snprintf(photos->chat_ids[photos->count++], sizeof(photos->chat_ids[0]), "%s", chat_id);
+    }
+}
 
-    esp_http_client_close(client);
-    esp_http_client_cleanup(client);
+// What to send for a frame, given the last full upload
+static dedup_action_t dedup_classify(const phash_t *hash)
+{
+    if (!dedup.valid || esp_timer_get_time() - dedup.time_us > DEDUP_MAX_AGE_MS * 1000LL) {
+        return DEDUP_UPLOAD;
+    }
+    int luma_step = hash->luma - dedup.hash.luma;
+    if (luma_step > DEDUP_LUMA_STEP || luma_step < -DEDUP_LUMA_STEP) {
+        return DEDUP_UPLOAD;
+    }
+    int distance = phash_distance(hash, &dedup.hash);
+    ESP_LOGI(TAG, "Photo %d bits from the last upload", distance);
+    if (distance <= DEDUP_SAME_BITS) {
+        return DEDUP_REPEAT;
+    }
+    return distance <= DEDUP_SIMILAR_BITS ? DEDUP_SMALLER : DEDUP_UPLOAD;
+}
 
-    if (status_code == 200) {
-        ESP_LOGI(TAG, "Photo sent successfully to chat %s", chat_id);
-        return ESP_OK;
+// The earlier photo arrives as a new message, so say when it was taken
+static void dedup_note(char *buf, size_t size)
+{
+    int64_t offset = wall_offset_us();
+    if (offset) {
+        time_t at = (offset + dedup.time_us) / 1000000;
+        struct tm tm;
+        localtime_r(&at, &tm);
+        snprintf(buf, size, "No change since the photo of %02d:%02d:%02d, sending it again "
+                 "(/dedup off to always take a new one)", tm.tm_hour, tm.tm_min, tm.tm_sec);
     } else {
-        ESP_LOGE(TAG, "Failed to send photo, status code: %d", status_code);
-        return ESP_FAIL;
+        snprintf(buf, size, "No change since the photo of %u min ago, sending it again "
+                 "(/dedup off to always take a new one)",
+                 (unsigned)((esp_timer_get_time() - dedup.time_us) / 60000000));
+    }
+}
+
+// Take one photo for every chat in the batch
+static void send_photos(const photo_batch_t *photos)
+{
+    const char *chats[UPDATES_PER_POLL];
+    for (size_t i = 0; i < photos->count; i++) {
+        chats[i] = photos->chat_ids[i];
+    }
+
+    trace_begin(TRACE_PHOTO, photos->count);
+
+    // Pick resolution/quality for the measured uplink before flushing,
+    // so the flushed frame absorbs the mode change
+    quality_ctl_apply(esp_camera_sensor_get());
+
+    // Flush any stale frames from buffer to prevent overflow
+    ESP_LOGI(TAG, "Flushing camera buffers...");
+    camera_fb_t *stale_fb = esp_camera_fb_get();
+    if (stale_fb) {
+        esp_camera_fb_return(stale_fb);
+    }
+    // Give camera time to stabilize after flush
+    vTaskDelay(pdMS_TO_TICKS(100));
+
+    // Turn on flash FIRST if enabled
+    int64_t ready_us = flash_enabled ? flash_on() : 0;
+
+    // Capture photo
+    trace_begin(TRACE_CAPTURE, 0);
+    camera_fb_t *fb = capture_after(ready_us);
+    trace_end(TRACE_CAPTURE, fb ? fb->len : 0);
+    if (fb) {
+        note_capture(fb);
+    }
+
+    // Turn off flash immediately after capture
+    if (flash_enabled) {
+        gpio_set_level(CAM_PIN_FLASH, 0);
+        trace_end(TRACE_FLASH, 0);
+    }
+
+    if (fb) {
+        trace_instant(TRACE_FRAME_READY, fb->len);
+        quality_ctl_record_frame(fb->len);
+
+        // Compare with the last full upload; without a hash the frame just goes up
+        phash_t hash;
+        bool hashed = dedup_enabled && phash_jpeg(fb->buf, fb->len, &hash) == ESP_OK;
+        dedup_action_t action = hashed ? dedup_classify(&hash) : DEDUP_UPLOAD;
+
+        // A small change goes up requantized
+        camera_fb_t smaller = *fb;
+        uint8_t *smaller_buf = NULL;
+        if (action == DEDUP_SMALLER) {
+            if (jpg2jpg(fb->buf, fb->len, DEDUP_QUALITY, &smaller_buf, &smaller.len)) {
+                smaller.buf = smaller_buf;
+            } else {
+                action = DEDUP_UPLOAD;
+            }
+        }
+        const camera_fb_t *out = action == DEDUP_SMALLER ? &smaller : fb;
+
+        // A repeat is the last upload's file_id; fb only goes up if Telegram lost it
+        char file_id[TELEGRAM_FILE_ID_MAX] = "";
+        camera_fb_t *preview = NULL;
+        if (action == DEDUP_REPEAT) {
+            char note[160];
+            dedup_note(note, sizeof(note));
+            snprintf(file_id, sizeof(file_id), "%s", dedup.file_id);
+            for (size_t i = 0; i < photos->count; i++) {
+                tg_sched_status(chats[i], note);
+            }
+        }
+        // The preview is the user's feedback; without one, say what is happening
+        else if (!preview_enabled || preview_make(out, &preview) != ESP_OK) {
+            for (size_t i = 0; i < photos->count; i++) {
+                tg_sched_status(chats[i], "Photo captured! Uploading...");
+            }
+        }
+
+        // One upload, then a file_id reference for every other chat
+        esp_err_t results[UPDATES_PER_POLL];
+        size_t served = telegram_send_photo_fanout(chats, photos->count, out, preview,
+                                                   file_id, sizeof(file_id), results);
+        preview_free(preview);
+
+        // A full upload becomes the reference for the next frames
+        if (action == DEDUP_REPEAT && strcmp(file_id, dedup.file_id) != 0) {
+            action = DEDUP_UPLOAD;
+        }
+        if (served) {
+            if (action == DEDUP_UPLOAD) {
+                dedup.uploads++;
+            } else if (action == DEDUP_SMALLER) {
+                dedup.smaller++;
+            } else {
+                dedup.repeats++;
+            }
+        }
+        if (hashed && action == DEDUP_UPLOAD && file_id[0]) {
+            dedup.valid = true;
+            dedup.hash = hash;
+            dedup.time_us = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+            snprintf(dedup.file_id, sizeof(dedup.file_id), "%s", file_id);
+        }
+
+        // Unless Telegram refused it, the photo follows once the link is back
+        bool queued[UPDATES_PER_POLL] = { false };
+        for (size_t i = 0; i < photos->count; i++) {
+            queued[i] = results[i] != ESP_OK && results[i] != ESP_ERR_INVALID_RESPONSE &&
+                        queue_photo(chats[i], out) == ESP_OK;
+        }
+        free(smaller_buf);
+
+        // CRITICAL: Return frame buffer immediately to prevent overflow
+        esp_camera_fb_return(fb);
+
+        for (size_t i = 0; i < photos->count; i++) {
+            if (queued[i]) {
+                tg_sched_status(chats[i], "Upload failed. The photo will follow when the connection is back.");
+            } else if (results[i] != ESP_OK) {
+                telegram_send_message(chats[i], "Failed to send photo. Please try again.");
+            }
+        }
+    } else {
+        ESP_LOGE(TAG, "Camera capture failed - buffer overflow or timeout");
+        for (size_t i = 0; i < photos->count; i++) {
+            telegram_send_message(chats[i], "Camera busy. Wait 2 seconds and try again.");
+        }
+        // Flush again to recover from error state
+        stale_fb = esp_camera_fb_get();
+        if (stale_fb) esp_camera_fb_return(stale_fb);
+    }
+    trace_end(TRACE_PHOTO, fb != NULL);
+}
+
+// Run one bot command; /photo is only queued in photos
+static void handle_command(const char *cmd_start, const char *chat_id, photo_batch_t *photos)
+{
+    // Handle /start command
+    if (strncmp(cmd_start, "/start", 6) == 0) {
+        ESP_LOGI(TAG, "Received /start from chat %s", chat_id);
+        telegram_send_message(chat_id,
+            "Welcome to ESP32-CAM Baby Monitor!\n\n"
+            "Available commands:\n"
+            "/photo - Take a photo (wait 15-30s)\n"
+            "/flash on - Enable LED flash\n"
+            "/flash off - Disable LED flash\n"
+            "/prebuffer on|off - Keep last seconds in memory\n"
+            "/clip - Send the buffered frames\n"
+            "/burst [n] - Send n photos taken back to back\n"
+            "/zoom x y w h - Close-up, in percent of the frame\n"
+            "/preview on|off - Quick thumbnail before the photo\n"
+            "/dedup [on|off] - Skip uploading unchanged photos\n"
+            "/quality [ms] - Photo size vs. upload speed\n"
+            "/boot - Boot stage timings\n"
+            "/trace [log|clear] - Timeline dump\n"
+            "/stats [reset] - Camera pipeline counters\n"
+            "/stream - Live view address\n"
+            "/sound on|off|test - Cry alerts\n"
+            "/sound threshold <1-10> - Cry sensitivity\n"
+            "/timelapse start <min>|stop|status|compile - Time-lapse\n"
+            "/help - Show this message\n\n"
+            "NOTE: Photos take 15-30 seconds to upload.");
+    }
+    // Handle /help command
+    else if (strncmp(cmd_start, "/help", 5) == 0) {
+        ESP_LOGI(TAG, "Received /help from chat %s", chat_id);
+        char help_msg[1024];
+        snprintf(help_msg, sizeof(help_msg),
+            "ESP32-CAM Commands:\n\n"
+            "/photo - Capture and send photo\n"
+            "/flash on - Turn flash ON\n"
+            "/flash off - Turn flash OFF\n"
+            "/prebuffer on|off - Pre-event buffer\n"
+            "/clip - Send buffered frames\n"
+            "/burst [n] - Burst of 2-10 photos\n"
+            "/zoom x y w h - Close-up (percent)\n"
+            "/preview on|off - Thumbnail first\n"
+            "/dedup [on|off] - Repeat photo check\n"
+            "/quality [ms] - Adaptive photo size status/target\n"
+            "/boot - Boot stage timings\n"
+            "/trace [log|clear] - Timeline dump\n"
+            "/stats [reset] - Camera pipeline counters\n"
+            "/stream - Live view address\n"
+            "/sound on|off|test - Cry alerts\n"
+            "/sound threshold <1-10> - Cry sensitivity\n"
+            "/timelapse start <min>|stop|status|compile - Time-lapse\n"
+            "/help - Show this help\n\n"
+            "Current flash: %s\n"
+            "Pre-event buffer: %s\n"
+            "Preview: %s\n"
+            "Repeat check: %s\n"
+            "Cry alerts: %s\n\n"
+            "Note: Photo capture takes 15-30 seconds.", 
+            flash_enabled ? "ON" : "OFF",
+            prebuffer_enabled ? "ON" : "OFF",
+            preview_enabled ? "ON" : "OFF",
+            dedup_enabled ? "ON" : "OFF",
+            audio_enabled() ? "ON" : "OFF");
+        telegram_send_message(chat_id, help_msg);
+    }
+    // Handle /flash command
+    else if (strncmp(cmd_start, "/flash", 6) == 0) {
+        // Check for 'on' or 'off' after /flash
+        if (strncmp(cmd_start + 7, "on", 2) == 0) {
+            flash_enabled = true;
+            ESP_LOGI(TAG, "Flash enabled by chat %s", chat_id);
+            telegram_send_message(chat_id, "Flash enabled");
+        } else if (strncmp(cmd_start + 7, "off", 3) == 0) {
+            flash_enabled = false;
+            ESP_LOGI(TAG, "Flash disabled by chat %s", chat_id);
+            telegram_send_message(chat_id, "Flash disabled");
+        } else {
+            char flash_status[128];
+            snprintf(flash_status, sizeof(flash_status),
+                "Flash is currently: %s\n\n"
+                "Use /flash on or /flash off",
+                flash_enabled ? "ON" : "OFF");
+            telegram_send_message(chat_id, flash_status);
+        }
+    }
+    // Handle /preview command
+    else if (strncmp(cmd_start, "/preview", 8) == 0) {
+        if (strncmp(cmd_start + 9, "on", 2) == 0) {
+            preview_enabled = true;
+            telegram_send_message(chat_id, "Preview enabled");
+        } else if (strncmp(cmd_start + 9, "off", 3) == 0) {
+            preview_enabled = false;
+            telegram_send_message(chat_id, "Preview disabled");
+        } else {
+            char preview_status[128];
+            snprintf(preview_status, sizeof(preview_status),
+                "Preview is currently: %s\n\n"
+                "Use /preview on or /preview off",
+                preview_enabled ? "ON" : "OFF");
+            telegram_send_message(chat_id, preview_status);
+        }
+    }
+    // Handle /dedup command
+    else if (strncmp(cmd_start, "/dedup", 6) == 0) {
+        if (strncmp(cmd_start + 7, "on", 2) == 0) {
+            dedup_enabled = true;
+            telegram_send_message(chat_id, "Repeat check enabled");
+        } else if (strncmp(cmd_start + 7, "off", 3) == 0) {
+            // Whatever was sent meanwhile, the next check starts afresh
+            dedup_enabled = false;
+            dedup.valid = false;
+            telegram_send_message(chat_id, "Repeat check disabled, every photo is uploaded");
+        } else {
+            char last[64] = "none";
+            if (dedup.valid) {
+                snprintf(last, sizeof(last), "%u min ago, brightness %u",
+                         (unsigned)((esp_timer_get_time() - dedup.time_us) / 60000000),
+                         (unsigned)dedup.hash.luma);
+            }
+            char status[384];
+            snprintf(status, sizeof(status),
+                "Repeat check: %s\n"
+                "Last full upload: %s\n"
+                "Up to %d of 64 hash bits changed: sent again, up to %d: sent at quality %d, "
+                "for %d min after an upload\n"
+                "Photos: %u uploaded, %u smaller, %u sent again\n\n"
+                "Use /dedup on or /dedup off",
+                dedup_enabled ? "ON" : "OFF", last,
+                DEDUP_SAME_BITS, DEDUP_SIMILAR_BITS, DEDUP_QUALITY, DEDUP_MAX_AGE_MS / 60000,
+                (unsigned)dedup.uploads, (unsigned)dedup.smaller, (unsigned)dedup.repeats);
+            telegram_send_message(chat_id, status);
+        }
+    }
+    // Handle /prebuffer command
+    else if (strncmp(cmd_start, "/prebuffer", 10) == 0) {
+        if (strncmp(cmd_start + 11, "on", 2) == 0) {
+            prebuffer_enabled = true;
+            telegram_send_message(chat_id, "Pre-event buffer enabled");
+        } else if (strncmp(cmd_start + 11, "off", 3) == 0) {
+            prebuffer_enabled = false;
+            frame_ring_clear(&prebuffer);
+            telegram_send_message(chat_id, "Pre-event buffer disabled");
+        } else {
+            frame_ring_stats_t st;
+            frame_ring_get_stats(&prebuffer, &st);
+            char status[256];
+            snprintf(status, sizeof(status),
+                "Pre-event buffer: %s\n"
+                "Frames: %u (%u KB of %u KB)\n"
+                "Appended: %u, evicted: %u, rejected: %u",
+                prebuffer_enabled ? "ON" : "OFF",
+                (unsigned)st.frames, (unsigned)(st.bytes / 1024),
+                (unsigned)(st.capacity / 1024),
+                (unsigned)st.appended, (unsigned)st.evicted,
+                (unsigned)st.rejected);
+            telegram_send_message(chat_id, status);
+        }
+    }
+    // Handle /clip command
+    else if (strncmp(cmd_start, "/clip", 5) == 0) {
+        ESP_LOGI(TAG, "Received /clip from chat %s", chat_id);
+        int64_t since = esp_timer_get_time() - (int64_t)PREBUFFER_WINDOW_MS * 1000;
+        esp_err_t err = queue_album(chat_id, &prebuffer, since, 0, "No buffered frames. Use /prebuffer on first.");
+        if (err != ESP_OK) {
+            reply_not_queued(chat_id, err, "Failed to send clip.");
+        }
+    }
+    // Handle /quality command
+    else if (strncmp(cmd_start, "/quality", 8) == 0) {
+        if (cmd_start[8] == ' ') {
+            int target = atoi(cmd_start + 9);
+            if (target >= 500) {
+                quality_ctl_set_target(target);
+            }
+        }
+        quality_ctl_status_t q;
+        quality_ctl_get_status(&q);
+        char status[256];
+        snprintf(status, sizeof(status),
+            "Photo size: %ux%u, quality %u (rung %d of %d)\n"
+            "Target delivery: %u ms, predicted: %u ms\n"
+            "Uplink: %u KB/s, setup: %u ms (%u uploads)",
+            resolution[q.framesize].width, resolution[q.framesize].height,
+            q.quality, q.step + 1, q.steps,
+            (unsigned)q.target_ms, (unsigned)q.predicted_ms,
+            (unsigned)(q.throughput_bps / 1024), (unsigned)q.setup_ms,
+            (unsigned)q.samples);
+        telegram_send_message(chat_id, status);
+    }
+    // Handle /boot command
+    else if (strncmp(cmd_start, "/boot", 5) == 0) {
+        char report[384];
+        int len = snprintf(report, sizeof(report), "Boot stages (ms since start):\n");
+        for (size_t n = 0; n < boot_stage_count() && len < (int)sizeof(report); n++) {
+            boot_stage_status_t st;
+            boot_get_status(n, &st);
+            len += snprintf(report + len, sizeof(report) - len,
+                "%s: ready %lld, done %lld%s\n", st.name, st.ready_ms, st.done_ms,
+                st.done && st.result != ESP_OK ? " (failed)" : "");
+        }
+        timekeep_status_t clock;
+        timekeep_get_status(&clock);
+        if (len < (int)sizeof(report)) {
+            if (clock.uncertainty_ms >= 0) {
+                snprintf(report + len, sizeof(report) - len, "clock: %s, +/-%lld ms\n",
+                    timekeep_source_name(clock.source), clock.uncertainty_ms);
+            } else {
+                snprintf(report + len, sizeof(report) - len, "clock: %s\n",
+                    timekeep_source_name(clock.source));
+            }
+        }
+        telegram_send_message(chat_id, report);
+    }
+    // Handle /stats command
+    else if (strncmp(cmd_start, "/stats", 6) == 0) {
+        send_camera_stats(chat_id, strncmp(cmd_start + 7, "reset", 5) == 0);
+    }
+    // Handle /stream command
+    else if (strncmp(cmd_start, "/stream", 7) == 0) {
+        send_stream_status(chat_id);
+    }
+    // Handle /sound command
+    else if (strncmp(cmd_start, "/sound", 6) == 0) {
+        if (!boot_wait(BOOT_BIT(BOOT_STAGE_AUDIO), 0)) {
+            telegram_send_message(chat_id, "Microphone unavailable.");
+        } else if (strncmp(cmd_start + 7, "on", 2) == 0) {
+            sound_subscribe(chat_id, true);
+            ESP_LOGI(TAG, "Cry alerts on for chat %s", chat_id);
+            telegram_send_message(chat_id, "Cry detection enabled");
+        } else if (strncmp(cmd_start + 7, "off", 3) == 0) {
+            sound_subscribe(chat_id, false);
+            ESP_LOGI(TAG, "Cry alerts off for chat %s", chat_id);
+            telegram_send_message(chat_id, "Cry detection disabled for this chat");
+        } else if (strncmp(cmd_start + 7, "threshold", 9) == 0) {
+            int level = atoi(cmd_start + 16);
+            if (level < 1 || level > 10) {
+                telegram_send_message(chat_id, "Use /sound threshold <1-10>, 10 is the most sensitive");
+            } else {
+                audio_set_sensitivity(level);
+                send_sound_status(chat_id);
+            }
+        } else {
+            send_sound_status(chat_id);
+        }
+    }
+    // Handle /timelapse command
+    else if (strncmp(cmd_start, "/timelapse", 10) == 0) {
+        const char *arg = cmd_start + 11;
+        if (!boot_wait(BOOT_BIT(BOOT_STAGE_SD), 0)) {
+            telegram_send_message(chat_id, "SD card unavailable.");
+        } else if (strncmp(arg, "start", 5) == 0) {
+            int minutes = atoi(arg + 5);
+            esp_err_t err = timelapse_start(minutes * 60);
+            if (err == ESP_ERR_INVALID_ARG) {
+                telegram_send_message(chat_id, "Use /timelapse start <1-60>, minutes between photos");
+            } else if (err == ESP_ERR_INVALID_STATE) {
+                telegram_send_message(chat_id, "A time-lapse video is uploading, try again after it.");
+            } else if (err != ESP_OK) {
+                telegram_send_message(chat_id, "Failed to start time-lapse.");
+            } else {
+                ESP_LOGI(TAG, "Time-lapse every %d min from chat %s", minutes, chat_id);
+                send_timelapse_status(chat_id);
+            }
+        } else if (strncmp(arg, "stop", 4) == 0) {
+            timelapse_stop();
+            send_timelapse_status(chat_id);
+        } else if (strncmp(arg, "compile", 7) == 0) {
+            timelapse_job_t *job = calloc(1, sizeof(*job));
+            if (!job) {
+                telegram_send_message(chat_id, "Failed to send time-lapse.");
+            } else {
+                snprintf(job->chat_id, sizeof(job->chat_id), "%s", chat_id);
+                telegram_send_message(chat_id, "Assembling time-lapse video...");
+                esp_err_t err = run_bulk(timelapse_job, job, timelapse_done);
+                if (err != ESP_OK) {
+                    reply_not_queued(chat_id, err, "Failed to send time-lapse.");
+                    free(job);
+                }
+            }
+        } else {
+            send_timelapse_status(chat_id);
+        }
+    }
+    // Handle /trace command
+    else if (strncmp(cmd_start, "/trace", 6) == 0) {
+        if (strncmp(cmd_start + 7, "log", 3) == 0) {
+            trace_dump_log();
+            telegram_send_message(chat_id, "Trace written to the serial console.");
+        } else if (strncmp(cmd_start + 7, "clear", 5) == 0) {
+            trace_clear();
+            telegram_send_message(chat_id, "Trace cleared.");
+        } else {
+            size_t cap = trace_dump_size();
+            document_job_t *job = malloc(sizeof(*job) + cap);
+            size_t len = job ? trace_dump(job->data, cap) : 0;
+            if (len == 0) {
+                telegram_send_message(chat_id, "Failed to send trace.");
+                free(job);
+            } else {
+                job->len = len;
+                snprintf(job->chat_id, sizeof(job->chat_id), "%s", chat_id);
+                esp_err_t err = run_bulk(document_job, job, document_done);
+                if (err != ESP_OK) {
+                    reply_not_queued(chat_id, err, "Failed to send trace.");
+                    free(job);
+                }
+            }
+        }
+    }
+    // Handle /burst command (camera_ready() replies if the camera is down)
+    else if (strncmp(cmd_start, "/burst", 6) == 0 && camera_ready(chat_id)) {
+        int count = BURST_DEFAULT_FRAMES;
+        if (cmd_start[6] == ' ') {
+            count = atoi(cmd_start + 7);
+        }
+        if (count < 2) count = 2;
+        if (count > TELEGRAM_MEDIA_GROUP_MAX) count = TELEGRAM_MEDIA_GROUP_MAX;
+        ESP_LOGI(TAG, "Received /burst %d from chat %s", count, chat_id);
+        esp_err_t err = send_burst(chat_id, count);
+        if (err == ESP_ERR_INVALID_STATE) {
+            telegram_send_message(chat_id, "Previous burst is still uploading.");
+        } else if (err != ESP_OK) {
+            reply_not_queued(chat_id, err, "Failed to send burst. Please try again.");
+        }
+    }
+    // Handle /zoom command (camera_ready() replies if the camera is down)
+    else if (strncmp(cmd_start, "/zoom", 5) == 0 && camera_ready(chat_id)) {
+        // Centre quarter of the frame by default
+        int x = 25, y = 25, w = 50, h = 50;
+        if (cmd_start[5] == ' ' && sscanf(cmd_start + 6, "%d %d %d %d", &x, &y, &w, &h) != 4) {
+            telegram_send_message(chat_id, "Use /zoom x y w h, in percent of the frame");
+            return;
+        }
+        if (x < 0 || y < 0 || w <= 0 || h <= 0 || x >= 100 || y >= 100) {
+            telegram_send_message(chat_id, "Zoom area is outside the frame");
+            return;
+        }
+        if (w > 100) w = 100;
+        if (h > 100) h = 100;
+        ESP_LOGI(TAG, "Received /zoom %d %d %d %d from chat %s", x, y, w, h, chat_id);
+        if (send_zoom(chat_id, x, y, w, h) != ESP_OK) {
+            telegram_send_message(chat_id, "Failed to send zoom. Please try again.");
+        }
+    }
+    // Handle /photo command (camera_ready() replies if the camera is down);
+    // the capture runs once the whole batch has been read
+    else if (strncmp(cmd_start, "/photo", 6) == 0 && camera_ready(chat_id)) {
+        ESP_LOGI(TAG, "Received /photo from chat %s", chat_id);
+        photo_batch_add(photos, chat_id);
+    }
+}
+
+// Parse one update of a getUpdates response; update is NUL-terminated
+// where the next one starts
+static void handle_update(const char *update, photo_batch_t *photos)
+{
+    // Simple JSON parsing to find the command
+    const char *text_ptr = strstr(update, "\"text\":");
+    const char *chat_id_ptr = strstr(update, "\"chat\":{\"id\":");
+
+    int update_id = atoi(update + 12);
+    if (update_id > last_update_id) {
+        last_update_id = update_id;
+        trace_instant(TRACE_COMMAND, update_id);
+    }
+
+    if (text_ptr && chat_id_ptr) {
+        // Extract command
+        const char *cmd_start = text_ptr + 8;
+        if (*cmd_start == '"') cmd_start++;
+
+        // Extract chat_id for all commands
+        const char *id_start = chat_id_ptr + 13;
+        char chat_id[32];
+        int i = 0;
+        while (id_start[i] >= '0' && id_start[i] <= '9' && i < 31) {
+            chat_id[i] = id_start[i];
+            i++;
+        }
+        chat_id[i] = '\0';
+
+        handle_command(cmd_start, chat_id, photos);
     }
 }
 
@@ -359,8 +1591,10 @@ static void telegram_get_updates_task(void *pvParameters)
     while (1) {
         // Wait for WiFi connection
         xEventGroupWaitBits(wifi_event_group, WIFI_CONNECTED_BIT, false, true, portMAX_DELAY);
+        outbox_kick();
         
-        snprintf(url, sizeof(url), TELEGRAM_API_URL "/getUpdates?offset=%d&timeout=5&limit=1", last_update_id + 1);
+        snprintf(url, sizeof(url), TELEGRAM_API_URL "/getUpdates?offset=%d&timeout=5&limit=%d",
+                 last_update_id + 1, UPDATES_PER_POLL);
         ESP_LOGI(TAG, "Polling Telegram API (offset=%d)...", last_update_id + 1);
         
         esp_http_client_config_t config = {
@@ -370,10 +1604,12 @@ static void telegram_get_updates_task(void *pvParameters)
         };
         
         esp_http_client_handle_t client = esp_http_client_init(&config);
+        trace_begin(TRACE_POLL, last_update_id + 1);
         esp_err_t err = esp_http_client_open(client, 0);
         if (err == ESP_OK) {
             int content_length = esp_http_client_fetch_headers(client);
             int status_code = esp_http_client_get_status_code(client);
+            trace_end(TRACE_POLL, status_code);
             ESP_LOGI(TAG, "getUpdates response: status=%d, length=%d", status_code, content_length);
             
             if (status_code == 200 && content_length != ESP_FAIL) {
@@ -386,140 +1622,25 @@ static void telegram_get_updates_task(void *pvParameters)
                 ESP_LOGI(TAG, "Read %d bytes from response", total_read);
                 if (total_read > 0) {
                     response_buffer[total_read] = '\0';
-                    
-                    // Simple JSON parsing to find /photo command
-                    char *text_ptr = strstr(response_buffer, "\"text\":");
-                    char *chat_id_ptr = strstr(response_buffer, "\"chat\":{\"id\":");
-                    char *update_id_ptr = strstr(response_buffer, "\"update_id\":");
-                    
-                    if (update_id_ptr) {
-                        int update_id = atoi(update_id_ptr + 12);
-                        if (update_id > last_update_id) {
-                            last_update_id = update_id;
-                        }
+
+                    // Handle every update in the batch; /photo requests are
+                    // collected so one capture serves all of them
+                    photo_batch_t photos = { .count = 0 };
+                    char *update = strstr(response_buffer, "\"update_id\":");
+                    while (update) {
+                        char *next = strstr(update + 12, "\"update_id\":");
+                        if (next) *next = '\0';
+                        handle_update(update, &photos);
+                        if (next) *next = '"';
+                        update = next;
                     }
-                    
-                    if (text_ptr && chat_id_ptr) {
-                        // Extract command
-                        char *cmd_start = text_ptr + 8;
-                        if (*cmd_start == '"') cmd_start++;
-                        
-                        // Extract chat_id for all commands
-                        char *id_start = chat_id_ptr + 13;
-                        char chat_id[32];
-                        int i = 0;
-                        while (id_start[i] >= '0' && id_start[i] <= '9' && i < 31) {
-                            chat_id[i] = id_start[i];
-                            i++;
-                        }
-                        chat_id[i] = '\0';
-                        
-                        // Handle /start command
-                        if (strncmp(cmd_start, "/start", 6) == 0) {
-                            ESP_LOGI(TAG, "Received /start from chat %s", chat_id);
-                            telegram_send_message(chat_id, 
-                                "Welcome to ESP32-CAM Baby Monitor!\n\n"
-                                "Available commands:\n"
-                                "/photo - Take a photo (wait 15-30s)\n"
-                                "/flash on - Enable LED flash\n"
-                                "/flash off - Disable LED flash\n"
-                                "/help - Show this message\n\n"
-                                "NOTE: Photos take 15-30 seconds to upload.");
-                        }
-                        // Handle /help command
-                        else if (strncmp(cmd_start, "/help", 5) == 0) {
-                            ESP_LOGI(TAG, "Received /help from chat %s", chat_id);
-                            char help_msg[512];
-                            snprintf(help_msg, sizeof(help_msg),
-                                "ESP32-CAM Commands:\n\n"
-                                "/photo - Capture and send photo\n"
-                                "/flash on - Turn flash ON\n"
-                                "/flash off - Turn flash OFF\n"
-                                "/help - Show this help\n\n"
-                                "Current flash: %s\n\n"
-                                "Note: Photo capture takes 15-30 seconds.", 
-                                flash_enabled ? "ON" : "OFF");
-                            telegram_send_message(chat_id, help_msg);
-                        }
-                        // Handle /flash command
-                        else if (strncmp(cmd_start, "/flash", 6) == 0) {
-                            // Check for 'on' or 'off' after /flash
-                            if (strncmp(cmd_start + 7, "on", 2) == 0) {
-                                flash_enabled = true;
-                                ESP_LOGI(TAG, "Flash enabled by chat %s", chat_id);
-                                telegram_send_message(chat_id, "Flash enabled");
-                            } else if (strncmp(cmd_start + 7, "off", 3) == 0) {
-                                flash_enabled = false;
-                                ESP_LOGI(TAG, "Flash disabled by chat %s", chat_id);
-                                telegram_send_message(chat_id, "Flash disabled");
-                            } else {
-                                char flash_status[128];
-                                snprintf(flash_status, sizeof(flash_status),
-                                    "Flash is currently: %s\n\n"
-                                    "Use /flash on or /flash off",
-                                    flash_enabled ? "ON" : "OFF");
-                                telegram_send_message(chat_id, flash_status);
-                            }
-                        }
-                        // Handle /photo command
-                        else if (strncmp(cmd_start, "/photo", 6) == 0) {
-                            ESP_LOGI(TAG, "[PERF] Received /photo command at %lld ms", esp_timer_get_time()/1000);
-                            
-                            // Flush any stale frames from buffer to prevent overflow
-                            ESP_LOGI(TAG, "Flushing camera buffers...");
-                            camera_fb_t *stale_fb = esp_camera_fb_get();
-                            if (stale_fb) {
-                                esp_camera_fb_return(stale_fb);
-                            }
-                            // Give camera time to stabilize after flush
-                            vTaskDelay(pdMS_TO_TICKS(100));
-                            
-                            // Turn on flash FIRST if enabled
-                            if (flash_enabled) {
-                                gpio_set_level(CAM_PIN_FLASH, 1);
-                                ESP_LOGI(TAG, "Flash LED ON");
-                                vTaskDelay(pdMS_TO_TICKS(800));  // 800ms for sensor to adjust exposure
-                            }
-                            
-                            // Capture photo
-                            ESP_LOGI(TAG, "[PERF] Starting capture at %lld ms", esp_timer_get_time()/1000);
-                            camera_fb_t *fb = esp_camera_fb_get();
-                            ESP_LOGI(TAG, "[PERF] Capture complete at %lld ms", esp_timer_get_time()/1000);
-                            
-                            // Turn off flash immediately after capture
-                            if (flash_enabled) {
-                                gpio_set_level(CAM_PIN_FLASH, 0);
-                                ESP_LOGI(TAG, "Flash LED OFF");
-                            }
-                            
-                            if (fb) {
-                                ESP_LOGI(TAG, "Photo captured: %d bytes", fb->len);
-                                
-                                // NOW send feedback (non-blocking, user gets status during upload)
-                                telegram_send_message(chat_id, "Photo captured! Uploading...");
-                                
-                                ESP_LOGI(TAG, "[PERF] Starting upload at %lld ms", esp_timer_get_time()/1000);
-                                esp_err_t result = telegram_send_photo(chat_id, fb);
-                                ESP_LOGI(TAG, "[PERF] Upload complete at %lld ms", esp_timer_get_time()/1000);
-                                
-                                // CRITICAL: Return frame buffer immediately to prevent overflow
-                                esp_camera_fb_return(fb);
-                                
-                                if (result != ESP_OK) {
-                                    telegram_send_message(chat_id, "Failed to send photo. Please try again.");
-                                }
-                            } else {
-                                ESP_LOGE(TAG, "Camera capture failed - buffer overflow or timeout");
-                                telegram_send_message(chat_id, "Camera busy. Wait 2 seconds and try again.");
-                                // Flush again to recover from error state
-                                stale_fb = esp_camera_fb_get();
-                                if (stale_fb) esp_camera_fb_return(stale_fb);
-                            }
-                        }
+                    if (photos.count) {
+                        send_photos(&photos);
                     }
                 }
             }
         } else {
+            trace_end(TRACE_POLL, 0);
             ESP_LOGE(TAG, "HTTP request failed: %s", esp_err_to_name(err));
         }
         
@@ -530,47 +1651,118 @@ static void telegram_get_updates_task(void *pvParameters)
     free(response_buffer);
 }
 
-void app_main(void)
+static esp_err_t nvs_stage(void)
 {
-    // Initialize NVS
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
         ESP_ERROR_CHECK(nvs_flash_erase());
         ret = nvs_flash_init();
     }
-    ESP_ERROR_CHECK(ret);
+    if (ret != ESP_OK) {
+        return ret;
+    }
 
-    ESP_LOGI(TAG, "ESP32-CAM Telegram Baby Monitor Starting...");
+    // Clock is usable from here on; SNTP only refines it
+    if (timekeep_restore() != ESP_OK) {
+        ESP_LOGW(TAG, "Could not restore the clock");
+    }
+    // Photos that missed their upload before a reset go out once the bot runs
+    if (outbox_init(OUTBOX_PARTITION_LABEL) != ESP_OK) {
+        ESP_LOGW(TAG, "Offline queue unavailable");
+    }
+    return ESP_OK;
+}
 
-    // Initialize camera
-    if (camera_init() != ESP_OK) {
+static esp_err_t camera_stage(void)
+{
+    esp_err_t err = camera_init();
+    if (err != ESP_OK) {
         ESP_LOGE(TAG, "Camera initialization failed!");
-        return;
+        return err;
     }
+    trace_attach_camera();
 
-    // Initialize WiFi
+    // Pre-event buffer lives in PSRAM; the bot still works without it
+    if (frame_ring_init(&prebuffer, PREBUFFER_BUDGET_BYTES, PREBUFFER_WINDOW_MS) == ESP_OK) {
+        xTaskCreate(prebuffer_task, "prebuffer_task", 3072, NULL, 4, NULL);
+    } else {
+        ESP_LOGW(TAG, "Pre-event buffer unavailable");
+    }
+    if (frame_ring_init(&burst_ring, BURST_BUDGET_BYTES, 60000) != ESP_OK) {
+        ESP_LOGW(TAG, "Burst buffer unavailable");
+    }
+    return ESP_OK;
+}
+
+static esp_err_t wifi_stage(void)
+{
     wifi_init();
 
-    // Wait for WiFi connection
     ESP_LOGI(TAG, "Waiting for WiFi connection...");
     xEventGroupWaitBits(wifi_event_group, WIFI_CONNECTED_BIT, false, true, portMAX_DELAY);
     ESP_LOGI(TAG, "WiFi connected successfully!");
+    return ESP_OK;
+}
 
-    // Sync time for TLS certificate validation
-    esp_sntp_setoperatingmode(SNTP_OPMODE_POLL);
-    esp_sntp_setservername(0, "pool.ntp.org");
-    esp_sntp_init();
-    // wait until time is set
-    for (int i = 0; i < 40; i++) {
-        time_t now; struct tm timeinfo;
-        time(&now);
-        localtime_r(&now, &timeinfo);
-        if (timeinfo.tm_year > (2019 - 1900)) break;
-        vTaskDelay(pdMS_TO_TICKS(500));
-    }
-
-    // Start Telegram polling task
-    xTaskCreate(telegram_get_updates_task, "telegram_task", 8192, NULL, 5, NULL);
-    
+// Refine the restored clock. Nothing waits on this stage: certificate dates
+// are not checked (CONFIG_MBEDTLS_HAVE_TIME_DATE is off), so TLS works with
+// whatever the clock says.
+static esp_err_t time_stage(void)
+{
+    timekeep_start_sync();
+    if (!timekeep_wait_sync(pdMS_TO_TICKS(SNTP_WAIT_MS))) {
+        ESP_LOGW(TAG, "No SNTP answer yet, still polling in the background");
+    }
+    return ESP_OK;
+}
+
+static esp_err_t stream_stage(void)
+{
+    return stream_server_start();
+}
+
+static esp_err_t audio_stage(void)
+{
+    return audio_start(on_cry, on_cry_clip);
+}
+
+static esp_err_t bot_stage(void)
+{
+    // Without the scheduler every request still runs, inline and in order
+    if (tg_sched_init() != ESP_OK) {
+        ESP_LOGW(TAG, "Request scheduler unavailable");
+    }
+    if (xTaskCreate(telegram_get_updates_task, "telegram_task", 8192, NULL, 5, NULL) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
     ESP_LOGI(TAG, "Bot is ready! Send /photo command in Telegram to get a photo.");
+    return ESP_OK;
+}
+
+static esp_err_t sd_stage(void)
+{
+    return timelapse_init();
+}
+
+// Polling needs the network; capture needs only the camera
+static const boot_stage_t boot_stages[] = {
+    [BOOT_STAGE_NVS]    = { "nvs",    nvs_stage,    0,                            3072 },
+    [BOOT_STAGE_CAMERA] = { "camera", camera_stage, 0,                            4096 },
+    [BOOT_STAGE_WIFI]   = { "wifi",   wifi_stage,   BOOT_BIT(BOOT_STAGE_NVS),     4096 },
+    [BOOT_STAGE_TIME]   = { "time",   time_stage,   BOOT_BIT(BOOT_STAGE_WIFI),    3072 },
+    [BOOT_STAGE_BOT]    = { "bot",    bot_stage,    BOOT_BIT(BOOT_STAGE_WIFI),    2048 },
+    [BOOT_STAGE_STREAM] = { "stream", stream_stage, BOOT_BIT(BOOT_STAGE_WIFI) | BOOT_BIT(BOOT_STAGE_CAMERA), 3072 },
+    [BOOT_STAGE_AUDIO]  = { "audio",  audio_stage,  0,                            3072 },
+    [BOOT_STAGE_SD]     = { "sd",     sd_stage,     BOOT_BIT(BOOT_STAGE_NVS) | BOOT_BIT(BOOT_STAGE_CAMERA), 4096 },
+};
+
+void app_main(void)
+{
+    ESP_LOGI(TAG, "ESP32-CAM Telegram Baby Monitor Starting...");
+
+    telegram_set_upload_observer(quality_ctl_record_upload);
+    telegram_set_metadata_provider(photo_metadata);
+
+    // Camera probe overlaps with Wi-Fi association; SNTP overlaps with polling
+    ESP_ERROR_CHECK(boot_start(boot_stages, sizeof(boot_stages) / sizeof(boot_stages[0])));
 }
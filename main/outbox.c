@@ -0,0 +1,636 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_partition.h"
+#include "esp_heap_caps.h"
+#include "esp_rom_crc.h"
+#include "outbox.h"
+
+static const char *TAG = "outbox";
+
+#define SEGMENT_MAGIC   0x3158424F      // "OBX1"
+#define RECORD_MAGIC    0xB0C5
+#define ERASED32        0xFFFFFFFF
+#define MAX_SEGMENTS    32
+
+// Start of every segment. magic and erase_count are written right after the
+// erase; seq and crc stay erased until the segment takes its first record.
+typedef struct {
+    uint32_t magic;
+    uint32_t erase_count;
+    uint32_t seq;
+    uint32_t crc;           // Of the fields above
+} seg_header_t;
+
+// Record header, followed by the payload padded to 4 bytes
+typedef struct {
+    uint16_t magic;
+    uint8_t type;
+    uint8_t reserved;
+    uint32_t len;
+    int64_t time_us;
+    uint16_t width;
+    uint16_t height;
+    char chat_id[OUTBOX_CHAT_ID_MAX];
+    uint32_t crc;           // Of the fields above and the payload
+    uint32_t done;          // Erased until delivered, then programmed to 0
+} record_t;
+
+_Static_assert(sizeof(record_t) % 4 == 0, "records must stay word aligned");
+
+typedef enum {
+    SEG_BLANK,              // Unknown contents, erase before use
+    SEG_FREE,               // Erased, header says how often
+    SEG_USED,
+    SEG_BUSY,               // Being erased outside the lock
+} seg_state_t;
+
+typedef struct {
+    seg_state_t state;
+    bool sealed;            // Ends in a torn record; no more appends
+    uint32_t seq;
+    uint32_t erase_count;
+    uint32_t end;           // Append offset
+    uint32_t first;         // No undelivered record before this offset
+    uint32_t pending;
+    size_t pending_bytes;
+} segment_t;
+
+// Where a record handed to a sink came from
+typedef struct {
+    int seg;
+    uint32_t seq;
+    uint32_t off;
+    uint32_t len;
+} record_ref_t;
+
+static struct {
+    const esp_partition_t *part;
+    SemaphoreHandle_t lock;
+    int count;
+    int head;               // Segment taking appends, -1 for none
+    uint32_t next_seq;
+    segment_t seg[MAX_SEGMENTS];
+    outbox_stats_t stats;
+} ob;
+
+static uint32_t record_size(uint32_t len)
+{
+    return sizeof(record_t) + ((len + 3) & ~3u);
+}
+
+static size_t seg_addr(int i)
+{
+    return (size_t)i * OUTBOX_SEGMENT_SIZE;
+}
+
+static uint32_t header_crc(const seg_header_t *h)
+{
+    return esp_rom_crc32_le(0, (const uint8_t *)h, offsetof(seg_header_t, crc));
+}
+
+static uint32_t record_crc(const record_t *r, const uint8_t *payload)
+{
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)r, offsetof(record_t, crc));
+    return esp_rom_crc32_le(crc, payload, r->len);
+}
+
+size_t outbox_max_payload(void)
+{
+    return OUTBOX_SEGMENT_SIZE - sizeof(seg_header_t) - sizeof(record_t);
+}
+
+// Read the record at off into r. 1 if it is intact, 0 at the end of the
+// segment's log, -1 if torn or corrupt. The payload CRC is checked when
+// verify is set.
+static int read_record(int i, uint32_t off, record_t *r, bool verify)
+{
+    if (off + sizeof(*r) > OUTBOX_SEGMENT_SIZE) {
+        return 0;
+    }
+    if (esp_partition_read(ob.part, seg_addr(i) + off, r, sizeof(*r)) != ESP_OK) {
+        return -1;
+    }
+    if (r->magic == 0xFFFF) {
+        return 0;
+    }
+    if (r->magic != RECORD_MAGIC || r->len > OUTBOX_SEGMENT_SIZE - off - sizeof(*r)) {
+        return -1;
+    }
+    if (!verify) {
+        return 1;
+    }
+    uint8_t chunk[256];
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t *)r, offsetof(record_t, crc));
+    for (uint32_t pos = 0; pos < r->len; pos += sizeof(chunk)) {
+        uint32_t n = r->len - pos < sizeof(chunk) ? r->len - pos : sizeof(chunk);
+        if (esp_partition_read(ob.part, seg_addr(i) + off + sizeof(*r) + pos, chunk, n) != ESP_OK) {
+            return -1;
+        }
+        crc = esp_rom_crc32_le(crc, chunk, n);
+    }
+    return crc == r->crc ? 1 : -1;
+}
+
+// Walk a segment's records after a reset
+static void scan_segment(int i)
+{
+    segment_t *s = &ob.seg[i];
+    uint32_t off = sizeof(seg_header_t);
+    s->first = 0;
+    record_t r;
+    int ok;
+    while ((ok = read_record(i, off, &r, true)) == 1) {
+        if (r.done == ERASED32) {
+            if (!s->first) {
+                s->first = off;
+            }
+            s->pending++;
+            s->pending_bytes += r.len;
+        }
+        off += record_size(r.len);
+    }
+    if (ok < 0) {
+        ESP_LOGW(TAG, "Segment %d: torn record at %u, sealed", i, (unsigned)off);
+        s->sealed = true;
+    }
+    s->end = off;
+    if (!s->first) {
+        s->first = off;
+    }
+}
+
+// Erase a segment and stamp its erase count. Called under the lock, or
+// with the segment marked busy so nothing else touches it.
+static esp_err_t erase_segment(int i, uint32_t erase_count)
+{
+    esp_err_t err = esp_partition_erase_range(ob.part, seg_addr(i), OUTBOX_SEGMENT_SIZE);
+    // The magic goes last, so a segment that has it also has its count
+    if (err == ESP_OK) {
+        err = esp_partition_write(ob.part, seg_addr(i) + offsetof(seg_header_t, erase_count),
+                                  &erase_count, sizeof(erase_count));
+    }
+    if (err == ESP_OK) {
+        static const uint32_t magic = SEGMENT_MAGIC;
+        err = esp_partition_write(ob.part, seg_addr(i), &magic, sizeof(magic));
+    }
+    return err;
+}
+
+static void reset_segment(segment_t *s, seg_state_t state, uint32_t erase_count)
+{
+    memset(s, 0, sizeof(*s));
+    s->state = state;
+    s->erase_count = erase_count;
+}
+
+// Whether a segment can be erased and reused without losing anything
+static bool reclaimable(int i)
+{
+    const segment_t *s = &ob.seg[i];
+    return s->state == SEG_BLANK || (s->state == SEG_USED && !s->pending && i != ob.head);
+}
+
+// Oldest segment in use, optionally skipping those with nothing pending
+static int oldest_used(bool pending_only)
+{
+    int best = -1;
+    for (int i = 0; i < ob.count; i++) {
+        const segment_t *s = &ob.seg[i];
+        if (s->state != SEG_USED || (pending_only && !s->pending)) {
+            continue;
+        }
+        if (best < 0 || (int32_t)(s->seq - ob.seg[best].seq) < 0) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Segment in use that follows seq, -1 if none
+static int next_used(uint32_t seq)
+{
+    int best = -1;
+    for (int i = 0; i < ob.count; i++) {
+        const segment_t *s = &ob.seg[i];
+        if (s->state == SEG_USED && (int32_t)(s->seq - seq) > 0 &&
+            (best < 0 || (int32_t)(s->seq - ob.seg[best].seq) < 0)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// Move appends to a fresh segment: the least-erased free one, else the
+// least-erased one that can be reclaimed, else the oldest one in use,
+// whose items are lost. Caller holds the lock.
+static esp_err_t open_segment(void)
+{
+    int best = -1;
+    for (int i = 0; i < ob.count; i++) {
+        if (ob.seg[i].state == SEG_FREE && (best < 0 || ob.seg[i].erase_count < ob.seg[best].erase_count)) {
+            best = i;
+        }
+    }
+    if (best < 0) {
+        for (int i = 0; i < ob.count; i++) {
+            if (reclaimable(i) && (best < 0 || ob.seg[i].erase_count < ob.seg[best].erase_count)) {
+                best = i;
+            }
+        }
+    }
+    if (best < 0) {
+        best = oldest_used(false);
+        if (best < 0 || best == ob.head) {
+            return ESP_ERR_NO_MEM;
+        }
+        ESP_LOGW(TAG, "Log full, dropping %u items", (unsigned)ob.seg[best].pending);
+        ob.stats.dropped += ob.seg[best].pending;
+        ob.stats.pending -= ob.seg[best].pending;
+        ob.stats.pending_bytes -= ob.seg[best].pending_bytes;
+    }
+
+    segment_t *s = &ob.seg[best];
+    if (s->state != SEG_FREE) {
+        // Under the lock: the append waiting for it could not go on anyway
+        uint32_t erase_count = s->erase_count + 1;
+        esp_err_t err = erase_segment(best, erase_count);
+        if (err != ESP_OK) {
+            reset_segment(s, SEG_BLANK, erase_count);
+            return err;
+        }
+        reset_segment(s, SEG_FREE, erase_count);
+    }
+
+    seg_header_t h = { SEGMENT_MAGIC, s->erase_count, ob.next_seq, 0 };
+    h.crc = header_crc(&h);
+    esp_err_t err = esp_partition_write(ob.part, seg_addr(best) + offsetof(seg_header_t, seq), &h.seq,
+                                        sizeof(h) - offsetof(seg_header_t, seq));
+    if (err != ESP_OK) {
+        reset_segment(s, SEG_BLANK, s->erase_count);
+        return err;
+    }
+    reset_segment(s, SEG_USED, s->erase_count);
+    s->seq = ob.next_seq++;
+    s->end = s->first = sizeof(seg_header_t);
+    ob.head = best;
+    return ESP_OK;
+}
+
+esp_err_t outbox_init(const char *label)
+{
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                           ESP_PARTITION_SUBTYPE_ANY, label);
+    if (!part) {
+        ESP_LOGW(TAG, "No partition '%s'", label);
+        return ESP_ERR_NOT_FOUND;
+    }
+    int count = part->size / OUTBOX_SEGMENT_SIZE;
+    if (count > MAX_SEGMENTS) {
+        count = MAX_SEGMENTS;
+    }
+    if (count < 2) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (!ob.lock) {
+        ob.lock = xSemaphoreCreateMutex();
+        if (!ob.lock) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    xSemaphoreTake(ob.lock, portMAX_DELAY);
+    SemaphoreHandle_t lock = ob.lock;
+    memset(&ob, 0, sizeof(ob));
+    ob.lock = lock;
+    ob.part = part;
+    ob.count = count;
+    ob.head = -1;
+
+    bool seen = false;
+    bool lost = false;
+    uint32_t most_worn = 0;
+    for (int i = 0; i < count; i++) {
+        segment_t *s = &ob.seg[i];
+        seg_header_t h;
+        if (esp_partition_read(part, seg_addr(i), &h, sizeof(h)) != ESP_OK || h.magic != SEGMENT_MAGIC) {
+            reset_segment(s, SEG_BLANK, 0);
+            lost = true;
+        } else if (h.seq == ERASED32 && h.crc == ERASED32) {
+            reset_segment(s, SEG_FREE, h.erase_count);
+        } else if (h.crc != header_crc(&h)) {
+            // Torn while being opened
+            reset_segment(s, SEG_BLANK, h.erase_count);
+        } else {
+            reset_segment(s, SEG_USED, h.erase_count);
+            s->seq = h.seq;
+            scan_segment(i);
+            if (!seen || (int32_t)(h.seq - ob.next_seq) >= 0) {
+                ob.next_seq = h.seq + 1;
+                ob.head = i;
+                seen = true;
+            }
+        }
+        ob.stats.pending += s->pending;
+        ob.stats.pending_bytes += s->pending_bytes;
+        if (s->erase_count > most_worn) {
+            most_worn = s->erase_count;
+        }
+    }
+    // A segment whose erase was cut short lost its count; take it for
+    // the most worn rather than let it soak up every erase from here on
+    for (int i = 0; lost && i < count; i++) {
+        if (ob.seg[i].state == SEG_BLANK && !ob.seg[i].erase_count) {
+            ob.seg[i].erase_count = most_worn;
+        }
+    }
+    if (ob.head >= 0 && ob.seg[ob.head].sealed) {
+        ob.head = -1;
+    }
+    xSemaphoreGive(ob.lock);
+
+    outbox_stats_t st;
+    outbox_get_stats(&st);
+    ESP_LOGI(TAG, "%u items (%u bytes) pending, %u of %u segments free, erase counts %u-%u",
+             (unsigned)st.pending, (unsigned)st.pending_bytes, st.free_segments, st.segments,
+             (unsigned)st.erase_min, (unsigned)st.erase_max);
+    return ESP_OK;
+}
+
+esp_err_t outbox_put(const outbox_item_t *item)
+{
+    if (!ob.part) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (item->len > outbox_max_payload()) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    record_t r;
+    memset(&r, 0xFF, sizeof(r));
+    r.magic = RECORD_MAGIC;
+    r.type = item->type;
+    r.len = item->len;
+    r.time_us = item->time_us;
+    r.width = item->width;
+    r.height = item->height;
+    memset(r.chat_id, 0, sizeof(r.chat_id));
+    snprintf(r.chat_id, sizeof(r.chat_id), "%s", item->chat_id);
+    r.crc = record_crc(&r, item->data);
+    uint32_t size = record_size(item->len);
+
+    xSemaphoreTake(ob.lock, portMAX_DELAY);
+    esp_err_t err = ESP_OK;
+    segment_t *s = ob.head >= 0 ? &ob.seg[ob.head] : NULL;
+    if (!s || s->sealed || s->end + size > OUTBOX_SEGMENT_SIZE) {
+        err = open_segment();
+        s = err == ESP_OK ? &ob.seg[ob.head] : NULL;
+    }
+    if (err == ESP_OK) {
+        // Header first: a reset before the payload lands leaves a CRC
+        // mismatch rather than a record that looks like the end of the log
+        size_t addr = seg_addr(ob.head) + s->end;
+        err = esp_partition_write(ob.part, addr, &r, sizeof(r));
+        if (err == ESP_OK) {
+            err = esp_partition_write(ob.part, addr + sizeof(r), item->data, item->len);
+        }
+        if (err == ESP_OK) {
+            s->end += size;
+            s->pending++;
+            s->pending_bytes += item->len;
+            ob.stats.pending++;
+            ob.stats.pending_bytes += item->len;
+            ob.stats.queued++;
+        } else {
+            s->sealed = true;
+        }
+    }
+    xSemaphoreGive(ob.lock);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to queue %u bytes: %s", (unsigned)item->len, esp_err_to_name(err));
+    }
+    return err;
+}
+
+// Locate the oldest undelivered record at or after (seg, off) and read its
+// header. Caller holds the lock.
+static bool next_pending(int *seg, uint32_t *off, record_t *r)
+{
+    int i = *seg;
+    uint32_t o = *off;
+    while (i >= 0) {
+        const segment_t *s = &ob.seg[i];
+        while (s->pending && o < s->end && read_record(i, o, r, false) == 1) {
+            if (r->done == ERASED32) {
+                *seg = i;
+                *off = o;
+                return true;
+            }
+            o += record_size(r->len);
+        }
+        i = next_used(s->seq);
+        o = i >= 0 ? ob.seg[i].first : 0;
+    }
+    return false;
+}
+
+// Read the next batch into items: one message, or consecutive photos for
+// one chat within the byte budget. Caller holds the lock.
+static size_t collect(outbox_item_t *items, record_ref_t *refs, size_t max_batch)
+{
+    int seg = oldest_used(true);
+    uint32_t off = seg >= 0 ? ob.seg[seg].first : 0;
+    size_t n = 0;
+    size_t bytes = 0;
+    record_t r;
+    while (n < max_batch && seg >= 0 && next_pending(&seg, &off, &r)) {
+        if (n && (r.type != OUTBOX_PHOTO || items[0].type != OUTBOX_PHOTO ||
+                  strncmp(r.chat_id, items[0].chat_id, OUTBOX_CHAT_ID_MAX) != 0 ||
+                  bytes + r.len > OUTBOX_BATCH_BYTES)) {
+            break;
+        }
+        uint8_t *data = heap_caps_malloc(r.len + 1, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (!data) {
+            data = malloc(r.len + 1);
+        }
+        if (!data || esp_partition_read(ob.part, seg_addr(seg) + off + sizeof(r), data, r.len) != ESP_OK ||
+            record_crc(&r, data) != r.crc) {
+            ESP_LOGE(TAG, "Cannot load record at %u:%u", seg, (unsigned)off);
+            free(data);
+            break;
+        }
+        data[r.len] = '\0';
+        outbox_item_t *it = &items[n];
+        it->type = r.type;
+        memcpy(it->chat_id, r.chat_id, sizeof(it->chat_id));
+        it->chat_id[sizeof(it->chat_id) - 1] = '\0';
+        it->time_us = r.time_us;
+        it->width = r.width;
+        it->height = r.height;
+        it->data = data;
+        it->len = r.len;
+        refs[n] = (record_ref_t) { seg, ob.seg[seg].seq, off, r.len };
+        n++;
+        bytes += r.len;
+        if (r.type != OUTBOX_PHOTO) {
+            break;
+        }
+        off += record_size(r.len);
+    }
+    return n;
+}
+
+// Mark a record done, unless its segment was dropped meanwhile. Returns a
+// segment that has nothing left and can be erased, or -1. Caller holds the
+// lock.
+static int mark_done(const record_ref_t *ref, bool delivered)
+{
+    segment_t *s = &ob.seg[ref->seg];
+    if (s->state != SEG_USED || s->seq != ref->seq) {
+        return -1;
+    }
+    static const uint32_t zero = 0;
+    if (esp_partition_write(ob.part, seg_addr(ref->seg) + ref->off + offsetof(record_t, done),
+                            &zero, sizeof(zero)) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to mark record at %d:%u", ref->seg, (unsigned)ref->off);
+    }
+    if (s->first == ref->off) {
+        s->first = ref->off + record_size(ref->len);
+    }
+    s->pending--;
+    s->pending_bytes -= ref->len;
+    ob.stats.pending--;
+    ob.stats.pending_bytes -= ref->len;
+    if (delivered) {
+        ob.stats.delivered++;
+    } else {
+        ob.stats.dropped++;
+    }
+    if (s->pending || ref->seg == ob.head) {
+        return -1;
+    }
+    s->state = SEG_BUSY;
+    return ref->seg;
+}
+
+// Erase a segment marked busy, outside the lock and off the enqueue path
+static void reclaim(int seg)
+{
+    uint32_t erase_count = ob.seg[seg].erase_count + 1;
+    esp_err_t err = erase_segment(seg, erase_count);
+    xSemaphoreTake(ob.lock, portMAX_DELAY);
+    reset_segment(&ob.seg[seg], err == ESP_OK ? SEG_FREE : SEG_BLANK, erase_count);
+    xSemaphoreGive(ob.lock);
+}
+
+esp_err_t outbox_flush(outbox_sink_t sink, void *ctx, size_t max_batch, size_t *delivered)
+{
+    if (!ob.part) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (max_batch > OUTBOX_BATCH_MAX) {
+        max_batch = OUTBOX_BATCH_MAX;
+    } else if (max_batch == 0) {
+        max_batch = 1;
+    }
+    outbox_item_t items[OUTBOX_BATCH_MAX];
+    record_ref_t refs[OUTBOX_BATCH_MAX];
+    size_t sent = 0;
+    esp_err_t err = ESP_OK;
+    for (;;) {
+        xSemaphoreTake(ob.lock, portMAX_DELAY);
+        size_t n = collect(items, refs, max_batch);
+        bool more = ob.stats.pending > 0;
+        xSemaphoreGive(ob.lock);
+        if (!n) {
+            err = more ? ESP_FAIL : ESP_OK;
+            break;
+        }
+
+        // Appends go on while the sink runs
+        err = sink(items, n, ctx);
+        for (size_t i = 0; i < n; i++) {
+            free((void *)items[i].data);
+        }
+        // Refused for good: retrying would hold up everything behind it
+        bool refused = err == ESP_ERR_INVALID_RESPONSE;
+        if (err != ESP_OK && !refused) {
+            break;
+        }
+        if (refused) {
+            ESP_LOGW(TAG, "%u items refused, discarded", (unsigned)n);
+        } else {
+            sent += n;
+        }
+
+        int erase[OUTBOX_BATCH_MAX];
+        size_t erases = 0;
+        xSemaphoreTake(ob.lock, portMAX_DELAY);
+        for (size_t i = 0; i < n; i++) {
+            int e = mark_done(&refs[i], !refused);
+            if (e >= 0) {
+                erase[erases++] = e;
+            }
+        }
+        xSemaphoreGive(ob.lock);
+
+        for (size_t i = 0; i < erases; i++) {
+            reclaim(erase[i]);
+        }
+    }
+
+    // Blank segments and ones left empty by a reset join the free pool too,
+    // so the least-erased choice sees every segment
+    for (;;) {
+        int seg = -1;
+        xSemaphoreTake(ob.lock, portMAX_DELAY);
+        for (int i = 0; i < ob.count && seg < 0; i++) {
+            if (reclaimable(i)) {
+                seg = i;
+                ob.seg[i].state = SEG_BUSY;
+            }
+        }
+        xSemaphoreGive(ob.lock);
+        if (seg < 0) {
+            break;
+        }
+        reclaim(seg);
+    }
+    if (delivered) {
+        *delivered = sent;
+    }
+    return err;
+}
+
+size_t outbox_pending(void)
+{
+    return ob.stats.pending;
+}
+
+void outbox_get_stats(outbox_stats_t *stats)
+{
+    if (!ob.lock) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+    xSemaphoreTake(ob.lock, portMAX_DELAY);
+    *stats = ob.stats;
+    stats->segments = ob.count;
+    stats->free_segments = 0;
+    for (int i = 0; i < ob.count; i++) {
+        uint32_t n = ob.seg[i].erase_count;
+        if (i == 0 || n < stats->erase_min) {
+            stats->erase_min = n;
+        }
+        if (i == 0 || n > stats->erase_max) {
+            stats->erase_max = n;
+        }
+        if (ob.seg[i].state == SEG_FREE || reclaimable(i)) {
+            stats->free_segments++;
+        }
+    }
+    xSemaphoreGive(ob.lock);
+}
@@ -0,0 +1,83 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// Store-and-forward queue for photos and alerts that could not be sent.
+//
+// Items are appended to a log on the "outbox" flash partition and survive
+// a reboot. The partition is split into segments; records are CRC-framed
+// and only ever appended, a delivered record is marked by clearing one
+// word of its header, and a segment is erased only once everything in it
+// is delivered. New segments are taken least-erased first. When the log is
+// full the oldest segment is dropped, so the newest items win.
+//
+// Delivery is at least once: a reset between a send and its mark sends
+// the item again.
+
+#define OUTBOX_PARTITION_LABEL  "outbox"
+
+// 32 flash sectors; a segment holds at least one full-size frame
+#define OUTBOX_SEGMENT_SIZE     (128 * 1024)
+
+#define OUTBOX_CHAT_ID_MAX      24
+
+// Largest batch handed to a sink, and the PSRAM it may take
+#define OUTBOX_BATCH_MAX        10
+#define OUTBOX_BATCH_BYTES      (512 * 1024)
+
+typedef enum {
+    OUTBOX_PHOTO = 1,       // JPEG frame
+    OUTBOX_MESSAGE = 2,     // Text, NUL included
+} outbox_type_t;
+
+typedef struct {
+    outbox_type_t type;
+    char chat_id[OUTBOX_CHAT_ID_MAX];
+    int64_t time_us;        // Wall time of the capture or alert, 0 if unknown
+    uint16_t width;         // Photos only
+    uint16_t height;
+    const uint8_t *data;
+    size_t len;
+} outbox_item_t;
+
+typedef struct {
+    uint32_t pending;       // Items waiting for delivery
+    size_t pending_bytes;
+    uint32_t queued;        // Items accepted since boot
+    uint32_t delivered;     // Items delivered since boot
+    uint32_t dropped;       // Items lost to a full log or refused since boot
+    uint16_t segments;
+    uint16_t free_segments;
+    uint32_t erase_min;     // Erase counts across segments
+    uint32_t erase_max;
+} outbox_stats_t;
+
+// Mount the log on the partition with the given label and recover its
+// state. Calling it again remounts from flash.
+esp_err_t outbox_init(const char *label);
+
+// Largest payload a single item may carry
+size_t outbox_max_payload(void);
+
+// Append an item. ESP_ERR_INVALID_SIZE if it can never fit.
+esp_err_t outbox_put(const outbox_item_t *item);
+
+// Deliver a batch: one message, or consecutive photos for the same chat
+typedef esp_err_t (*outbox_sink_t)(const outbox_item_t *items, size_t count, void *ctx);
+
+// Hand queued items to sink oldest first, in batches of up to max_batch,
+// until the log is empty or a batch fails. A batch the sink refuses with
+// ESP_ERR_INVALID_RESPONSE is discarded instead of retried. Fully
+// delivered segments are erased on the way. Returns ESP_OK once nothing is
+// pending, else the error of the failed batch; delivered (may be NULL)
+// counts items sent.
+esp_err_t outbox_flush(outbox_sink_t sink, void *ctx, size_t max_batch, size_t *delivered);
+
+size_t outbox_pending(void);
+
+void outbox_get_stats(outbox_stats_t *stats);
+
+#endif // OUTBOX_H
@@ -0,0 +1,131 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "img_converters.h"
+#include "phash.h"
+
+static const char *TAG = "phash";
+
+#define PHASH_FREQS     8
+#define PHASH_BITS      (PHASH_FREQS * PHASH_FREQS)
+
+// cos((2n + 1) u pi / 2N), filled on first use
+static float basis[PHASH_FREQS][PHASH_GRID];
+static bool basis_ready;
+
+static void basis_init(void)
+{
+    for (int u = 0; u < PHASH_FREQS; u++) {
+        for (int n = 0; n < PHASH_GRID; n++) {
+            basis[u][n] = cosf((2 * n + 1) * u * (float)M_PI / (2 * PHASH_GRID));
+        }
+    }
+    basis_ready = true;
+}
+
+// Share of block k inside [from, to), in blocks
+static float overlap(int k, float from, float to)
+{
+    float lo = k > from ? k : from;
+    float hi = k + 1 < to ? k + 1 : to;
+    return hi - lo;
+}
+
+// Cells cover a fractional number of blocks and share the blocks on their
+// edges, so a frame size that does not divide by the grid shifts nothing
+static void grid_row(const int16_t *dc, uint16_t w, uint16_t h, int y, float *line)
+{
+    float step_x = (float)w / PHASH_GRID;
+    float y0 = y * (float)h / PHASH_GRID;
+    float y1 = (y + 1) * (float)h / PHASH_GRID;
+    for (int x = 0; x < PHASH_GRID; x++) {
+        line[x] = 0;
+    }
+    for (int by = (int)y0; by < y1 && by < h; by++) {
+        float wy = overlap(by, y0, y1);
+        const int16_t *row = dc + by * w;
+        for (int x = 0; x < PHASH_GRID; x++) {
+            float x0 = x * step_x;
+            float x1 = x0 + step_x;
+            float sum = 0;
+            for (int bx = (int)x0; bx < x1 && bx < w; bx++) {
+                sum += row[bx] * overlap(bx, x0, x1);
+            }
+            line[x] += wy * sum;
+        }
+    }
+}
+
+static int cmp_float(const void *a, const void *b)
+{
+    float x = *(const float *)a;
+    float y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+esp_err_t phash_jpeg(const uint8_t *jpg, size_t len, phash_t *out)
+{
+    int16_t *dc = heap_caps_malloc(PHASH_MAX_BLOCKS * sizeof(int16_t), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!dc) {
+        return ESP_ERR_NO_MEM;
+    }
+    uint16_t w, h;
+    if (!jpg_dc_luma(jpg, len, dc, PHASH_MAX_BLOCKS, &w, &h)) {
+        free(dc);
+        ESP_LOGW(TAG, "No DC map from a %u byte JPEG", (unsigned)len);
+        return ESP_FAIL;
+    }
+    if (!basis_ready) {
+        basis_init();
+    }
+
+    int32_t total = 0;
+    for (int i = 0; i < w * h; i++) {
+        total += dc[i];
+    }
+    int luma = 128 + total / (w * h) / 8;
+
+    // Each grid row goes straight through the row transform, so the grid
+    // is never held whole. Cell sums are not divided by the cell area: the
+    // median comparison does not care about scale.
+    float rows[PHASH_GRID][PHASH_FREQS];
+    for (int y = 0; y < PHASH_GRID; y++) {
+        float line[PHASH_GRID];
+        grid_row(dc, w, h, y, line);
+        for (int u = 0; u < PHASH_FREQS; u++) {
+            float acc = 0;
+            for (int x = 0; x < PHASH_GRID; x++) {
+                acc += line[x] * basis[u][x];
+            }
+            rows[y][u] = acc;
+        }
+    }
+    free(dc);
+
+    float freq[PHASH_BITS];
+    for (int v = 0; v < PHASH_FREQS; v++) {
+        for (int u = 0; u < PHASH_FREQS; u++) {
+            float acc = 0;
+            for (int y = 0; y < PHASH_GRID; y++) {
+                acc += rows[y][u] * basis[v][y];
+            }
+            freq[v * PHASH_FREQS + u] = acc;
+        }
+    }
+
+    float sorted[PHASH_BITS];
+    memcpy(sorted, freq, sizeof(sorted));
+    qsort(sorted, PHASH_BITS, sizeof(float), cmp_float);
+    float median = (sorted[PHASH_BITS / 2 - 1] + sorted[PHASH_BITS / 2]) / 2;
+
+    uint64_t bits = 0;
+    for (int i = 0; i < PHASH_BITS; i++) {
+        bits |= (uint64_t)(freq[i] > median) << i;
+    }
+    out->bits = bits;
+    out->luma = luma < 0 ? 0 : luma > 255 ? 255 : luma;
+    return ESP_OK;
+}
@@ -0,0 +1,37 @@
+#ifndef PHASH_H
+#define PHASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// Perceptual hash of a camera JPEG, for telling a repeat of the same
+// scene from a change in it.
+//
+// The luminance DC coefficients (jpg_dc_luma()) are a 1/8 scale image
+// without any IDCT. They are averaged down to a 32x32 grid, and the
+// lowest 8x8 frequencies of its DCT give one bit each: above or below
+// their median. The bits follow the scene's layout of light and dark,
+// not JPEG quality, resolution, sensor noise or exposure. Two frames of
+// the same scene differ in a few bits; something moved, a toy that
+// appeared or a bumped camera changes many. A light switched on keeps the
+// layout, so the mean brightness comes with the bits.
+
+#define PHASH_GRID          32
+// DC map for the largest frame, UXGA: 200x150 blocks
+#define PHASH_MAX_BLOCKS    (200 * 150)
+
+typedef struct {
+    uint64_t bits;
+    uint8_t luma;           // Mean brightness, 0-255
+} phash_t;
+
+esp_err_t phash_jpeg(const uint8_t *jpg, size_t len, phash_t *out);
+
+// Bits that differ, 0-64
+static inline int phash_distance(const phash_t *a, const phash_t *b)
+{
+    return __builtin_popcountll(a->bits ^ b->bits);
+}
+
+#endif // PHASH_H
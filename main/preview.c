@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "jpeg_decoder.h"
+#include "img_converters.h"
+#include "preview.h"
+
+static const char *TAG = "preview";
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+} preview_out_t;
+
+static size_t collect(void *arg, size_t index, const void *data, size_t len)
+{
+    preview_out_t *out = (preview_out_t *)arg;
+    if (out->len + len > PREVIEW_MAX_BYTES) {
+        return 0;
+    }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+    return len;
+}
+
+esp_err_t preview_make(const camera_fb_t *fb, camera_fb_t **out)
+{
+    if (fb->format != PIXFORMAT_JPEG) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    int64_t start = esp_timer_get_time();
+
+    esp_jpeg_image_cfg_t cfg = {
+        .indata = fb->buf,
+        .indata_size = fb->len,
+        .out_format = JPEG_IMAGE_FORMAT_RGB565,
+        // Big endian, the byte order the encoder takes for RGB565
+        .flags.swap_color_bytes = 1,
+    };
+    // Largest reduction that still leaves a useful thumbnail
+    static const esp_jpeg_image_scale_t scales[] = {
+        JPEG_IMAGE_SCALE_1_8, JPEG_IMAGE_SCALE_1_4, JPEG_IMAGE_SCALE_1_2,
+    };
+    for (int i = 0; i < 3; i++) {
+        cfg.out_scale = scales[i];
+        if ((fb->width >> (3 - i)) >= PREVIEW_MIN_WIDTH) {
+            break;
+        }
+    }
+
+    esp_jpeg_image_output_t img;
+    esp_err_t err = esp_jpeg_get_image_info(&cfg, &img);
+    if (err != ESP_OK) {
+        return err;
+    }
+    uint8_t *rgb = malloc(img.output_len);
+    preview_out_t jpg = { .buf = malloc(PREVIEW_MAX_BYTES), .len = 0 };
+    if (!rgb || !jpg.buf) {
+        err = ESP_ERR_NO_MEM;
+    }
+    if (err == ESP_OK) {
+        cfg.outbuf = rgb;
+        cfg.outbuf_size = img.output_len;
+        err = esp_jpeg_decode(&cfg, &img);
+    }
+    if (err == ESP_OK && !fmt2jpg_cb(rgb, img.output_len, img.width, img.height, PIXFORMAT_RGB565,
+                                     PREVIEW_QUALITY, collect, &jpg)) {
+        err = ESP_FAIL;
+    }
+    free(rgb);
+    camera_fb_t *preview = NULL;
+    if (err == ESP_OK) {
+        preview = calloc(1, sizeof(*preview));
+        if (!preview) {
+            err = ESP_ERR_NO_MEM;
+        }
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "No preview: %s", esp_err_to_name(err));
+        free(jpg.buf);
+        return err;
+    }
+
+    // Give back the unused part of the encoder buffer
+    preview->buf = realloc(jpg.buf, jpg.len);
+    if (!preview->buf) {
+        preview->buf = jpg.buf;
+    }
+    preview->len = jpg.len;
+    preview->width = img.width;
+    preview->height = img.height;
+    preview->format = PIXFORMAT_JPEG;
+    preview->timestamp = fb->timestamp;
+    *out = preview;
+
+    ESP_LOGI(TAG, "%ux%u preview, %u bytes in %lld ms", img.width, img.height,
+             (unsigned)jpg.len, (esp_timer_get_time() - start) / 1000);
+    return ESP_OK;
+}
+
+void preview_free(camera_fb_t *preview)
+{
+    if (preview) {
+        free(preview->buf);
+        free(preview);
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include "esp_err.h"
+#include "esp_camera.h"
+
+// Thumbnail of a captured JPEG for progressive delivery.
+//
+// The frame is decoded at 1/8 (or 1/4, 1/2 for small modes) scale, which for
+// baseline JPEG needs little more than the DC coefficients, and re-encoded at
+// low quality. An XGA frame gives a 128x96 image of a few kilobytes that
+// uploads in a fraction of the time of the full photo.
+
+// Narrowest preview worth showing; the scale is picked to stay at or above it
+#define PREVIEW_MIN_WIDTH   120
+#define PREVIEW_QUALITY     40
+// Encoder output is collected here; anything bigger is not a preview
+#define PREVIEW_MAX_BYTES   (16 * 1024)
+
+// Build a preview of a JPEG frame. *out is a heap frame with the same
+// timestamp as fb; release it with preview_free().
+esp_err_t preview_make(const camera_fb_t *fb, camera_fb_t **out);
+
+void preview_free(camera_fb_t *preview);
+
+#endif // PREVIEW_H
@@ -0,0 +1,192 @@
+#include "esp_log.h"
+#include "esp_camera.h"
+#include "quality_ctl.h"
+
+static const char *TAG = "quality_ctl";
+
+// Ladder from cheapest to best; all rungs are 4:3 so framing stays the same
+static const quality_step_t ladder[] = {
+    { FRAMESIZE_QVGA, 12 },
+    { FRAMESIZE_VGA,  12 },
+    { FRAMESIZE_SVGA, 10 },
+    { FRAMESIZE_XGA,  10 },
+    { FRAMESIZE_XGA,   8 },    // Previous fixed setting
+    { FRAMESIZE_UXGA, 10 },
+};
+#define LADDER_STEPS    ((int)(sizeof(ladder) / sizeof(ladder[0])))
+#define LADDER_DEFAULT  4
+
+// Step up only when the next rung fits in this share of the target, and only
+// after this many consecutive captures agreed
+#define UP_MARGIN_PCT   70
+#define UP_VOTES        2
+
+// Priors used until uploads have been observed
+#define PRIOR_THROUGHPUT_BPS    (48 * 1024)
+#define PRIOR_SETUP_MS          800
+
+static struct {
+    int step;               // Rung chosen for the next capture
+    int applied;            // Rung the sensor is programmed for, -1 if unknown
+    int up_votes;
+    uint32_t target_ms;
+    uint32_t throughput_bps;
+    uint32_t setup_ms;
+    uint32_t samples;
+    uint32_t expected_bytes[LADDER_STEPS];
+} ctl;
+
+// Exponentially weighted moving average with alpha = 1/4
+static inline uint32_t ewma(uint32_t avg, uint32_t sample)
+{
+    return (uint32_t)((int64_t)avg + ((int64_t)sample - (int64_t)avg) / 4);
+}
+
+// Throughput follows a drop at once and recovers slowly, so one late photo
+// is enough to shrink the next, and a fast upload between slow ones cannot
+// lift the estimate above the slow link
+static inline uint32_t ewma_pessimistic(uint32_t avg, uint32_t sample)
+{
+    if (sample < avg) {
+        return sample;
+    }
+    return ewma(avg, sample);
+}
+
+// Rough JPEG size for a rung: bytes per pixel falls as quality number rises
+static uint32_t prior_bytes(const quality_step_t *q)
+{
+    uint32_t pixels = (uint32_t)resolution[q->framesize].width * resolution[q->framesize].height;
+    uint32_t milli_bpp = q->quality <= 8 ? 60 : (q->quality <= 10 ? 50 : 40);
+    return pixels / 1000 * milli_bpp;
+}
+
+static uint32_t predict_ms(int step)
+{
+    uint32_t bps = ctl.throughput_bps ? ctl.throughput_bps : 1;
+    return ctl.setup_ms + (uint32_t)((uint64_t)ctl.expected_bytes[step] * 1000 / bps);
+}
+
+void quality_ctl_init(uint32_t target_ms)
+{
+    ctl.step = LADDER_DEFAULT;
+    ctl.applied = -1;
+    ctl.up_votes = 0;
+    ctl.target_ms = target_ms;
+    ctl.throughput_bps = PRIOR_THROUGHPUT_BPS;
+    ctl.setup_ms = PRIOR_SETUP_MS;
+    ctl.samples = 0;
+    for (int i = 0; i < LADDER_STEPS; i++) {
+        ctl.expected_bytes[i] = prior_bytes(&ladder[i]);
+    }
+}
+
+void quality_ctl_set_target(uint32_t target_ms)
+{
+    ctl.target_ms = target_ms;
+    ctl.up_votes = 0;
+}
+
+void quality_ctl_record_upload(size_t bytes, int64_t open_us, int64_t write_us)
+{
+    if (write_us <= 0 || bytes == 0) {
+        return;
+    }
+    uint32_t bps = (uint32_t)((uint64_t)bytes * 1000000 / write_us);
+    uint32_t setup = (uint32_t)(open_us / 1000);
+
+    if (ctl.samples == 0) {
+        // First real measurement replaces the priors outright
+        ctl.throughput_bps = bps;
+        ctl.setup_ms = setup;
+    } else {
+        ctl.throughput_bps = ewma_pessimistic(ctl.throughput_bps, bps);
+        ctl.setup_ms = ewma(ctl.setup_ms, setup);
+    }
+    ctl.samples++;
+    ESP_LOGI(TAG, "Upload %u bytes: %u B/s (avg %u B/s), setup %u ms (avg %u ms)",
+             (unsigned)bytes, (unsigned)bps, (unsigned)ctl.throughput_bps,
+             (unsigned)setup, (unsigned)ctl.setup_ms);
+}
+
+void quality_ctl_record_frame(size_t len)
+{
+    if (ctl.applied >= 0 && len > 0) {
+        ctl.expected_bytes[ctl.applied] = ewma(ctl.expected_bytes[ctl.applied], len);
+    }
+}
+
+// Choose the rung for the next capture
+static void decide(void)
+{
+    if (ctl.samples == 0) {
+        return;
+    }
+
+    if (predict_ms(ctl.step) > ctl.target_ms) {
+        // Too slow: drop straight to the best rung that fits
+        while (ctl.step > 0 && predict_ms(ctl.step) > ctl.target_ms) {
+            ctl.step--;
+        }
+        ctl.up_votes = 0;
+        return;
+    }
+
+    if (ctl.step + 1 < LADDER_STEPS &&
+        predict_ms(ctl.step + 1) * 100 <= ctl.target_ms * UP_MARGIN_PCT) {
+        if (++ctl.up_votes >= UP_VOTES) {
+            ctl.step++;
+            ctl.up_votes = 0;
+        }
+    } else {
+        ctl.up_votes = 0;
+    }
+}
+
+esp_err_t quality_ctl_apply(sensor_t *s)
+{
+    if (!s) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    decide();
+    if (ctl.step == ctl.applied) {
+        return ESP_OK;
+    }
+
+    const quality_step_t *want = &ladder[ctl.step];
+    const quality_step_t *have = ctl.applied >= 0 ? &ladder[ctl.applied] : NULL;
+
+    if (!have || have->framesize != want->framesize) {
+        // Only rewrites the registers that differ; stale frames are dropped
+        if (esp_camera_switch_mode(want->framesize) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to set frame size %d", want->framesize);
+            return ESP_FAIL;
+        }
+        // A switch that needed bigger buffers re-created the sensor object
+        s = esp_camera_sensor_get();
+    }
+    if ((!have || have->quality != want->quality) && s->set_quality) {
+        s->set_quality(s, want->quality);
+    }
+
+    ESP_LOGI(TAG, "Rung %d: %ux%u q%u, predicted %u ms for ~%u bytes",
+             ctl.step, resolution[want->framesize].width, resolution[want->framesize].height,
+             want->quality, (unsigned)predict_ms(ctl.step), (unsigned)ctl.expected_bytes[ctl.step]);
+    ctl.applied = ctl.step;
+    return ESP_OK;
+}
+
+void quality_ctl_get_status(quality_ctl_status_t *out)
+{
+    out->step = ctl.step;
+    out->steps = LADDER_STEPS;
+    out->framesize = ladder[ctl.step].framesize;
+    out->quality = ladder[ctl.step].quality;
+    out->target_ms = ctl.target_ms;
+    out->throughput_bps = ctl.throughput_bps;
+    out->setup_ms = ctl.setup_ms;
+    out->predicted_ms = predict_ms(ctl.step);
+    out->expected_bytes = ctl.expected_bytes[ctl.step];
+    out->samples = ctl.samples;
+}
@@ -0,0 +1,55 @@
+#ifndef QUALITY_CTL_H
+#define QUALITY_CTL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "sensor.h"
+
+// Adaptive resolution/quality controller.
+//
+// Upload timings reported by the Telegram client feed an estimate of the
+// connection setup cost and the effective uplink throughput. Before each
+// capture the controller picks the largest rung of a QVGA..UXGA ladder whose
+// predicted delivery time fits the latency target. It drops as soon as the
+// current rung no longer fits but climbs only after consecutive captures
+// agree, so a single fast upload does not make it oscillate.
+
+// Default time-to-delivery target for one photo
+#define QUALITY_CTL_DEFAULT_TARGET_MS 3000
+
+typedef struct {
+    framesize_t framesize;
+    uint8_t quality;        // Sensor JPEG quality, lower is better
+} quality_step_t;
+
+typedef struct {
+    int step;                   // Current ladder index
+    int steps;                  // Number of ladder rungs
+    framesize_t framesize;
+    uint8_t quality;
+    uint32_t target_ms;
+    uint32_t throughput_bps;    // Smoothed uplink estimate, bytes per second
+    uint32_t setup_ms;          // Smoothed connection setup time
+    uint32_t predicted_ms;      // Predicted delivery time for the current rung
+    uint32_t expected_bytes;    // Expected frame size for the current rung
+    uint32_t samples;           // Uploads observed so far
+} quality_ctl_status_t;
+
+void quality_ctl_init(uint32_t target_ms);
+
+void quality_ctl_set_target(uint32_t target_ms);
+
+// Report one finished upload: payload bytes, time to open the connection and
+// time spent writing the body.
+void quality_ctl_record_upload(size_t bytes, int64_t open_us, int64_t write_us);
+
+// Report the size of a frame captured at the current rung.
+void quality_ctl_record_frame(size_t len);
+
+// Pick the rung for the next capture and program the sensor if it changed.
+esp_err_t quality_ctl_apply(sensor_t *s);
+
+void quality_ctl_get_status(quality_ctl_status_t *out);
+
+#endif // QUALITY_CTL_H
@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_http_server.h"
+#include "esp_camera.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "stream_server.h"
+
+static const char *TAG = "stream";
+
+#define PART_BOUNDARY       "frame-7f3c1a9e52d04b86"
+#define STREAM_CONTENT_TYPE "multipart/x-mixed-replace;boundary=" PART_BOUNDARY
+#define STREAM_PREAMBLE     "--" PART_BOUNDARY "\r\n"
+#define PART_SEPARATOR      "\r\n" STREAM_PREAMBLE
+#define PART_HEADER         "Content-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n"
+
+// How long the publisher waits for a frame before checking for viewers again
+#define FRAME_WAIT_MS       1000
+
+#define CLIENT_STACK        3072
+#define PUBLISHER_STACK     3072
+
+// Weight of the newest sample in the smoothed timings, in 1/8ths
+#define EWMA_NEW            2
+
+typedef struct {
+    bool used;
+    bool closing;               // Connection failed, the task is winding down
+    httpd_req_t *req;           // Async copy of the request, owned by the client task
+    TaskHandle_t task;
+    camera_fb_t *frame;         // Frame being sent, with a reference held for this client
+    int64_t handed_us;          // When it was handed over
+    uint32_t interval_ms;
+    int64_t next_due_us;
+    char fps_hdr[4];            // X-Framerate value
+    uint32_t sent;
+    uint32_t skipped;
+    uint32_t send_ms;
+    uint32_t latency_ms;
+} stream_client_t;
+
+static httpd_handle_t server;
+static TaskHandle_t publisher;
+static SemaphoreHandle_t lock;
+static stream_client_t clients[STREAM_MAX_CLIENTS];
+static uint32_t published;
+static uint32_t rejected;
+static uint32_t frame_ms;       // Smoothed camera frame interval seen by the publisher
+
+static uint32_t ewma(uint32_t avg, uint32_t sample)
+{
+    return avg ? (avg * (8 - EWMA_NEW) + sample * EWMA_NEW) / 8 : sample;
+}
+
+// Takes longer to send a frame than the camera takes to produce one, going
+// by the frames sent so far or by the one still out. A new viewer is only
+// known by the latter.
+static bool is_slow(const stream_client_t *c, int64_t now)
+{
+    if (!frame_ms) {
+        return false;
+    }
+    return c->send_ms > frame_ms || (c->frame && now - c->handed_us > (int64_t)frame_ms * 1000);
+}
+
+// Write one multipart part. The JPEG goes out of the camera buffer as is.
+static esp_err_t send_frame(httpd_req_t *req, const camera_fb_t *fb, bool first)
+{
+    char header[128];
+    int len = snprintf(header, sizeof(header), "%s" PART_HEADER,
+                       first ? "" : PART_SEPARATOR, (unsigned)fb->len);
+    esp_err_t err = httpd_resp_send_chunk(req, header, len);
+    if (err == ESP_OK) {
+        err = httpd_resp_send_chunk(req, (const char *)fb->buf, fb->len);
+    }
+    return err;
+}
+
+static void client_task(void *arg)
+{
+    stream_client_t *c = (stream_client_t *)arg;
+
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        camera_fb_t *fb = c->frame;
+        if (!fb) {
+            continue;
+        }
+
+        int64_t start = esp_timer_get_time();
+        esp_err_t err = send_frame(c->req, fb, c->sent == 0);
+        int64_t end = esp_timer_get_time();
+        int64_t captured = (int64_t)fb->timestamp.tv_sec * 1000000 + fb->timestamp.tv_usec;
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        c->frame = NULL;
+        if (err == ESP_OK) {
+            c->sent++;
+            c->send_ms = ewma(c->send_ms, (uint32_t)((end - start) / 1000));
+            c->latency_ms = ewma(c->latency_ms, (uint32_t)((end - captured) / 1000));
+        } else {
+            c->closing = true;
+        }
+        xSemaphoreGive(lock);
+        esp_camera_fb_release(fb);
+
+        if (err != ESP_OK) {
+            break;
+        }
+    }
+
+    ESP_LOGI(TAG, "Viewer %d left after %u frames", (int)(c - clients), (unsigned)c->sent);
+    httpd_req_async_handler_complete(c->req);
+    xSemaphoreTake(lock, portMAX_DELAY);
+    c->used = false;
+    xSemaphoreGive(lock);
+    vTaskDelete(NULL);
+}
+
+static bool any_client(void)
+{
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        if (clients[i].used) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Hand one reference of fb to every viewer that is idle and due
+static void fan_out(camera_fb_t *fb, int64_t now)
+{
+    // A viewer slower than the camera keeps its frame for more than one
+    // frame period. Slow viewers only start together, on the same frame, so
+    // between them they pin at most one of the driver's buffers.
+    bool slow_busy = false;
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        stream_client_t *c = &clients[i];
+        if (c->used && c->frame && is_slow(c, now)) {
+            slow_busy = true;
+        }
+    }
+
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        stream_client_t *c = &clients[i];
+        if (!c->used || c->closing || !c->task || now < c->next_due_us) {
+            continue;
+        }
+        bool slow = is_slow(c, now);
+        if (c->frame || (slow && slow_busy)) {
+            c->skipped++;
+            continue;
+        }
+        if (esp_camera_fb_retain(fb) != ESP_OK) {
+            break;
+        }
+        c->frame = fb;
+        c->handed_us = now;
+        // Keep the cadence, but don't bank credit while the camera was late
+        c->next_due_us += (int64_t)c->interval_ms * 1000;
+        if (c->next_due_us < now) {
+            c->next_due_us = now;
+        }
+        xTaskNotifyGive(c->task);
+    }
+}
+
+static void publisher_task(void *arg)
+{
+    int64_t last = 0;
+
+    while (1) {
+        if (!any_client()) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            last = 0;
+            continue;
+        }
+
+        camera_fb_t *fb = esp_camera_fb_acquire(FRAME_WAIT_MS);
+        if (!fb) {
+            continue;
+        }
+        int64_t now = esp_timer_get_time();
+        xSemaphoreTake(lock, portMAX_DELAY);
+        if (last) {
+            frame_ms = ewma(frame_ms, (uint32_t)((now - last) / 1000));
+        }
+        published++;
+        fan_out(fb, now);
+        xSemaphoreGive(lock);
+        last = now;
+
+        // Viewers hold their own references now
+        esp_camera_fb_release(fb);
+    }
+}
+
+static uint32_t requested_fps(httpd_req_t *req)
+{
+    char query[32];
+    char value[8];
+    int fps = STREAM_DEFAULT_FPS;
+    if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+        httpd_query_key_value(query, "fps", value, sizeof(value)) == ESP_OK) {
+        fps = atoi(value);
+    }
+    if (fps < 1) {
+        fps = 1;
+    }
+    if (fps > STREAM_MAX_FPS) {
+        fps = STREAM_MAX_FPS;
+    }
+    return fps;
+}
+
+static esp_err_t stream_handler(httpd_req_t *req)
+{
+    uint32_t fps = requested_fps(req);
+
+    stream_client_t *c = NULL;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        if (!clients[i].used) {
+            c = &clients[i];
+            memset(c, 0, sizeof(*c));
+            c->used = true;
+            c->interval_ms = 1000 / fps;
+            c->next_due_us = esp_timer_get_time();
+            break;
+        }
+    }
+    if (!c) {
+        rejected++;
+    }
+    xSemaphoreGive(lock);
+
+    if (!c) {
+        httpd_resp_set_status(req, "503 Service Unavailable");
+        return httpd_resp_sendstr(req, "Too many viewers\n");
+    }
+
+    snprintf(c->fps_hdr, sizeof(c->fps_hdr), "%u", (unsigned)fps);
+    httpd_resp_set_type(req, STREAM_CONTENT_TYPE);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "X-Framerate", c->fps_hdr);
+
+    // Headers go out here: the server reuses its header table for the next
+    // request. Streaming then runs in the client's own task so the server
+    // keeps accepting.
+    TaskHandle_t task = NULL;
+    esp_err_t err = httpd_resp_send_chunk(req, STREAM_PREAMBLE, strlen(STREAM_PREAMBLE));
+    if (err == ESP_OK) {
+        err = httpd_req_async_handler_begin(req, &c->req);
+    }
+    if (err == ESP_OK && xTaskCreate(client_task, "stream_client", CLIENT_STACK, c, 4, &task) != pdPASS) {
+        httpd_req_async_handler_complete(c->req);
+        err = ESP_ERR_NO_MEM;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (err == ESP_OK) {
+        c->task = task;
+    } else {
+        c->used = false;
+    }
+    xSemaphoreGive(lock);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Could not start viewer: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    ESP_LOGI(TAG, "Viewer %d connected at %u fps", (int)(c - clients), (unsigned)fps);
+    xTaskNotifyGive(publisher);
+    return ESP_OK;
+}
+
+esp_err_t stream_server_start(void)
+{
+    lock = xSemaphoreCreateMutex();
+    if (!lock) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreate(publisher_task, "stream_pub", PUBLISHER_STACK, NULL, 4, &publisher) != pdPASS) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = STREAM_PORT;
+    // One spare socket so a viewer over the limit still gets its 503
+    config.max_open_sockets = STREAM_MAX_CLIENTS + 1;
+    config.lru_purge_enable = true;
+    esp_err_t err = httpd_start(&server, &config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start HTTP server: %s", esp_err_to_name(err));
+        return err;
+    }
+
+    const httpd_uri_t stream_uri = {
+        .uri = "/stream",
+        .method = HTTP_GET,
+        .handler = stream_handler,
+    };
+    httpd_register_uri_handler(server, &stream_uri);
+    ESP_LOGI(TAG, "Live view on port %d at /stream", STREAM_PORT);
+    return ESP_OK;
+}
+
+void stream_server_get_stats(stream_server_stats_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    if (!lock) {
+        return;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    out->published = published;
+    out->rejected = rejected;
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        const stream_client_t *c = &clients[i];
+        if (!c->used) {
+            continue;
+        }
+        stream_client_stats_t *s = &out->client[out->clients++];
+        s->fps = 1000 / c->interval_ms;
+        s->sent = c->sent;
+        s->skipped = c->skipped;
+        s->send_ms = c->send_ms;
+        s->latency_ms = c->latency_ms;
+    }
+    xSemaphoreGive(lock);
+}
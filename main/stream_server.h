@@ -0,0 +1,47 @@
+#ifndef STREAM_SERVER_H
+#define STREAM_SERVER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// Local MJPEG live view.
+//
+// GET /stream answers with multipart/x-mixed-replace. One publisher task
+// takes each camera frame once and hands a reference to every viewer that
+// is ready for it; the viewers' tasks write the JPEG straight out of the
+// camera buffer, so nothing is copied per client. A viewer still sending
+// the previous frame skips the new one rather than holding up capture, and
+// viewers that take longer than a camera frame to send share a single
+// frame between them so they can pin at most one of the two buffers.
+//
+// Pacing is per viewer: /stream?fps=N asks for at most N frames per second
+// (clamped to 1..STREAM_MAX_FPS); the value granted is echoed in the
+// X-Framerate response header.
+
+#define STREAM_PORT           80
+#define STREAM_MAX_CLIENTS    4
+#define STREAM_DEFAULT_FPS    5
+#define STREAM_MAX_FPS        15
+
+typedef struct {
+    uint32_t fps;           // Negotiated pacing
+    uint32_t sent;          // Frames written
+    uint32_t skipped;       // Frames missed because the previous one was still being sent
+    uint32_t send_ms;       // Smoothed time to write one frame
+    uint32_t latency_ms;    // Smoothed capture-to-sent latency
+} stream_client_stats_t;
+
+typedef struct {
+    uint32_t clients;       // Viewers connected now
+    uint32_t published;     // Camera frames taken by the publisher
+    uint32_t rejected;      // Viewers turned away because all slots were taken
+    stream_client_stats_t client[STREAM_MAX_CLIENTS];
+} stream_server_stats_t;
+
+// Start the HTTP server. Needs the camera and a network interface.
+esp_err_t stream_server_start(void);
+
+void stream_server_get_stats(stream_server_stats_t *out);
+
+#endif // STREAM_SERVER_H
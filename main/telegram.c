@@ -0,0 +1,872 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "esp_memory_utils.h"
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+#include "esp_timer.h"
+#include "telegram.h"
+#include "trace.h"
+#include "tg_sched.h"
+
+static const char *TAG = "telegram";
+static telegram_upload_observer_t upload_observer;
+static telegram_metadata_provider_t metadata_provider;
+
+void telegram_set_upload_observer(telegram_upload_observer_t observer)
+{
+    upload_observer = observer;
+}
+
+void telegram_set_metadata_provider(telegram_metadata_provider_t provider)
+{
+    metadata_provider = provider;
+}
+
+// Every request holds a scheduler slot from init to cleanup
+static esp_http_client_handle_t client_init(const esp_http_client_config_t *config)
+{
+    tg_sched_acquire();
+    esp_http_client_handle_t client = esp_http_client_init(config);
+    if (!client) {
+        tg_sched_release();
+    }
+    return client;
+}
+
+static void client_cleanup(esp_http_client_handle_t client)
+{
+    esp_http_client_cleanup(client);
+    tg_sched_release();
+}
+
+// Error for a response other than 200: a 4xx other than 429 will be
+// refused again however often it is retried
+static esp_err_t status_error(int status_code)
+{
+    if (status_code >= 400 && status_code < 500 && status_code != 429) {
+        return ESP_ERR_INVALID_RESPONSE;
+    }
+    return ESP_FAIL;
+}
+
+// Send text message to Telegram
+esp_err_t telegram_send_message(const char *chat_id, const char *text)
+{
+    char url[512];
+    snprintf(url, sizeof(url), TELEGRAM_API_URL "/sendMessage");
+
+    esp_http_client_config_t config = {
+        .url = url,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+        .timeout_ms = 10000,
+    };
+
+    esp_http_client_handle_t client = client_init(&config);
+    esp_http_client_set_method(client, HTTP_METHOD_POST);
+    esp_http_client_set_header(client, "Content-Type", "application/x-www-form-urlencoded");
+
+    // URL encode the message and prepare POST data
+    char post_data[1024];
+    snprintf(post_data, sizeof(post_data), "chat_id=%s&text=%s", chat_id, text);
+
+    esp_err_t err = esp_http_client_open(client, strlen(post_data));
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection for message: %s", esp_err_to_name(err));
+        client_cleanup(client);
+        return err;
+    }
+
+    int written = esp_http_client_write(client, post_data, strlen(post_data));
+    if (written < 0) {
+        ESP_LOGE(TAG, "Failed to write message data");
+        esp_http_client_close(client);
+        client_cleanup(client);
+        return ESP_FAIL;
+    }
+
+    esp_http_client_fetch_headers(client);
+    int status_code = esp_http_client_get_status_code(client);
+    
+    esp_http_client_close(client);
+    client_cleanup(client);
+
+    if (status_code == 200) {
+        ESP_LOGI(TAG, "Message sent successfully");
+        return ESP_OK;
+    } else {
+        ESP_LOGE(TAG, "Failed to send message, status: %d", status_code);
+        return status_error(status_code);
+    }
+}
+
+// Pull the file_id of the largest size out of a sendPhoto response. The
+// "photo" array lists the sizes smallest first and holds no nested arrays.
+static bool parse_photo_file_id(const char *json, char *file_id, size_t size)
+{
+    static const char key[] = "\"file_id\":\"";
+    const char *p = strstr(json, "\"photo\":[");
+    if (!p) {
+        return false;
+    }
+    const char *end = strchr(p, ']');
+    const char *found = NULL;
+    size_t found_len = 0;
+    while ((p = strstr(p, key)) != NULL && (!end || p < end)) {
+        p += sizeof(key) - 1;
+        const char *q = strchr(p, '"');
+        if (!q) {
+            break;
+        }
+        found = p;
+        found_len = q - p;
+        p = q;
+    }
+    if (!found || found_len == 0 || found_len >= size) {
+        return false;
+    }
+    memcpy(file_id, found, found_len);
+    file_id[found_len] = '\0';
+    return true;
+}
+
+// Read what is left of a response body into a NUL-terminated buffer
+static int read_body(esp_http_client_handle_t client, char *buf, int size)
+{
+    int total = 0;
+    while (total < size - 1) {
+        int chunk = esp_http_client_read(client, buf + total, size - 1 - total);
+        if (chunk <= 0) {
+            break;
+        }
+        total += chunk;
+    }
+    buf[total] = '\0';
+    return total;
+}
+
+// Find the message_id of the Message a send or edit call returned
+static int parse_message_id(const char *json)
+{
+    const char *p = strstr(json, "\"message_id\":");
+    return p ? atoi(p + 13) : 0;
+}
+
+// One text field of a multipart form
+static int form_field(char *buf, size_t size, const char *name, const char *value)
+{
+    return snprintf(buf, size,
+        "--" TELEGRAM_BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"%s\"\r\n\r\n"
+        "%s\r\n",
+        name, value);
+}
+
+static esp_err_t write_direct(esp_http_client_handle_t client, const char *data, int len,
+                              const char *what, size_t *sent)
+{
+    if (esp_http_client_write(client, data, len) < 0) {
+        ESP_LOGE(TAG, "Failed to write %s", what);
+        return ESP_FAIL;
+    }
+    *sent += len;
+    trace_counter(TRACE_BYTES_WRITTEN, *sent);
+    return ESP_OK;
+}
+
+// PSRAM bodies are sent one TLS record's worth at a time from internal RAM.
+// A helper task on the other core copies the next chunk while the current
+// one is encrypted and sent, so mbedTLS never waits on external memory.
+#ifdef CONFIG_MBEDTLS_SSL_OUT_CONTENT_LEN
+#define STAGE_CHUNK CONFIG_MBEDTLS_SSL_OUT_CONTENT_LEN
+#else
+#define STAGE_CHUNK 4096
+#endif
+#define STAGE_STACK 2048
+
+typedef struct {
+    uint8_t *dst;
+    const char *src;
+    size_t len;
+    SemaphoreHandle_t done;     // The caller's own, so concurrent uploads never take each other's
+} stage_copy_t;
+
+typedef enum {
+    STAGE_OFF,
+    STAGE_STARTING,
+    STAGE_READY,
+} stage_state_t;
+
+static QueueHandle_t stage_jobs;
+static stage_state_t stage_state;
+static portMUX_TYPE stage_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void stage_task(void *arg)
+{
+    stage_copy_t job;
+    for (;;) {
+        xQueueReceive(stage_jobs, &job, portMAX_DELAY);
+        memcpy(job.dst, job.src, job.len);
+        xSemaphoreGive(job.done);
+    }
+}
+
+// Start the copy helper on the core the uploader is not running on. The
+// bot and the scheduler's workers upload at once; while one of them starts
+// the helper, the others write from PSRAM.
+static bool stage_start(void)
+{
+    taskENTER_CRITICAL(&stage_mux);
+    stage_state_t state = stage_state;
+    if (state == STAGE_OFF) {
+        stage_state = STAGE_STARTING;
+    }
+    taskEXIT_CRITICAL(&stage_mux);
+    if (state != STAGE_OFF) {
+        return state == STAGE_READY;
+    }
+
+    stage_jobs = xQueueCreate(TG_SCHED_CONNECTIONS, sizeof(stage_copy_t));
+    BaseType_t core = portNUM_PROCESSORS > 1 ? !xPortGetCoreID() : tskNO_AFFINITY;
+    bool ok = stage_jobs &&
+              xTaskCreatePinnedToCore(stage_task, "tg_stage", STAGE_STACK, NULL,
+                                      uxTaskPriorityGet(NULL), NULL, core) == pdPASS;
+    if (!ok) {
+        ESP_LOGW(TAG, "No copy helper, writing from PSRAM");
+        if (stage_jobs) {
+            vQueueDelete(stage_jobs);
+            stage_jobs = NULL;
+        }
+    }
+    taskENTER_CRITICAL(&stage_mux);
+    stage_state = ok ? STAGE_READY : STAGE_OFF;
+    taskEXIT_CRITICAL(&stage_mux);
+    return ok;
+}
+
+static esp_err_t write_staged(esp_http_client_handle_t client, const char *data, int len,
+                              const char *what, size_t *sent)
+{
+    uint8_t *stage = heap_caps_malloc(2 * STAGE_CHUNK, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!stage || !stage_start()) {
+        free(stage);
+        return write_direct(client, data, len, what, sent);
+    }
+    StaticSemaphore_t done_buf;
+    SemaphoreHandle_t done = xSemaphoreCreateBinaryStatic(&done_buf);
+
+    // Nothing to overlap the first copy with
+    memcpy(stage, data, len < STAGE_CHUNK ? len : STAGE_CHUNK);
+    int64_t waited = 0;
+    esp_err_t err = ESP_OK;
+    for (int off = 0, i = 0; off < len && err == ESP_OK; i++) {
+        // Higher-priority requests get the uplink between records. No copy
+        // is outstanding here, so a long yield leaves nothing half done.
+        tg_sched_checkpoint();
+        int n = len - off < STAGE_CHUNK ? len - off : STAGE_CHUNK;
+        int next = off + n;
+        if (next < len) {
+            stage_copy_t job = {
+                .dst = stage + ((i + 1) & 1) * STAGE_CHUNK,
+                .src = data + next,
+                .len = len - next < STAGE_CHUNK ? len - next : STAGE_CHUNK,
+                .done = done,
+            };
+            xQueueSend(stage_jobs, &job, portMAX_DELAY);
+        }
+        err = write_direct(client, (const char *)stage + (i & 1) * STAGE_CHUNK, n, what, sent);
+        // The buffer being filled is the next one to send and must not be
+        // freed under the helper either way
+        if (next < len) {
+            int64_t wait_start = esp_timer_get_time();
+            xSemaphoreTake(done, portMAX_DELAY);
+            waited += esp_timer_get_time() - wait_start;
+        }
+        off = next;
+    }
+    vSemaphoreDelete(done);
+    free(stage);
+    ESP_LOGD(TAG, "Staged %d bytes of %s, %lld us waiting for copies", len, what, waited);
+    return err;
+}
+
+// Write one chunk of a request body, logging what failed and adding it to
+// the running total in *sent
+static esp_err_t write_all(esp_http_client_handle_t client, const char *data, int len,
+                           const char *what, size_t *sent)
+{
+    if (len > STAGE_CHUNK && esp_ptr_external_ram(data)) {
+        return write_staged(client, data, len, what, sent);
+    }
+    return write_direct(client, data, len, what, sent);
+}
+
+// Body pulled from a reader one record at a time, so it never has to be in
+// RAM as a whole
+static esp_err_t write_reader(esp_http_client_handle_t client, size_t len,
+                              telegram_body_reader_t read, void *ctx, const char *what, size_t *sent)
+{
+    uint8_t *buf = heap_caps_malloc(STAGE_CHUNK, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (!buf) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = ESP_OK;
+    for (size_t off = 0; off < len && err == ESP_OK;) {
+        size_t want = len - off < STAGE_CHUNK ? len - off : STAGE_CHUNK;
+        int n = read(ctx, buf, want);
+        if (n <= 0) {
+            ESP_LOGE(TAG, "Failed to read %s at %u of %u bytes", what, (unsigned)off, (unsigned)len);
+            err = ESP_FAIL;
+            break;
+        }
+        tg_sched_checkpoint();
+        err = write_direct(client, (const char *)buf, n, what, sent);
+        off += n;
+    }
+    free(buf);
+    return err;
+}
+
+// Bytes in a list of body segments
+static size_t iov_len(const telegram_iov_t *iov, size_t count)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+        len += iov[i].len;
+    }
+    return len;
+}
+
+// Write a list of body segments in order, straight from where they live
+static esp_err_t write_iov(esp_http_client_handle_t client, const telegram_iov_t *iov, size_t count,
+                           size_t *sent)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (iov[i].len && write_all(client, iov[i].base, iov[i].len, "request body", sent) != ESP_OK) {
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+// POST a multipart form made of the text fields already formatted in fields
+// and fb as the "photo" part. On success the file_id of the stored photo and
+// the message_id are read back for the callers that want them. Previews
+// stay out of the upload observer, their size says nothing about the link,
+// and get no metadata.
+static esp_err_t post_photo(const char *method, const char *fields, const camera_fb_t *fb,
+                            bool observe, char *file_id, size_t file_id_size, int *message_id)
+{
+    char url[512];
+    snprintf(url, sizeof(url), TELEGRAM_API_URL "/%s", method);
+
+    esp_http_client_config_t config = {
+        .url = url,
+        .event_handler = NULL,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+        .timeout_ms = 60000,  // 60 seconds for XGA images (~30-50KB)
+    };
+
+    esp_http_client_handle_t client = client_init(&config);
+
+    // Add form data headers
+    esp_http_client_set_header(client, "Content-Type", "multipart/form-data; boundary=" TELEGRAM_BOUNDARY);
+
+    // Prepare form data
+    char form_start[768];
+    snprintf(form_start, sizeof(form_start),
+        "%s"
+        "--" TELEGRAM_BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"photo\"; filename=\"photo.jpg\"\r\n"
+        "Content-Type: image/jpeg\r\n\r\n",
+        fields);
+
+    static const char form_end[] = "\r\n--" TELEGRAM_BOUNDARY "--\r\n";
+
+    // The metadata segment goes between SOI and the rest of the frame
+    uint8_t metadata[TELEGRAM_METADATA_MAX];
+    size_t metadata_len = 0;
+    bool soi = fb->len >= 2 && fb->buf[0] == 0xFF && fb->buf[1] == 0xD8;
+    if (observe && metadata_provider && soi) {
+        metadata_len = metadata_provider(fb, metadata, sizeof(metadata));
+    }
+    size_t head = metadata_len ? 2 : fb->len;
+    const telegram_iov_t body[] = {
+        { form_start, strlen(form_start) },
+        { fb->buf, head },
+        { metadata, metadata_len },
+        { fb->buf + head, fb->len - head },
+        { form_end, sizeof(form_end) - 1 },
+    };
+    size_t count = sizeof(body) / sizeof(body[0]);
+    int total_len = iov_len(body, count);
+
+    ESP_LOGI(TAG, "%s: %d bytes (form_start=%u, image=%u, metadata=%u, form_end=%u)",
+             method, total_len, (unsigned)body[0].len, (unsigned)fb->len,
+             (unsigned)metadata_len, (unsigned)body[4].len);
+
+    // Open connection with known content length and stream the body
+    trace_begin(TRACE_UPLOAD, total_len);
+    trace_begin(TRACE_TLS_OPEN, 0);
+    int64_t open_start = esp_timer_get_time();
+    esp_err_t err = esp_http_client_open(client, total_len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        // Retry once after a short delay
+        vTaskDelay(pdMS_TO_TICKS(500));
+        err = esp_http_client_open(client, total_len);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Retry open failed: %s", esp_err_to_name(err));
+            trace_end(TRACE_TLS_OPEN, err);
+            trace_end(TRACE_UPLOAD, 0);
+            client_cleanup(client);
+            return err;
+        }
+    }
+    trace_end(TRACE_TLS_OPEN, 0);
+    
+    int64_t write_start = esp_timer_get_time();
+    ESP_LOGI(TAG, "HTTP connection opened, writing data...");
+
+    size_t sent = 0;
+    if (write_iov(client, body, count, &sent) != ESP_OK) {
+        trace_end(TRACE_UPLOAD, 0);
+        esp_http_client_close(client);
+        client_cleanup(client);
+        return ESP_FAIL;
+    }
+    int64_t write_end = esp_timer_get_time();
+    
+    ESP_LOGI(TAG, "All data written, fetching response headers...");
+
+    // Read response
+    int content_len = esp_http_client_fetch_headers(client);
+    int status_code = esp_http_client_get_status_code(client);
+    trace_instant(TRACE_RESPONSE, status_code);
+    trace_end(TRACE_UPLOAD, status_code);
+    ESP_LOGI(TAG, "HTTP Status = %d, content_length = %d", status_code, content_len);
+
+    // The stored photo's file_id lets later recipients skip the upload
+    if (file_id && file_id_size) {
+        file_id[0] = '\0';
+    }
+    if (message_id) {
+        *message_id = 0;
+    }
+    if ((file_id && file_id_size) || message_id) {
+        char *body = status_code == 200 ? malloc(TELEGRAM_RESPONSE_MAX) : NULL;
+        if (body) {
+            read_body(client, body, TELEGRAM_RESPONSE_MAX);
+            if (file_id && file_id_size && !parse_photo_file_id(body, file_id, file_id_size)) {
+                ESP_LOGW(TAG, "No file_id in %s response", method);
+            }
+            if (message_id) {
+                *message_id = parse_message_id(body);
+            }
+            free(body);
+        }
+    }
+
+    esp_http_client_close(client);
+    client_cleanup(client);
+
+    if (status_code == 200) {
+        ESP_LOGI(TAG, "%s done in %lld ms", method, (write_end - open_start) / 1000);
+        if (observe && upload_observer) {
+            upload_observer(total_len, write_start - open_start, write_end - write_start);
+        }
+        return ESP_OK;
+    } else {
+        ESP_LOGE(TAG, "%s failed, status code: %d", method, status_code);
+        return status_error(status_code);
+    }
+}
+
+esp_err_t telegram_send_photo(const char *chat_id, const camera_fb_t *fb)
+{
+    return telegram_upload_photo(chat_id, fb, NULL, 0);
+}
+
+esp_err_t telegram_upload_photo(const char *chat_id, const camera_fb_t *fb,
+                                char *file_id, size_t file_id_size)
+{
+    char fields[160];
+    form_field(fields, sizeof(fields), "chat_id", chat_id);
+    return post_photo("sendPhoto", fields, fb, true, file_id, file_id_size, NULL);
+}
+
+esp_err_t telegram_send_photo_message(const char *chat_id, const camera_fb_t *fb, int *message_id)
+{
+    char fields[160];
+    form_field(fields, sizeof(fields), "chat_id", chat_id);
+    esp_err_t err = post_photo("sendPhoto", fields, fb, false, NULL, 0, message_id);
+    if (err == ESP_OK && !*message_id) {
+        ESP_LOGW(TAG, "No message_id in sendPhoto response");
+    }
+    return err;
+}
+
+esp_err_t telegram_replace_photo(const char *chat_id, int message_id, const camera_fb_t *fb,
+                                 char *file_id, size_t file_id_size)
+{
+    char id[12];
+    char fields[512];
+    snprintf(id, sizeof(id), "%d", message_id);
+    int len = form_field(fields, sizeof(fields), "chat_id", chat_id);
+    len += form_field(fields + len, sizeof(fields) - len, "message_id", id);
+    form_field(fields + len, sizeof(fields) - len, "media",
+               "{\"type\":\"photo\",\"media\":\"attach://photo\"}");
+    return post_photo("editMessageMedia", fields, fb, true, file_id, file_id_size, NULL);
+}
+
+// POST a small application/x-www-form-urlencoded request
+static esp_err_t post_urlencoded(const char *method, const char *post_data, int len)
+{
+    char url[512];
+    snprintf(url, sizeof(url), TELEGRAM_API_URL "/%s", method);
+
+    esp_http_client_config_t config = {
+        .url = url,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+        .timeout_ms = 10000,
+    };
+
+    esp_http_client_handle_t client = client_init(&config);
+    esp_http_client_set_method(client, HTTP_METHOD_POST);
+    esp_http_client_set_header(client, "Content-Type", "application/x-www-form-urlencoded");
+
+    trace_begin(TRACE_UPLOAD, len);
+    esp_err_t err = esp_http_client_open(client, len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        trace_end(TRACE_UPLOAD, 0);
+        client_cleanup(client);
+        return err;
+    }
+    if (esp_http_client_write(client, post_data, len) < 0) {
+        ESP_LOGE(TAG, "Failed to write %s request", method);
+        err = ESP_FAIL;
+    }
+    int status_code = 0;
+    if (err == ESP_OK) {
+        esp_http_client_fetch_headers(client);
+        status_code = esp_http_client_get_status_code(client);
+        trace_instant(TRACE_RESPONSE, status_code);
+    }
+    trace_end(TRACE_UPLOAD, status_code);
+
+    esp_http_client_close(client);
+    client_cleanup(client);
+
+    if (status_code == 200) {
+        return ESP_OK;
+    }
+    ESP_LOGE(TAG, "%s failed, status: %d", method, status_code);
+    return status_error(status_code);
+}
+
+esp_err_t telegram_send_photo_id(const char *chat_id, const char *file_id)
+{
+    // file_ids are URL-safe base64, so they go into the form as they are
+    char post_data[64 + TELEGRAM_FILE_ID_MAX];
+    int len = snprintf(post_data, sizeof(post_data), "chat_id=%s&photo=%s", chat_id, file_id);
+    if (len >= (int)sizeof(post_data)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    esp_err_t err = post_urlencoded("sendPhoto", post_data, len);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Photo forwarded by file_id to chat %s", chat_id);
+    }
+    return err;
+}
+
+esp_err_t telegram_replace_photo_id(const char *chat_id, int message_id, const char *file_id)
+{
+    // media={"type":"photo","media":"<file_id>"}, percent-encoded
+    char post_data[128 + TELEGRAM_FILE_ID_MAX];
+    int len = snprintf(post_data, sizeof(post_data),
+        "chat_id=%s&message_id=%d"
+        "&media=%%7B%%22type%%22%%3A%%22photo%%22%%2C%%22media%%22%%3A%%22%s%%22%%7D",
+        chat_id, message_id, file_id);
+    if (len >= (int)sizeof(post_data)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    esp_err_t err = post_urlencoded("editMessageMedia", post_data, len);
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Preview in chat %s replaced by file_id", chat_id);
+    }
+    return err;
+}
+
+// Get the full photo to one chat, replacing its preview message if it has
+// one. A stored copy costs a few hundred bytes instead of an upload.
+static esp_err_t deliver_photo(const char *chat_id, int message_id, const camera_fb_t *fb,
+                               char *file_id, size_t file_id_size)
+{
+    esp_err_t err = ESP_FAIL;
+    if (file_id[0] && message_id) {
+        err = telegram_replace_photo_id(chat_id, message_id, file_id);
+    }
+    // A preview that can't be edited (deleted, too old) still takes the
+    // stored copy as a follow-up; only a file_id Telegram lost costs an upload
+    if (err != ESP_OK && file_id[0]) {
+        err = telegram_send_photo_id(chat_id, file_id);
+    }
+    if (err != ESP_OK && message_id) {
+        err = telegram_replace_photo(chat_id, message_id, fb, file_id, file_id_size);
+    }
+    // Nothing stored, and no preview it could replace: upload a new message
+    if (err != ESP_OK) {
+        err = telegram_upload_photo(chat_id, fb, file_id, file_id_size);
+    }
+    return err;
+}
+
+size_t telegram_send_photo_fanout(const char *const *chat_ids, size_t count,
+                                  const camera_fb_t *fb, const camera_fb_t *preview,
+                                  char *file_id, size_t file_id_size, esp_err_t *results)
+{
+    char own_id[TELEGRAM_FILE_ID_MAX];
+    size_t delivered = 0;
+    if (!file_id || !file_id_size) {
+        file_id = own_id;
+        file_id_size = sizeof(own_id);
+        file_id[0] = '\0';
+    }
+
+    // Every chat sees the preview before any of them waits for the upload
+    int *message_ids = preview ? calloc(count, sizeof(int)) : NULL;
+    if (message_ids) {
+        trace_begin(TRACE_PREVIEW, preview->len);
+        for (size_t i = 0; i < count; i++) {
+            telegram_send_photo_message(chat_ids[i], preview, &message_ids[i]);
+        }
+        trace_end(TRACE_PREVIEW, preview->len);
+    }
+
+    // The first successful upload yields the file_id the other chats reuse
+    for (size_t i = 0; i < count; i++) {
+        esp_err_t err = deliver_photo(chat_ids[i], message_ids ? message_ids[i] : 0,
+                                      fb, file_id, file_id_size);
+        if (err == ESP_OK) {
+            delivered++;
+        }
+        if (results) {
+            results[i] = err;
+        }
+    }
+    free(message_ids);
+    return delivered;
+}
+
+// Multipart header that precedes photo number idx in a media group body
+static int media_part_header(char *buf, size_t size, size_t idx)
+{
+    return snprintf(buf, size,
+        "\r\n--" TELEGRAM_BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"p%u\"; filename=\"p%u.jpg\"\r\n"
+        "Content-Type: image/jpeg\r\n\r\n",
+        (unsigned)idx, (unsigned)idx);
+}
+
+esp_err_t telegram_send_media_group(const char *chat_id, const camera_fb_t *const *frames, size_t count)
+{
+    if (count == 0 || count > TELEGRAM_MEDIA_GROUP_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // Telegram rejects albums with a single item
+    if (count == 1) {
+        return telegram_send_photo(chat_id, frames[0]);
+    }
+
+    // Leading fields: chat_id and the media JSON referencing each part by name
+    char form_start[768];
+    int form_start_len = snprintf(form_start, sizeof(form_start),
+        "--" TELEGRAM_BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"chat_id\"\r\n\r\n"
+        "%s\r\n"
+        "--" TELEGRAM_BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"media\"\r\n\r\n"
+        "[", chat_id);
+    for (size_t i = 0; i < count; i++) {
+        form_start_len += snprintf(form_start + form_start_len, sizeof(form_start) - form_start_len,
+            "%s{\"type\":\"photo\",\"media\":\"attach://p%u\"}",
+            i ? "," : "", (unsigned)i);
+    }
+    form_start_len += snprintf(form_start + form_start_len, sizeof(form_start) - form_start_len, "]");
+    if (form_start_len >= (int)sizeof(form_start)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    static const char form_end[] = "\r\n--" TELEGRAM_BOUNDARY "--\r\n";
+    int form_end_len = sizeof(form_end) - 1;
+
+    // Content-Length is known before anything is sent: the part headers are
+    // fixed-size text and the frame lengths come from the buffers themselves
+    char part[160];
+    size_t total_len = form_start_len + form_end_len;
+    size_t image_bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        total_len += media_part_header(part, sizeof(part), i) + frames[i]->len;
+        image_bytes += frames[i]->len;
+    }
+
+    char url[512];
+    snprintf(url, sizeof(url), TELEGRAM_API_URL "/sendMediaGroup");
+
+    esp_http_client_config_t config = {
+        .url = url,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+        .timeout_ms = 60000,
+    };
+
+    esp_http_client_handle_t client = client_init(&config);
+    esp_http_client_set_method(client, HTTP_METHOD_POST);
+    esp_http_client_set_header(client, "Content-Type", "multipart/form-data; boundary=" TELEGRAM_BOUNDARY);
+
+    ESP_LOGI(TAG, "Sending media group: %u photos, %u bytes (images=%u)",
+             (unsigned)count, (unsigned)total_len, (unsigned)image_bytes);
+
+    trace_begin(TRACE_UPLOAD, total_len);
+    trace_begin(TRACE_TLS_OPEN, 0);
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = esp_http_client_open(client, total_len);
+    trace_end(TRACE_TLS_OPEN, err);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        trace_end(TRACE_UPLOAD, 0);
+        client_cleanup(client);
+        return err;
+    }
+    int64_t write_start = esp_timer_get_time();
+
+    // Stream the body straight from the frame buffers
+    size_t sent = 0;
+    err = write_all(client, form_start, form_start_len, "media group header", &sent);
+    for (size_t i = 0; err == ESP_OK && i < count; i++) {
+        int part_len = media_part_header(part, sizeof(part), i);
+        err = write_all(client, part, part_len, "part header", &sent);
+        if (err == ESP_OK) {
+            err = write_all(client, (const char *)frames[i]->buf, frames[i]->len, "image body", &sent);
+        }
+    }
+    if (err == ESP_OK) {
+        err = write_all(client, form_end, form_end_len, "form footer", &sent);
+    }
+    if (err != ESP_OK) {
+        trace_end(TRACE_UPLOAD, 0);
+        esp_http_client_close(client);
+        client_cleanup(client);
+        return err;
+    }
+    int64_t write_end = esp_timer_get_time();
+
+    esp_http_client_fetch_headers(client);
+    int status_code = esp_http_client_get_status_code(client);
+    trace_instant(TRACE_RESPONSE, status_code);
+    trace_end(TRACE_UPLOAD, status_code);
+
+    esp_http_client_close(client);
+    client_cleanup(client);
+
+    if (status_code == 200) {
+        ESP_LOGI(TAG, "Media group of %u photos sent in %lld ms", (unsigned)count,
+                 (esp_timer_get_time() - start) / 1000);
+        if (upload_observer) {
+            upload_observer(total_len, write_start - start, write_end - write_start);
+        }
+        return ESP_OK;
+    } else {
+        ESP_LOGE(TAG, "Failed to send media group, status code: %d", status_code);
+        return status_error(status_code);
+    }
+}
+
+// Body from data, or from read when data is NULL
+static esp_err_t post_document(const char *chat_id, const char *filename, const void *data,
+                               size_t len, telegram_body_reader_t read, void *ctx)
+{
+    char form_start[384];
+    int form_start_len = snprintf(form_start, sizeof(form_start),
+        "--" TELEGRAM_BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"chat_id\"\r\n\r\n"
+        "%s\r\n"
+        "--" TELEGRAM_BOUNDARY "\r\n"
+        "Content-Disposition: form-data; name=\"document\"; filename=\"%s\"\r\n"
+        "Content-Type: application/octet-stream\r\n\r\n",
+        chat_id, filename);
+    if (form_start_len >= (int)sizeof(form_start)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    static const char form_end[] = "\r\n--" TELEGRAM_BOUNDARY "--\r\n";
+    int form_end_len = sizeof(form_end) - 1;
+    size_t total_len = form_start_len + len + form_end_len;
+
+    char url[512];
+    snprintf(url, sizeof(url), TELEGRAM_API_URL "/sendDocument");
+
+    esp_http_client_config_t config = {
+        .url = url,
+        .crt_bundle_attach = esp_crt_bundle_attach,
+        .timeout_ms = 30000,
+    };
+
+    esp_http_client_handle_t client = client_init(&config);
+    esp_http_client_set_method(client, HTTP_METHOD_POST);
+    esp_http_client_set_header(client, "Content-Type", "multipart/form-data; boundary=" TELEGRAM_BOUNDARY);
+
+    esp_err_t err = esp_http_client_open(client, total_len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open HTTP connection: %s", esp_err_to_name(err));
+        client_cleanup(client);
+        return err;
+    }
+
+    size_t sent = 0;
+    err = write_all(client, form_start, form_start_len, "document header", &sent);
+    if (err == ESP_OK) {
+        err = data ? write_all(client, data, len, "document body", &sent) :
+                     write_reader(client, len, read, ctx, "document body", &sent);
+    }
+    if (err == ESP_OK) {
+        err = write_all(client, form_end, form_end_len, "form footer", &sent);
+    }
+    if (err != ESP_OK) {
+        esp_http_client_close(client);
+        client_cleanup(client);
+        return err;
+    }
+
+    esp_http_client_fetch_headers(client);
+    int status_code = esp_http_client_get_status_code(client);
+
+    esp_http_client_close(client);
+    client_cleanup(client);
+
+    if (status_code == 200) {
+        ESP_LOGI(TAG, "Document %s (%u bytes) sent", filename, (unsigned)len);
+        return ESP_OK;
+    } else {
+        ESP_LOGE(TAG, "Failed to send document, status code: %d", status_code);
+        return status_error(status_code);
+    }
+}
+
+esp_err_t telegram_send_document(const char *chat_id, const char *filename,
+                                 const void *data, size_t len)
+{
+    return post_document(chat_id, filename, data, len, NULL, NULL);
+}
+
+esp_err_t telegram_send_document_stream(const char *chat_id, const char *filename, size_t len,
+                                        telegram_body_reader_t read, void *ctx)
+{
+    return post_document(chat_id, filename, NULL, len, read, ctx);
+}
@@ -0,0 +1,104 @@
+#ifndef TELEGRAM_H
+#define TELEGRAM_H
+
+#include <stddef.h>
+#include "esp_err.h"
+#include "esp_camera.h"
+#include "secrets.h"
+
+// Telegram Configuration (from secrets.h)
+#define TELEGRAM_API_URL "https://api.telegram.org/bot" TELEGRAM_BOT_TOKEN
+
+// Multipart boundary shared by every upload
+#define TELEGRAM_BOUNDARY "----WebKitFormBoundary1234567890"
+
+// sendMediaGroup accepts between 2 and 10 items
+#define TELEGRAM_MEDIA_GROUP_MAX 10
+
+// Called after every successful full-size photo upload with the payload size, the time
+// taken to open the connection and the time spent writing the body
+typedef void (*telegram_upload_observer_t)(size_t bytes, int64_t open_us, int64_t write_us);
+
+void telegram_set_upload_observer(telegram_upload_observer_t observer);
+
+// Largest segment a metadata provider may insert
+#define TELEGRAM_METADATA_MAX 384
+
+// Writes a JPEG segment (an EXIF APP1) for fb into buf and returns its
+// length, 0 for none. It is sent right after the SOI of full-size photo
+// uploads; the frame itself is never copied or modified.
+typedef size_t (*telegram_metadata_provider_t)(const camera_fb_t *fb, uint8_t *buf, size_t size);
+
+void telegram_set_metadata_provider(telegram_metadata_provider_t provider);
+
+// One piece of a request body, sent as it is
+typedef struct {
+    const void *base;
+    size_t len;
+} telegram_iov_t;
+
+// Requests return ESP_ERR_INVALID_RESPONSE when Telegram refused them for
+// good (a 4xx other than 429); any other error may pass on a retry.
+
+// Send text message to Telegram
+esp_err_t telegram_send_message(const char *chat_id, const char *text);
+
+// Longest file_id kept from a sendPhoto response, terminator included
+#define TELEGRAM_FILE_ID_MAX 160
+
+// Bytes of a sendPhoto response searched for the file_id
+#define TELEGRAM_RESPONSE_MAX 4096
+
+// Upload a single JPEG frame with sendPhoto
+esp_err_t telegram_send_photo(const char *chat_id, const camera_fb_t *fb);
+
+// telegram_send_photo() that also returns the file_id Telegram assigned to
+// the stored photo. file_id is an empty string if the response had none.
+esp_err_t telegram_upload_photo(const char *chat_id, const camera_fb_t *fb,
+                                char *file_id, size_t file_id_size);
+
+// Send a photo Telegram already stores, by file_id, without uploading it
+esp_err_t telegram_send_photo_id(const char *chat_id, const char *file_id);
+
+// Send a photo and return the id of the message carrying it (0 if the
+// response had none), so the image can be swapped out later
+esp_err_t telegram_send_photo_message(const char *chat_id, const camera_fb_t *fb, int *message_id);
+
+// Replace the photo of an earlier message with fb (editMessageMedia).
+// file_id as for telegram_upload_photo().
+esp_err_t telegram_replace_photo(const char *chat_id, int message_id, const camera_fb_t *fb,
+                                 char *file_id, size_t file_id_size);
+
+// Replace the photo of an earlier message with one Telegram already stores
+esp_err_t telegram_replace_photo_id(const char *chat_id, int message_id, const char *file_id);
+
+// Deliver one frame to several chats: the first recipient gets the upload,
+// the others a file_id reference. With a preview, every chat first gets the
+// preview and the full frame then replaces it in the same message; where
+// that edit fails the frame follows as a new message. A file_id passed in
+// is sent instead of fb, which is then only uploaded where Telegram no
+// longer has that photo; on return file_id holds the one the chats got, or
+// an empty string. file_id may be NULL. Per-chat results go to results
+// unless it is NULL. Returns the number of chats served.
+size_t telegram_send_photo_fanout(const char *const *chat_ids, size_t count,
+                                  const camera_fb_t *fb, const camera_fb_t *preview,
+                                  char *file_id, size_t file_id_size, esp_err_t *results);
+
+// Upload up to TELEGRAM_MEDIA_GROUP_MAX frames as one album in a single
+// sendMediaGroup request. The body is streamed from the frame buffers.
+esp_err_t telegram_send_media_group(const char *chat_id, const camera_fb_t *const *frames, size_t count);
+
+// Upload a file with sendDocument
+esp_err_t telegram_send_document(const char *chat_id, const char *filename,
+                                 const void *data, size_t len);
+
+// Fills buf with the next bytes of a body, up to size. Returns how many,
+// 0 or less if there are none to give.
+typedef int (*telegram_body_reader_t)(void *ctx, uint8_t *buf, size_t size);
+
+// telegram_send_document() of a len-byte body pulled from read as it is
+// sent, for files too big to hold in memory
+esp_err_t telegram_send_document_stream(const char *chat_id, const char *filename, size_t len,
+                                        telegram_body_reader_t read, void *ctx);
+
+#endif // TELEGRAM_H
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "telegram.h"
+#include "tg_sched.h"
+
+static const char *TAG = "tg_sched";
+
+// Jobs run whole HTTPS uploads (TLS handshake, post_photo's form buffers,
+// the EXIF provider), the same path as telegram_task, so the same stack
+#define WORKER_STACK 8192
+// Tasks blocked in acquire, checkpoint or waiting for a job at once
+#define MAX_WAITERS 8
+#define CHAT_ID_MAX 32
+
+static const uint8_t class_limit[TG_CLASS_COUNT] = {
+    TG_SCHED_LIMIT_INTERACTIVE, TG_SCHED_LIMIT_STATUS, TG_SCHED_LIMIT_BULK,
+};
+
+tg_class_t tg_policy_next(const tg_policy_t *p)
+{
+    int running = 0;
+    for (int c = 0; c < TG_CLASS_COUNT; c++) {
+        running += p->running[c];
+    }
+    if (running >= TG_SCHED_CONNECTIONS) {
+        return TG_CLASS_COUNT;
+    }
+    for (int c = 0; c < TG_CLASS_COUNT; c++) {
+        if (p->waiting[c] && p->running[c] < class_limit[c]) {
+            return c;
+        }
+    }
+    return TG_CLASS_COUNT;
+}
+
+bool tg_policy_should_yield(const tg_policy_t *p, tg_class_t cls)
+{
+    // Status messages are a few hundred bytes and, with a clip going out,
+    // arrive often enough that yielding to them would stall it for good
+    return cls == TG_CLASS_BULK &&
+           (p->running[TG_CLASS_INTERACTIVE] || p->waiting[TG_CLASS_INTERACTIVE]);
+}
+
+typedef struct {
+    bool used;
+    tg_class_t cls;
+    uint32_t seq;
+    tg_job_fn_t fn;         // NULL for a status message
+    void *arg;
+    tg_job_done_t done;
+    char chat_id[CHAT_ID_MAX];
+    char text[TG_SCHED_STATUS_MAX];
+} job_t;
+
+static SemaphoreHandle_t lock;
+static tg_policy_t policy;
+static job_t jobs[TG_SCHED_QUEUE];
+static uint32_t next_seq;
+// Worker jobs per class, so a worker never takes a job that could only block
+static uint8_t active[TG_CLASS_COUNT];
+static struct {
+    TaskHandle_t task;
+    tg_class_t cls;
+} workers[TG_SCHED_WORKERS];
+static SemaphoreHandle_t waiters[MAX_WAITERS];
+
+// Every state change wakes all waiters and each re-checks its condition.
+// Caller holds the lock.
+static void wake_all(void)
+{
+    for (int i = 0; i < MAX_WAITERS; i++) {
+        if (waiters[i]) {
+            xSemaphoreGive(waiters[i]);
+        }
+    }
+}
+
+// Drop the lock until the next wake_all() or timeout, then take it back
+static void wait_locked(TickType_t timeout)
+{
+    StaticSemaphore_t buf;
+    SemaphoreHandle_t sem = xSemaphoreCreateBinaryStatic(&buf);
+    int slot = 0;
+    while (slot < MAX_WAITERS && waiters[slot]) {
+        slot++;
+    }
+    if (slot == MAX_WAITERS) {
+        // Full: fall back to polling
+        xSemaphoreGive(lock);
+        vTaskDelay(pdMS_TO_TICKS(10));
+        xSemaphoreTake(lock, portMAX_DELAY);
+        vSemaphoreDelete(sem);
+        return;
+    }
+    waiters[slot] = sem;
+    xSemaphoreGive(lock);
+    xSemaphoreTake(sem, timeout);
+    xSemaphoreTake(lock, portMAX_DELAY);
+    waiters[slot] = NULL;
+    vSemaphoreDelete(sem);
+}
+
+static tg_class_t current_class(void)
+{
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    for (int i = 0; i < TG_SCHED_WORKERS; i++) {
+        if (workers[i].task == self) {
+            return workers[i].cls;
+        }
+    }
+    return TG_CLASS_INTERACTIVE;
+}
+
+void tg_sched_acquire(void)
+{
+    if (!lock) {
+        return;
+    }
+    tg_class_t cls = current_class();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    policy.waiting[cls]++;
+    // A bulk transfer may have to notice the new waiter
+    wake_all();
+    while (tg_policy_next(&policy) != cls) {
+        wait_locked(portMAX_DELAY);
+    }
+    policy.waiting[cls]--;
+    policy.running[cls]++;
+    xSemaphoreGive(lock);
+}
+
+void tg_sched_release(void)
+{
+    if (!lock) {
+        return;
+    }
+    tg_class_t cls = current_class();
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (policy.running[cls]) {
+        policy.running[cls]--;
+    }
+    wake_all();
+    xSemaphoreGive(lock);
+}
+
+void tg_sched_checkpoint(void)
+{
+    if (!lock) {
+        return;
+    }
+    tg_class_t cls = current_class();
+    int64_t deadline = esp_timer_get_time() + (int64_t)TG_SCHED_MAX_PAUSE_MS * 1000;
+    int64_t paused = 0;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    while (tg_policy_should_yield(&policy, cls)) {
+        int64_t now = esp_timer_get_time();
+        if (now >= deadline) {
+            break;
+        }
+        if (!paused) {
+            paused = now;
+        }
+        wait_locked(pdMS_TO_TICKS((deadline - now) / 1000) + 1);
+    }
+    xSemaphoreGive(lock);
+    if (paused) {
+        ESP_LOGI(TAG, "Bulk transfer paused %lld ms", (esp_timer_get_time() - paused) / 1000);
+    }
+}
+
+// Oldest queued job of the highest class a worker may start. Caller holds the lock.
+static job_t *pick_job(void)
+{
+    job_t *best = NULL;
+    for (int i = 0; i < TG_SCHED_QUEUE; i++) {
+        job_t *j = &jobs[i];
+        if (!j->used || active[j->cls] >= class_limit[j->cls]) {
+            continue;
+        }
+        if (!best || j->cls < best->cls || (j->cls == best->cls && (int32_t)(j->seq - best->seq) < 0)) {
+            best = j;
+        }
+    }
+    return best;
+}
+
+static void worker_task(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    job_t job;
+    for (;;) {
+        xSemaphoreTake(lock, portMAX_DELAY);
+        job_t *next;
+        while ((next = pick_job()) == NULL) {
+            wait_locked(portMAX_DELAY);
+        }
+        // The slot is free again once copied, so a later status message
+        // for the same chat queues behind this one instead of merging
+        job = *next;
+        next->used = false;
+        active[job.cls]++;
+        workers[id].cls = job.cls;
+        xSemaphoreGive(lock);
+
+        esp_err_t err;
+        if (job.fn) {
+            err = job.fn(job.arg);
+        } else {
+            err = telegram_send_message(job.chat_id, job.text);
+        }
+        if (job.done) {
+            job.done(job.arg, err);
+        }
+        ESP_LOGD(TAG, "Worker %d: %u bytes of stack never used", id,
+                 (unsigned)uxTaskGetStackHighWaterMark(NULL));
+
+        xSemaphoreTake(lock, portMAX_DELAY);
+        active[job.cls]--;
+        wake_all();
+        xSemaphoreGive(lock);
+    }
+}
+
+esp_err_t tg_sched_init(void)
+{
+    if (lock) {
+        return ESP_OK;
+    }
+    SemaphoreHandle_t l = xSemaphoreCreateMutex();
+    if (!l) {
+        return ESP_ERR_NO_MEM;
+    }
+    lock = l;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    for (int i = 0; i < TG_SCHED_WORKERS; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "tg_worker%d", i);
+        if (xTaskCreate(worker_task, name, WORKER_STACK, (void *)(intptr_t)i, 5, &workers[i].task) != pdPASS) {
+            ESP_LOGE(TAG, "Failed to start %s", name);
+            xSemaphoreGive(lock);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    xSemaphoreGive(lock);
+    return ESP_OK;
+}
+
+// Free queue slot, NULL if full. Caller holds the lock.
+static job_t *new_job(tg_class_t cls)
+{
+    for (int i = 0; i < TG_SCHED_QUEUE; i++) {
+        if (!jobs[i].used) {
+            memset(&jobs[i], 0, sizeof(jobs[i]));
+            jobs[i].used = true;
+            jobs[i].cls = cls;
+            jobs[i].seq = next_seq++;
+            return &jobs[i];
+        }
+    }
+    return NULL;
+}
+
+esp_err_t tg_sched_submit(tg_class_t cls, tg_job_fn_t fn, void *arg, tg_job_done_t done)
+{
+    if (!lock || cls >= TG_CLASS_COUNT || !fn) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    job_t *job = new_job(cls);
+    if (job) {
+        job->fn = fn;
+        job->arg = arg;
+        job->done = done;
+        wake_all();
+    }
+    xSemaphoreGive(lock);
+    return job ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+esp_err_t tg_sched_status(const char *chat_id, const char *text)
+{
+    if (!lock) {
+        return telegram_send_message(chat_id, text);
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    job_t *job = NULL;
+    for (int i = 0; i < TG_SCHED_QUEUE && !job; i++) {
+        if (jobs[i].used && !jobs[i].fn && strcmp(jobs[i].chat_id, chat_id) == 0) {
+            job = &jobs[i];
+        }
+    }
+    if (job) {
+        ESP_LOGD(TAG, "Status for chat %s replaced", chat_id);
+    } else {
+        job = new_job(TG_CLASS_STATUS);
+        if (job) {
+            snprintf(job->chat_id, sizeof(job->chat_id), "%s", chat_id);
+            wake_all();
+        }
+    }
+    if (job) {
+        snprintf(job->text, sizeof(job->text), "%s", text);
+    }
+    xSemaphoreGive(lock);
+    return job ? ESP_OK : ESP_ERR_NO_MEM;
+}
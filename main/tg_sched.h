@@ -0,0 +1,73 @@
+#ifndef TG_SCHED_H
+#define TG_SCHED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+
+// Priority scheduler for outbound Telegram requests.
+//
+// Every request telegram.c makes holds one of TG_SCHED_CONNECTIONS slots
+// for its duration, each class has its own cap, and free slots go to the
+// highest class waiting. Interactive work (command replies, photos) runs
+// inline on the bot task; status messages and bulk uploads (clips, albums,
+// documents) are queued and run on worker tasks. A bulk body is paused at
+// chunk boundaries while interactive work is waiting or running, so it
+// leaves the uplink to the photo someone is waiting for. Queued
+// status messages to the same chat collapse into the newest one.
+
+typedef enum {
+    TG_CLASS_INTERACTIVE,   // Replies to a command, photos; runs inline
+    TG_CLASS_STATUS,        // Progress messages, coalesced per chat
+    TG_CLASS_BULK,          // Clips, albums, documents; paused at chunk boundaries
+    TG_CLASS_COUNT,
+} tg_class_t;
+
+// TLS sessions open at once, about 40 KB of internal RAM each
+#define TG_SCHED_CONNECTIONS    2
+// Per-class caps; bulk leaves a slot for interactive work
+#define TG_SCHED_LIMIT_INTERACTIVE 2
+#define TG_SCHED_LIMIT_STATUS   1
+#define TG_SCHED_LIMIT_BULK     1
+// Worker tasks running queued jobs
+#define TG_SCHED_WORKERS        2
+#define TG_SCHED_QUEUE          8
+#define TG_SCHED_STATUS_MAX     128
+// A paused body resumes after this long, before the server times it out
+#define TG_SCHED_MAX_PAUSE_MS   20000
+
+// Slot accounting, kept apart from the tasks so the policy can be replayed
+// in a simulation
+typedef struct {
+    uint8_t running[TG_CLASS_COUNT];
+    uint8_t waiting[TG_CLASS_COUNT];
+} tg_policy_t;
+
+// Class that gets the next free slot, TG_CLASS_COUNT if none may start
+tg_class_t tg_policy_next(const tg_policy_t *p);
+
+// Whether a transfer of class cls should pause at its next chunk boundary
+bool tg_policy_should_yield(const tg_policy_t *p, tg_class_t cls);
+
+typedef esp_err_t (*tg_job_fn_t)(void *arg);
+// Called on the worker once the job has run; may be NULL
+typedef void (*tg_job_done_t)(void *arg, esp_err_t err);
+
+esp_err_t tg_sched_init(void);
+
+// Queue fn to run on a worker. ESP_ERR_NO_MEM if the queue is full.
+esp_err_t tg_sched_submit(tg_class_t cls, tg_job_fn_t fn, void *arg, tg_job_done_t done);
+
+// Queue a status message. A message still queued for the same chat is
+// replaced rather than followed.
+esp_err_t tg_sched_status(const char *chat_id, const char *text);
+
+// Hold a slot around one request, in the class of the calling task:
+// its job's class on a worker, interactive anywhere else
+void tg_sched_acquire(void);
+void tg_sched_release(void);
+
+// Chunk boundary of a request body; waits while the caller should yield
+void tg_sched_checkpoint(void);
+
+#endif // TG_SCHED_H
@@ -0,0 +1,146 @@
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp_sntp.h"
+#include "nvs.h"
+#include "freertos/task.h"
+#include "timekeep.h"
+
+static const char *TAG = "timekeep";
+
+#define NVS_NAMESPACE   "timekeep"
+#define NVS_KEY_SYNC    "last_sync"
+
+#define RTC_MAGIC       0x544B5053      // "TKPS"
+
+// Anything earlier was never set by SNTP or a restore
+#define MIN_VALID_TIME  1577836800      // 2020-01-01
+
+// Survives software resets but not power loss; checked with the magic
+static RTC_NOINIT_ATTR struct {
+    uint32_t magic;
+    int64_t last_sync;
+} rtc_state;
+
+static timekeep_source_t source = TIMEKEEP_NONE;
+static time_t last_sync;
+static volatile bool synced;
+
+static void save_sync(time_t t)
+{
+    rtc_state.magic = RTC_MAGIC;
+    rtc_state.last_sync = t;
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_i64(nvs, NVS_KEY_SYNC, t);
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to save sync time: %s", esp_err_to_name(err));
+    }
+}
+
+// Runs in the lwIP task after every SNTP update
+static void on_sync(struct timeval *tv)
+{
+    last_sync = tv->tv_sec;
+    source = TIMEKEEP_SNTP;
+    synced = true;
+    save_sync(tv->tv_sec);
+    ESP_LOGI(TAG, "SNTP sync at %lld", (long long)tv->tv_sec);
+}
+
+esp_err_t timekeep_restore(void)
+{
+    time_t now = time(NULL);
+    esp_reset_reason_t reason = esp_reset_reason();
+    bool rtc_kept = reason != ESP_RST_POWERON && reason != ESP_RST_BROWNOUT &&
+                    rtc_state.magic == RTC_MAGIC;
+
+    if (rtc_kept && now >= rtc_state.last_sync && now >= MIN_VALID_TIME) {
+        // RTC timer kept running through the reset; nothing to set
+        source = TIMEKEEP_RTC;
+        last_sync = rtc_state.last_sync;
+        ESP_LOGI(TAG, "Clock kept across reset, last sync %lld s ago",
+                 (long long)(now - last_sync));
+        return ESP_OK;
+    }
+    rtc_state.magic = 0;
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGI(TAG, "No saved time, waiting for SNTP");
+        return ESP_OK;
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    int64_t saved = 0;
+    err = nvs_get_i64(nvs, NVS_KEY_SYNC, &saved);
+    nvs_close(nvs);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGI(TAG, "No saved time, waiting for SNTP");
+        return ESP_OK;
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    if (saved > now) {
+        struct timeval tv = { .tv_sec = saved };
+        settimeofday(&tv, NULL);
+    }
+    source = TIMEKEEP_RESTORED;
+    last_sync = saved;
+    ESP_LOGI(TAG, "Clock restored from NVS to %lld (lower bound)", (long long)saved);
+    return ESP_OK;
+}
+
+void timekeep_start_sync(void)
+{
+    esp_sntp_setoperatingmode(SNTP_OPMODE_POLL);
+    esp_sntp_setservername(0, "pool.ntp.org");
+    sntp_set_time_sync_notification_cb(on_sync);
+    esp_sntp_init();
+}
+
+bool timekeep_wait_sync(TickType_t timeout)
+{
+    TickType_t start = xTaskGetTickCount();
+    while (!synced) {
+        if (xTaskGetTickCount() - start >= timeout) {
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    return true;
+}
+
+void timekeep_get_status(timekeep_status_t *out)
+{
+    out->source = source;
+    out->last_sync = last_sync;
+    if (source == TIMEKEEP_RTC || source == TIMEKEEP_SNTP) {
+        int64_t elapsed = (int64_t)(time(NULL) - last_sync);
+        out->uncertainty_ms = elapsed > 0 ? elapsed * TIMEKEEP_DRIFT_PPM / 1000 : 0;
+    } else {
+        out->uncertainty_ms = -1;
+    }
+}
+
+const char *timekeep_source_name(timekeep_source_t s)
+{
+    switch (s) {
+    case TIMEKEEP_RESTORED: return "restored";
+    case TIMEKEEP_RTC:      return "rtc";
+    case TIMEKEEP_SNTP:     return "sntp";
+    default:                return "none";
+    }
+}
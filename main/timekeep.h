@@ -0,0 +1,48 @@
+#ifndef TIMEKEEP_H
+#define TIMEKEEP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+// Wall clock that survives reboots.
+//
+// Every SNTP sync is saved to NVS and mirrored in RTC memory. After a
+// software reset the RTC timer has kept counting, so the clock is still
+// good to within a drift bound. After a power cycle the saved time is
+// restored as a lower bound. Either way the clock is usable as soon as NVS
+// is up, and SNTP refines it in the background instead of gating startup.
+
+// Drift assumed for the RTC between syncs, generous for the calibrated
+// slow clock over temperature
+#define TIMEKEEP_DRIFT_PPM 500
+
+typedef enum {
+    TIMEKEEP_NONE,          // Nothing to go on (first boot)
+    TIMEKEEP_RESTORED,      // Saved time after power loss, a lower bound
+    TIMEKEEP_RTC,           // Kept by the RTC across a reset since the last sync
+    TIMEKEEP_SNTP,          // Synced during this boot
+} timekeep_source_t;
+
+typedef struct {
+    timekeep_source_t source;
+    time_t last_sync;           // Wall time of the last SNTP sync, 0 if never
+    int64_t uncertainty_ms;     // Drift bound, -1 when unbounded
+} timekeep_status_t;
+
+// Restore the clock from RTC memory or NVS. Call once NVS is initialized.
+esp_err_t timekeep_restore(void);
+
+// Start background SNTP; needs the network stack.
+void timekeep_start_sync(void);
+
+// Wait for the first SNTP sync of this boot. Returns false on timeout.
+bool timekeep_wait_sync(TickType_t timeout);
+
+void timekeep_get_status(timekeep_status_t *out);
+
+const char *timekeep_source_name(timekeep_source_t source);
+
+#endif // TIMEKEEP_H
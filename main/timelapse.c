@@ -0,0 +1,348 @@
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_camera.h"
+#include "esp_vfs_fat.h"
+#include "sdmmc_cmd.h"
+#include "driver/sdmmc_host.h"
+#include "nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "timekeep.h"
+#include "timelapse.h"
+
+static const char *TAG = "timelapse";
+
+#define NVS_NAMESPACE       "timelapse"
+#define NVS_KEY_INTERVAL    "interval"
+
+#define TIMELAPSE_STACK     4096
+#define TIMELAPSE_PRIORITY  4       // Below the bot; a shot can wait a moment
+// Store and video each hold the data and index files open
+#define SD_MAX_FILES        5
+
+static sdmmc_card_t *card;
+static frame_store_t store;         // Under lock
+static frame_store_avi_t video;     // Only touched by the reader between open and close
+static bool video_open;             // Under lock
+static SemaphoreHandle_t lock;
+static TaskHandle_t task;
+static volatile uint32_t interval_s;
+static volatile bool shoot_now;
+static volatile bool full;
+static volatile uint32_t failed;
+
+static void save_interval(uint32_t interval)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_u32(nvs, NVS_KEY_INTERVAL, interval);
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to save interval: %s", esp_err_to_name(err));
+    }
+}
+
+static uint32_t load_interval(void)
+{
+    nvs_handle_t nvs;
+    uint32_t interval = 0;
+    if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+        nvs_get_u32(nvs, NVS_KEY_INTERVAL, &interval);
+        nvs_close(nvs);
+    }
+    return interval;
+}
+
+// Microseconds on the wall clock, or on the uptime clock while it is unset
+static int64_t clock_us(bool *wall)
+{
+    timekeep_status_t clock;
+    timekeep_get_status(&clock);
+    *wall = clock.uncertainty_ms >= 0;
+    if (!*wall) {
+        return esp_timer_get_time();
+    }
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+// Ticks to the next multiple of the interval. One more than the rounded
+// down wait, so the wake-up is never before it and a shot is not repeated.
+static TickType_t ticks_to_next_shot(uint32_t interval)
+{
+    bool wall;
+    int64_t now = clock_us(&wall);
+    int64_t period = (int64_t)interval * 1000000;
+    int64_t next = (now / period + 1) * period;
+    return pdMS_TO_TICKS((next - now) / 1000) + 1;
+}
+
+// A frame at TIMELAPSE_FRAMESIZE, whatever size the photo quality ladder
+// has the sensor at. The sensor goes back to that size afterwards unless
+// someone else switched it meanwhile.
+static camera_fb_t *capture(void)
+{
+    sensor_t *s = esp_camera_sensor_get();
+    framesize_t was = s ? s->status.framesize : TIMELAPSE_FRAMESIZE;
+    bool switched = was != TIMELAPSE_FRAMESIZE;
+    if (switched && esp_camera_switch_mode(TIMELAPSE_FRAMESIZE) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to switch to the time-lapse frame size");
+        return NULL;
+    }
+    camera_fb_t *fb = esp_camera_fb_get();
+    // A switch that needed bigger buffers re-created the sensor object
+    s = esp_camera_sensor_get();
+    if (switched && s && s->status.framesize == TIMELAPSE_FRAMESIZE) {
+        esp_camera_switch_mode(was);
+    }
+    return fb;
+}
+
+static void shoot(void)
+{
+    camera_fb_t *fb = capture();
+    if (!fb) {
+        failed++;
+        ESP_LOGW(TAG, "Capture failed");
+        return;
+    }
+    // The AVI header has one frame size; a frame taken while another task
+    // changed the size is not stored
+    if (fb->width != resolution[TIMELAPSE_FRAMESIZE].width ||
+        fb->height != resolution[TIMELAPSE_FRAMESIZE].height) {
+        failed++;
+        ESP_LOGW(TAG, "Dropped a %ux%u frame", (unsigned)fb->width, (unsigned)fb->height);
+        esp_camera_fb_return(fb);
+        return;
+    }
+    bool wall;
+    int64_t now = clock_us(&wall);
+    xSemaphoreTake(lock, portMAX_DELAY);
+    esp_err_t err = frame_store_append(&store, fb->buf, fb->len, fb->width, fb->height,
+                                       wall ? now / 1000000 : 0);
+    uint32_t frames = store.frames;
+    xSemaphoreGive(lock);
+    esp_camera_fb_return(fb);
+
+    if (err == ESP_ERR_NO_MEM) {
+        ESP_LOGW(TAG, "Store full after %u frames, time-lapse stopped", (unsigned)frames);
+        full = true;
+        interval_s = 0;
+        save_interval(0);
+    } else if (err != ESP_OK) {
+        failed++;
+        ESP_LOGE(TAG, "Failed to store frame: %s", esp_err_to_name(err));
+    } else {
+        ESP_LOGD(TAG, "Frame %u stored", (unsigned)frames);
+    }
+}
+
+static void timelapse_task(void *arg)
+{
+    while (1) {
+        uint32_t interval = interval_s;
+        if (!interval) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        if (shoot_now) {
+            shoot_now = false;
+            shoot();
+            continue;
+        }
+        // A notification means the settings changed: look again
+        if (ulTaskNotifyTake(pdTRUE, ticks_to_next_shot(interval)) == 0 && interval_s == interval) {
+            shoot();
+        }
+    }
+}
+
+static esp_err_t mount_card(void)
+{
+    sdmmc_host_t host = SDMMC_HOST_DEFAULT();
+    sdmmc_slot_config_t slot = SDMMC_SLOT_CONFIG_DEFAULT();
+    slot.width = 1;
+    slot.flags |= SDMMC_SLOT_FLAG_INTERNAL_PULLUP;
+    esp_vfs_fat_sdmmc_mount_config_t mount = {
+        .format_if_mount_failed = false,
+        .max_files = SD_MAX_FILES,
+        .allocation_unit_size = 16 * 1024,
+    };
+    esp_err_t err = esp_vfs_fat_sdmmc_mount(TIMELAPSE_MOUNT, &host, &slot, &mount, &card);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "No SD card: %s", esp_err_to_name(err));
+        return err;
+    }
+    ESP_LOGI(TAG, "SD card %s, %llu MB", card->cid.name,
+             (unsigned long long)card->csd.capacity * card->csd.sector_size / (1024 * 1024));
+    return ESP_OK;
+}
+
+// The full store size, or what the card has room for
+static uint32_t store_capacity(void)
+{
+    uint64_t total = 0;
+    uint64_t free_bytes = 0;
+    if (esp_vfs_fat_info(TIMELAPSE_MOUNT, &total, &free_bytes) != ESP_OK) {
+        return 0;
+    }
+    struct stat st;
+    uint64_t room = free_bytes;
+    if (stat(TIMELAPSE_MOUNT "/" FRAME_STORE_DATA, &st) == 0) {
+        room += st.st_size;
+    }
+    if (room <= TIMELAPSE_SD_RESERVE) {
+        return 0;
+    }
+    room -= TIMELAPSE_SD_RESERVE;
+    return room < TIMELAPSE_STORE_BYTES ? room : TIMELAPSE_STORE_BYTES;
+}
+
+esp_err_t timelapse_init(void)
+{
+    esp_err_t err = mount_card();
+    if (err != ESP_OK) {
+        return err;
+    }
+    uint32_t capacity = store_capacity();
+    if (!capacity) {
+        ESP_LOGE(TAG, "SD card is full");
+        return ESP_ERR_NO_MEM;
+    }
+    // Allocating every cluster of a new data file takes a few seconds
+    int64_t start = esp_timer_get_time();
+    err = frame_store_open(&store, TIMELAPSE_MOUNT, capacity);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open the frame store: %s", esp_err_to_name(err));
+        return err;
+    }
+    ESP_LOGI(TAG, "Store: %u frames, %u of %u KB, opened in %lld ms", (unsigned)store.frames,
+             (unsigned)(store.used / 1024), (unsigned)(store.capacity / 1024),
+             (esp_timer_get_time() - start) / 1000);
+    if (store.dropped) {
+        ESP_LOGW(TAG, "Dropped %u torn frames", (unsigned)store.dropped);
+    }
+
+    lock = xSemaphoreCreateMutex();
+    if (!lock) {
+        frame_store_close(&store);
+        return ESP_ERR_NO_MEM;
+    }
+    uint32_t interval = load_interval();
+    if (interval >= TIMELAPSE_MIN_INTERVAL && interval <= TIMELAPSE_MAX_INTERVAL) {
+        ESP_LOGI(TAG, "Resuming time-lapse every %u s", (unsigned)interval);
+        interval_s = interval;
+    }
+    if (xTaskCreate(timelapse_task, "timelapse_task", TIMELAPSE_STACK, NULL, TIMELAPSE_PRIORITY,
+                    &task) != pdPASS) {
+        frame_store_close(&store);
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+esp_err_t timelapse_start(uint32_t interval)
+{
+    if (!task) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (interval < TIMELAPSE_MIN_INTERVAL || interval > TIMELAPSE_MAX_INTERVAL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    esp_err_t err = video_open ? ESP_ERR_INVALID_STATE : frame_store_reset(&store);
+    xSemaphoreGive(lock);
+    if (err != ESP_OK) {
+        return err;
+    }
+    full = false;
+    failed = 0;
+    shoot_now = true;
+    interval_s = interval;
+    save_interval(interval);
+    xTaskNotifyGive(task);
+    ESP_LOGI(TAG, "Time-lapse every %u s", (unsigned)interval);
+    return ESP_OK;
+}
+
+void timelapse_stop(void)
+{
+    if (!task) {
+        return;
+    }
+    interval_s = 0;
+    save_interval(0);
+    xTaskNotifyGive(task);
+    ESP_LOGI(TAG, "Time-lapse stopped");
+}
+
+void timelapse_get_status(timelapse_status_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    if (!lock) {
+        return;
+    }
+    frame_store_entry_t e;
+    xSemaphoreTake(lock, portMAX_DELAY);
+    out->frames = store.frames;
+    out->used = store.used;
+    out->capacity = store.capacity;
+    out->dropped = store.dropped;
+    if (store.frames && frame_store_get(&store, 0, &e) == ESP_OK) {
+        out->first_time = e.time;
+    }
+    if (store.frames && frame_store_get(&store, store.frames - 1, &e) == ESP_OK) {
+        out->last_time = e.time;
+    }
+    xSemaphoreGive(lock);
+    out->interval_s = interval_s;
+    out->running = out->interval_s != 0;
+    out->full = full;
+    out->failed = failed;
+}
+
+esp_err_t timelapse_video_open(uint32_t max_bytes, size_t *len)
+{
+    if (!lock) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    if (!video_open) {
+        err = store.frames ? frame_store_avi_open(&video, &store, store.frames, max_bytes, TIMELAPSE_FPS) :
+                             ESP_ERR_NOT_FOUND;
+        video_open = err == ESP_OK;
+    }
+    xSemaphoreGive(lock);
+    if (err == ESP_OK) {
+        *len = video.size;
+        ESP_LOGI(TAG, "Video: %u frames, every %u stored, %u bytes", (unsigned)video.frames,
+                 (unsigned)video.step, (unsigned)video.size);
+    }
+    return err;
+}
+
+int timelapse_video_read(uint8_t *buf, size_t size)
+{
+    return frame_store_avi_read(&video, buf, size);
+}
+
+void timelapse_video_close(void)
+{
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (video_open) {
+        frame_store_avi_close(&video);
+        video_open = false;
+    }
+    xSemaphoreGive(lock);
+}
@@ -0,0 +1,76 @@
+#ifndef TIMELAPSE_H
+#define TIMELAPSE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "sensor.h"
+#include "frame_store.h"
+
+// Time-lapse on the SD card.
+//
+// A task takes a photo every interval and appends the JPEG, as the camera
+// made it, to the frame store in frame_store.h. Shots fall on multiples of
+// the interval on the wall clock (every 5 minutes is :00, :05, ...), or on
+// the uptime clock while the wall clock is unset; between shots the task
+// sleeps in a notification wait, so stop and start act at once. The
+// interval is kept in NVS and a time-lapse carries on after a reset.
+//
+// Every frame is XGA: the sensor is switched to it for the shot, whatever
+// size the photo quality ladder has chosen, since an AVI has one frame size.
+//
+// The video is the store read out as an AVI: header, the stored chunks
+// and an index, produced a piece at a time for an upload to pull.
+//
+// Pins: SDMMC slot 1 in 1-bit mode, CLK 14, CMD 15, D0 2, with the
+// internal pull-ups. 4-bit mode would take GPIO4, the flash LED, and the
+// mic's 12 and 13.
+
+#define TIMELAPSE_MOUNT         "/sdcard"
+// Data file size when the card has the room; about 3000 XGA frames
+#define TIMELAPSE_STORE_BYTES   (256u * 1024 * 1024)
+// Left free on the card for the index and anything else on it
+#define TIMELAPSE_SD_RESERVE    (1024 * 1024)
+#define TIMELAPSE_MIN_INTERVAL  60
+#define TIMELAPSE_MAX_INTERVAL  3600
+#define TIMELAPSE_FPS           10
+#define TIMELAPSE_FRAMESIZE     FRAMESIZE_XGA
+
+typedef struct {
+    bool running;
+    bool full;              // Stopped because the store filled up
+    uint32_t interval_s;    // 0 when stopped
+    uint32_t frames;
+    uint32_t first_time;    // Unix seconds of the first and last frame, 0 if unknown
+    uint32_t last_time;
+    uint32_t used;          // Bytes of the data file taken by frames
+    uint32_t capacity;
+    uint32_t failed;        // Shots lost to the camera or the card since boot
+    uint32_t dropped;       // Torn frames dropped at boot
+} timelapse_status_t;
+
+// Mount the card, open the store and start the capture task, resuming a
+// time-lapse that was running. Needs NVS and the camera.
+esp_err_t timelapse_init(void);
+
+// Start over with a shot every interval_s seconds, the first one now.
+// ESP_ERR_INVALID_STATE while a video is being read out.
+esp_err_t timelapse_start(uint32_t interval_s);
+
+// Stop capturing; the frames stay for a video
+void timelapse_stop(void);
+
+void timelapse_get_status(timelapse_status_t *out);
+
+// Open the frames so far as an AVI at TIMELAPSE_FPS of at most max_bytes,
+// skipping frames evenly if they would not fit. *len is the file size.
+// Capture carries on meanwhile. One video at a time.
+esp_err_t timelapse_video_open(uint32_t max_bytes, size_t *len);
+
+// Next bytes of the video, see frame_store_avi_read()
+int timelapse_video_read(uint8_t *buf, size_t size);
+
+void timelapse_video_close(void);
+
+#endif // TIMELAPSE_H
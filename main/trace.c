@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_attr.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_camera.h"
+#include "freertos/FreeRTOS.h"
+#include "mbedtls/base64.h"
+#include "trace.h"
+
+static const char *TAG = "trace";
+
+#define DUMP_MAGIC      "TRC1"
+#define DUMP_VERSION    1
+
+typedef struct {
+    uint32_t seq;           // Claim index + 1 once complete, 0 while being written
+    uint32_t ts_us;         // esp_timer time, low 32 bits
+    uint32_t arg;
+    uint8_t id;
+    uint8_t kind;
+    uint16_t reserved;
+} trace_record_t;
+
+typedef struct {
+    uint32_t head;          // Events claimed since boot
+    uint32_t floor;         // Events before this index were cleared
+    trace_record_t records[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+// Written from ISRs, so it has to stay in internal RAM
+static DRAM_ATTR trace_ring_t rings[portNUM_PROCESSORS];
+
+static const char *const names[TRACE_ID_MAX] = {
+    [TRACE_POLL]            = "poll",
+    [TRACE_COMMAND]         = "command",
+    [TRACE_PHOTO]           = "photo",
+    [TRACE_BURST]           = "burst",
+    [TRACE_FLASH]           = "flash",
+    [TRACE_CAPTURE]         = "capture",
+    [TRACE_FRAME_READY]     = "frame_ready",
+    [TRACE_UPLOAD]          = "upload",
+    [TRACE_TLS_OPEN]        = "tls_open",
+    [TRACE_BYTES_WRITTEN]   = "bytes_written",
+    [TRACE_RESPONSE]        = "response",
+    [TRACE_PREVIEW]         = "preview",
+    [TRACE_EXPOSURE]        = "exposure",
+    [TRACE_CAM_FRAME_START] = "cam_frame_start",
+    [TRACE_CAM_FRAME_DONE]  = "cam_frame_done",
+    [TRACE_CAM_FRAME_DROP]  = "cam_frame_drop",
+    [TRACE_CAM_FB_GET]      = "cam_fb_get",
+};
+
+static const DRAM_ATTR uint8_t camera_ids[CAMERA_TRACE_MAX] = {
+    [CAMERA_TRACE_FRAME_START] = TRACE_CAM_FRAME_START,
+    [CAMERA_TRACE_FRAME_DONE]  = TRACE_CAM_FRAME_DONE,
+    [CAMERA_TRACE_FRAME_DROP]  = TRACE_CAM_FRAME_DROP,
+    [CAMERA_TRACE_FB_GET]      = TRACE_CAM_FB_GET,
+};
+
+void IRAM_ATTR trace_event(trace_id_t id, trace_kind_t kind, uint32_t arg)
+{
+    trace_ring_t *ring = &rings[xPortGetCoreID()];
+    uint32_t idx = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    trace_record_t *r = &ring->records[idx & (TRACE_RING_EVENTS - 1)];
+
+    // Invalidate first so a concurrent dump skips the slot instead of
+    // reading half of the old record and half of the new one
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->ts_us = (uint32_t)esp_timer_get_time();
+    r->arg = arg;
+    r->id = id;
+    r->kind = kind;
+    __atomic_store_n(&r->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+static void IRAM_ATTR camera_hook(camera_trace_event_t event, uint32_t arg)
+{
+    if (event < CAMERA_TRACE_MAX) {
+        trace_event(camera_ids[event], TRACE_INSTANT, arg);
+    }
+}
+
+void trace_attach_camera(void)
+{
+    esp_camera_set_trace_cb(camera_hook);
+}
+
+size_t trace_dump_size(void)
+{
+    size_t size = 4 + 1 + 1 + 2 + 4 + 8;
+    for (int i = 0; i < TRACE_ID_MAX; i++) {
+        size += strlen(names[i]) + 1;
+    }
+    return size + portNUM_PROCESSORS * (4 + TRACE_RING_EVENTS * sizeof(trace_record_t));
+}
+
+// Dump layout, little endian:
+//   "TRC1", u8 version, u8 cores, u16 name count, u32 ring size, i64 now_us,
+//   NUL-terminated event names, then per core a u32 record count followed by
+//   16-byte records (seq, ts_us, arg, id, kind, reserved)
+size_t trace_dump(uint8_t *buf, size_t size)
+{
+    if (size < trace_dump_size()) {
+        return 0;
+    }
+
+    uint8_t *p = buf;
+    memcpy(p, DUMP_MAGIC, 4);
+    p += 4;
+    *p++ = DUMP_VERSION;
+    *p++ = portNUM_PROCESSORS;
+    uint16_t name_count = TRACE_ID_MAX;
+    memcpy(p, &name_count, 2);
+    p += 2;
+    uint32_t ring_events = TRACE_RING_EVENTS;
+    memcpy(p, &ring_events, 4);
+    p += 4;
+    // Lets the decoder widen the 32-bit timestamps
+    int64_t now = esp_timer_get_time();
+    memcpy(p, &now, 8);
+    p += 8;
+    for (int i = 0; i < TRACE_ID_MAX; i++) {
+        size_t len = strlen(names[i]) + 1;
+        memcpy(p, names[i], len);
+        p += len;
+    }
+
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        trace_ring_t *ring = &rings[core];
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t first = head - ring->floor > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : ring->floor;
+
+        uint8_t *count_at = p;
+        p += 4;
+        uint32_t count = 0;
+        for (uint32_t idx = first; idx != head; idx++) {
+            const trace_record_t *r = &ring->records[idx & (TRACE_RING_EVENTS - 1)];
+            trace_record_t copy;
+            if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != idx + 1) {
+                continue;
+            }
+            memcpy(&copy, r, sizeof(copy));
+            // Overwritten while copying
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != idx + 1) {
+                continue;
+            }
+            memcpy(p, &copy, sizeof(copy));
+            p += sizeof(copy);
+            count++;
+        }
+        memcpy(count_at, &count, 4);
+    }
+    return p - buf;
+}
+
+esp_err_t trace_dump_log(void)
+{
+    size_t cap = trace_dump_size();
+    uint8_t *buf = malloc(cap);
+    if (!buf) {
+        return ESP_ERR_NO_MEM;
+    }
+    size_t len = trace_dump(buf, cap);
+
+    // 57 input bytes make one 76 character base64 line
+    printf("----- BEGIN TRACE -----\n");
+    for (size_t off = 0; off < len; off += 57) {
+        unsigned char line[80];
+        size_t out = 0;
+        size_t chunk = len - off < 57 ? len - off : 57;
+        mbedtls_base64_encode(line, sizeof(line), &out, buf + off, chunk);
+        printf("%.*s\n", (int)out, line);
+    }
+    printf("----- END TRACE -----\n");
+
+    ESP_LOGI(TAG, "Dumped %u bytes", (unsigned)len);
+    free(buf);
+    return ESP_OK;
+}
+
+void trace_clear(void)
+{
+    for (int core = 0; core < portNUM_PROCESSORS; core++) {
+        rings[core].floor = __atomic_load_n(&rings[core].head, __ATOMIC_ACQUIRE);
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+// Hot-path tracing.
+//
+// Events are 16-byte binary records in a per-core ring, so instrumenting a
+// path costs a timestamp read and a few stores instead of a formatted UART
+// line. A slot is claimed with an atomic increment, which keeps a task and
+// an ISR preempting it on the same core from clobbering each other; the
+// other core has its own ring. Dump with trace_dump() (the /trace command)
+// or trace_dump_log(), then run tools/trace2json.py to get a Chrome/Perfetto
+// timeline.
+
+// Events kept per core, power of two
+#define TRACE_RING_EVENTS 256
+
+typedef enum {
+    TRACE_INSTANT,
+    TRACE_BEGIN,
+    TRACE_END,
+    TRACE_COUNTER,
+} trace_kind_t;
+
+// Names are written into every dump, so the decoder needs no copy of this list
+typedef enum {
+    TRACE_POLL,             // span: one getUpdates round trip
+    TRACE_COMMAND,          // instant: command received, arg = update_id
+    TRACE_PHOTO,            // span: whole /photo request
+    TRACE_BURST,            // span: whole /burst request, arg = frames
+    TRACE_FLASH,            // span: flash LED lit
+    TRACE_CAPTURE,          // span: esp_camera_fb_get()
+    TRACE_FRAME_READY,      // instant: arg = JPEG bytes
+    TRACE_UPLOAD,           // span: one photo or album upload
+    TRACE_TLS_OPEN,         // span: esp_http_client_open()
+    TRACE_BYTES_WRITTEN,    // counter: request body bytes written so far
+    TRACE_RESPONSE,         // instant: response headers, arg = HTTP status
+    TRACE_PREVIEW,          // span: previews sent to every chat, arg = preview bytes
+    TRACE_EXPOSURE,         // instant: flash exposure settled, arg = exposure_state_t
+    TRACE_CAM_FRAME_START,  // instant: driver armed DMA, arg = frame slot
+    TRACE_CAM_FRAME_DONE,   // instant: frame queued by the driver, arg = bytes
+    TRACE_CAM_FRAME_DROP,   // instant: arg = camera_drop_reason_t
+    TRACE_CAM_FB_GET,       // instant: frame handed to the app, arg = bytes
+    TRACE_ID_MAX,
+} trace_id_t;
+
+// Record one event. Safe from any task or ISR on either core.
+void trace_event(trace_id_t id, trace_kind_t kind, uint32_t arg);
+
+static inline void trace_begin(trace_id_t id, uint32_t arg) { trace_event(id, TRACE_BEGIN, arg); }
+static inline void trace_end(trace_id_t id, uint32_t arg) { trace_event(id, TRACE_END, arg); }
+static inline void trace_instant(trace_id_t id, uint32_t arg) { trace_event(id, TRACE_INSTANT, arg); }
+static inline void trace_counter(trace_id_t id, uint32_t value) { trace_event(id, TRACE_COUNTER, value); }
+
+// Feed camera driver events into the trace.
+void trace_attach_camera(void);
+
+// Upper bound for the size of a dump.
+size_t trace_dump_size(void);
+
+// Serialize both rings into buf. Returns the number of bytes written, or 0
+// if buf is too small.
+size_t trace_dump(uint8_t *buf, size_t size);
+
+// Print a dump to the console as base64 between marker lines.
+esp_err_t trace_dump_log(void);
+
+// Drop every recorded event.
+void trace_clear(void);
+
+#endif // TRACE_H
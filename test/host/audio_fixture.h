@@ -0,0 +1,285 @@
+#ifndef HOST_AUDIO_FIXTURE_H
+#define HOST_AUDIO_FIXTURE_H
+
+// Synthetic 8 kHz nursery audio for the cry detector and the ADPCM clip
+// path: infant cry episodes and the sounds a nursery mic hears besides
+// them. Signals are built in float at about unit level, then scaled and
+// mixed into 16-bit samples. One seeded generator, so every run hears the
+// same audio.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "test.h"
+
+#define AUDIO_RATE 8000
+
+static uint32_t synth_seed = 987654;
+
+static inline double synth_uniform(void)
+{
+    synth_seed ^= synth_seed << 13;
+    synth_seed ^= synth_seed >> 17;
+    synth_seed ^= synth_seed << 5;
+    return synth_seed / 4294967296.0;
+}
+
+static inline double synth_gauss(void)
+{
+    double u = synth_uniform() + 1e-12;
+    double v = synth_uniform();
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static inline double rms(const float *x, int n)
+{
+    double s = 0;
+    for (int i = 0; i < n; i++) {
+        s += x[i] * x[i];
+    }
+    return sqrt(s / n);
+}
+
+// Harmonics of f0 up to 3.8 kHz falling off as 1/h^tilt, with some breath
+static inline double voice_sample(double *phase, double f0, double tilt, double breath)
+{
+    *phase += 2 * M_PI * f0 / AUDIO_RATE;
+    double v = 0;
+    for (int h = 1; h * f0 < 3800; h++) {
+        v += sin(h * *phase) / pow(h, tilt);
+    }
+    return v * 0.3 + breath * synth_gauss() * 0.05;
+}
+
+// A cry episode into x[start, start + len): bursts of 0.4-1.6 s, each a
+// rise and fall of pitch inside [flo, fhi], with 0.1-0.5 s breaths between
+static inline void synth_cry(float *x, int start, int len, double flo, double fhi)
+{
+    double phase = 0;
+    int t = start;
+    while (t < start + len) {
+        int burst = (0.4 + synth_uniform() * 1.2) * AUDIO_RATE;
+        double lo = flo + synth_uniform() * (fhi - flo) * 0.3;
+        double hi = lo + (fhi - lo) * (0.4 + 0.6 * synth_uniform());
+        for (int i = 0; i < burst && t + i < start + len; i++) {
+            double u = (double)i / burst;
+            double vibrato = 1 + 0.02 * sin(2 * M_PI * 7 * i / AUDIO_RATE);
+            double f0 = lo + (hi - lo) * sin(M_PI * u) * vibrato * (1 + 0.01 * synth_gauss());
+            double env = fmin(1, i / (0.05 * AUDIO_RATE)) * fmin(1, (burst - i) / (0.08 * AUDIO_RATE));
+            x[t + i] += env * voice_sample(&phase, f0, 1.2, 1);
+        }
+        t += burst + (0.1 + synth_uniform() * 0.4) * AUDIO_RATE;
+    }
+}
+
+// Talk: phrases of 120-280 ms syllables around f0base, falling in pitch
+static inline void synth_speech(float *x, int n, double amp, double f0base)
+{
+    double phase = 0;
+    int t = 0;
+    while (t < n) {
+        int words = 3 + synth_uniform() * 8;
+        for (int w = 0; w < words && t < n; w++) {
+            int syl = (0.12 + synth_uniform() * 0.16) * AUDIO_RATE;
+            double f0 = f0base * (0.85 + 0.35 * synth_uniform());
+            for (int i = 0; i < syl && t + i < n; i++) {
+                double env = sin(M_PI * i / syl);
+                x[t + i] += amp * env * voice_sample(&phase, f0 * (1 - 0.1 * i / syl), 1.6, 0.5);
+            }
+            t += syl + synth_uniform() * 0.06 * AUDIO_RATE;
+        }
+        t += (0.3 + synth_uniform() * 0.8) * AUDIO_RATE;
+    }
+}
+
+// Plucked notes of 0.2-0.7 s from a scale over 196-784 Hz, with a bass
+static inline void synth_music(float *x, int n, double amp)
+{
+    static const double scale[] = {
+        196, 220, 247, 262, 294, 330, 349, 392, 440, 494, 523, 587, 659, 698, 784,
+    };
+    int notes = sizeof(scale) / sizeof(scale[0]);
+    int t = 0;
+    while (t < n) {
+        int note = (0.2 + synth_uniform() * 0.5) * AUDIO_RATE;
+        double f = scale[(int)(synth_uniform() * notes)];
+        double bass = scale[(int)(synth_uniform() * notes)] / 2;
+        for (int i = 0; i < note && t + i < n; i++) {
+            double env = exp(-3.0 * i / note) * fmin(1, i / 40.0);
+            double p = 2 * M_PI * i / AUDIO_RATE;
+            x[t + i] += amp * env * (sin(f * p) + 0.5 * sin(2 * f * p) + 0.25 * sin(3 * f * p) + 0.6 * sin(bass * p));
+        }
+        t += note;
+    }
+}
+
+// An appliance: a square wave at f, half a second on, half off
+static inline void synth_beeps(float *x, int n, double amp, double f)
+{
+    for (int i = 0; i < n; i++) {
+        if ((i / (AUDIO_RATE / 2)) % 2 == 0) {
+            x[i] += amp * (sin(2 * M_PI * f * i / AUDIO_RATE) > 0 ? 0.5 : -0.5);
+        }
+    }
+}
+
+// Three knocks on a door every 2-8 s
+static inline void synth_knocks(float *x, int n, double amp)
+{
+    int t = AUDIO_RATE / 2;
+    while (t < n) {
+        for (int k = 0; k < 3; k++) {
+            for (int i = 0; i < 600 && t + i < n; i++) {
+                x[t + i] += amp * exp(-i / 80.0) * (synth_gauss() * 0.5 + sin(2 * M_PI * 150 * i / AUDIO_RATE));
+            }
+            t += AUDIO_RATE / 4;
+        }
+        t += (2 + synth_uniform() * 6) * AUDIO_RATE;
+    }
+}
+
+typedef enum {
+    NOISE_WHITE,
+    NOISE_PINK,
+    NOISE_FAN,      // Mains hum and its harmonics over a little hiss
+} noise_t;
+
+static inline void synth_noise(float *x, int n, noise_t type, double amp)
+{
+    double b[7] = { 0 };
+    for (int i = 0; i < n; i++) {
+        double w = synth_gauss();
+        double v;
+        if (type == NOISE_WHITE) {
+            v = w * 0.3;
+        } else if (type == NOISE_PINK) {
+            // Paul Kellet's filter
+            b[0] = 0.99886 * b[0] + w * 0.0555179;
+            b[1] = 0.99332 * b[1] + w * 0.0750759;
+            b[2] = 0.96900 * b[2] + w * 0.1538520;
+            b[3] = 0.86650 * b[3] + w * 0.3104856;
+            b[4] = 0.55000 * b[4] + w * 0.5329522;
+            b[5] = -0.7616 * b[5] - w * 0.0168980;
+            v = (b[0] + b[1] + b[2] + b[3] + b[4] + b[5] + b[6] + w * 0.5362) * 0.05;
+            b[6] = w * 0.115926;
+        } else {
+            double p = 2 * M_PI * i / AUDIO_RATE;
+            v = 0.3 * sin(50 * p) + 0.15 * sin(100 * p) + 0.1 * sin(150 * p) + 0.05 * sin(300 * p) + w * 0.05;
+        }
+        x[i] += amp * v;
+    }
+}
+
+// Full scale 16-bit samples of x
+static inline int16_t *to_pcm(const float *x, int n)
+{
+    int16_t *pcm = malloc(n * sizeof(int16_t));
+    REQUIRE(pcm);
+    for (int i = 0; i < n; i++) {
+        double v = x[i] * 32767;
+        pcm[i] = lrint(v > 32767 ? 32767 : v < -32768 ? -32768 : v);
+    }
+    return pcm;
+}
+
+// len seconds holding a cry from cry_at for cry_len, at cry_dbfs RMS over
+// its span, in noise snr dB below it. snr < 0: only the mic's self-noise.
+static inline int16_t *cry_episode(int len, int cry_at, int cry_len, double cry_dbfs, noise_t noise, int snr)
+{
+    int n = len * AUDIO_RATE;
+    float *x = calloc(n, sizeof(float));
+    REQUIRE(x);
+    double flo = 280 + synth_uniform() * 80;
+    double fhi = 480 + synth_uniform() * 120;
+    synth_cry(x, cry_at * AUDIO_RATE, cry_len * AUDIO_RATE, flo, fhi);
+    double amp = pow(10, cry_dbfs / 20);
+    double k = amp / rms(x + cry_at * AUDIO_RATE, cry_len * AUDIO_RATE);
+    for (int i = 0; i < n; i++) {
+        x[i] *= k;
+    }
+    float *nz = calloc(n, sizeof(float));
+    REQUIRE(nz);
+    if (snr >= 0) {
+        synth_noise(nz, n, noise, 1);
+        k = amp / pow(10, snr / 20.0) / rms(nz, n);
+    } else {
+        synth_noise(nz, n, NOISE_WHITE, 1);
+        k = 0.0003;
+    }
+    for (int i = 0; i < n; i++) {
+        x[i] += nz[i] * k;
+    }
+    int16_t *pcm = to_pcm(x, n);
+    free(nz);
+    free(x);
+    return pcm;
+}
+
+// What else a nursery mic hears, none of which may raise an alert
+typedef enum {
+    SOUND_SPEECH_MALE,
+    SOUND_SPEECH_FEMALE,
+    SOUND_SPEECH_CHILD,
+    SOUND_MUSIC,
+    SOUND_BEEPS,
+    SOUND_KNOCKS,
+    SOUND_FAN,
+    SOUND_PINK,
+    SOUND_TV,       // Talk over music
+    SOUND_QUIET,
+    SOUND_COUNT,
+} sound_t;
+
+static const char *const sound_names[SOUND_COUNT] = {
+    "male speech", "female speech", "child speech", "music", "beeps",
+    "knocks", "fan", "pink noise", "tv", "quiet room",
+};
+
+static inline int16_t *sound(sound_t kind, int len)
+{
+    int n = len * AUDIO_RATE;
+    float *x = calloc(n, sizeof(float));
+    REQUIRE(x);
+    switch (kind) {
+    case SOUND_SPEECH_MALE: synth_speech(x, n, 0.1, 120); break;
+    case SOUND_SPEECH_FEMALE: synth_speech(x, n, 0.1, 210); break;
+    case SOUND_SPEECH_CHILD: synth_speech(x, n, 0.1, 280); break;
+    case SOUND_MUSIC: synth_music(x, n, 0.1); break;
+    case SOUND_BEEPS: synth_beeps(x, n, 0.1, 500); break;
+    case SOUND_KNOCKS: synth_knocks(x, n, 0.3); break;
+    case SOUND_FAN: synth_noise(x, n, NOISE_FAN, 0.3); break;
+    case SOUND_PINK: synth_noise(x, n, NOISE_PINK, 0.3); break;
+    case SOUND_TV:
+        synth_speech(x, n, 0.07, 150);
+        synth_music(x, n, 0.05);
+        break;
+    default: break;
+    }
+    synth_noise(x, n, NOISE_WHITE, 0.0003);
+    int16_t *pcm = to_pcm(x, n);
+    free(x);
+    return pcm;
+}
+
+static inline double snr_db(const int16_t *ref, const int16_t *got, int n)
+{
+    double signal = 0;
+    double error = 0;
+    for (int i = 0; i < n; i++) {
+        double d = (double)ref[i] - got[i];
+        signal += (double)ref[i] * ref[i];
+        error += d * d;
+    }
+    return error ? 10 * log10(signal / error) : 99;
+}
+
+static inline double audio_now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+#endif // HOST_AUDIO_FIXTURE_H
@@ -0,0 +1,102 @@
+#ifndef HOST_JPEG_FIXTURE_H
+#define HOST_JPEG_FIXTURE_H
+
+// The camera component's test pictures, and the pixel-domain path the
+// coefficient-domain conversions are measured against: esp_jpeg decode to
+// RGB888, fmt2jpg() encode
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "img_converters.h"
+#include "test.h"
+
+#define FIXTURE_COUNT 3
+
+static const char *const fixture_names[FIXTURE_COUNT] = {
+    "testimg.jpeg",         // 227x149, odd size
+    "test_inside.jpeg",     // 320x240
+    "test_outside.jpeg",    // 480x320, EXIF thumbnail
+};
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+} fixture_t;
+
+static inline fixture_t fixture_load(int i)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", FIXTURE_DIR, fixture_names[i]);
+    FILE *f = fopen(path, "rb");
+    REQUIRE(f);
+    fixture_t fx = { 0 };
+    fseek(f, 0, SEEK_END);
+    fx.len = ftell(f);
+    rewind(f);
+    fx.buf = malloc(fx.len);
+    REQUIRE(fx.buf && fread(fx.buf, 1, fx.len, f) == fx.len);
+    fclose(f);
+    return fx;
+}
+
+// RGB888 pixels of a JPEG, NULL if it does not decode
+static inline uint8_t *jpeg_decode_rgb(const uint8_t *jpg, size_t len, int *w, int *h)
+{
+    esp_jpeg_image_cfg_t cfg = {
+        .indata = (uint8_t *)jpg,
+        .indata_size = len,
+        .out_format = JPEG_IMAGE_FORMAT_RGB888,
+        .out_scale = JPEG_IMAGE_SCALE_0,
+    };
+    esp_jpeg_image_output_t img;
+    if (esp_jpeg_get_image_info(&cfg, &img) != ESP_OK) {
+        return NULL;
+    }
+    cfg.outbuf = malloc(img.output_len);
+    cfg.outbuf_size = img.output_len;
+    if (!cfg.outbuf || esp_jpeg_decode(&cfg, &img) != ESP_OK) {
+        free(cfg.outbuf);
+        return NULL;
+    }
+    *w = img.width;
+    *h = img.height;
+    return cfg.outbuf;
+}
+
+// fmt2jpg() of RGB888 pixels. It takes them in the camera's BGR order.
+static inline bool jpeg_encode_rgb(const uint8_t *rgb, int w, int h, int quality, uint8_t **out, size_t *out_len)
+{
+    size_t n = (size_t)w * h * 3;
+    uint8_t *bgr = malloc(n);
+    REQUIRE(bgr);
+    for (size_t i = 0; i < n; i += 3) {
+        bgr[i] = rgb[i + 2];
+        bgr[i + 1] = rgb[i + 1];
+        bgr[i + 2] = rgb[i];
+    }
+    bool ok = fmt2jpg(bgr, n, w, h, PIXFORMAT_RGB888, quality, out, out_len);
+    free(bgr);
+    return ok;
+}
+
+static inline double psnr(const uint8_t *a, const uint8_t *b, size_t n)
+{
+    double err = 0;
+    for (size_t i = 0; i < n; i++) {
+        double d = (double)a[i] - b[i];
+        err += d * d;
+    }
+    return err ? 10 * log10(255.0 * 255.0 * n / err) : 99;
+}
+
+static inline double now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+#endif // HOST_JPEG_FIXTURE_H
@@ -0,0 +1,14 @@
+// The OV2640 driver with its register shadow cache compiled out, under its
+// own names so it links next to the real one. test_ov2640 uses it as the
+// reference for what the sensor should end up holding.
+#define OV2640_REG_CACHE 0
+#define esp32_camera_ov2640_detect ov2640_uncached_detect
+#define esp32_camera_ov2640_init ov2640_uncached_init
+// ov2640_settings.h defines these tables without static
+#define ov2640_settings_cif ov2640_uncached_settings_cif
+#define ov2640_settings_to_cif ov2640_uncached_settings_to_cif
+#define ov2640_settings_to_svga ov2640_uncached_settings_to_svga
+#define ov2640_settings_to_uxga ov2640_uncached_settings_to_uxga
+#define ov2640_settings_jpeg3 ov2640_uncached_settings_jpeg3
+#define agc_gain_tbl ov2640_uncached_agc_gain_tbl
+#include "sensors/ov2640.c"
@@ -0,0 +1,7 @@
+#pragma once
+
+typedef int ledc_timer_t;
+typedef int ledc_channel_t;
+
+#define LEDC_TIMER_0    0
+#define LEDC_CHANNEL_0  0
@@ -0,0 +1,16 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_SPIRAM   (1 << 0)
+#define MALLOC_CAP_8BIT     (1 << 1)
+#define MALLOC_CAP_INTERNAL (1 << 2)
+#define MALLOC_CAP_DMA      (1 << 3)
+#define MALLOC_CAP_DEFAULT  (1 << 4)
+
+#define heap_caps_malloc(size, caps)        malloc(size)
+#define heap_caps_calloc(n, size, caps)     calloc(n, size)
+#define heap_caps_realloc(ptr, size, caps)  realloc(ptr, size)
+
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_largest_free_block(uint32_t caps);
@@ -0,0 +1,165 @@
+// esp_http_client that records requests for the test to inspect
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "esp_http_client.h"
+#include "esp_crt_bundle.h"
+#include "esp_memory_utils.h"
+
+struct esp_http_client {
+    host_http_request_t *req;
+    size_t read_pos;
+};
+
+host_http_server_t host_http_server = { .status = 200, .fail_after = -1 };
+host_http_request_t host_http_requests[HOST_HTTP_REQUESTS];
+int host_http_count;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+// Held while bytes are on the shaped uplink
+static pthread_mutex_t uplink = PTHREAD_MUTEX_INITIALIZER;
+
+void host_http_reset(void)
+{
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < host_http_count; i++) {
+        free(host_http_requests[i].body);
+    }
+    memset(host_http_requests, 0, sizeof(host_http_requests));
+    host_http_count = 0;
+    host_http_server = (host_http_server_t) { .status = 200, .fail_after = -1 };
+    pthread_mutex_unlock(&lock);
+}
+
+esp_err_t esp_crt_bundle_attach(void *conf)
+{
+    (void)conf;
+    return ESP_OK;
+}
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config)
+{
+    pthread_mutex_lock(&lock);
+    if (host_http_count == HOST_HTTP_REQUESTS) {
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    host_http_request_t *req = &host_http_requests[host_http_count++];
+    pthread_mutex_unlock(&lock);
+
+    struct esp_http_client *c = calloc(1, sizeof(*c));
+    c->req = req;
+    snprintf(req->url, sizeof(req->url), "%s", config->url);
+    req->open_len = -1;
+    return c;
+}
+
+esp_err_t esp_http_client_set_method(esp_http_client_handle_t client, esp_http_client_method_t method)
+{
+    (void)client;
+    (void)method;
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value)
+{
+    if (strcmp(key, "Content-Type") == 0) {
+        snprintf(client->req->content_type, sizeof(client->req->content_type), "%s", value);
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_url(esp_http_client_handle_t client, const char *url)
+{
+    snprintf(client->req->url, sizeof(client->req->url), "%s", url);
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len)
+{
+    if (host_http_server.open_err != ESP_OK) {
+        return host_http_server.open_err;
+    }
+    usleep(host_http_server.open_ms * 1000);
+    client->req->open_len = write_len;
+    client->req->body = malloc(write_len > 0 ? write_len : 1);
+    return client->req->body ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+int esp_http_client_write(esp_http_client_handle_t client, const char *buffer, int len)
+{
+    host_http_request_t *req = client->req;
+    if (!req->body) {
+        return -1;
+    }
+    if (host_http_server.fail_after >= 0 && req->body_len + len > (size_t)host_http_server.fail_after) {
+        return -1;
+    }
+    // Writing past Content-Length is recorded as a short body the test catches
+    if (req->body_len + len > (size_t)req->open_len) {
+        len = req->open_len - req->body_len;
+    }
+    if (host_http_server.bytes_per_s > 0) {
+        pthread_mutex_lock(&uplink);
+        usleep((int64_t)len * 1000000 / host_http_server.bytes_per_s);
+        pthread_mutex_unlock(&uplink);
+    }
+    memcpy(req->body + req->body_len, buffer, len);
+    req->body_len += len;
+    req->writes++;
+    if ((size_t)len > req->largest_write) {
+        req->largest_write = len;
+    }
+    if (esp_ptr_external_ram(buffer)) {
+        req->external_bytes += len;
+    }
+    return len;
+}
+
+int64_t esp_http_client_fetch_headers(esp_http_client_handle_t client)
+{
+    host_http_request_t *req = client->req;
+    usleep(host_http_server.response_ms * 1000);
+    if (host_http_server.respond) {
+        req->status = host_http_server.respond(req, req->response, sizeof(req->response));
+    } else {
+        req->status = host_http_server.status;
+        snprintf(req->response, sizeof(req->response), "%s",
+                 host_http_server.response ? host_http_server.response : "");
+    }
+    return strlen(req->response);
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client)
+{
+    return client->req->status;
+}
+
+int esp_http_client_read(esp_http_client_handle_t client, char *buffer, int len)
+{
+    const char *resp = client->req->response;
+    size_t left = strlen(resp) - client->read_pos;
+    if ((size_t)len > left) {
+        len = left;
+    }
+    if (len > 0) {
+        memcpy(buffer, resp + client->read_pos, len);
+        client->read_pos += len;
+    }
+    return len;
+}
+
+esp_err_t esp_http_client_close(esp_http_client_handle_t client)
+{
+    client->req->closed = true;
+    return ESP_OK;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client)
+{
+    client->req->cleaned_up = true;
+    free(client);
+    return ESP_OK;
+}
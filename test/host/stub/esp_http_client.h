@@ -0,0 +1,78 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef struct esp_http_client *esp_http_client_handle_t;
+typedef struct esp_http_client_event esp_http_client_event_t;
+typedef esp_err_t (*http_event_handle_cb)(esp_http_client_event_t *evt);
+
+typedef enum {
+    HTTP_METHOD_GET,
+    HTTP_METHOD_POST,
+} esp_http_client_method_t;
+
+typedef struct {
+    const char *url;
+    http_event_handle_cb event_handler;
+    esp_err_t (*crt_bundle_attach)(void *conf);
+    int timeout_ms;
+    int buffer_size;
+    int buffer_size_tx;
+    bool keep_alive_enable;
+    void *user_data;
+} esp_http_client_config_t;
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t *config);
+esp_err_t esp_http_client_set_method(esp_http_client_handle_t client, esp_http_client_method_t method);
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char *key, const char *value);
+esp_err_t esp_http_client_set_url(esp_http_client_handle_t client, const char *url);
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len);
+int esp_http_client_write(esp_http_client_handle_t client, const char *buffer, int len);
+int64_t esp_http_client_fetch_headers(esp_http_client_handle_t client);
+int esp_http_client_get_status_code(esp_http_client_handle_t client);
+int esp_http_client_read(esp_http_client_handle_t client, char *buffer, int len);
+esp_err_t esp_http_client_close(esp_http_client_handle_t client);
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client);
+
+// Host side: every request is recorded instead of sent
+
+#define HOST_HTTP_REQUESTS 64
+
+typedef struct {
+    char url[256];
+    char content_type[128];
+    int open_len;               // Content-Length given to open, -1 if never opened
+    uint8_t *body;
+    size_t body_len;
+    bool closed;
+    bool cleaned_up;
+    int writes;                 // esp_http_client_write() calls
+    size_t largest_write;
+    size_t external_bytes;      // Written straight out of PSRAM
+    int status;                 // Answered when the headers are fetched
+    char response[512];
+} host_http_request_t;
+
+// Answers one request from what was sent: writes the body into response
+// and returns the status code
+typedef int (*host_http_responder_t)(const host_http_request_t *req, char *response, size_t size);
+
+typedef struct {
+    int status;                 // Status code of every response
+    const char *response;       // Response body, NULL for none
+    host_http_responder_t respond;  // Replaces the two above when set
+    esp_err_t open_err;         // Returned by open
+    long fail_after;            // Fail the write that takes the body past this many bytes, -1 for never
+    long bytes_per_s;           // One uplink all connections share, 0 for unlimited
+    long open_ms;               // Connection setup, TCP and TLS handshakes
+    long response_ms;           // From the end of the body to the response headers
+} host_http_server_t;
+
+extern host_http_server_t host_http_server;
+extern host_http_request_t host_http_requests[HOST_HTTP_REQUESTS];
+extern int host_http_count;
+
+// Forget recorded requests and go back to a server answering 200
+void host_http_reset(void);
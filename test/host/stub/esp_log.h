@@ -0,0 +1,14 @@
+#pragma once
+#include <stdio.h>
+
+// Set HOST_LOG=1 in the environment to see the firmware's log lines
+#ifdef __cplusplus
+extern "C"
+#endif
+void host_log(const char *tag, char level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#define ESP_LOGE(tag, fmt, ...) host_log(tag, 'E', fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) host_log(tag, 'W', fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) host_log(tag, 'I', fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) host_log(tag, 'D', fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) host_log(tag, 'V', fmt, ##__VA_ARGS__)
@@ -0,0 +1,13 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Host memory is all "internal"; tests may mark one block as PSRAM to take
+// the PSRAM paths
+extern const uint8_t *host_psram_start;
+extern const uint8_t *host_psram_end;
+
+static inline bool esp_ptr_external_ram(const void *p)
+{
+    return (const uint8_t *)p >= host_psram_start && (const uint8_t *)p < host_psram_end;
+}
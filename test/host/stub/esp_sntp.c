@@ -0,0 +1,45 @@
+// SNTP client that syncs only when the test says so
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_sntp.h"
+
+const char *host_sntp_server;
+bool host_sntp_running;
+
+static sntp_sync_time_cb_t callback;
+static sntp_sync_status_t status = SNTP_SYNC_STATUS_RESET;
+
+void esp_sntp_setoperatingmode(int mode)
+{
+    (void)mode;
+}
+
+void esp_sntp_setservername(int idx, const char *server)
+{
+    (void)idx;
+    host_sntp_server = server;
+}
+
+void esp_sntp_init(void)
+{
+    host_sntp_running = true;
+}
+
+sntp_sync_status_t sntp_get_sync_status(void)
+{
+    return status;
+}
+
+void sntp_set_time_sync_notification_cb(sntp_sync_time_cb_t cb)
+{
+    callback = cb;
+}
+
+void host_sntp_sync(time_t now)
+{
+    struct timeval tv = { .tv_sec = now };
+    status = SNTP_SYNC_STATUS_COMPLETED;
+    if (callback) {
+        callback(&tv);
+    }
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdbool.h>
+#include <sys/time.h>
+
+#define SNTP_OPMODE_POLL 0
+
+typedef enum {
+    SNTP_SYNC_STATUS_RESET,
+    SNTP_SYNC_STATUS_COMPLETED,
+    SNTP_SYNC_STATUS_IN_PROGRESS,
+} sntp_sync_status_t;
+
+typedef void (*sntp_sync_time_cb_t)(struct timeval *tv);
+
+void esp_sntp_setoperatingmode(int mode);
+void esp_sntp_setservername(int idx, const char *server);
+void esp_sntp_init(void);
+sntp_sync_status_t sntp_get_sync_status(void);
+void sntp_set_time_sync_notification_cb(sntp_sync_time_cb_t callback);
+
+// Host side: the server the last esp_sntp_setservername() named, whether
+// esp_sntp_init() ran, and a sync delivered to the registered callback.
+// The system clock is left alone; the test sets its own.
+extern const char *host_sntp_server;
+extern bool host_sntp_running;
+void host_sntp_sync(time_t now);
@@ -0,0 +1,428 @@
+// FreeRTOS on pthreads, enough of it for the firmware modules under test
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+
+struct host_task {
+    TaskFunction_t fn;
+    void *arg;
+    char name[16];
+    pthread_mutex_t mutex;      // Guards notified
+    pthread_cond_t cond;
+    uint32_t notified;
+};
+
+struct host_sem {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    UBaseType_t count;
+    UBaseType_t max;
+};
+
+struct host_queue {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint8_t *items;
+    UBaseType_t length;
+    UBaseType_t size;
+    UBaseType_t head;
+    UBaseType_t count;
+};
+
+struct host_group {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    EventBits_t bits;
+};
+
+static __thread struct host_task *current;
+static pthread_mutex_t critical = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+static void init_sync(pthread_mutex_t *mutex, pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_mutex_init(mutex, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// Wait on cond until woken or the timeout runs out; false on timeout
+static bool wait_cond(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *deadline)
+{
+    if (!deadline) {
+        pthread_cond_wait(cond, mutex);
+        return true;
+    }
+    return pthread_cond_timedwait(cond, mutex, deadline) != ETIMEDOUT;
+}
+
+static struct timespec *deadline_after(TickType_t ticks, struct timespec *ts)
+{
+    if (ticks == portMAX_DELAY) {
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += ticks / 1000;
+    ts->tv_nsec += (long)(ticks % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+void host_enter_critical(void)
+{
+    pthread_mutex_lock(&critical);
+}
+
+void host_exit_critical(void)
+{
+    pthread_mutex_unlock(&critical);
+}
+
+// ---- tasks ----
+
+static void *task_entry(void *arg)
+{
+    current = arg;
+    current->fn(current->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                       UBaseType_t prio, TaskHandle_t *out)
+{
+    (void)stack;
+    (void)prio;
+    struct host_task *t = calloc(1, sizeof(*t));
+    if (!t) {
+        return pdFAIL;
+    }
+    t->fn = fn;
+    t->arg = arg;
+    init_sync(&t->mutex, &t->cond);
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    if (out) {
+        *out = t;
+    }
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, task_entry, t);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        free(t);
+        return pdFAIL;
+    }
+    return pdPASS;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t fn, const char *name, uint32_t stack, void *arg,
+                                   UBaseType_t prio, TaskHandle_t *out, BaseType_t core)
+{
+    (void)core;
+    return xTaskCreate(fn, name, stack, arg, prio, out);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    if (task && task != current) {
+        fprintf(stderr, "vTaskDelete: only self-deletion is supported\n");
+        abort();
+    }
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec ts = { ticks / 1000, (long)(ticks % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) && errno == EINTR) {
+    }
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (TickType_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    if (!current) {
+        // A thread the shim did not start, such as main()
+        current = calloc(1, sizeof(*current));
+        init_sync(&current->mutex, &current->cond);
+        snprintf(current->name, sizeof(current->name), "main");
+    }
+    return current;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    (void)task;
+    return 0;
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task)
+{
+    (void)task;
+    return 5;
+}
+
+BaseType_t xPortGetCoreID(void)
+{
+    return 0;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->mutex);
+    task->notified++;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->mutex);
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *woken)
+{
+    xTaskNotifyGive(task);
+    if (woken) {
+        *woken = pdTRUE;
+    }
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t timeout)
+{
+    struct host_task *self = xTaskGetCurrentTaskHandle();
+    struct timespec ts;
+    struct timespec *deadline = deadline_after(timeout, &ts);
+    pthread_mutex_lock(&self->mutex);
+    while (!self->notified && timeout && wait_cond(&self->cond, &self->mutex, deadline)) {
+    }
+    uint32_t value = self->notified;
+    if (value) {
+        self->notified = clear ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&self->mutex);
+    return value;
+}
+
+// ---- semaphores ----
+
+static SemaphoreHandle_t sem_create(UBaseType_t max, UBaseType_t initial)
+{
+    struct host_sem *s = calloc(1, sizeof(*s));
+    if (!s) {
+        return NULL;
+    }
+    init_sync(&s->mutex, &s->cond);
+    s->max = max;
+    s->count = initial;
+    return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return sem_create(1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return sem_create(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buf)
+{
+    buf->sem = sem_create(1, 0);
+    return buf->sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial)
+{
+    return sem_create(max, initial);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t timeout)
+{
+    struct timespec ts;
+    struct timespec *deadline = deadline_after(timeout, &ts);
+    pthread_mutex_lock(&s->mutex);
+    while (!s->count && timeout && wait_cond(&s->cond, &s->mutex, deadline)) {
+    }
+    BaseType_t got = s->count ? pdTRUE : pdFALSE;
+    if (got) {
+        s->count--;
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return got;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s)
+{
+    pthread_mutex_lock(&s->mutex);
+    BaseType_t given = s->count < s->max ? pdTRUE : pdFALSE;
+    if (given) {
+        s->count++;
+        pthread_cond_signal(&s->cond);
+    }
+    pthread_mutex_unlock(&s->mutex);
+    return given;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t s)
+{
+    pthread_mutex_destroy(&s->mutex);
+    pthread_cond_destroy(&s->cond);
+    free(s);
+}
+
+// ---- queues ----
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct host_queue *q = calloc(1, sizeof(*q));
+    if (!q) {
+        return NULL;
+    }
+    q->items = calloc(length, item_size);
+    if (!q->items) {
+        free(q);
+        return NULL;
+    }
+    init_sync(&q->mutex, &q->cond);
+    q->length = length;
+    q->size = item_size;
+    return q;
+}
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *item, TickType_t timeout)
+{
+    struct timespec ts;
+    struct timespec *deadline = deadline_after(timeout, &ts);
+    pthread_mutex_lock(&q->mutex);
+    while (q->count == q->length && timeout && wait_cond(&q->cond, &q->mutex, deadline)) {
+    }
+    BaseType_t sent = q->count < q->length ? pdTRUE : pdFALSE;
+    if (sent) {
+        memcpy(q->items + (size_t)((q->head + q->count) % q->length) * q->size, item, q->size);
+        q->count++;
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return sent;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t timeout)
+{
+    struct timespec ts;
+    struct timespec *deadline = deadline_after(timeout, &ts);
+    pthread_mutex_lock(&q->mutex);
+    while (!q->count && timeout && wait_cond(&q->cond, &q->mutex, deadline)) {
+    }
+    BaseType_t got = q->count ? pdTRUE : pdFALSE;
+    if (got) {
+        memcpy(item, q->items + (size_t)q->head * q->size, q->size);
+        q->head = (q->head + 1) % q->length;
+        q->count--;
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return got;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+    pthread_mutex_lock(&q->mutex);
+    UBaseType_t n = q->count;
+    pthread_mutex_unlock(&q->mutex);
+    return n;
+}
+
+void vQueueDelete(QueueHandle_t q)
+{
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->cond);
+    free(q->items);
+    free(q);
+}
+
+// ---- event groups ----
+
+EventGroupHandle_t xEventGroupCreate(void)
+{
+    struct host_group *g = calloc(1, sizeof(*g));
+    if (g) {
+        init_sync(&g->mutex, &g->cond);
+    }
+    return g;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t g, EventBits_t bits)
+{
+    pthread_mutex_lock(&g->mutex);
+    g->bits |= bits;
+    EventBits_t now = g->bits;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->mutex);
+    return now;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t g, EventBits_t bits)
+{
+    pthread_mutex_lock(&g->mutex);
+    EventBits_t before = g->bits;
+    g->bits &= ~bits;
+    pthread_mutex_unlock(&g->mutex);
+    return before;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t g)
+{
+    pthread_mutex_lock(&g->mutex);
+    EventBits_t now = g->bits;
+    pthread_mutex_unlock(&g->mutex);
+    return now;
+}
+
+static bool bits_met(EventBits_t have, EventBits_t want, BaseType_t all)
+{
+    return all ? (have & want) == want : (have & want) != 0;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t g, EventBits_t bits, BaseType_t clear_on_exit,
+                                BaseType_t wait_for_all, TickType_t timeout)
+{
+    struct timespec ts;
+    struct timespec *deadline = deadline_after(timeout, &ts);
+    pthread_mutex_lock(&g->mutex);
+    while (!bits_met(g->bits, bits, wait_for_all) && timeout &&
+           wait_cond(&g->cond, &g->mutex, deadline)) {
+    }
+    EventBits_t now = g->bits;
+    if (clear_on_exit && bits_met(now, bits, wait_for_all)) {
+        g->bits &= ~bits;
+    }
+    pthread_mutex_unlock(&g->mutex);
+    return now;
+}
+
+void vEventGroupDelete(EventGroupHandle_t g)
+{
+    pthread_mutex_destroy(&g->mutex);
+    pthread_cond_destroy(&g->cond);
+    free(g);
+}
@@ -0,0 +1,193 @@
+// NVS in memory: a flat list of namespace/key pairs holding raw bytes
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nvs.h"
+
+#define MAX_ENTRIES     64
+#define MAX_HANDLES     16
+#define NAME_MAX_LEN    16      // NVS limit, terminator included
+#define VALUE_MAX       4000
+
+typedef struct {
+    char ns[NAME_MAX_LEN];
+    char key[NAME_MAX_LEN];
+    uint8_t value[VALUE_MAX];
+    size_t len;
+    bool used;
+} entry_t;
+
+typedef struct {
+    char ns[NAME_MAX_LEN];
+    bool writable;
+    bool open;
+} handle_t;
+
+esp_err_t host_nvs_open_err = ESP_OK;
+
+static entry_t entries[MAX_ENTRIES];
+static handle_t handles[MAX_HANDLES];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+void host_nvs_erase(void)
+{
+    pthread_mutex_lock(&lock);
+    memset(entries, 0, sizeof(entries));
+    pthread_mutex_unlock(&lock);
+}
+
+static bool ns_exists(const char *ns)
+{
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        if (entries[i].used && strcmp(entries[i].ns, ns) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+esp_err_t nvs_open(const char *name, nvs_open_mode_t mode, nvs_handle_t *out)
+{
+    if (host_nvs_open_err != ESP_OK) {
+        return host_nvs_open_err;
+    }
+    if (strlen(name) >= NAME_MAX_LEN) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&lock);
+    esp_err_t err = ESP_ERR_NO_MEM;
+    if (mode == NVS_READONLY && !ns_exists(name)) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else {
+        for (int i = 0; i < MAX_HANDLES; i++) {
+            if (!handles[i].open) {
+                strcpy(handles[i].ns, name);
+                handles[i].writable = mode == NVS_READWRITE;
+                handles[i].open = true;
+                *out = i + 1;
+                err = ESP_OK;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+static handle_t *get_handle(nvs_handle_t h)
+{
+    if (h < 1 || h > MAX_HANDLES || !handles[h - 1].open) {
+        return NULL;
+    }
+    return &handles[h - 1];
+}
+
+static entry_t *find(const handle_t *h, const char *key)
+{
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        if (entries[i].used && strcmp(entries[i].ns, h->ns) == 0 && strcmp(entries[i].key, key) == 0) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+static esp_err_t get(nvs_handle_t handle, const char *key, void *out, size_t *len, bool exact)
+{
+    pthread_mutex_lock(&lock);
+    handle_t *h = get_handle(handle);
+    entry_t *e = h ? find(h, key) : NULL;
+    esp_err_t err = ESP_OK;
+    if (!h) {
+        err = ESP_ERR_INVALID_ARG;
+    } else if (!e) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else if (!out) {
+        *len = e->len;
+    } else if (exact ? e->len != *len : e->len > *len) {
+        err = ESP_ERR_INVALID_SIZE;
+    } else {
+        memcpy(out, e->value, e->len);
+        *len = e->len;
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+static esp_err_t set(nvs_handle_t handle, const char *key, const void *value, size_t len)
+{
+    if (strlen(key) >= NAME_MAX_LEN || len > VALUE_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    pthread_mutex_lock(&lock);
+    handle_t *h = get_handle(handle);
+    esp_err_t err = ESP_OK;
+    if (!h || !h->writable) {
+        err = h ? ESP_ERR_NOT_SUPPORTED : ESP_ERR_INVALID_ARG;
+    } else {
+        entry_t *e = find(h, key);
+        for (int i = 0; i < MAX_ENTRIES && !e; i++) {
+            if (!entries[i].used) {
+                e = &entries[i];
+                strcpy(e->ns, h->ns);
+                strcpy(e->key, key);
+                e->used = true;
+            }
+        }
+        if (e) {
+            memcpy(e->value, value, len);
+            e->len = len;
+        } else {
+            err = ESP_ERR_NO_MEM;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return err;
+}
+
+esp_err_t nvs_get_i64(nvs_handle_t handle, const char *key, int64_t *out)
+{
+    size_t len = sizeof(*out);
+    return get(handle, key, out, &len, true);
+}
+
+esp_err_t nvs_set_i64(nvs_handle_t handle, const char *key, int64_t value)
+{
+    return set(handle, key, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out)
+{
+    size_t len = sizeof(*out);
+    return get(handle, key, out, &len, true);
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+    return set(handle, key, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out, size_t *len)
+{
+    return get(handle, key, out, len, false);
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t len)
+{
+    return set(handle, key, value, len);
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return get_handle(handle) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+    pthread_mutex_lock(&lock);
+    handle_t *h = get_handle(handle);
+    if (h) {
+        h->open = false;
+    }
+    pthread_mutex_unlock(&lock);
+}
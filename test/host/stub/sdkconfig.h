@@ -0,0 +1,4 @@
+#pragma once
+
+#define CONFIG_IDF_TARGET_ESP32 1
+#define CONFIG_IDF_TARGET "esp32"
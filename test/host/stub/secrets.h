@@ -0,0 +1,9 @@
+#ifndef SECRETS_H
+#define SECRETS_H
+
+#define WIFI_SSID "host"
+#define WIFI_PASSWORD "host"
+#define TELEGRAM_BOT_TOKEN "123:host"
+#define TELEGRAM_CHAT_ID "1000"
+
+#endif // SECRETS_H
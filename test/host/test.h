@@ -0,0 +1,42 @@
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Checks stay on in every build type, unlike assert()
+
+static int check_failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            check_failures++; \
+        } \
+    } while (0)
+
+#define CHECK_EQ(a, b) do { \
+        long long a_ = (long long)(a), b_ = (long long)(b); \
+        if (a_ != b_) { \
+            printf("%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #a, #b, a_, b_); \
+            check_failures++; \
+        } \
+    } while (0)
+
+// Stop the test: later steps depend on this one
+#define REQUIRE(cond) do { \
+        if (!(cond)) { \
+            printf("%s:%d: REQUIRE(%s) failed\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+#define RUN(fn) do { \
+        int before_ = check_failures; \
+        fn(); \
+        printf("%s %s\n", check_failures == before_ ? "PASS" : "FAIL", #fn); \
+    } while (0)
+
+#define TEST_DONE() (check_failures ? (printf("%d checks failed\n", check_failures), 1) : 0)
+
+#endif // HOST_TEST_H
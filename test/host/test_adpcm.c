@@ -0,0 +1,238 @@
+// adpcm: clips encoded the way the audio task does it decode through
+// adpcm_decode_block() as any IMA-ADPCM decoder would, above an SNR floor
+// per kind of sound, and the look-ahead beats the plain quantizer on voice.
+// Reports encode and decode cost per sample.
+#include "audio_fixture.h"
+#include "adpcm.h"
+#include "cry.h"
+
+#define CLIP_S      30
+
+static const int16_t ima_steps[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767,
+};
+
+static const int ima_index[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+typedef struct {
+    int predictor;
+    int index;
+} ima_state_t;
+
+static int ima_step(ima_state_t *s, int code)
+{
+    int step = ima_steps[s->index];
+    int diff = step >> 3;
+    if (code & 4) {
+        diff += step;
+    }
+    if (code & 2) {
+        diff += step >> 1;
+    }
+    if (code & 1) {
+        diff += step >> 2;
+    }
+    s->predictor += code & 8 ? -diff : diff;
+    s->predictor = s->predictor > 32767 ? 32767 : s->predictor < -32768 ? -32768 : s->predictor;
+    s->index += ima_index[code & 7];
+    s->index = s->index < 0 ? 0 : s->index > 88 ? 88 : s->index;
+    return s->predictor;
+}
+
+// The Microsoft IMA-ADPCM block as a player reads it, written from the
+// format description rather than from adpcm.c
+static void reference_decode(const uint8_t *in, int16_t *pcm)
+{
+    ima_state_t s = { (int16_t)(in[0] | in[1] << 8), in[2] > 88 ? 88 : in[2] };
+    pcm[0] = s.predictor;
+    for (int i = 0; i < ADPCM_BLOCK_BYTES - 4; i++) {
+        pcm[1 + 2 * i] = ima_step(&s, in[4 + i] & 0x0F);
+        pcm[2 + 2 * i] = ima_step(&s, in[4 + i] >> 4);
+    }
+}
+
+// The textbook encoder, each code the nearest to its sample
+static void plain_encode(const int16_t *pcm, int blocks, uint8_t *out)
+{
+    ima_state_t s = { 0, 0 };
+    for (int b = 0; b < blocks; b++, out += ADPCM_BLOCK_BYTES, pcm += ADPCM_BLOCK_SAMPLES) {
+        s.predictor = pcm[0];
+        out[0] = pcm[0] & 0xFF;
+        out[1] = (uint16_t)pcm[0] >> 8;
+        out[2] = s.index;
+        out[3] = 0;
+        for (int i = 1; i < ADPCM_BLOCK_SAMPLES; i++) {
+            int step = ima_steps[s.index];
+            int diff = pcm[i] - s.predictor;
+            int code = diff < 0 ? 8 : 0;
+            diff = abs(diff);
+            for (int bit = 4; bit; bit >>= 1, step >>= 1) {
+                if (diff >= step) {
+                    code |= bit;
+                    diff -= step;
+                }
+            }
+            ima_step(&s, code);
+            uint8_t *byte = &out[4 + (i - 1) / 2];
+            *byte = (i - 1) & 1 ? *byte | code << 4 : code;
+        }
+    }
+}
+
+static double encode_ns, decode_ns;
+static long coded_samples;
+
+// Encode n samples into blocks behind a WAV header, fed in detector
+// blocks as the audio task does
+static uint8_t *encode(const int16_t *pcm, int blocks, size_t *len)
+{
+    *len = ADPCM_WAV_HEADER + (size_t)blocks * ADPCM_BLOCK_BYTES;
+    uint8_t *wav = malloc(*len);
+    REQUIRE(wav);
+    adpcm_wav_header(wav, CRY_SAMPLE_RATE, blocks);
+    adpcm_encoder_t enc;
+    adpcm_init(&enc);
+    int n = blocks * ADPCM_BLOCK_SAMPLES;
+    int b = 0;
+    double t0 = audio_now_ms();
+    for (int i = 0; i < n;) {
+        if (enc.pos == 0 || enc.pos == ADPCM_BLOCK_SAMPLES) {
+            adpcm_begin_block(&enc, wav + ADPCM_WAV_HEADER + b++ * ADPCM_BLOCK_BYTES);
+        }
+        i += adpcm_encode(&enc, pcm + i, n - i < CRY_BLOCK ? n - i : CRY_BLOCK);
+    }
+    encode_ns += (audio_now_ms() - t0) * 1e6;
+    CHECK_EQ(b, blocks);
+    CHECK_EQ(enc.pos, ADPCM_BLOCK_SAMPLES);
+    return wav;
+}
+
+static uint32_t le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t le16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static void test_wav_header(void)
+{
+    uint8_t h[ADPCM_WAV_HEADER];
+    int blocks = 80;
+    adpcm_wav_header(h, CRY_SAMPLE_RATE, blocks);
+    CHECK(memcmp(h, "RIFF", 4) == 0 && memcmp(h + 8, "WAVEfmt ", 8) == 0);
+    CHECK_EQ(le32(h + 4), ADPCM_WAV_HEADER - 8 + blocks * ADPCM_BLOCK_BYTES);
+    CHECK_EQ(le32(h + 16), 20);
+    CHECK_EQ(le16(h + 20), 0x11);
+    CHECK_EQ(le16(h + 22), 1);
+    CHECK_EQ(le32(h + 24), CRY_SAMPLE_RATE);
+    CHECK_EQ(le16(h + 32), ADPCM_BLOCK_BYTES);
+    CHECK_EQ(le16(h + 34), 4);
+    CHECK_EQ(le16(h + 36), 2);
+    CHECK_EQ(le16(h + 38), ADPCM_BLOCK_SAMPLES);
+    CHECK(memcmp(h + 40, "fact", 4) == 0);
+    CHECK_EQ(le32(h + 48), blocks * ADPCM_BLOCK_SAMPLES);
+    CHECK(memcmp(h + 52, "data", 4) == 0);
+    CHECK_EQ(le32(h + 56), blocks * ADPCM_BLOCK_BYTES);
+    // Bytes a second, as players compute it from the block layout
+    CHECK_EQ(le32(h + 28), CRY_SAMPLE_RATE * ADPCM_BLOCK_BYTES / ADPCM_BLOCK_SAMPLES);
+}
+
+typedef struct {
+    const char *name;
+    int16_t *pcm;
+    double min_db;      // Round-trip floor
+    bool voice;         // The look-ahead must gain on it
+} clip_t;
+
+static void test_round_trip(void)
+{
+    clip_t clips[] = {
+        { "cry, quiet room", cry_episode(CLIP_S, 0, CLIP_S, -20, NOISE_WHITE, -1), 14, true },
+        { "cry, pink 10 dB", cry_episode(CLIP_S, 0, CLIP_S, -20, NOISE_PINK, 10), 14, true },
+        { "female speech", sound(SOUND_SPEECH_FEMALE, CLIP_S), 22, true },
+        { "music", sound(SOUND_MUSIC, CLIP_S), 22, false },
+        { "pink noise", sound(SOUND_PINK, CLIP_S), 20, false },
+        { "knocks", sound(SOUND_KNOCKS, CLIP_S), 10, false },
+    };
+    int blocks = CLIP_S * AUDIO_RATE / ADPCM_BLOCK_SAMPLES;
+    int n = blocks * ADPCM_BLOCK_SAMPLES;
+    int16_t *out = malloc(n * sizeof(int16_t));
+    int16_t *ref = malloc(n * sizeof(int16_t));
+    uint8_t *plain = malloc((size_t)blocks * ADPCM_BLOCK_BYTES);
+    REQUIRE(out && ref && plain);
+    for (size_t c = 0; c < sizeof(clips) / sizeof(clips[0]); c++) {
+        size_t len;
+        uint8_t *wav = encode(clips[c].pcm, blocks, &len);
+        double t0 = audio_now_ms();
+        for (int b = 0; b < blocks; b++) {
+            adpcm_decode_block(wav + ADPCM_WAV_HEADER + b * ADPCM_BLOCK_BYTES, out + b * ADPCM_BLOCK_SAMPLES);
+        }
+        decode_ns += (audio_now_ms() - t0) * 1e6;
+        coded_samples += n;
+        for (int b = 0; b < blocks; b++) {
+            reference_decode(wav + ADPCM_WAV_HEADER + b * ADPCM_BLOCK_BYTES, ref + b * ADPCM_BLOCK_SAMPLES);
+        }
+        CHECK(memcmp(out, ref, n * sizeof(int16_t)) == 0);
+
+        plain_encode(clips[c].pcm, blocks, plain);
+        for (int b = 0; b < blocks; b++) {
+            reference_decode(plain + b * ADPCM_BLOCK_BYTES, ref + b * ADPCM_BLOCK_SAMPLES);
+        }
+        double db = snr_db(clips[c].pcm, out, n);
+        double plain_db = snr_db(clips[c].pcm, ref, n);
+        printf("%-16s %zu bytes (%.2f:1), SNR %5.1f dB, plain encoder %5.1f dB\n",
+               clips[c].name, len, n * 2.0 / len, db, plain_db);
+        CHECK(db >= clips[c].min_db);
+        CHECK(db >= plain_db);
+        if (clips[c].voice && ADPCM_LOOKAHEAD) {
+            CHECK(db >= plain_db + 2);
+        }
+        free(wav);
+        free(clips[c].pcm);
+    }
+    free(plain);
+    free(ref);
+    free(out);
+}
+
+// Any bytes decode, clamped, through the same steps a player takes
+static void test_any_block(void)
+{
+    uint8_t block[ADPCM_BLOCK_BYTES];
+    int16_t out[ADPCM_BLOCK_SAMPLES], ref[ADPCM_BLOCK_SAMPLES];
+    srand(1);
+    for (int t = 0; t < 1000; t++) {
+        for (int i = 0; i < ADPCM_BLOCK_BYTES; i++) {
+            block[i] = rand();
+        }
+        adpcm_decode_block(block, out);
+        reference_decode(block, ref);
+        CHECK(memcmp(out, ref, sizeof(out)) == 0);
+    }
+}
+
+static void test_cost(void)
+{
+    printf("encode %.1f ns/sample, decode %.1f ns/sample\n", encode_ns / coded_samples, decode_ns / coded_samples);
+    // The look-ahead tries up to eight codes a sample
+    CHECK(encode_ns / coded_samples < 1000);
+    CHECK(decode_ns * 4 < encode_ns);
+}
+
+int main(void)
+{
+    RUN(test_wav_header);
+    RUN(test_round_trip);
+    RUN(test_any_block);
+    RUN(test_cost);
+    return TEST_DONE();
+}
@@ -0,0 +1,165 @@
+// audio: the audio task, fed a cry through a fake I2S microphone, raises
+// the alert and hands out a clip AUDIO_CLIP_AFTER_MS later that holds the
+// last AUDIO_CLIP_MS of what it heard. No second clip is taken while the
+// first is still out.
+#include "audio_fixture.h"
+#include "audio.h"
+#include "driver/i2s_std.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#define INPUT_S     90
+#define CRY_AT_S    8
+
+// The microphone: 32-bit slots at twice the detector's rate. Each input
+// sample is split over the two slots the task sums, so the decimated
+// block is the input exactly.
+static struct {
+    const int16_t *pcm;
+    int n;
+    int fed;                // Input samples handed out
+    bool enabled;
+    SemaphoreHandle_t done; // Given when the input runs out
+} mic;
+
+esp_err_t i2s_new_channel(const i2s_chan_config_t *chan_cfg, i2s_chan_handle_t *tx, i2s_chan_handle_t *rx)
+{
+    *rx = (i2s_chan_handle_t)&mic;
+    return ESP_OK;
+}
+
+esp_err_t i2s_del_channel(i2s_chan_handle_t handle)
+{
+    return ESP_OK;
+}
+
+esp_err_t i2s_channel_init_std_mode(i2s_chan_handle_t handle, const i2s_std_config_t *std_cfg)
+{
+    CHECK_EQ(std_cfg->clk_cfg.sample_rate_hz, 2 * AUDIO_RATE);
+    return ESP_OK;
+}
+
+esp_err_t i2s_channel_register_event_callback(i2s_chan_handle_t handle, const i2s_event_callbacks_t *callbacks,
+                                              void *user_data)
+{
+    return ESP_OK;
+}
+
+esp_err_t i2s_channel_enable(i2s_chan_handle_t handle)
+{
+    mic.enabled = true;
+    return ESP_OK;
+}
+
+esp_err_t i2s_channel_disable(i2s_chan_handle_t handle)
+{
+    mic.enabled = false;
+    return ESP_OK;
+}
+
+esp_err_t i2s_channel_read(i2s_chan_handle_t handle, void *dest, size_t size, size_t *bytes_read, uint32_t timeout_ms)
+{
+    CHECK(mic.enabled);
+    int32_t *slots = dest;
+    int n = size / sizeof(int32_t) / 2;
+    if (mic.fed + n > mic.n) {
+        if (mic.fed <= mic.n) {
+            mic.fed = mic.n + 1;
+            xSemaphoreGive(mic.done);
+        }
+        vTaskDelay(timeout_ms);
+        *bytes_read = 0;
+        return ESP_ERR_TIMEOUT;
+    }
+    for (int i = 0; i < n; i++) {
+        int s = mic.pcm[mic.fed + i];
+        slots[2 * i] = (int32_t)(s >> 1) << 15;
+        slots[2 * i + 1] = (int32_t)(s - (s >> 1)) << 15;
+    }
+    mic.fed += n;
+    *bytes_read = size;
+    return ESP_OK;
+}
+
+static int alerts_at[4];
+static int alert_count;
+static int clip_at = -1;
+static uint8_t *clip;
+static size_t clip_len;
+
+static void on_alert(void)
+{
+    if (alert_count < 4) {
+        alerts_at[alert_count] = mic.fed;
+    }
+    alert_count++;
+}
+
+// Keeps the clip out, as a slow upload would
+static void on_clip(const uint8_t *wav, size_t len)
+{
+    CHECK(clip_at < 0);
+    clip_at = mic.fed;
+    clip = malloc(len);
+    REQUIRE(clip);
+    memcpy(clip, wav, len);
+    clip_len = len;
+}
+
+static void test_cry_to_clip(void)
+{
+    mic.pcm = cry_episode(INPUT_S, CRY_AT_S, INPUT_S - CRY_AT_S, -20, NOISE_WHITE, -1);
+    mic.n = INPUT_S * AUDIO_RATE;
+    mic.done = xSemaphoreCreateBinary();
+    REQUIRE(audio_start(on_alert, on_clip) == ESP_OK);
+    audio_set_enabled(true);
+    REQUIRE(xSemaphoreTake(mic.done, 60000));
+
+    audio_stats_t stats;
+    audio_get_stats(&stats);
+    printf("%d alerts, first at %.2f s; clip at %.2f s, %zu bytes; load %u permille\n", alert_count,
+           alerts_at[0] / (double)AUDIO_RATE, clip_at / (double)AUDIO_RATE, clip_len, (unsigned)stats.load_permille);
+    // Crying throughout: a second alert once the holdoff is over, but the
+    // first clip is still out
+    CHECK_EQ(alert_count, 2);
+    CHECK(alerts_at[0] > CRY_AT_S * AUDIO_RATE);
+    CHECK(alerts_at[1] - alerts_at[0] >= CRY_HOLDOFF_MS * AUDIO_RATE / 1000);
+    CHECK_EQ(stats.alerts, 2);
+    CHECK_EQ(stats.clips, 1);
+    CHECK_EQ(stats.overruns, 0);
+    CHECK(stats.enabled);
+
+    REQUIRE(clip);
+    CHECK_EQ(clip_at - alerts_at[0], AUDIO_CLIP_AFTER_MS * AUDIO_RATE / 1000);
+    CHECK_EQ(clip_len, AUDIO_CLIP_MAX);
+    // The clip is the complete blocks before the one being written, and
+    // the encoder started with the input
+    int blocks = (clip_len - ADPCM_WAV_HEADER) / ADPCM_BLOCK_BYTES;
+    int end = clip_at / ADPCM_BLOCK_SAMPLES * ADPCM_BLOCK_SAMPLES;
+    int start = end - blocks * ADPCM_BLOCK_SAMPLES;
+    int16_t *pcm = malloc(blocks * ADPCM_BLOCK_SAMPLES * sizeof(int16_t));
+    REQUIRE(pcm && start >= 0);
+    for (int b = 0; b < blocks; b++) {
+        adpcm_decode_block(clip + ADPCM_WAV_HEADER + b * ADPCM_BLOCK_BYTES, pcm + b * ADPCM_BLOCK_SAMPLES);
+    }
+    double db = snr_db(mic.pcm + start, pcm, blocks * ADPCM_BLOCK_SAMPLES);
+    printf("clip covers %.2f-%.2f s, %.1f dB against the input\n",
+           start / (double)AUDIO_RATE, end / (double)AUDIO_RATE, db);
+    CHECK(end - start >= AUDIO_CLIP_MS * AUDIO_RATE / 1000);
+    CHECK(db > 12);
+    free(pcm);
+
+    // Released, the next alert gets its clip; the detector starts over
+    audio_clip_release();
+    audio_set_enabled(false);
+    audio_get_stats(&stats);
+    CHECK(!stats.enabled);
+    free(clip);
+}
+
+int main(void)
+{
+    RUN(test_cry_to_clip);
+    return TEST_DONE();
+}
@@ -0,0 +1,134 @@
+// boot: stages start once what they require has succeeded, independent
+// stages overlap, a failed dependency skips everything downstream, and
+// boot_wait() reports it
+#include <string.h>
+#include "test.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "boot.h"
+
+enum { NVS, CAMERA, WIFI, TIME, BOT, SDCARD, TIMELAPSE, GATE, STAGES };
+
+static int64_t began_us[STAGES];
+static int64_t ended_us[STAGES];
+static uint32_t ran;
+static SemaphoreHandle_t gate;
+static const boot_stage_t table[STAGES];
+
+// Every stage checks on entry that what it requires has already succeeded
+static esp_err_t run(int i, int ms, esp_err_t result)
+{
+    began_us[i] = esp_timer_get_time();
+    for (int d = 0; d < STAGES; d++) {
+        if (table[i].requires & BOOT_BIT(d)) {
+            boot_stage_status_t st;
+            CHECK(boot_get_status(d, &st));
+            CHECK(st.done);
+            CHECK_EQ(st.result, ESP_OK);
+        }
+    }
+    __atomic_fetch_or(&ran, BOOT_BIT(i), __ATOMIC_SEQ_CST);
+    vTaskDelay(pdMS_TO_TICKS(ms));
+    ended_us[i] = esp_timer_get_time();
+    return result;
+}
+
+static esp_err_t nvs(void) { return run(NVS, 20, ESP_OK); }
+static esp_err_t camera(void) { return run(CAMERA, 150, ESP_OK); }
+static esp_err_t wifi(void) { return run(WIFI, 150, ESP_OK); }
+static esp_err_t timekeep(void) { return run(TIME, 5, ESP_OK); }
+static esp_err_t bot(void) { return run(BOT, 5, ESP_OK); }
+static esp_err_t sdcard(void) { return run(SDCARD, 10, ESP_FAIL); }
+static esp_err_t timelapse(void) { return run(TIMELAPSE, 5, ESP_OK); }
+
+static esp_err_t gated(void)
+{
+    began_us[GATE] = esp_timer_get_time();
+    xSemaphoreTake(gate, portMAX_DELAY);
+    __atomic_fetch_or(&ran, BOOT_BIT(GATE), __ATOMIC_SEQ_CST);
+    return ESP_OK;
+}
+
+static const boot_stage_t table[STAGES] = {
+    [NVS]       = { "nvs", nvs, 0, 4096 },
+    [CAMERA]    = { "camera", camera, 0, 4096 },
+    [WIFI]      = { "wifi", wifi, BOOT_BIT(NVS), 4096 },
+    [TIME]      = { "time", timekeep, BOOT_BIT(NVS), 4096 },
+    [BOT]       = { "bot", bot, BOOT_BIT(CAMERA) | BOOT_BIT(WIFI) | BOOT_BIT(TIME), 4096 },
+    [SDCARD]    = { "sdcard", sdcard, 0, 4096 },
+    [TIMELAPSE] = { "timelapse", timelapse, BOOT_BIT(SDCARD) | BOOT_BIT(CAMERA), 4096 },
+    [GATE]      = { "gate", gated, 0, 4096 },
+};
+
+#define ALL ((1u << STAGES) - 1)
+
+static void test_before_start(void)
+{
+    boot_stage_status_t st;
+    CHECK(!boot_wait(BOOT_BIT(NVS), 0));
+    CHECK(!boot_get_status(0, &st));
+    CHECK_EQ(boot_stage_count(), 0);
+    CHECK_EQ(boot_start(table, 0), ESP_ERR_INVALID_ARG);
+    CHECK_EQ(boot_start(table, BOOT_MAX_STAGES + 1), ESP_ERR_INVALID_ARG);
+}
+
+static void test_boot(void)
+{
+    gate = xSemaphoreCreateBinary();
+    int64_t start = esp_timer_get_time();
+    REQUIRE(boot_start(table, STAGES) == ESP_OK);
+    CHECK_EQ(boot_stage_count(), STAGES);
+    CHECK_EQ(boot_start(table, STAGES), ESP_ERR_INVALID_ARG);
+
+    CHECK(boot_wait(BOOT_BIT(BOT), pdMS_TO_TICKS(5000)));
+    int64_t bot_ready = esp_timer_get_time() - start;
+
+    // Camera and Wi-Fi ran side by side, so the bot was up in about the
+    // longest chain (nvs, wifi, bot) rather than the sum of every stage
+    CHECK(began_us[CAMERA] < ended_us[WIFI] && began_us[WIFI] < ended_us[CAMERA]);
+    CHECK(bot_ready < (20 + 150 + 150 + 5 + 5) * 1000);
+    CHECK(began_us[BOT] >= ended_us[CAMERA] && began_us[BOT] >= ended_us[WIFI]);
+
+    // The gate stage is still running
+    CHECK(!boot_wait(BOOT_BIT(GATE), pdMS_TO_TICKS(50)));
+    boot_stage_status_t st;
+    CHECK(boot_get_status(GATE, &st));
+    CHECK(!st.done);
+    CHECK_EQ(st.done_ms, -1);
+    xSemaphoreGive(gate);
+    CHECK(boot_wait(BOOT_BIT(GATE), pdMS_TO_TICKS(5000)));
+
+    // The SD card failed: time-lapse is skipped, and waiting on it says so
+    CHECK(!boot_wait(BOOT_BIT(TIMELAPSE), pdMS_TO_TICKS(5000)));
+    CHECK(!boot_wait(BOOT_BIT(SDCARD), 0));
+    CHECK(!boot_wait(ALL, 0));
+    CHECK(boot_wait(ALL & ~BOOT_BIT(SDCARD) & ~BOOT_BIT(TIMELAPSE), 0));
+    CHECK_EQ(ran, ALL & ~BOOT_BIT(TIMELAPSE));
+
+    CHECK(boot_get_status(SDCARD, &st));
+    CHECK(st.done);
+    CHECK_EQ(st.result, ESP_FAIL);
+    CHECK(boot_get_status(TIMELAPSE, &st));
+    CHECK(st.done);
+    CHECK_EQ(st.result, ESP_ERR_INVALID_STATE);
+    CHECK(strcmp(st.name, "timelapse") == 0);
+    CHECK(st.ready_ms >= 0);
+
+    for (int i = 0; i < STAGES; i++) {
+        CHECK(boot_get_status(i, &st));
+        CHECK(st.done);
+        CHECK(st.ready_ms >= 0 && st.done_ms >= st.ready_ms);
+    }
+    CHECK(boot_get_status(WIFI, &st));
+    CHECK(st.ready_ms >= 15);
+    CHECK(!boot_get_status(STAGES, &st));
+}
+
+int main(void)
+{
+    RUN(test_before_start);
+    RUN(test_boot);
+    return TEST_DONE();
+}
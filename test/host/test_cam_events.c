@@ -0,0 +1,480 @@
+// cam_event_ring: the ISR -> cam_task hand-off never strands an event,
+// whatever the interleaving, and a model of the capture pipeline shows
+// what the ring buys over the old FreeRTOS queue
+#include <math.h>
+#include <string.h>
+#include "test.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "cam_event_ring.h"
+
+enum { EV_EOF, EV_VSYNC };
+
+// --- Lost wake-up ---
+//
+// Step by step, as the ISR and cam_task interleave on two cores. The
+// consumer mirrors cam_task: pop until empty, then block on a notification.
+
+typedef struct {
+    cam_event_ring_t ring;
+    uint32_t notified;      // Pending notifications
+    bool blocked;           // In ulTaskNotifyTake() with none pending
+    uint32_t received;
+} hand_off_t;
+
+// cam_task: drain, then take a notification or block
+static void consumer_run(hand_off_t *h)
+{
+    if (h->blocked) {
+        if (!h->notified) {
+            return;
+        }
+        h->notified = 0;
+        h->blocked = false;
+    }
+    cam_event_rec_t ev;
+    while (cam_event_ring_pop(&h->ring, &ev)) {
+        h->received++;
+    }
+    if (h->notified) {
+        // A stale notification only costs one empty pass
+        h->notified = 0;
+        consumer_run(h);
+        return;
+    }
+    h->blocked = true;
+}
+
+// The ISR in steps, so the consumer can run between any two of them. Before
+// the fix it woke cam_task only if the tail it read first equalled its head.
+typedef enum { WAKE_WHEN_EMPTY, WAKE_ALWAYS } wake_rule_t;
+
+static bool isr_post(hand_off_t *h, wake_rule_t rule, int consumer_at)
+{
+    if (consumer_at == 0) {
+        consumer_run(h);
+    }
+    uint32_t head = h->ring.head;
+    uint32_t tail = h->ring.tail;
+    cam_event_rec_t *rec = cam_event_ring_reserve(&h->ring);
+    if (!rec) {
+        return false;
+    }
+    rec->type = EV_EOF;
+    if (consumer_at == 1) {
+        consumer_run(h);
+    }
+    cam_event_ring_publish(&h->ring);
+    if (consumer_at == 2) {
+        consumer_run(h);
+    }
+    if (rule == WAKE_ALWAYS || head == tail) {
+        h->notified++;
+    }
+    if (consumer_at == 3) {
+        consumer_run(h);
+    }
+    return true;
+}
+
+static void test_lost_wakeup(void)
+{
+    // The reported sequence: one event queued, the ISR reads the tail, the
+    // task pops that event and blocks, the ISR publishes
+    hand_off_t h = {0};
+    CHECK(isr_post(&h, WAKE_WHEN_EMPTY, -1));
+    CHECK(isr_post(&h, WAKE_WHEN_EMPTY, 1));
+    CHECK(h.blocked);
+    CHECK_EQ(h.notified, 0);
+    CHECK_EQ(h.ring.head - h.ring.tail, 1);
+    // From here head != tail at every post, so the task never wakes and
+    // the ring overflows
+    int posted = 0;
+    while (isr_post(&h, WAKE_WHEN_EMPTY, 3)) {
+        posted++;
+    }
+    CHECK_EQ(posted, CAM_EVENT_RING_LEN - 1);
+    CHECK(h.blocked);
+
+    // The same sequence with a wake-up after every publish
+    h = (hand_off_t){0};
+    CHECK(isr_post(&h, WAKE_ALWAYS, -1));
+    CHECK(isr_post(&h, WAKE_ALWAYS, 1));
+    consumer_run(&h);
+    CHECK_EQ(h.received, 2);
+    CHECK_EQ(h.ring.head, h.ring.tail);
+
+    // Every point the task can run at, from every starting depth
+    for (uint32_t depth = 0; depth < CAM_EVENT_RING_LEN; depth++) {
+        for (int at = 0; at < 4; at++) {
+            h = (hand_off_t){0};
+            for (uint32_t i = 0; i < depth; i++) {
+                REQUIRE(isr_post(&h, WAKE_ALWAYS, -1));
+            }
+            consumer_run(&h);
+            CHECK(isr_post(&h, WAKE_ALWAYS, at));
+            // Whatever the task saw, it is either awake or has a wake-up
+            // pending, and the next run empties the ring
+            consumer_run(&h);
+            CHECK_EQ(h.received, depth + 1);
+            CHECK(h.blocked && !h.notified);
+        }
+    }
+}
+
+// --- Threads ---
+//
+// The producer posts as the ISR does, from another thread; the consumer is
+// a task blocked in ulTaskNotifyTake() whenever the ring is empty.
+
+#define THREAD_EVENTS   2000000
+
+static cam_event_ring_t ring;
+static TaskHandle_t consumer_task;
+static volatile uint32_t consumed;
+static volatile uint32_t out_of_order;
+static volatile uint32_t full;
+static SemaphoreHandle_t producer_done;
+
+static void consumer(void *arg)
+{
+    uint16_t expect = 0;
+    cam_event_rec_t ev;
+    for (;;) {
+        if (!cam_event_ring_pop(&ring, &ev)) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        if (ev.eof_seq != expect) {
+            out_of_order++;
+        }
+        expect = ev.eof_seq + 1;
+        __atomic_add_fetch(&consumed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void producer(void *arg)
+{
+    for (uint32_t i = 0; i < THREAD_EVENTS; i++) {
+        cam_event_rec_t *rec;
+        // A full ring stops capture on the target; here the ISR waits, so
+        // every event must come out
+        while (!(rec = cam_event_ring_reserve(&ring))) {
+            full++;
+            vTaskDelay(0);
+        }
+        rec->type = EV_EOF;
+        rec->eof_seq = (uint16_t)i;
+        cam_event_ring_publish(&ring);
+        BaseType_t woken = pdFALSE;
+        vTaskNotifyGiveFromISR(consumer_task, &woken);
+        // Bursts and pauses, so the consumer keeps emptying the ring and
+        // going back to sleep
+        if (i % 97 == 0) {
+            vTaskDelay(0);
+        }
+    }
+    xSemaphoreGive(producer_done);
+    vTaskDelete(NULL);
+}
+
+static void test_threads(void)
+{
+    cam_event_ring_reset(&ring);
+    producer_done = xSemaphoreCreateBinary();
+    REQUIRE(xTaskCreate(consumer, "cam_task", 4096, NULL, 23, &consumer_task) == pdPASS);
+    REQUIRE(xTaskCreate(producer, "isr", 4096, NULL, 24, NULL) == pdPASS);
+    REQUIRE(xSemaphoreTake(producer_done, pdMS_TO_TICKS(60000)) == pdTRUE);
+    // The last events must not wait for a wake-up that never comes
+    for (int i = 0; i < 1000 && consumed < THREAD_EVENTS; i++) {
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+    CHECK_EQ(consumed, THREAD_EVENTS);
+    CHECK_EQ(out_of_order, 0);
+    printf("  %u events, ring full %u times\n", (unsigned)consumed, (unsigned)full);
+}
+
+// --- Pipeline model ---
+//
+// The sensor streams JPEG continuously: VSYNC, then eofs_per_frame DMA EOFs
+// every eof_us. The consumer mirrors cam_task: IDLE waits for VSYNC and arms
+// the DMA; READ_BUF copies one half buffer per EOF and finishes the frame
+// on the next VSYNC. A higher priority task (WiFi, lwIP) preempts cam_task
+// for random bursts.
+//
+//   queue: the old FreeRTOS queue, depth half_cnt - 1, shared by EOF and
+//          VSYNC. Full stops the DMA and drops the frame. Nothing checks
+//          that a half buffer is still intact when it is copied.
+//   ring:  cam_event_ring_t. EOFs carry their DMA sequence number, and a
+//          frame is dropped only if the DMA lapped the half buffer during
+//          the copy.
+//
+// In PSRAM mode the DMA writes straight into the frame, so EOFs cost next
+// to nothing and there is no half buffer to lap.
+
+#define EOFS_PER_FRAME  24
+#define EOF_US          100.0
+#define COPY_US         40.0
+#define STALL_MAX_US    1500.0
+#define MODEL_FRAMES    20000
+#define MAX_STALLS      40000
+
+typedef struct {
+    int good;
+    int ovf;
+    int overrun;
+    int no_soi;
+    int corrupt;
+    uint32_t peak;
+} model_t;
+
+typedef struct {
+    uint8_t type;
+    uint8_t gen;
+    uint16_t seq;
+    double tpost;
+} model_ev_t;
+
+static double stall_start[MAX_STALLS];
+static double stall_end[MAX_STALLS];
+static int nstalls;
+static int stall_i;
+
+// Finish time of cost us of cam_task work starting at start
+static double run_for(double start, double cost)
+{
+    double t = start;
+    while (stall_i < nstalls && stall_end[stall_i] <= t) {
+        stall_i++;
+    }
+    int j = stall_i;
+    while (cost > 0) {
+        if (j < nstalls && stall_start[j] <= t && t < stall_end[j]) {
+            t = stall_end[j++];
+            continue;
+        }
+        double next = j < nstalls ? stall_start[j] : INFINITY;
+        double step = cost < next - t ? cost : next - t;
+        t += step;
+        cost -= step;
+    }
+    return t;
+}
+
+// Event FIFO: the old queue or the driver's ring
+static bool use_ring;
+static int queue_cap;
+static model_ev_t queue[CAM_EVENT_RING_LEN];
+static int queue_head;
+static int queue_len;
+static cam_event_ring_t model_ring;
+static double ring_tpost[CAM_EVENT_RING_LEN];
+
+static bool ev_push(model_ev_t ev, uint32_t *depth)
+{
+    if (use_ring) {
+        cam_event_rec_t *rec = cam_event_ring_reserve(&model_ring);
+        if (!rec) {
+            return false;
+        }
+        *rec = (cam_event_rec_t){ .type = ev.type, .gen = ev.gen, .eof_seq = ev.seq };
+        ring_tpost[rec - model_ring.rec] = ev.tpost;
+        *depth = cam_event_ring_publish(&model_ring);
+        return true;
+    }
+    if (queue_len >= queue_cap) {
+        return false;
+    }
+    queue[(queue_head + queue_len++) % CAM_EVENT_RING_LEN] = ev;
+    *depth = queue_len;
+    return true;
+}
+
+static bool ev_peek(model_ev_t *ev)
+{
+    if (use_ring) {
+        if (model_ring.head == model_ring.tail) {
+            return false;
+        }
+        const cam_event_rec_t *rec = &model_ring.rec[model_ring.tail & (CAM_EVENT_RING_LEN - 1)];
+        *ev = (model_ev_t){ rec->type, rec->gen, rec->eof_seq,
+                            ring_tpost[model_ring.tail & (CAM_EVENT_RING_LEN - 1)] };
+        return true;
+    }
+    if (!queue_len) {
+        return false;
+    }
+    *ev = queue[queue_head];
+    return true;
+}
+
+static void ev_pop(void)
+{
+    if (use_ring) {
+        cam_event_rec_t rec;
+        cam_event_ring_pop(&model_ring, &rec);
+        return;
+    }
+    queue_head = (queue_head + 1) % CAM_EVENT_RING_LEN;
+    queue_len--;
+}
+
+static model_t run_model(bool ring_mode, bool psram, int half_cnt, double stalls_per_s)
+{
+    srand48(7);
+    use_ring = ring_mode;
+    queue_cap = half_cnt - 1 > 1 ? half_cnt - 1 : 1;
+    queue_head = queue_len = 0;
+    cam_event_ring_reset(&model_ring);
+
+    double period = (EOFS_PER_FRAME + 2) * EOF_US;
+    double end = MODEL_FRAMES * period;
+    nstalls = stall_i = 0;
+    for (double t = 0; t < end && nstalls < MAX_STALLS; nstalls++) {
+        t += -log(1 - drand48()) * 1e6 / stalls_per_s;
+        stall_start[nstalls] = t;
+        stall_end[nstalls] = t + drand48() * STALL_MAX_US;
+    }
+
+    model_t m = {0};
+    bool dma_on = false;
+    uint8_t gen = 0;
+    uint16_t eof_seq = 0;
+    // Raise times of the current generation's EOFs
+    static double eof_time[65536];
+    int eof_n = 0;
+    double task_t = 0;
+    bool reading = false;
+    int cnt = 0;
+    enum { FRAME_OK, FRAME_NO_SOI, FRAME_CORRUPT } frame = FRAME_OK;
+
+    int nisr = MODEL_FRAMES * (EOFS_PER_FRAME + 1);
+    int i = 0;
+    model_ev_t ev;
+    while (i < nisr || ev_peek(&ev)) {
+        double next_isr = i < nisr ? (i / (EOFS_PER_FRAME + 1)) * period + (i % (EOFS_PER_FRAME + 1)) * EOF_US
+                                   : INFINITY;
+        // The task runs if it can start on its next event before the next ISR
+        if (ev_peek(&ev) && (task_t > ev.tpost ? task_t : ev.tpost) <= next_isr) {
+            ev_pop();
+            double s = task_t > ev.tpost ? task_t : ev.tpost;
+            if (!reading) {
+                task_t = run_for(s, 5);
+                if (ev.type == EV_VSYNC) {
+                    gen++;
+                    eof_seq = 0;
+                    eof_n = 0;
+                    dma_on = true;
+                    // Armed after the frame's first half buffer began
+                    frame = task_t - ev.tpost > EOF_US ? FRAME_NO_SOI : FRAME_OK;
+                    reading = true;
+                    cnt = 0;
+                }
+            } else if (ev.type == EV_EOF) {
+                if (ring_mode && ev.gen != gen) {
+                    task_t = run_for(s, 1);
+                    continue;
+                }
+                task_t = run_for(s, psram ? 1 : COPY_US);
+                if (cnt == 0 && frame == FRAME_NO_SOI) {
+                    dma_on = reading = false;
+                    m.no_soi++;
+                    continue;
+                }
+                int raised = 0;
+                while (raised < eof_n && eof_time[raised] <= task_t) {
+                    raised++;
+                }
+                if (!psram && raised - ev.seq >= half_cnt) {
+                    if (ring_mode) {
+                        dma_on = reading = false;
+                        m.overrun++;
+                        continue;
+                    }
+                    frame = FRAME_CORRUPT;
+                }
+                cnt++;
+            } else {
+                task_t = run_for(s, 10);
+                if (frame == FRAME_CORRUPT) {
+                    m.corrupt++;
+                } else {
+                    m.good++;
+                }
+                // cam_task re-arms straight away
+                gen++;
+                eof_seq = 0;
+                eof_n = 0;
+                dma_on = true;
+                frame = task_t - ev.tpost > EOF_US ? FRAME_NO_SOI : FRAME_OK;
+                cnt = 0;
+            }
+            continue;
+        }
+
+        bool eof = i % (EOFS_PER_FRAME + 1) != 0;
+        i++;
+        model_ev_t rec = { eof ? EV_EOF : EV_VSYNC, gen, eof_seq, next_isr };
+        if (eof) {
+            if (!dma_on) {
+                continue;
+            }
+            if (eof_n < (int)(sizeof(eof_time) / sizeof(eof_time[0]))) {
+                eof_time[eof_n++] = next_isr;
+            }
+            eof_seq++;
+        }
+        uint32_t depth;
+        if (!ev_push(rec, &depth)) {
+            dma_on = reading = false;
+            m.ovf++;
+            continue;
+        }
+        m.peak = depth > m.peak ? depth : m.peak;
+    }
+    return m;
+}
+
+static double good_pct(const model_t *m)
+{
+    int total = m->good + m->ovf + m->overrun + m->no_soi + m->corrupt;
+    return total ? 100.0 * m->good / total : 0;
+}
+
+static void test_model(void)
+{
+    static const struct {
+        bool psram;
+        int half_cnt;
+        double stalls_per_s;
+    } runs[] = {
+        { false, 8, 200 }, { false, 4, 500 }, { false, 16, 50 },
+        { true, 4, 200 }, { true, 8, 500 },
+    };
+    printf("  mode   half stalls/s | good%% queue -> ring | ovf queue -> ring | corrupt queue -> ring | peak\n");
+    for (size_t k = 0; k < sizeof(runs) / sizeof(runs[0]); k++) {
+        model_t q = run_model(false, runs[k].psram, runs[k].half_cnt, runs[k].stalls_per_s);
+        model_t r = run_model(true, runs[k].psram, runs[k].half_cnt, runs[k].stalls_per_s);
+        printf("  %-6s %4d %9.0f | %5.1f -> %5.1f     | %5d -> %5d     | %5d -> %5d         | %u\n",
+               runs[k].psram ? "PSRAM" : "copy", runs[k].half_cnt, runs[k].stalls_per_s,
+               good_pct(&q), good_pct(&r), q.ovf, r.ovf, q.corrupt, r.corrupt, (unsigned)r.peak);
+        // Never worse, and a lapped half buffer is dropped, not delivered
+        CHECK(good_pct(&r) >= good_pct(&q));
+        CHECK_EQ(r.corrupt, 0);
+        CHECK(r.ovf < q.ovf);
+        CHECK(r.peak <= CAM_EVENT_RING_LEN);
+        if (runs[k].psram) {
+            // Without copies the queue depth was the only limit
+            CHECK(good_pct(&r) > good_pct(&q) + 10);
+        }
+    }
+}
+
+int main(void)
+{
+    RUN(test_lost_wakeup);
+    RUN(test_threads);
+    RUN(test_model);
+    return TEST_DONE();
+}
@@ -0,0 +1,377 @@
+// cam_frame_ref: consumers sharing a frame through retain/release never see
+// it refilled under them, every slot goes back to the DMA exactly once, and
+// counts and pipeline peaks survive contention
+#include <string.h>
+#include <time.h>
+#include "test.h"
+#include "esp_camera.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "cam_frame_ref.h"
+
+#define SLOTS       2
+#define FRAME_BYTES (50 * 1024)
+#define CONSUMERS   3
+#define FRAMES      2000
+
+// cam_frame_t without the DMA fields
+typedef struct {
+    camera_fb_t fb;
+    uint8_t en;
+    uint32_t refs;
+} slot_t;
+
+static slot_t slots[SLOTS];
+static uint8_t bufs[SLOTS][FRAME_BYTES];
+static camera_stats_t stats;
+static QueueHandle_t frame_queue;
+static QueueHandle_t consumer_queue[CONSUMERS];
+static SemaphoreHandle_t consumers_done;
+static volatile bool dma_stop;
+
+static uint32_t refilled_held;      // Slots the DMA wrote while someone held them
+static uint32_t over_released;
+static uint32_t returned[SLOTS];    // Times each slot went back to the DMA
+static uint32_t handed_out[SLOTS];
+static double filled_ms[SLOTS];
+static uint32_t torn[CONSUMERS];
+static uint32_t seen[CONSUMERS];
+
+static double now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+static slot_t *slot_of(camera_fb_t *fb)
+{
+    return (slot_t *)fb;
+}
+
+// Every byte carries the frame's sequence number, so a refill shows
+static void fill(slot_t *s, uint32_t seq)
+{
+    memset(s->fb.buf, (uint8_t)seq, FRAME_BYTES);
+    s->fb.len = FRAME_BYTES;
+    s->fb.timestamp.tv_usec = seq;
+    filled_ms[s - slots] = now_ms();
+}
+
+static bool intact(const camera_fb_t *fb)
+{
+    uint8_t seq = (uint8_t)fb->timestamp.tv_usec;
+    for (size_t i = 0; i < fb->len; i += 509) {
+        if (fb->buf[i] != seq) {
+            return false;
+        }
+    }
+    return fb->buf[fb->len - 1] == seq;
+}
+
+// cam_task: refill only what the DMA owns, queue it for cam_take()
+static void dma_task(void *arg)
+{
+    uint32_t seq = 0;
+    while (!dma_stop) {
+        bool filled = false;
+        for (int i = 0; i < SLOTS; i++) {
+            slot_t *s = &slots[i];
+            if (!__atomic_load_n(&s->en, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            if (__atomic_load_n(&s->refs, __ATOMIC_RELAXED)) {
+                refilled_held++;
+            }
+            s->en = 0;
+            fill(s, seq++);
+            __atomic_fetch_add(&stats.frames_captured, 1, __ATOMIC_RELAXED);
+            REQUIRE(xQueueSend(frame_queue, &s, portMAX_DELAY) == pdTRUE);
+            cam_stat_peak(&stats.fb_queue_peak, uxQueueMessagesWaiting(frame_queue));
+            filled = true;
+        }
+        if (!filled) {
+            vTaskDelay(0);
+        }
+    }
+    vTaskDelete(NULL);
+}
+
+static camera_fb_t *take(void)
+{
+    slot_t *s;
+    REQUIRE(xQueueReceive(frame_queue, &s, pdMS_TO_TICKS(10000)) == pdTRUE);
+    // As cam_take(): the caller holds the only reference
+    s->refs = 1;
+    handed_out[s - slots]++;
+    // As cam_record_delivery()
+    uint32_t ms = (uint32_t)(now_ms() - filled_ms[s - slots]);
+    size_t bucket = 0;
+    while (bucket < CAMERA_LATENCY_BUCKETS - 1 && ms >= CAMERA_LATENCY_BUCKET_MS(bucket)) {
+        bucket++;
+    }
+    __atomic_fetch_add(&stats.frames_delivered, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats.latency_hist[bucket], 1, __ATOMIC_RELAXED);
+    cam_stat_peak(&stats.latency_max_ms, ms);
+    return &s->fb;
+}
+
+static void release(camera_fb_t *fb)
+{
+    slot_t *s = slot_of(fb);
+    uint32_t refs = cam_frame_ref_release(&s->refs);
+    if (refs == 0) {
+        __atomic_fetch_add(&over_released, 1, __ATOMIC_RELAXED);
+    } else if (refs == 1) {
+        __atomic_fetch_add(&returned[s - slots], 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->en, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Hold each frame for a while, as a slow HTTP client or uploader would
+static void consumer(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    unsigned seed = id + 1;
+    camera_fb_t *fb;
+    for (;;) {
+        xQueueReceive(consumer_queue[id], &fb, portMAX_DELAY);
+        if (!fb) {
+            break;
+        }
+        if (!intact(fb)) {
+            torn[id]++;
+        }
+        for (volatile int spin = rand_r(&seed) % 20000; spin > 0; spin--) {
+        }
+        if (!intact(fb)) {
+            torn[id]++;
+        }
+        seen[id]++;
+        release(fb);
+    }
+    xSemaphoreGive(consumers_done);
+    vTaskDelete(NULL);
+}
+
+static void test_shared_frames(void)
+{
+    for (int i = 0; i < SLOTS; i++) {
+        slots[i] = (slot_t){ .fb = { .buf = bufs[i] }, .en = 1 };
+    }
+    frame_queue = xQueueCreate(SLOTS, sizeof(slot_t *));
+    consumers_done = xSemaphoreCreateCounting(CONSUMERS, 0);
+    for (int i = 0; i < CONSUMERS; i++) {
+        consumer_queue[i] = xQueueCreate(SLOTS, sizeof(camera_fb_t *));
+        REQUIRE(xTaskCreate(consumer, "consumer", 4096, (void *)(intptr_t)i, 5, NULL) == pdPASS);
+    }
+    REQUIRE(xTaskCreate(dma_task, "cam_task", 4096, NULL, 23, NULL) == pdPASS);
+
+    for (int n = 0; n < FRAMES; n++) {
+        camera_fb_t *fb = take();
+        for (int i = 0; i < CONSUMERS; i++) {
+            CHECK(cam_frame_ref_retain(&slot_of(fb)->refs));
+            REQUIRE(xQueueSend(consumer_queue[i], &fb, portMAX_DELAY) == pdTRUE);
+        }
+        release(fb);
+    }
+    camera_fb_t *end = NULL;
+    for (int i = 0; i < CONSUMERS; i++) {
+        REQUIRE(xQueueSend(consumer_queue[i], &end, portMAX_DELAY) == pdTRUE);
+    }
+    for (int i = 0; i < CONSUMERS; i++) {
+        REQUIRE(xSemaphoreTake(consumers_done, pdMS_TO_TICKS(60000)) == pdTRUE);
+    }
+
+    // The last frames went back to the DMA and were refilled; take one
+    // more and let it go, then stop the DMA
+    camera_fb_t *fb = take();
+    uint32_t slot = slot_of(fb) - slots;
+    release(fb);
+    dma_stop = true;
+    vTaskDelay(pdMS_TO_TICKS(20));
+
+    CHECK_EQ(refilled_held, 0);
+    CHECK_EQ(over_released, 0);
+    for (int i = 0; i < CONSUMERS; i++) {
+        CHECK_EQ(seen[i], FRAMES);
+        CHECK_EQ(torn[i], 0);
+    }
+    uint32_t total = 0;
+    for (int i = 0; i < SLOTS; i++) {
+        CHECK_EQ(returned[i], handed_out[i]);
+        total += handed_out[i];
+    }
+    CHECK_EQ(total, FRAMES + 1);
+    CHECK_EQ(stats.frames_delivered, FRAMES + 1);
+    CHECK(stats.frames_captured >= stats.frames_delivered);
+    CHECK(stats.fb_queue_peak >= 1 && stats.fb_queue_peak <= SLOTS);
+    uint32_t hist = 0;
+    for (int i = 0; i < CAMERA_LATENCY_BUCKETS; i++) {
+        hist += stats.latency_hist[i];
+    }
+    CHECK_EQ(hist, stats.frames_delivered);
+
+    // A released frame cannot be picked back up, and a second release of
+    // it neither wraps the count nor hands the slot back again
+    CHECK(!cam_frame_ref_retain(&slots[slot].refs));
+    release(fb);
+    CHECK_EQ(over_released, 1);
+    CHECK_EQ(slots[slot].refs, 0);
+    CHECK_EQ(returned[slot], handed_out[slot]);
+    printf("  %u frames to %d consumers, queue peak %u, slowest %u ms\n",
+           (unsigned)total, CONSUMERS, (unsigned)stats.fb_queue_peak, (unsigned)stats.latency_max_ms);
+}
+
+// What sharing saves over each consumer copying the frame
+static void test_copy_cost(void)
+{
+    static uint8_t copies[CONSUMERS][FRAME_BYTES];
+    slot_t s = { .fb = { .buf = bufs[0], .len = FRAME_BYTES }, .refs = 1 };
+    const int rounds = 200;
+
+    double best_copy = 1e9, best_share = 1e9;
+    for (int r = 0; r < 5; r++) {
+        double t0 = now_ms();
+        for (int n = 0; n < rounds; n++) {
+            for (int i = 0; i < CONSUMERS; i++) {
+                memcpy(copies[i], s.fb.buf, s.fb.len);
+            }
+            __asm__ volatile("" ::: "memory");
+        }
+        double t1 = now_ms();
+        for (int n = 0; n < rounds; n++) {
+            for (int i = 0; i < CONSUMERS; i++) {
+                cam_frame_ref_retain(&s.refs);
+            }
+            for (int i = 0; i < CONSUMERS; i++) {
+                cam_frame_ref_release(&s.refs);
+            }
+            __asm__ volatile("" ::: "memory");
+        }
+        double t2 = now_ms();
+        best_copy = t1 - t0 < best_copy ? t1 - t0 : best_copy;
+        best_share = t2 - t1 < best_share ? t2 - t1 : best_share;
+    }
+    double copy_us = best_copy * 1e3 / rounds, share_us = best_share * 1e3 / rounds;
+    printf("  %d KB frame to %d consumers: copy %.2f us, retain %.3f us\n",
+           FRAME_BYTES / 1024, CONSUMERS, copy_us, share_us);
+    CHECK_EQ(s.refs, 1);
+    CHECK(share_us * 10 < copy_us);
+}
+
+// --- Contention ---
+//
+// The frame stays held throughout while every thread retains and releases
+// it at once, so a lost update shows as a count that drifts, or as a slot
+// handed back to the DMA while held. The ISR and cam_task raise the same
+// peaks; each writer offers rising values, so a lost update lets the mark
+// fall back.
+
+#define WRITERS     4
+#define ROUNDS      1000000
+
+static uint32_t shared_refs;
+static uint32_t early_return;       // Releases that saw the last reference
+static uint32_t retain_failed;
+static uint32_t peak;
+static uint32_t peak_fell;
+static volatile bool started;
+static volatile bool writers_running;
+static SemaphoreHandle_t writers_done;
+
+static void ref_writer(void *arg)
+{
+    while (!started) {
+    }
+    for (uint32_t i = 0; i < ROUNDS; i++) {
+        if (!cam_frame_ref_retain(&shared_refs)) {
+            __atomic_fetch_add(&retain_failed, 1, __ATOMIC_RELAXED);
+        }
+        if (cam_frame_ref_release(&shared_refs) <= 1) {
+            __atomic_fetch_add(&early_return, 1, __ATOMIC_RELAXED);
+        }
+    }
+    xSemaphoreGive(writers_done);
+    vTaskDelete(NULL);
+}
+
+static void peak_writer(void *arg)
+{
+    uint32_t id = (uint32_t)(intptr_t)arg;
+    while (!started) {
+    }
+    for (uint32_t i = 0; i < ROUNDS; i++) {
+        cam_stat_peak(&peak, i * WRITERS + id);
+    }
+    xSemaphoreGive(writers_done);
+    vTaskDelete(NULL);
+}
+
+static void peak_reader(void *arg)
+{
+    uint32_t last = 0;
+    while (writers_running) {
+        uint32_t n = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+        if (n < last) {
+            peak_fell++;
+        }
+        last = n;
+    }
+    xSemaphoreGive(writers_done);
+    vTaskDelete(NULL);
+}
+
+static void contend(TaskFunction_t writer, bool with_reader)
+{
+    writers_done = xSemaphoreCreateCounting(WRITERS + 1, 0);
+    started = false;
+    writers_running = true;
+    if (with_reader) {
+        REQUIRE(xTaskCreate(peak_reader, "reader", 4096, NULL, 5, NULL) == pdPASS);
+    }
+    for (int i = 0; i < WRITERS; i++) {
+        REQUIRE(xTaskCreate(writer, "writer", 4096, (void *)(intptr_t)i, 5, NULL) == pdPASS);
+    }
+    started = true;
+    for (int i = 0; i < WRITERS; i++) {
+        REQUIRE(xSemaphoreTake(writers_done, pdMS_TO_TICKS(60000)) == pdTRUE);
+    }
+    writers_running = false;
+    if (with_reader) {
+        REQUIRE(xSemaphoreTake(writers_done, pdMS_TO_TICKS(60000)) == pdTRUE);
+    }
+}
+
+static void test_contended_refs(void)
+{
+    shared_refs = 1;
+    contend(ref_writer, false);
+    CHECK_EQ(shared_refs, 1);
+    CHECK_EQ(early_return, 0);
+    CHECK_EQ(retain_failed, 0);
+}
+
+static void test_peaks(void)
+{
+    contend(peak_writer, true);
+    CHECK_EQ(peak, (ROUNDS - 1) * WRITERS + WRITERS - 1);
+    CHECK_EQ(peak_fell, 0);
+
+    // Lower values never pull it down
+    uint32_t before = peak;
+    cam_stat_peak(&peak, 0);
+    cam_stat_peak(&peak, before - 1);
+    CHECK_EQ(peak, before);
+}
+
+int main(void)
+{
+    RUN(test_shared_frames);
+    RUN(test_copy_cost);
+    RUN(test_contended_refs);
+    RUN(test_peaks);
+    return TEST_DONE();
+}
@@ -0,0 +1,150 @@
+// cry: synthetic cry episodes in noise raise an alert after the crying
+// starts and never before; speech, music, appliances and noise raise none.
+// Reports what each block of detection costs per sample.
+#include "audio_fixture.h"
+#include "cry.h"
+
+#define EPISODE_S       30
+#define CRY_AT_S        8
+#define CRY_LEN_S       15
+#define NEGATIVE_S      180
+
+typedef struct {
+    int alerts;
+    int first_ms;       // -1 without an alert
+    double ns;          // Processing time
+} run_result_t;
+
+static run_result_t run(const int16_t *pcm, int n, uint8_t sensitivity)
+{
+    run_result_t r = { .first_ms = -1 };
+    cry_detector_t d;
+    cry_init(&d, sensitivity);
+    int16_t block[CRY_BLOCK];
+    for (int b = 0; b + CRY_BLOCK <= n; b += CRY_BLOCK) {
+        memcpy(block, pcm + b, sizeof(block));
+        double t0 = audio_now_ms();
+        bool alert = cry_process(&d, block);
+        r.ns += (audio_now_ms() - t0) * 1e6;
+        if (alert) {
+            r.alerts++;
+            if (r.first_ms < 0) {
+                r.first_ms = (b + CRY_BLOCK) * 1000 / AUDIO_RATE;
+            }
+        }
+    }
+    return r;
+}
+
+static double total_ns;
+static long total_samples;
+
+// Every episode at 5 dB SNR and up is caught at the default sensitivity,
+// and at least as many at the most sensitive
+static void test_episodes(void)
+{
+    static const char *const noise_names[] = { "white", "pink", "fan" };
+    static const int snrs[] = { 20, 10, 5, 0 };
+    int caught[2] = { 0 };
+    int episodes = 0;
+    double latency = 0;
+    int n = EPISODE_S * AUDIO_RATE;
+    for (int noise = -1; noise < 3; noise++) {
+        for (size_t s = 0; s < sizeof(snrs) / sizeof(snrs[0]); s++) {
+            if (noise < 0 && s) {
+                break;
+            }
+            for (int take = 0; take < 2; take++) {
+                double dbfs = -28 + synth_uniform() * 14;
+                int snr = noise < 0 ? -1 : snrs[s];
+                int16_t *pcm = cry_episode(EPISODE_S, CRY_AT_S, CRY_LEN_S, dbfs, noise < 0 ? NOISE_WHITE : noise, snr);
+                run_result_t a = run(pcm, n, CRY_SENSITIVITY_DEFAULT);
+                run_result_t b = run(pcm, n, 10);
+                total_ns += a.ns;
+                total_samples += n;
+                printf("%-6s %3d dB, cry at %5.1f dBFS: %s %5d ms | sensitivity 10: %5d ms\n",
+                       noise < 0 ? "quiet" : noise_names[noise], noise < 0 ? 99 : snr, dbfs,
+                       a.first_ms >= 0 ? "alert at" : "no alert", a.first_ms, b.first_ms);
+                // Nothing before the crying starts, and one alert at most
+                // inside the holdoff
+                CHECK(a.first_ms < 0 || a.first_ms > CRY_AT_S * 1000);
+                CHECK(b.first_ms < 0 || b.first_ms > CRY_AT_S * 1000);
+                CHECK(a.alerts <= 1 && b.alerts <= 1);
+                if (snr < 0 || snr >= 5) {
+                    CHECK(a.first_ms > 0);
+                }
+                if (a.first_ms > 0) {
+                    CHECK(b.first_ms > 0);
+                    latency += a.first_ms - CRY_AT_S * 1000;
+                }
+                caught[0] += a.first_ms > 0;
+                caught[1] += b.first_ms > 0;
+                episodes++;
+                free(pcm);
+            }
+        }
+    }
+    printf("caught %d/%d, %d/%d at sensitivity 10, mean latency %.1f s\n",
+           caught[0], episodes, caught[1], episodes, latency / caught[0] / 1000);
+    CHECK(caught[0] && latency / caught[0] < 6000);
+}
+
+// Minutes of each non-cry sound, at both ends of the sensitivity range
+static void test_negatives(void)
+{
+    int n = NEGATIVE_S * AUDIO_RATE;
+    for (sound_t kind = 0; kind < SOUND_COUNT; kind++) {
+        int16_t *pcm = sound(kind, NEGATIVE_S);
+        run_result_t a = run(pcm, n, CRY_SENSITIVITY_DEFAULT);
+        run_result_t b = run(pcm, n, 10);
+        total_ns += a.ns;
+        total_samples += n;
+        printf("%-14s %d s: %d alerts, %d at sensitivity 10\n", sound_names[kind], NEGATIVE_S, a.alerts, b.alerts);
+        CHECK_EQ(a.alerts, 0);
+        CHECK_EQ(b.alerts, 0);
+        free(pcm);
+    }
+}
+
+// A wail that goes on alerts once per holdoff, not once per burst
+static void test_holdoff(void)
+{
+    int len = CRY_HOLDOFF_MS / 1000 * 2 + 10;
+    int16_t *pcm = cry_episode(len, 0, len, -20, NOISE_WHITE, -1);
+    cry_detector_t d;
+    cry_init(&d, CRY_SENSITIVITY_DEFAULT);
+    int16_t block[CRY_BLOCK];
+    int last_ms = -CRY_HOLDOFF_MS;
+    int alerts = 0;
+    for (int b = 0; b + CRY_BLOCK <= len * AUDIO_RATE; b += CRY_BLOCK) {
+        memcpy(block, pcm + b, sizeof(block));
+        if (cry_process(&d, block)) {
+            int ms = b * 1000 / AUDIO_RATE;
+            printf("alert at %d ms\n", ms);
+            CHECK(ms - last_ms >= CRY_HOLDOFF_MS);
+            last_ms = ms;
+            alerts++;
+        }
+    }
+    CHECK(alerts == 2 || alerts == 3);
+    free(pcm);
+}
+
+static void test_cost(void)
+{
+    double ns = total_ns / total_samples;
+    // The ESP32 is far slower per sample; this guards against the cost
+    // growing, the device reports its own load under /sound test
+    printf("%.1f ns/sample over %.0f s of audio, %.3f%% of real time\n",
+           ns, (double)total_samples / AUDIO_RATE, ns * AUDIO_RATE / 1e7);
+    CHECK(ns < 500);
+}
+
+int main(void)
+{
+    RUN(test_episodes);
+    RUN(test_negatives);
+    RUN(test_holdoff);
+    RUN(test_cost);
+    return TEST_DONE();
+}
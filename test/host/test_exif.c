@@ -0,0 +1,234 @@
+// exif: the APP1 segment is a valid big-endian TIFF structure whose tags
+// carry the capture info, fits EXIF_MAX_BYTES for any input, and is
+// refused rather than truncated when the buffer is too small
+#include <string.h>
+#include "test.h"
+#include "exif.h"
+
+typedef struct {
+    const uint8_t *seg;
+    size_t len;
+    const uint8_t *tiff;
+    size_t tiff_len;
+} exif_t;
+
+typedef struct {
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    const uint8_t *value;   // Inline or at its offset, NULL if out of bounds
+} entry_t;
+
+static uint16_t be16(const uint8_t *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static uint32_t be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static size_t type_size(uint16_t type)
+{
+    switch (type) {
+    case 2: case 7: return 1;   // ASCII, UNDEFINED
+    case 3:         return 2;   // SHORT
+    case 4:         return 4;   // LONG
+    default:        return 0;
+    }
+}
+
+// Check the APP1 and TIFF headers; false if they are wrong
+static bool parse(const uint8_t *seg, size_t len, exif_t *e)
+{
+    CHECK(len >= 18);
+    CHECK_EQ(be16(seg), 0xFFE1);
+    CHECK_EQ(be16(seg + 2), len - 2);
+    CHECK(memcmp(seg + 4, "Exif\0\0", 6) == 0);
+    CHECK(memcmp(seg + 10, "MM", 2) == 0);
+    CHECK_EQ(be16(seg + 12), 42);
+    CHECK_EQ(be32(seg + 14), 8);
+    e->seg = seg;
+    e->len = len;
+    e->tiff = seg + 10;
+    e->tiff_len = len - 10;
+    return len >= 18 && be16(seg) == 0xFFE1;
+}
+
+// Read the IFD at offset into entries; returns the count. Checks ordering,
+// types, bounds and the next-IFD link.
+static int read_ifd(const exif_t *e, uint32_t offset, entry_t *entries, int max)
+{
+    REQUIRE(offset % 2 == 0 && offset + 2 <= e->tiff_len);
+    int n = be16(e->tiff + offset);
+    REQUIRE(n <= max && offset + 2 + n * 12 + 4 <= e->tiff_len);
+    for (int i = 0; i < n; i++) {
+        const uint8_t *p = e->tiff + offset + 2 + i * 12;
+        entry_t *en = &entries[i];
+        en->tag = be16(p);
+        en->type = be16(p + 2);
+        en->count = be32(p + 4);
+        size_t bytes = type_size(en->type) * en->count;
+        CHECK(type_size(en->type) != 0);
+        if (i) {
+            CHECK(en->tag > entries[i - 1].tag);
+        }
+        if (bytes <= 4) {
+            en->value = p + 8;
+        } else {
+            uint32_t at = be32(p + 8);
+            CHECK(at % 2 == 0);
+            en->value = at + bytes <= e->tiff_len ? e->tiff + at : NULL;
+            CHECK(en->value != NULL);
+            // Values live past the IFD, not inside a header or an entry
+            CHECK(at >= offset + 2 + n * 12 + 4);
+        }
+        if (en->type == 2 && en->value) {
+            CHECK_EQ(en->value[en->count - 1], 0);
+        }
+    }
+    CHECK_EQ(be32(e->tiff + offset + 2 + n * 12), 0);
+    return n;
+}
+
+static const entry_t *find(const entry_t *entries, int n, uint16_t tag)
+{
+    for (int i = 0; i < n; i++) {
+        if (entries[i].tag == tag) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+static bool is_ascii(const entry_t *en, const char *want)
+{
+    return en && en->type == 2 && en->value && en->count == strlen(want) + 1 &&
+           memcmp(en->value, want, en->count) == 0;
+}
+
+static long number(const entry_t *en)
+{
+    if (!en || en->count != 1) {
+        return -1;
+    }
+    return en->type == 3 ? be16(en->value) : en->type == 4 ? (long)be32(en->value) : -1;
+}
+
+typedef struct {
+    entry_t ifd0[16];
+    entry_t sub[16];
+    int n0;
+    int n1;
+} tags_t;
+
+static size_t build_and_read(const exif_info_t *info, tags_t *t)
+{
+    uint8_t seg[EXIF_MAX_BYTES + 16];
+    memset(seg, 0xAA, sizeof(seg));
+    size_t len = exif_build(info, seg, EXIF_MAX_BYTES);
+    REQUIRE(len > 0 && len <= EXIF_MAX_BYTES);
+    CHECK_EQ(seg[EXIF_MAX_BYTES], 0xAA);
+
+    static uint8_t copy[EXIF_MAX_BYTES];
+    memcpy(copy, seg, len);
+    exif_t e;
+    REQUIRE(parse(copy, len, &e));
+    t->n0 = read_ifd(&e, 8, t->ifd0, 16);
+    long sub = number(find(t->ifd0, t->n0, 0x8769));
+    REQUIRE(sub > 0);
+    t->n1 = read_ifd(&e, sub, t->sub, 16);
+    return len;
+}
+
+static void test_full(void)
+{
+    exif_info_t info = {
+        .time = 1792329296,     // 2026-10-18 13:14:56 UTC
+        .msec = 7,
+        .width = 1024,
+        .height = 768,
+        .exposure_lines = 312,
+        .gain_x16 = 40,
+        .flash = true,
+    };
+    tags_t t;
+    build_and_read(&info, &t);
+    CHECK(is_ascii(find(t.ifd0, t.n0, 0x010E), "Exposure 312 rows, gain 2.50x"));
+    CHECK(is_ascii(find(t.ifd0, t.n0, 0x010F), "Espressif"));
+    CHECK(find(t.ifd0, t.n0, 0x0110) != NULL);
+    CHECK(is_ascii(find(t.ifd0, t.n0, 0x0132), "2026:10:18 13:14:56"));
+    CHECK_EQ(number(find(t.sub, t.n1, 0x8827)), 250);
+    const entry_t *version = find(t.sub, t.n1, 0x9000);
+    CHECK(version && version->type == 7 && version->count == 4 && memcmp(version->value, "0232", 4) == 0);
+    CHECK(is_ascii(find(t.sub, t.n1, 0x9003), "2026:10:18 13:14:56"));
+    CHECK(is_ascii(find(t.sub, t.n1, 0x9011), "+00:00"));
+    CHECK_EQ(number(find(t.sub, t.n1, 0x9209)), 0x09);
+    CHECK(is_ascii(find(t.sub, t.n1, 0x9291), "007"));
+    CHECK_EQ(number(find(t.sub, t.n1, 0xA002)), 1024);
+    CHECK_EQ(number(find(t.sub, t.n1, 0xA003)), 768);
+}
+
+static void test_bare(void)
+{
+    // No clock and no sensor state: those tags are left out, not zeroed
+    exif_info_t info = { .width = 640, .height = 480 };
+    tags_t t;
+    build_and_read(&info, &t);
+    CHECK(find(t.ifd0, t.n0, 0x010E) == NULL);
+    CHECK(find(t.ifd0, t.n0, 0x0132) == NULL);
+    CHECK(find(t.sub, t.n1, 0x8827) == NULL);
+    CHECK(find(t.sub, t.n1, 0x9003) == NULL);
+    CHECK(find(t.sub, t.n1, 0x9291) == NULL);
+    CHECK_EQ(number(find(t.sub, t.n1, 0x9209)), 0x10);
+    CHECK_EQ(number(find(t.sub, t.n1, 0xA002)), 640);
+    CHECK_EQ(number(find(t.sub, t.n1, 0xA003)), 480);
+}
+
+static void test_largest(void)
+{
+    // Every field at its widest still fits EXIF_MAX_BYTES
+    exif_info_t info = {
+        .time = 253402300799,   // 9999-12-31 23:59:59
+        .msec = 65535,
+        .width = 65535,
+        .height = 65535,
+        .exposure_lines = 65535,
+        .gain_x16 = 65535,
+        .flash = true,
+    };
+    tags_t t;
+    build_and_read(&info, &t);
+    CHECK(is_ascii(find(t.ifd0, t.n0, 0x0132), "9999:12:31 23:59:59"));
+    CHECK(is_ascii(find(t.sub, t.n1, 0x9291), "535"));
+    CHECK(is_ascii(find(t.ifd0, t.n0, 0x010E), "Exposure 65535 rows, gain 4095.93x"));
+}
+
+static void test_too_small(void)
+{
+    exif_info_t info = { .time = 1792329296, .width = 1024, .height = 768, .exposure_lines = 100, .gain_x16 = 16 };
+    uint8_t seg[EXIF_MAX_BYTES];
+    size_t len = exif_build(&info, seg, sizeof(seg));
+    REQUIRE(len > 0);
+    memset(seg, 0xAA, sizeof(seg));
+    CHECK_EQ(exif_build(&info, seg, len - 1), 0);
+    CHECK_EQ(exif_build(&info, seg, 0), 0);
+    // Nothing written when it does not fit
+    for (size_t i = 0; i < sizeof(seg); i++) {
+        CHECK_EQ(seg[i], 0xAA);
+        if (seg[i] != 0xAA) {
+            break;
+        }
+    }
+    CHECK_EQ(exif_build(&info, seg, len), len);
+}
+
+int main(void)
+{
+    RUN(test_full);
+    RUN(test_bare);
+    RUN(test_largest);
+    RUN(test_too_small);
+    return TEST_DONE();
+}
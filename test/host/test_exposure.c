@@ -0,0 +1,346 @@
+// exposure: the convergence tracker, replayed on samples from a synthetic
+// OV2640-like AEC under the flash and on hand-made traces. It must call
+// STABLE only once the AEC has settled in its window, PINNED only once it
+// sits at a limit outside it, and TIMEOUT at EXPOSURE_TIMEOUT_MS otherwise.
+// Steadiness counts driver frames, never polls.
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include "test.h"
+#include "esp_camera.h"
+#include "trace.h"
+#include "exposure.h"
+
+// The sensor's AEC: window AEB..AEW around the target, exposure up to a
+// full UXGA frame of rows, gain up to 8x
+#define WINDOW_LOW      0x38
+#define WINDOW_HIGH     0x40
+#define TARGET          60.0
+#define MAX_LINES       1248
+#define MAX_GAIN        8.0
+#define RUNS            20
+
+// exposure_wait_flash() is not run here, only the tracker it is built on
+esp_err_t esp_camera_get_stats(camera_stats_t *out)
+{
+    memset(out, 0, sizeof(*out));
+    return ESP_OK;
+}
+
+void trace_event(trace_id_t id, trace_kind_t kind, uint32_t arg)
+{
+}
+
+// Sensitivity S is exposure lines times gain. A frame's mean luma is S
+// times the light on the subject, ambient plus the part of the frame the
+// flash was on for. The AEC looks at each completed frame: far off target
+// it jumps (at most 4x), near it steps by 1/8 until inside the window. What
+// it writes applies from the next frame on.
+typedef struct {
+    double ambient, flash;
+    double frame_ms, flicker;
+    double S;               // What the AEC has written
+    double latched;         // What the frame being exposed uses
+    double phase_ms;        // When frame 0 ended, before the flash
+    uint32_t frames;
+    double luma;            // YAVG of the last completed frame
+    unsigned rng;
+} aec_t;
+
+static double noise(aec_t *m)
+{
+    m->rng = m->rng * 1103515245 + 12345;
+    return ((m->rng >> 16) % 1000 / 1000.0 - 0.5) * 1.6;
+}
+
+static uint16_t lines_of(double S)
+{
+    return (uint16_t)fmin(MAX_LINES, fmax(1, round(S)));
+}
+
+static uint16_t gain_of(double S)
+{
+    return (uint16_t)round(fmin(MAX_GAIN, fmax(1, S / lines_of(S))) * 16);
+}
+
+static double quantize(double S)
+{
+    return lines_of(S) * gain_of(S) / 16.0;
+}
+
+static void aec_react(aec_t *m)
+{
+    double r = 1;
+    if (m->luma < 32 || m->luma > 128) {
+        r = fmin(4, fmax(0.25, TARGET / fmax(m->luma, 1)));
+    } else if (m->luma < WINDOW_LOW) {
+        r = 1.125;
+    } else if (m->luma > WINDOW_HIGH) {
+        r = 1 / 1.125;
+    }
+    m->S = quantize(fmin(MAX_LINES * MAX_GAIN, fmax(1, m->S * r)));
+}
+
+// Completes every frame that ended by t ms after the flash went on
+static void aec_advance(aec_t *m, double t)
+{
+    for (;;) {
+        double end = m->phase_ms + m->frames * m->frame_ms;
+        if (end > t) {
+            return;
+        }
+        double start = end - m->frame_ms;
+        double lit = fmin(1, fmax(0, end - fmax(start, 0)) / m->frame_ms);
+        double light = m->ambient * (1 + m->flicker * sin(2 * M_PI * start / 10)) + m->flash * lit;
+        m->luma = round(fmax(0, fmin(255, m->latched * light / 100 + noise(m))));
+        m->frames++;
+        aec_react(m);
+        m->latched = m->S;
+    }
+}
+
+// The AEC settled on ambient light, then the flash comes on at t = 0
+static void aec_init(aec_t *m, double ambient, double flash, double frame_ms, double flicker, unsigned seed)
+{
+    memset(m, 0, sizeof(*m));
+    m->rng = seed * 7919 + 1;
+    m->ambient = ambient;
+    m->frame_ms = frame_ms;
+    m->flicker = flicker;
+    m->phase_ms = -(double)(noise(m) + 0.8) / 1.6 * frame_ms;
+    m->S = m->latched = quantize(fmin(100 * TARGET / ambient, MAX_LINES * MAX_GAIN));
+    aec_advance(m, -1e-9);
+    m->flash = flash;
+}
+
+static exposure_sample_t aec_sample(const aec_t *m)
+{
+    return (exposure_sample_t){
+        .luma = (uint8_t)m->luma,
+        .lines = lines_of(m->S),
+        .gain_x16 = gain_of(m->S),
+        .frame = m->frames,
+    };
+}
+
+typedef struct {
+    exposure_state_t state;
+    uint32_t ms;
+    exposure_sample_t last;
+    double S;
+} outcome_t;
+
+// Polls the model the way exposure_wait_flash() does until the tracker
+// decides. The AEC then runs on for ten more frames: what it does after
+// the call tells whether the call was right.
+static outcome_t replay(aec_t *m, outcome_t *after)
+{
+    exposure_tracker_t t;
+    exposure_sample_t s = aec_sample(m);
+    exposure_tracker_init(&t, WINDOW_LOW, WINDOW_HIGH, &s);
+    outcome_t out = { EXPOSURE_WAIT };
+    for (uint32_t ms = EXPOSURE_POLL_MS; out.state == EXPOSURE_WAIT; ms += EXPOSURE_POLL_MS) {
+        aec_advance(m, ms);
+        s = aec_sample(m);
+        out = (outcome_t){ exposure_tracker_step(&t, &s, ms), ms, s, m->S };
+        // Whatever it decides, it knows when the values last changed
+        CHECK(t.steady_ms <= ms);
+        REQUIRE(ms <= 2 * EXPOSURE_TIMEOUT_MS);
+    }
+    aec_advance(m, out.ms + 10 * m->frame_ms);
+    *after = (outcome_t){ out.state, out.ms, aec_sample(m), m->S };
+    return out;
+}
+
+typedef struct {
+    const char *name;
+    double ambient, flash, frame_ms, flicker;
+    exposure_state_t want;
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    { "dim room, XGA",          25,   60,  80, 0,    EXPOSURE_STABLE },
+    { "dim room, VGA",          25,   60,  40, 0,    EXPOSURE_STABLE },
+    { "flickering lamp, XGA",   25,   60,  80, 0.15, EXPOSURE_STABLE },
+    // The flash adds 3%: nothing moves, and the first frames decide
+    { "daylight, XGA",        2000,   60,  80, 0,    EXPOSURE_STABLE },
+    // Full exposure and gain, and still darker than the window
+    { "far subject, dark, XGA", 0.1,   0.3, 80, 0,    EXPOSURE_PINNED },
+    // Brighter than the shortest exposure can take
+    { "sunlit, XGA",          2e6,    60,  80, 0,    EXPOSURE_PINNED },
+    // The jumps down and the 1/8 steps back take longer than the timeout
+    // at a sixth of a second a frame
+    { "dark room, UXGA",         2,   60, 160, 0,    EXPOSURE_TIMEOUT },
+};
+
+static const char *state_name(exposure_state_t s)
+{
+    static const char *names[] = { "wait", "stable", "pinned", "timeout", "predicted" };
+    return names[s];
+}
+
+static void test_synthetic_aec(void)
+{
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        const scenario_t *sc = &scenarios[i];
+        int right = 0;
+        uint32_t slowest = 0;
+        for (unsigned seed = 0; seed < RUNS; seed++) {
+            aec_t m;
+            outcome_t after;
+            aec_init(&m, sc->ambient, sc->flash, sc->frame_ms, sc->flicker, seed);
+            outcome_t out = replay(&m, &after);
+            right += out.state == sc->want;
+            slowest = out.ms > slowest ? out.ms : slowest;
+            switch (out.state) {
+            case EXPOSURE_STABLE:
+                // In the window, and the AEC has nothing left to do
+                CHECK(out.last.luma >= WINDOW_LOW && out.last.luma <= WINDOW_HIGH);
+                CHECK(after.S == out.S);
+                CHECK(out.ms < EXPOSURE_TIMEOUT_MS);
+                break;
+            case EXPOSURE_PINNED:
+                // Outside the window, and the AEC can't do anything about it
+                CHECK(out.last.luma < WINDOW_LOW || out.last.luma > WINDOW_HIGH);
+                CHECK(after.S == out.S);
+                CHECK(out.S == quantize(1) || out.S == quantize(MAX_LINES * MAX_GAIN));
+                break;
+            case EXPOSURE_TIMEOUT:
+                // Not before, and at the first poll after
+                CHECK(out.ms >= EXPOSURE_TIMEOUT_MS && out.ms < EXPOSURE_TIMEOUT_MS + EXPOSURE_POLL_MS);
+                break;
+            default:
+                CHECK(false);
+            }
+        }
+        printf("%-24s %d/%d %s, slowest %u ms\n", sc->name, right, RUNS, state_name(sc->want), (unsigned)slowest);
+        CHECK_EQ(right, RUNS);
+    }
+}
+
+typedef struct {
+    exposure_tracker_t t;
+    exposure_sample_t s;
+    uint32_t ms;
+} trace_t;
+
+static void trace_start(trace_t *tr, uint8_t luma, uint32_t frame)
+{
+    tr->s = (exposure_sample_t){ .luma = luma, .lines = 600, .gain_x16 = 32, .frame = frame };
+    tr->ms = 0;
+    exposure_tracker_init(&tr->t, WINDOW_LOW, WINDOW_HIGH, &tr->s);
+}
+
+// The next poll, frames later, with luma and exposure lines as given
+static exposure_state_t poll(trace_t *tr, uint32_t frames, uint8_t luma, uint16_t lines)
+{
+    tr->ms += EXPOSURE_POLL_MS;
+    tr->s.frame += frames;
+    tr->s.luma = luma;
+    tr->s.lines = lines;
+    return exposure_tracker_step(&tr->t, &tr->s, tr->ms);
+}
+
+static void test_steady_frames(void)
+{
+    trace_t tr;
+    // The AEC moves, then holds in the window: stable after two whole
+    // frames, however many polls saw the same frame
+    trace_start(&tr, 180, 10);
+    CHECK_EQ(poll(&tr, 1, 70, 300), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 1, 60, 260), EXPOSURE_WAIT);
+    uint32_t settled_ms = tr.ms;
+    for (int i = 0; i < 20; i++) {
+        CHECK_EQ(poll(&tr, 0, 60, 260), EXPOSURE_WAIT);
+    }
+    CHECK_EQ(poll(&tr, 1, 60, 260), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 1, 60, 260), EXPOSURE_STABLE);
+    CHECK_EQ(tr.t.steady_ms, settled_ms);
+
+    // Luma noise within the tolerance doesn't restart the count
+    trace_start(&tr, 180, 10);
+    CHECK_EQ(poll(&tr, 1, 60, 260), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 1, 60 + EXPOSURE_LUMA_TOLERANCE, 260), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 1, 60, 260), EXPOSURE_STABLE);
+
+    // Beyond it, it does, every frame
+    trace_start(&tr, 180, 10);
+    uint8_t luma = 60;
+    while (tr.ms < EXPOSURE_TIMEOUT_MS - EXPOSURE_POLL_MS) {
+        luma = luma == 60 ? 60 + EXPOSURE_LUMA_TOLERANCE + 1 : 60;
+        CHECK_EQ(poll(&tr, 1, luma, 260), EXPOSURE_WAIT);
+    }
+    CHECK_EQ(poll(&tr, 1, 60, 260), EXPOSURE_TIMEOUT);
+
+    // Frame counts wrap
+    trace_start(&tr, 180, UINT32_MAX - 1);
+    CHECK_EQ(poll(&tr, 1, 60, 260), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 1, 60, 260), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 1, 60, 260), EXPOSURE_STABLE);
+}
+
+static void test_pinned(void)
+{
+    trace_t tr;
+    // Moved, then steady below the window: twice as many frames before
+    // that counts as a limit rather than an AEC step
+    trace_start(&tr, 10, 0);
+    CHECK_EQ(poll(&tr, 1, 40, 1248), EXPOSURE_WAIT);
+    for (int i = 0; i < 2 * EXPOSURE_STEADY_FRAMES - 1; i++) {
+        CHECK_EQ(poll(&tr, 1, 40, 1248), EXPOSURE_WAIT);
+    }
+    CHECK_EQ(poll(&tr, 1, 40, 1248), EXPOSURE_PINNED);
+
+    // Above it, the same
+    trace_start(&tr, 200, 0);
+    CHECK_EQ(poll(&tr, 1, 240, 1), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 2 * EXPOSURE_STEADY_FRAMES - 1, 240, 1), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 1, 240, 1), EXPOSURE_PINNED);
+}
+
+static void test_unmoved(void)
+{
+    trace_t tr;
+    // The flash changes nothing: EXPOSURE_MIN_FRAMES frames decide, stable
+    // in the window, pinned outside it
+    trace_start(&tr, 60, 0);
+    CHECK_EQ(poll(&tr, EXPOSURE_MIN_FRAMES - 1, 61, 600), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 0, 60, 600), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 1, 59, 600), EXPOSURE_STABLE);
+
+    trace_start(&tr, 250, 0);
+    CHECK_EQ(poll(&tr, EXPOSURE_MIN_FRAMES - 1, 250, 600), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 1, 250, 600), EXPOSURE_PINNED);
+
+    // A frame that drifted back to the start still counts as moved
+    trace_start(&tr, 60, 0);
+    CHECK_EQ(poll(&tr, 1, 60, 500), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 1, 60, 600), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 1, 60, 600), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 1, 60, 600), EXPOSURE_STABLE);
+
+    // So does luma that crept out of the window in steps within the
+    // tolerance: it is an AEC still at work, not the flash making no
+    // difference
+    trace_start(&tr, 64, 0);
+    CHECK_EQ(poll(&tr, 1, 66, 600), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 1, 68, 600), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 1, 70, 600), EXPOSURE_WAIT);
+    CHECK_EQ(poll(&tr, 1, 70, 600), EXPOSURE_PINNED);
+
+    // No frames at all, as with a stalled driver: only the timeout ends it
+    trace_start(&tr, 60, 0);
+    while (tr.ms < EXPOSURE_TIMEOUT_MS - EXPOSURE_POLL_MS) {
+        CHECK_EQ(poll(&tr, 0, 60, 600), EXPOSURE_WAIT);
+    }
+    CHECK_EQ(poll(&tr, 0, 60, 600), EXPOSURE_TIMEOUT);
+}
+
+int main(void)
+{
+    RUN(test_synthetic_aec);
+    RUN(test_steady_frames);
+    RUN(test_pinned);
+    RUN(test_unmoved);
+    return TEST_DONE();
+}
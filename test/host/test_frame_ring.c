@@ -0,0 +1,387 @@
+// frame_ring: content and order survive eviction and wraparound, pinned
+// frames are never overwritten, batches and statistics add up. An append
+// costs the same however many frames the ring holds, a flush copies
+// nothing, and neither allocates.
+#include <string.h>
+#include <time.h>
+#include "test.h"
+#include "frame_ring.h"
+
+#define FRAME_MS 100
+
+static uint8_t src[200000];
+static int64_t clock_us = 1000000;
+
+static void fill(uint8_t *buf, size_t len, uint32_t seed)
+{
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (uint8_t)(seed + i * 7);
+    }
+}
+
+// A frame whose bytes derive from its timestamp, so a sink can check them
+static esp_err_t append(frame_ring_t *ring, size_t len)
+{
+    camera_fb_t fb = { 0 };
+    clock_us += FRAME_MS * 1000;
+    fb.buf = src;
+    fb.len = len;
+    fb.width = 1024;
+    fb.height = 768;
+    fb.timestamp.tv_sec = clock_us / 1000000;
+    fb.timestamp.tv_usec = clock_us % 1000000;
+    fill(src, len, (uint32_t)(clock_us / 1000));
+    return frame_ring_append(ring, &fb);
+}
+
+typedef struct {
+    int frames;
+    int64_t last_us;
+    int fail_after;         // Refuse the frame after this many, 0 for never
+    frame_ring_t *ring;     // Append into it from inside the sink
+    frame_ring_t *overlap;  // Flush it whole from inside the first call
+} sink_ctx_t;
+
+static uint8_t ref[200000];
+
+static void check_frame(const camera_fb_t *f, sink_ctx_t *c)
+{
+    int64_t ts = (int64_t)f->timestamp.tv_sec * 1000000 + f->timestamp.tv_usec;
+    fill(ref, f->len, (uint32_t)(ts / 1000));
+    CHECK(memcmp(f->buf, ref, f->len) == 0);
+    CHECK(ts > c->last_us);
+    CHECK_EQ(f->width, 1024);
+    CHECK_EQ(f->format, PIXFORMAT_JPEG);
+    c->last_us = ts;
+}
+
+static esp_err_t sink(const camera_fb_t *f, void *ctx)
+{
+    sink_ctx_t *c = ctx;
+    if (c->fail_after && c->frames == c->fail_after) {
+        return ESP_FAIL;
+    }
+    check_frame(f, c);
+    c->frames++;
+    if (c->overlap) {
+        // A second flush starts and ends while this one is still out
+        sink_ctx_t inner = { 0 };
+        CHECK(frame_ring_flush(c->overlap, 0, sink, &inner) >= 8);
+        c->overlap = NULL;
+    }
+    if (c->ring) {
+        // Fills the arena while this flush pins the stored frames
+        append(c->ring, 200000);
+    }
+    return ESP_OK;
+}
+
+static void test_random_appends(void)
+{
+    frame_ring_t ring;
+    REQUIRE(frame_ring_init(&ring, 1 << 20, 5000) == ESP_OK);
+    unsigned seed = 1;
+    const int n = 20000;
+    for (int i = 0; i < n; i++) {
+        CHECK_EQ(append(&ring, 20000 + rand_r(&seed) % 80000), ESP_OK);
+        if (i % 500 == 499) {
+            frame_ring_stats_t st;
+            frame_ring_get_stats(&ring, &st);
+            sink_ctx_t c = { 0 };
+            CHECK_EQ(frame_ring_flush(&ring, 0, sink, &c), st.frames);
+            CHECK_EQ(c.frames, st.frames);
+            // Newest frame is always kept and nothing older than the window
+            CHECK_EQ(c.last_us, clock_us);
+            CHECK(st.frames <= 5000 / FRAME_MS + 1);
+        }
+    }
+    frame_ring_stats_t st;
+    frame_ring_get_stats(&ring, &st);
+    CHECK_EQ(st.appended, n);
+    CHECK_EQ(st.appended - st.evicted, st.frames);
+    CHECK_EQ(st.rejected, 0);
+    CHECK(st.bytes <= st.capacity);
+    CHECK(st.peak_bytes <= st.capacity);
+    CHECK(st.peak_bytes > st.capacity / 2);
+    frame_ring_deinit(&ring);
+}
+
+static void test_window_and_since(void)
+{
+    frame_ring_t ring;
+    REQUIRE(frame_ring_init(&ring, 1 << 20, 1000) == ESP_OK);
+    for (int i = 0; i < 30; i++) {
+        append(&ring, 1000);
+    }
+    frame_ring_stats_t st;
+    frame_ring_get_stats(&ring, &st);
+    // 1 s window at 100 ms per frame: the newest plus ten before it
+    CHECK_EQ(st.frames, 11);
+
+    sink_ctx_t c = { 0 };
+    int64_t since = clock_us - 4 * FRAME_MS * 1000;
+    CHECK_EQ(frame_ring_flush(&ring, since, sink, &c), 5);
+
+    frame_ring_clear(&ring);
+    frame_ring_get_stats(&ring, &st);
+    CHECK_EQ(st.frames, 0);
+    CHECK_EQ(st.bytes, 0);
+    frame_ring_deinit(&ring);
+}
+
+static void test_too_large(void)
+{
+    frame_ring_t ring;
+    REQUIRE(frame_ring_init(&ring, 100000, 5000) == ESP_OK);
+    CHECK_EQ(append(&ring, 100001), ESP_ERR_INVALID_SIZE);
+    CHECK_EQ(append(&ring, 100000), ESP_OK);
+    frame_ring_stats_t st;
+    frame_ring_get_stats(&ring, &st);
+    CHECK_EQ(st.rejected, 1);
+    CHECK_EQ(st.frames, 1);
+    camera_fb_t empty = { 0 };
+    CHECK_EQ(frame_ring_append(&ring, &empty), ESP_ERR_INVALID_ARG);
+    frame_ring_deinit(&ring);
+}
+
+static void test_pinned_during_flush(void)
+{
+    frame_ring_t ring;
+    REQUIRE(frame_ring_init(&ring, 1 << 20, 60000) == ESP_OK);
+    for (int i = 0; i < 8; i++) {
+        append(&ring, 100000);
+    }
+    // Each sink call appends 200 KB; once the free space is gone the
+    // appends must be refused rather than evict what is being flushed
+    sink_ctx_t c = { .ring = &ring };
+    CHECK_EQ(frame_ring_flush(&ring, 0, sink, &c), 8);
+    frame_ring_stats_t st;
+    frame_ring_get_stats(&ring, &st);
+    CHECK_EQ(st.evicted, 0);
+    CHECK(st.rejected > 0);
+    CHECK_EQ(st.flushed, 8);
+    // Unpinned again: the next append may evict
+    CHECK_EQ(append(&ring, 200000), ESP_OK);
+    frame_ring_get_stats(&ring, &st);
+    CHECK(st.evicted > 0);
+    frame_ring_deinit(&ring);
+}
+
+// The first flush to finish must not release frames the other still reads
+static void test_overlapping_flushes(void)
+{
+    frame_ring_t ring;
+    REQUIRE(frame_ring_init(&ring, 1 << 20, 60000) == ESP_OK);
+    for (int i = 0; i < 8; i++) {
+        append(&ring, 100000);
+    }
+    sink_ctx_t c = { .ring = &ring, .overlap = &ring };
+    CHECK_EQ(frame_ring_flush(&ring, 0, sink, &c), 8);
+    frame_ring_stats_t st;
+    frame_ring_get_stats(&ring, &st);
+    CHECK_EQ(st.evicted, 0);
+    CHECK(st.rejected > 0);
+    // Both released: the next append may evict
+    CHECK_EQ(append(&ring, 200000), ESP_OK);
+    frame_ring_get_stats(&ring, &st);
+    CHECK(st.evicted > 0);
+    frame_ring_deinit(&ring);
+}
+
+typedef struct {
+    int calls;
+    size_t sizes[8];
+    int fail_call;          // 1-based call to refuse, 0 for never
+    sink_ctx_t frames;
+} batch_ctx_t;
+
+static esp_err_t batch_sink(const camera_fb_t *const *frames, size_t count, void *ctx)
+{
+    batch_ctx_t *b = ctx;
+    b->calls++;
+    if (b->calls == b->fail_call) {
+        return ESP_FAIL;
+    }
+    b->sizes[b->calls - 1] = count;
+    for (size_t i = 0; i < count; i++) {
+        check_frame(frames[i], &b->frames);
+    }
+    return ESP_OK;
+}
+
+static void test_batches(void)
+{
+    frame_ring_t ring;
+    REQUIRE(frame_ring_init(&ring, 1 << 20, 60000) == ESP_OK);
+    for (int i = 0; i < 10; i++) {
+        append(&ring, 5000);
+    }
+    batch_ctx_t b = { 0 };
+    CHECK_EQ(frame_ring_flush_batch(&ring, 0, 4, batch_sink, &b), 10);
+    CHECK_EQ(b.calls, 3);
+    CHECK_EQ(b.sizes[0], 4);
+    CHECK_EQ(b.sizes[1], 4);
+    CHECK_EQ(b.sizes[2], 2);
+
+    // A failed batch stops the flush and is not counted
+    batch_ctx_t f = { .fail_call = 2 };
+    CHECK_EQ(frame_ring_flush_batch(&ring, 0, 4, batch_sink, &f), 4);
+    CHECK_EQ(f.calls, 2);
+
+    // Zero or oversized batches fall back to the maximum
+    batch_ctx_t m = { 0 };
+    CHECK_EQ(frame_ring_flush_batch(&ring, 0, 0, batch_sink, &m), 10);
+    CHECK_EQ(m.calls, 1);
+    CHECK_EQ(m.sizes[0], FRAME_RING_MAX_BATCH);
+
+    sink_ctx_t c = { .fail_after = 3 };
+    CHECK_EQ(frame_ring_flush(&ring, 0, sink, &c), 3);
+    frame_ring_deinit(&ring);
+}
+
+// Allocations made through the wrapped allocator, frame_ring's included
+static int allocs;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    allocs++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+    allocs++;
+    return __real_calloc(n, size);
+}
+
+static double now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+}
+
+// Appends of one size into a full ring, so each one also evicts.
+// Returns the best time per append over a few rounds, in ns.
+static double append_ns(frame_ring_t *ring, size_t len, int n)
+{
+    camera_fb_t fb = { .buf = src, .len = len, .width = 1024, .height = 768 };
+    double best = 1e30;
+    for (int round = 0; round < 5; round++) {
+        double t0 = now_ms();
+        for (int i = 0; i < n; i++) {
+            clock_us += FRAME_MS * 1000;
+            fb.timestamp.tv_sec = clock_us / 1000000;
+            fb.timestamp.tv_usec = clock_us % 1000000;
+            CHECK_EQ(frame_ring_append(ring, &fb), ESP_OK);
+        }
+        double ns = (now_ms() - t0) * 1e6 / n;
+        best = ns < best ? ns : best;
+    }
+    return best;
+}
+
+typedef struct {
+    const frame_ring_t *ring;
+    size_t frames, bytes;
+} arena_ctx_t;
+
+static esp_err_t arena_sink(const camera_fb_t *f, void *ctx)
+{
+    arena_ctx_t *a = ctx;
+    CHECK(f->buf >= a->ring->arena && f->buf + f->len <= a->ring->arena + a->ring->arena_size);
+    a->frames++;
+    a->bytes += f->len;
+    return ESP_OK;
+}
+
+static void test_performance(void)
+{
+    // The prebuffer's 1.5 MB, filled with tiny frames up to its slot count
+    // and with typical XGA frames
+    frame_ring_t small, large;
+    REQUIRE(frame_ring_init(&small, 1536 * 1024, 1000000) == ESP_OK);
+    REQUIRE(frame_ring_init(&large, 1536 * 1024, 1000000) == ESP_OK);
+    // Tiny frames into a ring of 16 slots and into the prebuffer's 384:
+    // the cost is the bookkeeping, which must not grow with what is stored
+    frame_ring_t few;
+    REQUIRE(frame_ring_init(&few, 16 * FRAME_RING_MIN_FRAME_BYTES, 1000000) == ESP_OK);
+    append_ns(&few, 64, 1000);
+    append_ns(&small, 64, 1000);
+    allocs = 0;
+    double few_ns = append_ns(&few, 64, 20000);
+    double many_ns = append_ns(&small, 64, 20000);
+
+    // Large frames: close to a plain copy of the same bytes
+    const size_t len = 60000;
+    const int n = 2000;
+    append_ns(&large, len, 100);
+    double large_ns = append_ns(&large, len, n);
+    static uint8_t copy[1536 * 1024];
+    double copy_ns = 1e30;
+    for (int round = 0; round < 5; round++) {
+        double t0 = now_ms();
+        for (int i = 0; i < n; i++) {
+            memcpy(copy + (i % 25) * len, src, len);
+        }
+        double ns = (now_ms() - t0) * 1e6 / n;
+        copy_ns = ns < copy_ns ? ns : copy_ns;
+    }
+
+    // A flush hands out the frames where they lie
+    arena_ctx_t a = { .ring = &large };
+    double t0 = now_ms();
+    size_t flushed = frame_ring_flush(&large, 0, arena_sink, &a);
+    double flush_ns = (now_ms() - t0) * 1e6 / (flushed ? flushed : 1);
+    int used = allocs;
+
+    frame_ring_stats_t st;
+    frame_ring_get_stats(&small, &st);
+    uint32_t small_slots = st.slot_capacity;
+    frame_ring_get_stats(&large, &st);
+    printf("64 B appends: %.0f ns with 16 frames stored, %.0f ns with %u\n", few_ns, many_ns, (unsigned)small_slots);
+    printf("%zu B appends: %.1f us, memcpy %.1f us, %.0f MB/s; flush %.0f ns a frame for %zu frames\n",
+           len, large_ns / 1000, copy_ns / 1000, len / large_ns * 1e3, flush_ns, flushed);
+    CHECK(many_ns < 3 * few_ns + 200);
+    CHECK(large_ns < 2 * copy_ns + 2000);
+    CHECK_EQ(flushed, st.frames);
+    CHECK_EQ(a.frames, flushed);
+    CHECK_EQ(a.bytes, st.bytes);
+    // Touching no pixels, a frame costs a fraction of copying it
+    CHECK(flush_ns < copy_ns / 4);
+    CHECK_EQ(used, 0);
+    frame_ring_deinit(&few);
+    frame_ring_deinit(&small);
+    frame_ring_deinit(&large);
+}
+
+static void test_failed_init(void)
+{
+    frame_ring_t ring;
+    memset(&ring, 0, sizeof(ring));
+    CHECK_EQ(append(&ring, 1000), ESP_ERR_INVALID_STATE);
+    sink_ctx_t c = { 0 };
+    CHECK_EQ(frame_ring_flush(&ring, 0, sink, &c), 0);
+    frame_ring_clear(&ring);
+    frame_ring_stats_t st;
+    memset(&st, 0xAA, sizeof(st));
+    frame_ring_get_stats(&ring, &st);
+    CHECK_EQ(st.frames, 0);
+    CHECK_EQ(st.capacity, 0);
+}
+
+int main(void)
+{
+    RUN(test_random_appends);
+    RUN(test_window_and_since);
+    RUN(test_too_large);
+    RUN(test_pinned_during_flush);
+    RUN(test_overlapping_flushes);
+    RUN(test_batches);
+    RUN(test_performance);
+    RUN(test_failed_init);
+    return TEST_DONE();
+}
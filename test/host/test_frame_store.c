@@ -0,0 +1,345 @@
+// frame_store: frames survive a reopen, a reset mid-append loses at most
+// the frame being written, and the AVI made from the store is well formed
+// whatever read sizes it is pulled with
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "test.h"
+#include "frame_store.h"
+
+#define CAPACITY    (4u << 20)
+
+static char dir[] = "/tmp/frame_store_XXXXXX";
+static char data_path[64];
+static char index_path[64];
+
+static uint32_t le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Frame i's length and bytes; odd and even lengths alternate unevenly
+static size_t frame_len(uint32_t i)
+{
+    return 500 + (i * 7919) % 3001;
+}
+
+static void frame_fill(uint32_t i, uint8_t *buf)
+{
+    size_t len = frame_len(i);
+    uint32_t s = i + 1;
+    for (size_t k = 0; k < len; k++) {
+        s = s * 1103515245 + 12345;
+        buf[k] = s >> 16;
+    }
+    buf[0] = 0xFF;
+    buf[1] = 0xD8;
+    memcpy(buf + 2, &i, 4);
+}
+
+static uint8_t frame[4096];
+
+static esp_err_t append(frame_store_t *s, uint32_t i)
+{
+    frame_fill(i, frame);
+    return frame_store_append(s, frame, frame_len(i), 320 + i % 2, 240, 1700000000 + i * 60);
+}
+
+static long file_size(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    REQUIRE(f);
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fclose(f);
+    return n;
+}
+
+static void open_fresh(frame_store_t *s, uint32_t capacity)
+{
+    unlink(data_path);
+    unlink(index_path);
+    REQUIRE(frame_store_open(s, dir, capacity) == ESP_OK);
+}
+
+// The stored frames 0..n-1 match what was appended
+static void check_frames(frame_store_t *s, uint32_t n)
+{
+    CHECK_EQ(s->frames, n);
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < s->frames; i++) {
+        frame_store_entry_t e;
+        REQUIRE(frame_store_get(s, i, &e) == ESP_OK);
+        CHECK_EQ(e.offset, offset);
+        CHECK_EQ(e.len, frame_len(i));
+        CHECK_EQ(e.time, 1700000000 + i * 60);
+        CHECK_EQ(e.width, 320 + i % 2);
+        CHECK_EQ(e.height, 240);
+        offset += FRAME_STORE_CHUNK_HDR + e.len + (e.len & 1);
+    }
+    CHECK_EQ(s->used, offset);
+    frame_store_entry_t e;
+    CHECK_EQ(frame_store_get(s, s->frames, &e), ESP_ERR_INVALID_ARG);
+}
+
+static void test_append_reopen(void)
+{
+    frame_store_t s;
+    open_fresh(&s, CAPACITY);
+    CHECK_EQ(file_size(data_path), CAPACITY);
+    for (uint32_t i = 0; i < 100; i++) {
+        CHECK_EQ(append(&s, i), ESP_OK);
+    }
+    frame_store_close(&s);
+    CHECK_EQ(frame_store_append(&s, frame, 10, 1, 1, 0), ESP_ERR_INVALID_STATE);
+
+    REQUIRE(frame_store_open(&s, dir, CAPACITY) == ESP_OK);
+    CHECK_EQ(s.dropped, 0);
+    check_frames(&s, 100);
+    frame_store_close(&s);
+
+    // Reset forgets the frames, not the space
+    REQUIRE(frame_store_open(&s, dir, CAPACITY) == ESP_OK);
+    CHECK_EQ(frame_store_reset(&s), ESP_OK);
+    CHECK_EQ(s.frames, 0);
+    CHECK_EQ(append(&s, 0), ESP_OK);
+    frame_store_close(&s);
+    REQUIRE(frame_store_open(&s, dir, CAPACITY) == ESP_OK);
+    check_frames(&s, 1);
+    CHECK_EQ(file_size(data_path), CAPACITY);
+    frame_store_close(&s);
+}
+
+static void test_partial_entry(void)
+{
+    // Reset while the index entry was being written
+    frame_store_t s;
+    open_fresh(&s, CAPACITY);
+    for (uint32_t i = 0; i < 10; i++) {
+        CHECK_EQ(append(&s, i), ESP_OK);
+    }
+    frame_store_close(&s);
+    FILE *f = fopen(index_path, "ab");
+    REQUIRE(f);
+    fwrite("\1\2\3\4\5\6\7", 7, 1, f);
+    fclose(f);
+
+    REQUIRE(frame_store_open(&s, dir, CAPACITY) == ESP_OK);
+    CHECK_EQ(s.dropped, 1);
+    check_frames(&s, 10);
+    CHECK_EQ(file_size(index_path), 10 * 16);
+    frame_store_close(&s);
+}
+
+static void test_lost_chunk(void)
+{
+    // The card lost the last frame's chunk header although its entry made it
+    frame_store_t s;
+    open_fresh(&s, CAPACITY);
+    for (uint32_t i = 0; i < 10; i++) {
+        CHECK_EQ(append(&s, i), ESP_OK);
+    }
+    frame_store_entry_t last;
+    REQUIRE(frame_store_get(&s, 9, &last) == ESP_OK);
+    frame_store_close(&s);
+    FILE *f = fopen(data_path, "r+b");
+    REQUIRE(f);
+    fseek(f, last.offset, SEEK_SET);
+    fwrite("\0\0\0\0", 4, 1, f);
+    fclose(f);
+
+    REQUIRE(frame_store_open(&s, dir, CAPACITY) == ESP_OK);
+    CHECK_EQ(s.dropped, 1);
+    CHECK_EQ(s.used, last.offset);
+    check_frames(&s, 9);
+
+    // Appends carry on in the dropped frame's place
+    CHECK_EQ(append(&s, 9), ESP_OK);
+    CHECK_EQ(append(&s, 10), ESP_OK);
+    frame_store_close(&s);
+    REQUIRE(frame_store_open(&s, dir, CAPACITY) == ESP_OK);
+    CHECK_EQ(s.dropped, 0);
+    check_frames(&s, 11);
+    frame_store_close(&s);
+}
+
+static void test_full(void)
+{
+    frame_store_t s;
+    open_fresh(&s, 1000);
+    uint8_t jpeg[333];
+    memset(jpeg, 0xAB, sizeof(jpeg));
+    // Two 342-byte chunks fit in 1000 bytes, a third does not
+    CHECK_EQ(frame_store_append(&s, jpeg, sizeof(jpeg), 1, 1, 0), ESP_OK);
+    CHECK_EQ(frame_store_append(&s, jpeg, sizeof(jpeg), 1, 1, 0), ESP_OK);
+    CHECK_EQ(frame_store_append(&s, jpeg, sizeof(jpeg), 1, 1, 0), ESP_ERR_NO_MEM);
+    CHECK_EQ(frame_store_append(&s, jpeg, 0, 1, 1, 0), ESP_ERR_NO_MEM);
+    CHECK_EQ(s.frames, 2);
+    CHECK_EQ(s.used, 684);
+    frame_store_close(&s);
+    // Still full after a reopen; the capacity is the file's size
+    REQUIRE(frame_store_open(&s, dir, 1000) == ESP_OK);
+    CHECK_EQ(s.frames, 2);
+    CHECK_EQ(frame_store_append(&s, jpeg, sizeof(jpeg), 1, 1, 0), ESP_ERR_NO_MEM);
+    frame_store_close(&s);
+}
+
+// --- AVI ---
+
+// Pull the whole file with reads of the given sizes, cycling; 0 for varying
+static uint8_t *read_avi(frame_store_avi_t *avi, size_t size, size_t *len)
+{
+    uint8_t *out = malloc(avi->size + 1);
+    REQUIRE(out);
+    uint8_t buf[16384];
+    size_t n = 0;
+    int got;
+    for (int k = 0;; k++) {
+        size_t want = size ? size : 1 + (k * 7919u) % 997;
+        got = frame_store_avi_read(avi, buf, want);
+        if (got <= 0) {
+            break;
+        }
+        CHECK(got <= (int)want);
+        REQUIRE(n + got <= avi->size);
+        memcpy(out + n, buf, got);
+        n += got;
+    }
+    CHECK_EQ(got, 0);
+    *len = n;
+    return out;
+}
+
+// A RIFF AVI whose movi chunks are the stored frames step apart, and whose
+// idx1 points at each of them
+static void check_avi(const uint8_t *f, size_t len, const frame_store_avi_t *avi, uint32_t fps)
+{
+    REQUIRE(len >= FRAME_STORE_AVI_HEADER + 8);
+    CHECK_EQ(len, avi->size);
+    CHECK(memcmp(f, "RIFF", 4) == 0);
+    CHECK_EQ(le32(f + 4), len - 8);
+    CHECK(memcmp(f + 8, "AVI LIST", 8) == 0);
+    uint32_t hdrl = le32(f + 16);
+    CHECK(memcmp(f + 20, "hdrlavih", 8) == 0);
+    CHECK_EQ(le32(f + 32), 1000000 / fps);
+    CHECK_EQ(le32(f + 48), avi->frames);
+    CHECK(memcmp(f + 20 + hdrl, "LIST", 4) == 0);
+    CHECK(memcmp(f + FRAME_STORE_AVI_HEADER - 4, "movi", 4) == 0);
+    uint32_t movi_len = le32(f + FRAME_STORE_AVI_HEADER - 8);
+    size_t idx1 = FRAME_STORE_AVI_HEADER - 4 + movi_len;
+    REQUIRE(idx1 + 8 <= len);
+    CHECK(memcmp(f + idx1, "idx1", 4) == 0);
+    CHECK_EQ(le32(f + idx1 + 4), avi->frames * 16);
+    CHECK_EQ(idx1 + 8 + avi->frames * 16, len);
+
+    size_t pos = FRAME_STORE_AVI_HEADER;
+    for (uint32_t j = 0; j < avi->frames && pos + 8 <= idx1; j++) {
+        uint32_t i = j * avi->step;
+        size_t flen = frame_len(i);
+        frame_fill(i, frame);
+        CHECK(memcmp(f + pos, "00dc", 4) == 0);
+        CHECK_EQ(le32(f + pos + 4), flen);
+        CHECK(memcmp(f + pos + 8, frame, flen) == 0);
+        const uint8_t *e = f + idx1 + 8 + j * 16;
+        CHECK(memcmp(e, "00dc", 4) == 0);
+        CHECK_EQ(le32(e + 8), pos - (FRAME_STORE_AVI_HEADER - 4));
+        CHECK_EQ(le32(e + 12), flen);
+        pos += 8 + flen + (flen & 1);
+    }
+    CHECK_EQ(pos, idx1);
+}
+
+static void test_avi(void)
+{
+    frame_store_t s;
+    open_fresh(&s, CAPACITY);
+    for (uint32_t i = 0; i < 60; i++) {
+        CHECK_EQ(append(&s, i), ESP_OK);
+    }
+
+    frame_store_avi_t avi;
+    REQUIRE(frame_store_avi_open(&avi, &s, s.frames, UINT32_MAX, 10) == ESP_OK);
+    CHECK_EQ(avi.frames, 60);
+    CHECK_EQ(avi.step, 1);
+    size_t len;
+    uint8_t *whole = read_avi(&avi, sizeof(frame), &len);
+    frame_store_avi_close(&avi);
+    check_avi(whole, len, &avi, 10);
+
+    // Byte-wise and odd-sized reads split headers, chunks and idx1 entries
+    static const size_t sizes[] = { 1, 15, 17, 0 };
+    for (int k = 0; k < 4; k++) {
+        REQUIRE(frame_store_avi_open(&avi, &s, s.frames, UINT32_MAX, 10) == ESP_OK);
+        size_t n;
+        uint8_t *f = read_avi(&avi, sizes[k], &n);
+        frame_store_avi_close(&avi);
+        CHECK(n == len && memcmp(f, whole, len) == 0);
+        free(f);
+    }
+
+    // Frames appended meanwhile are not in a video already opened
+    REQUIRE(frame_store_avi_open(&avi, &s, s.frames, UINT32_MAX, 10) == ESP_OK);
+    uint8_t head[100];
+    CHECK_EQ(frame_store_avi_read(&avi, head, sizeof(head)), sizeof(head));
+    CHECK_EQ(append(&s, 60), ESP_OK);
+    size_t n;
+    uint8_t *rest = read_avi(&avi, 0, &n);
+    frame_store_avi_close(&avi);
+    CHECK(n + sizeof(head) == len && memcmp(rest, whole + sizeof(head), n) == 0);
+    free(rest);
+    free(whole);
+    frame_store_close(&s);
+}
+
+static void test_avi_cap(void)
+{
+    frame_store_t s;
+    open_fresh(&s, CAPACITY);
+    for (uint32_t i = 0; i < 60; i++) {
+        CHECK_EQ(append(&s, i), ESP_OK);
+    }
+    frame_store_avi_t avi;
+    REQUIRE(frame_store_avi_open(&avi, &s, s.frames, UINT32_MAX, 10) == ESP_OK);
+    uint32_t full = avi.size;
+    frame_store_avi_close(&avi);
+
+    // Every step-th frame, the smallest step that fits
+    static const uint32_t caps[] = { 2, 3, 7, 25 };
+    for (int k = 0; k < 4; k++) {
+        uint32_t cap = full / caps[k];
+        REQUIRE(frame_store_avi_open(&avi, &s, s.frames, cap, 5) == ESP_OK);
+        CHECK(avi.size <= cap);
+        CHECK(avi.step > 1);
+        CHECK_EQ(avi.frames, (60 + avi.step - 1) / avi.step);
+        size_t len;
+        uint8_t *f = read_avi(&avi, 0, &len);
+        frame_store_avi_close(&avi);
+        check_avi(f, len, &avi, 5);
+        free(f);
+    }
+
+    // Not even the first frame fits
+    CHECK_EQ(frame_store_avi_open(&avi, &s, s.frames, FRAME_STORE_AVI_HEADER + 100, 10), ESP_ERR_INVALID_SIZE);
+    CHECK_EQ(frame_store_avi_open(&avi, &s, 0, UINT32_MAX, 10), ESP_ERR_INVALID_ARG);
+    CHECK_EQ(frame_store_avi_open(&avi, &s, s.frames, UINT32_MAX, 0), ESP_ERR_INVALID_ARG);
+    frame_store_close(&s);
+}
+
+int main(void)
+{
+    REQUIRE(mkdtemp(dir));
+    snprintf(data_path, sizeof(data_path), "%s/" FRAME_STORE_DATA, dir);
+    snprintf(index_path, sizeof(index_path), "%s/" FRAME_STORE_INDEX, dir);
+
+    RUN(test_append_reopen);
+    RUN(test_partial_entry);
+    RUN(test_lost_chunk);
+    RUN(test_full);
+    RUN(test_avi);
+    RUN(test_avi_cap);
+
+    unlink(data_path);
+    unlink(index_path);
+    rmdir(dir);
+    return TEST_DONE();
+}
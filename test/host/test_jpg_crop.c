@@ -0,0 +1,141 @@
+// jpg_crop: a coefficient-domain crop of the test pictures decodes to
+// exactly the pixels of the same area of the decoded source, faster than
+// decoding, cropping and encoding again
+#include "jpeg_fixture.h"
+
+#define REPS 15
+
+// Crop r out of fx and compare with the decoded source. r is widened to
+// whole MCUs, and cut to the frame, on return.
+static bool crop_matches(const fixture_t *fx, const uint8_t *ref, int w, int h, jpg_rect_t *r)
+{
+    jpg_rect_t want = *r;
+    uint8_t *out;
+    size_t len;
+    if (!jpg_crop(fx->buf, fx->len, r, &out, &len)) {
+        printf("crop %u,%u %ux%u failed\n", want.x, want.y, want.w, want.h);
+        return false;
+    }
+    int right = want.x + want.w < w ? want.x + want.w : w;
+    int bottom = want.y + want.h < h ? want.y + want.h : h;
+    bool ok = r->x <= want.x && r->y <= want.y
+              && r->x + r->w >= right && r->y + r->h >= bottom
+              && r->x + r->w <= w && r->y + r->h <= h;
+    int cw, ch;
+    uint8_t *px = jpeg_decode_rgb(out, len, &cw, &ch);
+    if (!ok || !px || cw != r->w || ch != r->h) {
+        printf("crop %u,%u %ux%u: kept %u,%u %ux%u, decoded %dx%d\n", want.x, want.y, want.w, want.h,
+               r->x, r->y, r->w, r->h, px ? cw : 0, px ? ch : 0);
+        ok = false;
+    }
+    for (int y = 0; ok && y < ch; y++) {
+        if (memcmp(px + (size_t)y * cw * 3, ref + ((size_t)(r->y + y) * w + r->x) * 3, (size_t)cw * 3)) {
+            printf("crop %u,%u %ux%u: row %d differs\n", r->x, r->y, r->w, r->h, y);
+            ok = false;
+        }
+    }
+    free(px);
+    free(out);
+    return ok;
+}
+
+static void test_pixel_exact(void)
+{
+    srand(1);
+    for (int i = 0; i < FIXTURE_COUNT; i++) {
+        fixture_t fx = fixture_load(i);
+        int w, h;
+        uint8_t *ref = jpeg_decode_rgb(fx.buf, fx.len, &w, &h);
+        REQUIRE(ref);
+        int bad = 0;
+        for (int t = 0; t < 300; t++) {
+            jpg_rect_t r;
+            if (t == 0) {
+                r = (jpg_rect_t){ 0, 0, w, h };
+            } else if (t == 1) {
+                r = (jpg_rect_t){ w - 1, h - 1, 1, 1 };
+            } else {
+                r.x = rand() % w;
+                r.y = rand() % h;
+                r.w = 1 + rand() % (w - r.x);
+                r.h = 1 + rand() % (h - r.y);
+            }
+            bad += !crop_matches(&fx, ref, w, h, &r);
+        }
+        printf("%-18s %dx%d: 300 crops, %d differ\n", fixture_names[i], w, h, bad);
+        CHECK_EQ(bad, 0);
+        free(ref);
+        free(fx.buf);
+    }
+}
+
+// Rectangles that leave the frame
+static void test_outside_frame(void)
+{
+    fixture_t fx = fixture_load(1);
+    int w, h;
+    uint8_t *ref = jpeg_decode_rgb(fx.buf, fx.len, &w, &h);
+    REQUIRE(ref);
+    uint8_t *out;
+    size_t len;
+    jpg_rect_t r = { w, 0, 16, 16 };
+    CHECK(!jpg_crop(fx.buf, fx.len, &r, &out, &len));
+    r = (jpg_rect_t){ 0, 0, 0, 16 };
+    CHECK(!jpg_crop(fx.buf, fx.len, &r, &out, &len));
+    // Overhanging the frame keeps what is inside it
+    r = (jpg_rect_t){ w - 20, h - 20, 100, 100 };
+    CHECK(crop_matches(&fx, ref, w, h, &r));
+    free(ref);
+    free(fx.buf);
+}
+
+// The centre quarter, against decode + crop + fmt2jpg at q90
+static void test_speed(void)
+{
+    for (int i = 0; i < FIXTURE_COUNT; i++) {
+        fixture_t fx = fixture_load(i);
+        int w, h;
+        uint8_t *ref = jpeg_decode_rgb(fx.buf, fx.len, &w, &h);
+        REQUIRE(ref);
+        jpg_rect_t r = { w / 4, h / 4, w / 2, h / 2 };
+        uint8_t *out = NULL;
+        size_t crop_len = 0, enc_len = 0;
+        double crop_ms = 1e9, enc_ms = 1e9;
+        for (int k = 0; k < REPS; k++) {
+            jpg_rect_t rr = r;
+            double t0 = now_ms();
+            REQUIRE(jpg_crop(fx.buf, fx.len, &rr, &out, &crop_len));
+            crop_ms = fmin(crop_ms, now_ms() - t0);
+            free(out);
+            r = rr;
+        }
+        for (int k = 0; k < REPS; k++) {
+            double t0 = now_ms();
+            int dw, dh;
+            uint8_t *px = jpeg_decode_rgb(fx.buf, fx.len, &dw, &dh);
+            uint8_t *area = malloc((size_t)r.w * r.h * 3);
+            REQUIRE(px && area);
+            for (int y = 0; y < r.h; y++) {
+                memcpy(area + (size_t)y * r.w * 3, px + ((size_t)(r.y + y) * dw + r.x) * 3, (size_t)r.w * 3);
+            }
+            REQUIRE(jpeg_encode_rgb(area, r.w, r.h, 90, &out, &enc_len));
+            enc_ms = fmin(enc_ms, now_ms() - t0);
+            free(out);
+            free(area);
+            free(px);
+        }
+        printf("%-18s %3ux%-3u crop %6zu B %5.2f ms | decode+crop+encode q90 %6zu B %5.2f ms | %4.1fx\n",
+               fixture_names[i], r.w, r.h, crop_len, crop_ms, enc_len, enc_ms, enc_ms / crop_ms);
+        CHECK(crop_ms * 2 < enc_ms);
+        free(ref);
+        free(fx.buf);
+    }
+}
+
+int main(void)
+{
+    RUN(test_pixel_exact);
+    RUN(test_outside_frame);
+    RUN(test_speed);
+    return TEST_DONE();
+}
@@ -0,0 +1,187 @@
+// jpg2jpg: requantizing the test pictures gives a valid, smaller JPEG of
+// the same quality as decoding and encoding again, in a fraction of the time
+#include "jpeg_fixture.h"
+
+// Best of REPS, so a busy machine does not skew the comparison
+#define REPS 15
+
+typedef struct {
+    size_t len;
+    double ms;
+    double db;      // PSNR against the decoded source
+} result_t;
+
+static result_t requant(const fixture_t *fx, const uint8_t *ref, int w, int h, int quality)
+{
+    result_t r = { .ms = 1e9 };
+    uint8_t *out = NULL;
+    for (int k = 0; k < REPS; k++) {
+        free(out);
+        double t0 = now_ms();
+        REQUIRE(jpg2jpg(fx->buf, fx->len, quality, &out, &r.len));
+        r.ms = fmin(r.ms, now_ms() - t0);
+    }
+    int w2, h2;
+    uint8_t *px = jpeg_decode_rgb(out, r.len, &w2, &h2);
+    REQUIRE(px);
+    CHECK_EQ(w2, w);
+    CHECK_EQ(h2, h);
+    r.db = psnr(ref, px, (size_t)w * h * 3);
+    free(px);
+    free(out);
+    return r;
+}
+
+static result_t reencode(const fixture_t *fx, const uint8_t *ref, int w, int h, int quality)
+{
+    result_t r = { .ms = 1e9 };
+    uint8_t *out = NULL;
+    for (int k = 0; k < REPS; k++) {
+        free(out);
+        double t0 = now_ms();
+        int w2, h2;
+        uint8_t *px = jpeg_decode_rgb(fx->buf, fx->len, &w2, &h2);
+        REQUIRE(px);
+        REQUIRE(jpeg_encode_rgb(px, w2, h2, quality, &out, &r.len));
+        free(px);
+        r.ms = fmin(r.ms, now_ms() - t0);
+    }
+    int w2, h2;
+    uint8_t *px = jpeg_decode_rgb(out, r.len, &w2, &h2);
+    REQUIRE(px);
+    r.db = psnr(ref, px, (size_t)w * h * 3);
+    free(px);
+    free(out);
+    return r;
+}
+
+static void test_against_reencode(void)
+{
+    static const int qualities[] = { 10, 30, 50, 80 };
+    printf("%-18s %2s %18s %28s\n", "", "q", "requant", "decode+encode");
+    for (int i = 0; i < FIXTURE_COUNT; i++) {
+        fixture_t fx = fixture_load(i);
+        int w, h;
+        uint8_t *ref = jpeg_decode_rgb(fx.buf, fx.len, &w, &h);
+        REQUIRE(ref);
+        for (size_t q = 0; q < sizeof(qualities) / sizeof(qualities[0]); q++) {
+            result_t a = requant(&fx, ref, w, h, qualities[q]);
+            result_t b = reencode(&fx, ref, w, h, qualities[q]);
+            printf("%-18s %2d %6zu -> %6zu B %6.2f ms %4.1f dB | %6zu B %6.2f ms %4.1f dB | %4.1fx\n",
+                   fixture_names[i], qualities[q], fx.len, a.len, a.ms, a.db, b.len, b.ms, b.db, b.ms / a.ms);
+            // Where the source tables are already coarser they are kept
+            CHECK(qualities[q] > 50 ? a.len <= fx.len : a.len < fx.len);
+            // From q50 up, the same quality as going through pixels or
+            // better. Below that, test_outside loses up to 2.2 dB: its
+            // coefficients carry highlights the decoder clips, which the
+            // pixel path starts from already clipped.
+            if (qualities[q] >= 50) {
+                CHECK(a.db > b.db - 0.3);
+            } else {
+                CHECK(a.db > b.db - 3);
+            }
+            CHECK(a.ms * 2 < b.ms);
+        }
+        free(ref);
+        free(fx.buf);
+    }
+}
+
+// Quality 100 keeps every source table, so nothing changes but the coding
+static void test_quality_100(void)
+{
+    for (int i = 0; i < FIXTURE_COUNT; i++) {
+        fixture_t fx = fixture_load(i);
+        int w, h, w2, h2;
+        uint8_t *ref = jpeg_decode_rgb(fx.buf, fx.len, &w, &h);
+        uint8_t *out;
+        size_t len;
+        REQUIRE(ref && jpg2jpg(fx.buf, fx.len, 100, &out, &len));
+        CHECK_EQ(len, fx.len);
+        uint8_t *px = jpeg_decode_rgb(out, len, &w2, &h2);
+        REQUIRE(px);
+        CHECK(w2 == w && h2 == h && memcmp(px, ref, (size_t)w * h * 3) == 0);
+        free(px);
+        free(out);
+        free(ref);
+        free(fx.buf);
+    }
+}
+
+// A second pass at the same quality finds the coefficients already on the
+// new tables and must give back the same image
+static void test_round_trip(void)
+{
+    for (int i = 0; i < FIXTURE_COUNT; i++) {
+        fixture_t fx = fixture_load(i);
+        for (int q = 10; q <= 90; q += 20) {
+            uint8_t *once, *twice;
+            size_t once_len, twice_len;
+            REQUIRE(jpg2jpg(fx.buf, fx.len, q, &once, &once_len));
+            REQUIRE(jpg2jpg(once, once_len, q, &twice, &twice_len));
+            CHECK_EQ(twice_len, once_len);
+            CHECK(twice_len == once_len && memcmp(once, twice, once_len) == 0);
+            free(once);
+            free(twice);
+        }
+        free(fx.buf);
+    }
+}
+
+static bool requant_ok(const uint8_t *jpg, size_t len)
+{
+    uint8_t *out;
+    size_t out_len;
+    if (!jpg2jpg(jpg, len, 50, &out, &out_len)) {
+        return false;
+    }
+    CHECK(out_len >= 4 && out[0] == 0xFF && out[1] == 0xD8);
+    free(out);
+    return true;
+}
+
+// A frame cut short is refused, not padded out with grey MCUs. Only the
+// EOI marker may go missing.
+static void test_truncated(void)
+{
+    srand(1);
+    for (int i = 0; i < FIXTURE_COUNT; i++) {
+        fixture_t fx = fixture_load(i);
+        CHECK(requant_ok(fx.buf, fx.len - 2));
+        for (int t = 0; t < 300; t++) {
+            size_t len = t < 64 ? fx.len - 3 - t : (size_t)rand() % (fx.len - 3);
+            CHECK(!requant_ok(fx.buf, len));
+        }
+        free(fx.buf);
+    }
+}
+
+// Damaged input is refused or gives some JPEG, never a crash
+static void test_damaged(void)
+{
+    srand(1);
+    for (int i = 0; i < FIXTURE_COUNT; i++) {
+        fixture_t fx = fixture_load(i);
+        uint8_t *bad = malloc(fx.len);
+        REQUIRE(bad);
+        for (int t = 0; t < 300; t++) {
+            memcpy(bad, fx.buf, fx.len);
+            for (int k = 0; k < 4; k++) {
+                bad[rand() % fx.len] ^= 1 << (rand() % 8);
+            }
+            requant_ok(bad, fx.len);
+        }
+        free(bad);
+        free(fx.buf);
+    }
+}
+
+int main(void)
+{
+    RUN(test_against_reencode);
+    RUN(test_quality_100);
+    RUN(test_round_trip);
+    RUN(test_truncated);
+    RUN(test_damaged);
+    return TEST_DONE();
+}
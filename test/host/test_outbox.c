@@ -0,0 +1,541 @@
+// outbox: the log on a file-backed partition with NOR flash semantics
+// (programming only clears bits, erase by 4 KB sector or 64 KB block),
+// through offline backlogs, failing uplinks, a full log and power cuts at
+// any byte of an append or any block of an erase
+#include <setjmp.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "test.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "esp_partition.h"
+#include "outbox.h"
+
+// --- Flash ---
+
+#define PART_SIZE   0x140000    // 10 segments
+#define SECTOR      4096
+#define BLOCK       0x10000
+
+static uint8_t *flash;
+static const esp_partition_t part = { PART_SIZE, OUTBOX_PARTITION_LABEL };
+static long long violations;        // Programs that would have set a bit
+static uint32_t erased_blocks;
+// Power is cut after this many more programmed bytes or erase operations,
+// or this many more block erases; -1 for never
+static long long cut_at = -1;
+static long long erase_cut_at = -1;
+static jmp_buf power_loss;
+
+// A power cut is a reboot: the outbox lock taken before it is not held after
+static SemaphoreHandle_t held[4];
+static int nheld;
+
+BaseType_t __real_xSemaphoreTake(SemaphoreHandle_t sem, TickType_t timeout);
+BaseType_t __real_xSemaphoreGive(SemaphoreHandle_t sem);
+
+BaseType_t __wrap_xSemaphoreTake(SemaphoreHandle_t sem, TickType_t timeout)
+{
+    BaseType_t got = __real_xSemaphoreTake(sem, timeout);
+    if (got == pdTRUE) {
+        REQUIRE(nheld < 4);
+        held[nheld++] = sem;
+    }
+    return got;
+}
+
+BaseType_t __wrap_xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    for (int i = nheld - 1; i >= 0; i--) {
+        if (held[i] == sem) {
+            held[i] = held[--nheld];
+            break;
+        }
+    }
+    return __real_xSemaphoreGive(sem);
+}
+
+static void cut_power(void)
+{
+    while (nheld) {
+        __real_xSemaphoreGive(held[--nheld]);
+    }
+    cut_at = erase_cut_at = -1;
+    longjmp(power_loss, 1);
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype,
+                                                const char *label)
+{
+    return strcmp(label, part.label) ? NULL : &part;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *p, size_t offset, void *dst, size_t len)
+{
+    if (offset + len > PART_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    memcpy(dst, flash + offset, len);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *p, size_t offset, const void *src, size_t len)
+{
+    if (offset + len > PART_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    const uint8_t *s = src;
+    for (size_t i = 0; i < len; i++) {
+        if (cut_at == 0) {
+            cut_power();
+        }
+        if (cut_at > 0) {
+            cut_at--;
+        }
+        if (s[i] & ~flash[offset + i]) {
+            violations++;
+        }
+        flash[offset + i] &= s[i];
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *p, size_t offset, size_t len)
+{
+    if (offset % SECTOR || len % SECTOR || offset + len > PART_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // Aligned 64 KB runs go out as block erases, like esp_flash_erase_region()
+    for (size_t a = offset; a < offset + len;) {
+        bool block = a % BLOCK == 0 && a + BLOCK <= offset + len;
+        if ((block && erase_cut_at == 0) || cut_at == 0) {
+            // The sector under way is left half erased
+            memset(flash + a, 0xFF, SECTOR / 2);
+            cut_power();
+        }
+        if (block && erase_cut_at > 0) {
+            erase_cut_at--;
+        }
+        if (cut_at > 0) {
+            cut_at--;
+        }
+        size_t n = block ? BLOCK : SECTOR;
+        memset(flash + a, 0xFF, n);
+        erased_blocks += block;
+        a += n;
+    }
+    return ESP_OK;
+}
+
+// --- Items ---
+
+static uint32_t rng = 1;
+
+static uint32_t rnd(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+// Every item's type, size and contents follow from its id
+static size_t item_len(uint32_t id, outbox_type_t *type)
+{
+    uint32_t h = id * 2654435761u;
+    if (h % 5 == 0) {
+        *type = OUTBOX_MESSAGE;
+        return 40 + h % 80;
+    }
+    *type = OUTBOX_PHOTO;
+    return 30000 + (h >> 8) % 90000;
+}
+
+static void item_fill(uint32_t id, uint8_t *buf, size_t len, outbox_type_t type)
+{
+    uint32_t s = id * 7919 + 1;
+    for (size_t i = 0; i < len; i++) {
+        s = s * 1103515245 + 12345;
+        buf[i] = s >> 16;
+    }
+    memcpy(buf, &id, 4);
+    if (type == OUTBOX_MESSAGE) {
+        for (size_t i = 4; i < len; i++) {
+            buf[i] = 'a' + buf[i] % 26;
+        }
+        buf[len - 1] = 0;
+    }
+}
+
+static int64_t item_time(uint32_t id)
+{
+    return 1700000000000000LL + id;
+}
+
+static uint8_t payload[OUTBOX_SEGMENT_SIZE];
+static uint32_t next_id;
+
+static esp_err_t put_one(void)
+{
+    uint32_t id = next_id;
+    outbox_item_t it = {
+        .time_us = item_time(id),
+        .width = 1024,
+        .height = 768,
+        .data = payload,
+    };
+    it.len = item_len(id, &it.type);
+    item_fill(id, payload, it.len, it.type);
+    snprintf(it.chat_id, sizeof(it.chat_id), "%d", it.type == OUTBOX_PHOTO ? 1000 + (int)(id / 7) % 2 : 1000);
+    esp_err_t err = outbox_put(&it);
+    if (err == ESP_OK) {
+        next_id++;
+    }
+    return err;
+}
+
+// --- Sink ---
+
+#define MAX_ITEMS   (1 << 20)
+
+static long long last_delivered = -1;
+static int fail_permille;
+static int batches;
+static int dups;
+static uint8_t *delivered;          // Per id: 1 delivered, 2 torn by a power cut
+
+static esp_err_t sink(const outbox_item_t *items, size_t count, void *ctx)
+{
+    if (fail_permille && (int)(rnd() % 1000) < fail_permille) {
+        return ESP_FAIL;
+    }
+    CHECK(count >= 1 && count <= OUTBOX_BATCH_MAX);
+    batches++;
+    static uint8_t ref[OUTBOX_SEGMENT_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        uint32_t id;
+        memcpy(&id, items[i].data, 4);
+        REQUIRE(id < next_id);
+        outbox_type_t type;
+        size_t len = item_len(id, &type);
+        item_fill(id, ref, len, type);
+        CHECK(len == items[i].len && type == items[i].type && memcmp(ref, items[i].data, len) == 0);
+        CHECK_EQ(items[i].time_us, item_time(id));
+        // A batch is one message or photos for a single chat
+        if (i) {
+            CHECK(items[i].type == OUTBOX_PHOTO && strcmp(items[i].chat_id, items[0].chat_id) == 0);
+        }
+        // Oldest first; only a redelivery goes back
+        if ((long long)id <= last_delivered) {
+            CHECK(delivered[id]);
+            dups++;
+        } else {
+            last_delivered = id;
+        }
+        delivered[id] = 1;
+    }
+    return ESP_OK;
+}
+
+static uint32_t lost(uint32_t upto)
+{
+    uint32_t n = 0;
+    for (uint32_t id = 0; id < upto; id++) {
+        n += !delivered[id];
+    }
+    return n;
+}
+
+// Never-formatted partition, nothing delivered yet
+static void fresh_flash(void)
+{
+    memset(flash, 0x5A, PART_SIZE);
+    memset(delivered, 0, MAX_ITEMS);
+    next_id = 0;
+    last_delivered = -1;
+    violations = 0;
+    dups = 0;
+    REQUIRE(outbox_init(OUTBOX_PARTITION_LABEL) == ESP_OK);
+}
+
+// --- Tests ---
+
+static void test_backlog_flush(void)
+{
+    // The first round formats the blank partition, the second reuses the
+    // segments the first flush erased
+    fresh_flash();
+    for (int batch = OUTBOX_BATCH_MAX; batch >= 1; batch -= OUTBOX_BATCH_MAX - 1) {
+        for (int i = 0; i < 14; i++) {
+            CHECK_EQ(put_one(), ESP_OK);
+        }
+        CHECK_EQ(outbox_pending(), 14);
+        batches = 0;
+        size_t sent = 0;
+        CHECK_EQ(outbox_flush(sink, NULL, batch, &sent), ESP_OK);
+        CHECK_EQ(sent, 14);
+        CHECK_EQ(outbox_pending(), 0);
+        CHECK_EQ(lost(next_id), 0);
+        if (batch == 1) {
+            CHECK_EQ(batches, 14);
+        } else {
+            CHECK(batches < 14);
+        }
+    }
+    CHECK_EQ(dups, 0);
+    CHECK_EQ(violations, 0);
+
+    // A new mount finds nothing left to send
+    REQUIRE(outbox_init(OUTBOX_PARTITION_LABEL) == ESP_OK);
+    CHECK_EQ(outbox_pending(), 0);
+}
+
+static void test_disconnects(void)
+{
+    // Bursts queued offline, flushes that stop at a failed request
+    fresh_flash();
+    int cut_short = 0;
+    for (int c = 0; c < 500; c++) {
+        int n = rnd() % 8;
+        for (int i = 0; i < n; i++) {
+            put_one();
+        }
+        fail_permille = 250;
+        cut_short += outbox_flush(sink, NULL, OUTBOX_BATCH_MAX, NULL) != ESP_OK;
+    }
+    fail_permille = 0;
+    CHECK_EQ(outbox_flush(sink, NULL, OUTBOX_BATCH_MAX, NULL), ESP_OK);
+    outbox_stats_t st;
+    outbox_get_stats(&st);
+    CHECK(cut_short > 0);
+    CHECK_EQ(st.pending, 0);
+    CHECK_EQ(st.queued, next_id);
+    CHECK_EQ(st.delivered + st.dropped, next_id);
+    CHECK_EQ(lost(next_id), st.dropped);
+    CHECK_EQ(dups, 0);
+    CHECK_EQ(violations, 0);
+    // Appends rotate through every segment, least erased first
+    CHECK(st.erase_min > 0);
+    CHECK(st.erase_max - st.erase_min <= 1);
+}
+
+static void test_overflow(void)
+{
+    // More than the partition holds: the oldest go, the newest stay
+    fresh_flash();
+    for (int i = 0; i < 60; i++) {
+        CHECK_EQ(put_one(), ESP_OK);
+    }
+    outbox_stats_t st;
+    outbox_get_stats(&st);
+    CHECK(st.dropped > 0);
+    CHECK_EQ(outbox_flush(sink, NULL, OUTBOX_BATCH_MAX, NULL), ESP_OK);
+    uint32_t first = 0;
+    while (first < next_id && !delivered[first]) {
+        first++;
+    }
+    CHECK_EQ(first, st.dropped);
+    CHECK_EQ(lost(next_id), st.dropped);
+    CHECK_EQ(violations, 0);
+
+    // An item that can never fit is refused up front
+    outbox_item_t big = { .type = OUTBOX_PHOTO, .data = payload, .len = outbox_max_payload() + 1 };
+    CHECK_EQ(outbox_put(&big), ESP_ERR_INVALID_SIZE);
+}
+
+static void test_power_loss(void)
+{
+    // Power cut at random points of puts, flushes and erases
+    fresh_flash();
+    int crashes = 0;
+    int torn = 0;
+    uint32_t dropped = 0;
+    outbox_stats_t st;
+    for (int round = 0; round < 300; round++) {
+        volatile bool in_put = false;
+        cut_at = rnd() % 3 ? rnd() % 400000 : rnd() % 40;
+        if (setjmp(power_loss) == 0) {
+            int n = rnd() % 6;
+            for (int i = 0; i < n; i++) {
+                in_put = true;
+                put_one();
+                in_put = false;
+            }
+            fail_permille = 100;
+            outbox_flush(sink, NULL, OUTBOX_BATCH_MAX, NULL);
+            cut_at = -1;
+        } else {
+            crashes++;
+            if (in_put) {
+                // Whether the record made it is unknown, so it must be
+                // intact or absent; the sink checks the former
+                delivered[next_id++] = 2;
+                torn++;
+            }
+            outbox_get_stats(&st);
+            dropped += st.dropped;
+            REQUIRE(outbox_init(OUTBOX_PARTITION_LABEL) == ESP_OK);
+        }
+    }
+    fail_permille = 0;
+    CHECK_EQ(outbox_flush(sink, NULL, OUTBOX_BATCH_MAX, NULL), ESP_OK);
+    outbox_get_stats(&st);
+    dropped += st.dropped;
+    CHECK(crashes > 100);
+    CHECK(torn > 10);
+    CHECK_EQ(st.pending, 0);
+    CHECK(lost(next_id) <= dropped);
+    CHECK_EQ(violations, 0);
+}
+
+static void test_reset_mid_append(void)
+{
+    // Start so the fourth item is a message: small enough to cut at every byte
+    uint32_t base = 0;
+    outbox_type_t type;
+    while (item_len(base + 3, &type), type != OUTBOX_MESSAGE) {
+        base++;
+    }
+    int cuts = 0;
+    for (long long k = 0;; k++) {
+        fresh_flash();
+        next_id = base;
+        last_delivered = base - 1;
+        for (int i = 0; i < 3; i++) {
+            REQUIRE(put_one() == ESP_OK);
+        }
+        bool cut = true;
+        if (setjmp(power_loss) == 0) {
+            cut_at = k;
+            put_one();
+            cut_at = -1;
+            cut = false;
+        }
+        if (!cut) {
+            break;
+        }
+        cuts++;
+        next_id = base + 4;
+        REQUIRE(outbox_init(OUTBOX_PARTITION_LABEL) == ESP_OK);
+        size_t pending = outbox_pending();
+        CHECK(pending == 3 || pending == 4);
+        CHECK_EQ(put_one(), ESP_OK);
+        CHECK_EQ(outbox_flush(sink, NULL, OUTBOX_BATCH_MAX, NULL), ESP_OK);
+        for (uint32_t id = base; id < base + 5; id++) {
+            if (id != base + 3) {
+                CHECK(delivered[id]);
+            }
+        }
+        CHECK_EQ(outbox_pending(), 0);
+        CHECK_EQ(dups, 0);
+        CHECK_EQ(violations, 0);
+    }
+    // Every byte of the header and the payload was a cut point
+    size_t len = item_len(base + 3, &type);
+    CHECK(cuts >= (int)(len + 48));
+}
+
+// Segments whose header is erased but not the rest
+static int half_erased(void)
+{
+    int n = 0;
+    for (size_t a = 0; a < PART_SIZE; a += OUTBOX_SEGMENT_SIZE) {
+        static const uint8_t blank[16] = {
+            0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        };
+        n += memcmp(flash + a, blank, sizeof(blank)) == 0 &&
+             memchr(flash + a + SECTOR / 2, 0x00, OUTBOX_SEGMENT_SIZE - SECTOR / 2) != NULL;
+    }
+    return n;
+}
+
+static void test_reset_mid_erase(void)
+{
+    for (int block = 0; block < 2; block++) {
+        // Wear every segment a few times, so a segment that loses its
+        // count to the cut stands out
+        fresh_flash();
+        outbox_stats_t st;
+        do {
+            put_one();
+            if (next_id % 4 == 0) {
+                CHECK_EQ(outbox_flush(sink, NULL, OUTBOX_BATCH_MAX, NULL), ESP_OK);
+            }
+            outbox_get_stats(&st);
+        } while (st.erase_min < 4);
+        CHECK_EQ(outbox_flush(sink, NULL, OUTBOX_BATCH_MAX, NULL), ESP_OK);
+        uint32_t worn = st.erase_max;
+
+        // Photos over several segments, then a flush cut at the first or
+        // second block erase of the first segment it reclaims
+        uint32_t first = next_id;
+        for (int i = 0; i < 12; i++) {
+            CHECK_EQ(put_one(), ESP_OK);
+        }
+        bool cut = false;
+        if (setjmp(power_loss) == 0) {
+            erase_cut_at = block;
+            outbox_flush(sink, NULL, OUTBOX_BATCH_MAX, NULL);
+            erase_cut_at = -1;
+        } else {
+            cut = true;
+        }
+        CHECK(cut);
+        CHECK_EQ(half_erased(), 1);
+        uint32_t sent = 0;
+        for (uint32_t id = first; id < next_id; id++) {
+            sent += delivered[id] != 0;
+        }
+        CHECK(sent > 0 && sent < next_id - first);
+
+        REQUIRE(outbox_init(OUTBOX_PARTITION_LABEL) == ESP_OK);
+        // Items not yet delivered survived the cut, and the segment that
+        // lost its count is taken for the most worn rather than as new
+        CHECK(outbox_pending() >= next_id - first - sent);
+        outbox_get_stats(&st);
+        CHECK(st.erase_min >= worn - 1);
+
+        // Wrap every segment, the half-erased one included
+        uint32_t wrap = next_id + 2 * PART_SIZE / 75000;
+        while (next_id < wrap) {
+            CHECK_EQ(put_one(), ESP_OK);
+            if (next_id % 4 == 0) {
+                CHECK_EQ(outbox_flush(sink, NULL, OUTBOX_BATCH_MAX, NULL), ESP_OK);
+            }
+        }
+        CHECK_EQ(outbox_flush(sink, NULL, OUTBOX_BATCH_MAX, NULL), ESP_OK);
+        outbox_get_stats(&st);
+        CHECK_EQ(st.dropped, 0);
+        CHECK_EQ(lost(next_id), 0);
+        CHECK_EQ(half_erased(), 0);
+        CHECK_EQ(violations, 0);
+        CHECK(st.erase_min >= worn);
+        CHECK(st.erase_max - st.erase_min <= 2);
+    }
+}
+
+int main(void)
+{
+    // Backed by an unlinked temporary file, as the partition is by flash
+    char path[] = "/tmp/outbox_XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    unlink(path);
+    REQUIRE(ftruncate(fd, PART_SIZE) == 0);
+    flash = mmap(NULL, PART_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    REQUIRE(flash != MAP_FAILED);
+    delivered = calloc(1, MAX_ITEMS);
+    REQUIRE(delivered);
+
+    CHECK_EQ(outbox_init("missing"), ESP_ERR_NOT_FOUND);
+    RUN(test_backlog_flush);
+    RUN(test_disconnects);
+    RUN(test_overflow);
+    RUN(test_power_loss);
+    RUN(test_reset_mid_append);
+    RUN(test_reset_mid_erase);
+    return TEST_DONE();
+}
@@ -0,0 +1,203 @@
+// ov2640: mode switches through a recording SCCB bus. The register shadow
+// cache must leave the sensor in the same state as writing every table
+// entry, and batching must cut the transactions to the counts quoted for it
+#include <math.h>
+#include <string.h>
+#include "test.h"
+#include "sensor.h"
+#include "sccb.h"
+#include "xclk.h"
+
+int esp32_camera_ov2640_init(sensor_t *sensor);
+// ov2640_uncached.c: the same driver writing every table entry
+int ov2640_uncached_init(sensor_t *sensor);
+
+#define BATCH_MAX 32    // writes sccb.c chains into one command link
+
+// Fake sensor: applies writes to both register banks and counts what an
+// I2C bus would carry. 0xFF is the bank select.
+static struct {
+    uint8_t regs[2][256];
+    int bank;
+    bool batched;       // false: one transaction per register, as before batching
+    long writes, txns, bits;
+} bus;
+
+static void bus_apply(uint8_t reg, uint8_t value)
+{
+    bus.writes++;
+    if (reg == 0xFF) {
+        bus.bank = value & 1;
+    } else {
+        bus.regs[bus.bank][reg] = value;
+    }
+}
+
+int SCCB_Write(uint8_t slv_addr, uint8_t reg, uint8_t data)
+{
+    // START, address, register, data, each byte with its ACK, STOP
+    bus.txns++;
+    bus.bits += 1 + 27 + 1;
+    bus_apply(reg, data);
+    return 0;
+}
+
+int SCCB_WriteBatch(uint8_t slv_addr, const uint8_t (*regs)[2], size_t count)
+{
+    for (size_t i = 0; i < count; i += BATCH_MAX) {
+        size_t n = count - i < BATCH_MAX ? count - i : BATCH_MAX;
+        for (size_t j = i; j < i + n; j++) {
+            if (!bus.batched) {
+                SCCB_Write(slv_addr, regs[j][0], regs[j][1]);
+                continue;
+            }
+            // Repeated START in place of STOP between registers
+            bus.bits += 1 + 27;
+            bus_apply(regs[j][0], regs[j][1]);
+        }
+        if (bus.batched) {
+            bus.txns++;
+            bus.bits++;
+        }
+    }
+    return 0;
+}
+
+uint8_t SCCB_Read(uint8_t slv_addr, uint8_t reg)
+{
+    // Register write, then a separate read transaction
+    bus.txns += 2;
+    bus.bits += 2 * (1 + 18 + 1);
+    return bus.regs[bus.bank][reg];
+}
+
+esp_err_t xclk_timer_conf(int ledc_timer, int xclk_freq_hz)
+{
+    return ESP_OK;
+}
+
+// Bus time in ms at clk_hz, with 100 us of driver overhead per transaction
+static double bus_ms(long bits, long txns, int clk_hz)
+{
+    return bits * 1000.0 / clk_hz + txns * 0.1;
+}
+
+typedef struct {
+    const char *name;
+    framesize_t size;
+    long cold_writes, warm_writes;  // register writes, without and with the cache
+    long cold_txns, warm_txns;      // transactions, before and after batching
+    // Bus time quoted for the step, 0 where none was: before at 100 kHz,
+    // after at 100 and 400 kHz
+    double before_ms, after_ms, fast_ms;
+} step_t;
+
+// The first step brings the sensor up the way esp_camera_init() does
+static const step_t steps[] = {
+    { "init to UXGA", FRAMESIZE_UXGA, 237, 203, 237, 19, 92, 59, 16 },
+    { "UXGA->SVGA",   FRAMESIZE_SVGA,  66, 40,   66, 8,  26, 12, 3.6 },
+    { "SVGA->UXGA",   FRAMESIZE_UXGA,  65, 39,   65, 8 },
+    { "UXGA->XGA",    FRAMESIZE_XGA,   65, 13,   65, 7,  25, 4.4, 1.6 },
+    { "XGA->UXGA",    FRAMESIZE_UXGA,  65, 13,   65, 7,  25, 4.4, 1.6 },
+    { "UXGA->VGA",    FRAMESIZE_VGA,   66, 40,   66, 8 },
+    { "VGA->QVGA",    FRAMESIZE_QVGA,  64, 18,   64, 7 },
+    { "QVGA->UXGA",   FRAMESIZE_UXGA,  65, 39,   65, 8 },
+};
+#define STEPS (sizeof(steps) / sizeof(steps[0]))
+
+typedef struct {
+    uint8_t regs[STEPS][2][256];
+    long writes[STEPS], txns[STEPS], bits[STEPS];
+} run_t;
+
+// Play every step through the driver that init() sets up
+static void replay(run_t *run, int (*init)(sensor_t *), bool batched)
+{
+    sensor_t s = { .slv_addr = 0x30, .pixformat = PIXFORMAT_JPEG };
+    memset(&bus, 0, sizeof(bus));
+    bus.batched = batched;
+    init(&s);
+    REQUIRE(s.reset(&s) == 0);
+    for (size_t i = 0; i < STEPS; i++) {
+        REQUIRE(s.set_framesize(&s, steps[i].size) == 0);
+        if (i == 0) {
+            REQUIRE(s.set_pixformat(&s, PIXFORMAT_JPEG) == 0);
+            REQUIRE(s.set_quality(&s, 10) == 0);
+        }
+        memcpy(run->regs[i], bus.regs, sizeof(bus.regs));
+        run->writes[i] = bus.writes;
+        run->txns[i] = bus.txns;
+        run->bits[i] = bus.bits;
+        bus.writes = bus.txns = bus.bits = 0;
+    }
+}
+
+static run_t cold, warm, cold_unbatched;
+
+static void test_register_image(void)
+{
+    replay(&cold, ov2640_uncached_init, true);
+    replay(&warm, esp32_camera_ov2640_init, true);
+    for (size_t i = 0; i < STEPS; i++) {
+        for (int bank = 0; bank < 2; bank++) {
+            for (int reg = 0; reg < 256; reg++) {
+                if (warm.regs[i][bank][reg] != cold.regs[i][bank][reg]) {
+                    printf("%s: bank %d reg 0x%02x is 0x%02x, want 0x%02x\n", steps[i].name,
+                           bank, reg, warm.regs[i][bank][reg], cold.regs[i][bank][reg]);
+                    check_failures++;
+                }
+            }
+        }
+    }
+}
+
+static void test_switch_writes(void)
+{
+    for (size_t i = 0; i < STEPS; i++) {
+        printf("%-12s %3ld -> %3ld writes\n", steps[i].name, cold.writes[i], warm.writes[i]);
+        CHECK_EQ(cold.writes[i], steps[i].cold_writes);
+        CHECK_EQ(warm.writes[i], steps[i].warm_writes);
+        // Nothing may get worse
+        CHECK(warm.writes[i] <= cold.writes[i]);
+    }
+}
+
+// Quoted times are rounded to two significant digits
+static bool near(double ms, double quoted)
+{
+    return fabs(ms - quoted) <= quoted * 0.05;
+}
+
+static void test_transactions(void)
+{
+    replay(&cold_unbatched, ov2640_uncached_init, false);
+    printf("%-12s %26s %42s\n", "", "before", "after");
+    for (size_t i = 0; i < STEPS; i++) {
+        printf("%-12s %4ld txns %5.1f ms @100k | %4ld txns %5.1f ms @100k %5.1f ms @400k\n",
+               steps[i].name, cold_unbatched.txns[i],
+               bus_ms(cold_unbatched.bits[i], cold_unbatched.txns[i], 100000),
+               warm.txns[i], bus_ms(warm.bits[i], warm.txns[i], 100000),
+               bus_ms(warm.bits[i], warm.txns[i], 400000));
+        CHECK_EQ(cold_unbatched.txns[i], steps[i].cold_txns);
+        CHECK_EQ(warm.txns[i], steps[i].warm_txns);
+        if (steps[i].before_ms) {
+            CHECK(near(bus_ms(cold_unbatched.bits[i], cold_unbatched.txns[i], 100000), steps[i].before_ms));
+            CHECK(near(bus_ms(warm.bits[i], warm.txns[i], 100000), steps[i].after_ms));
+            CHECK(near(bus_ms(warm.bits[i], warm.txns[i], 400000), steps[i].fast_ms));
+        }
+        CHECK(warm.txns[i] < cold_unbatched.txns[i]);
+    }
+    // Batching leaves what reaches the registers alone
+    for (size_t i = 0; i < STEPS; i++) {
+        CHECK(memcmp(cold_unbatched.regs[i], cold.regs[i], sizeof(cold.regs[i])) == 0);
+        CHECK_EQ(cold_unbatched.writes[i], cold.writes[i]);
+    }
+}
+
+int main(void)
+{
+    RUN(test_register_image);
+    RUN(test_switch_writes);
+    RUN(test_transactions);
+    return TEST_DONE();
+}
@@ -0,0 +1,279 @@
+// phash: the test pictures stay within the resend threshold through
+// requantizing, re-encoding, exposure, a small shift and sensor noise, and
+// leave it when the scene changes. The hash costs about as much as the DC
+// map it is built on, far less than a decode.
+#include "jpeg_fixture.h"
+#include "phash.h"
+
+#define REPS 15
+
+// main.c's DEDUP_SAME_BITS and DEDUP_SIMILAR_BITS: up to SAME resends the
+// last upload, above CHANGED is a new scene
+#define SAME        4
+#define CHANGED     10
+
+static phash_t hash_of(const uint8_t *jpg, size_t len)
+{
+    phash_t h;
+    REQUIRE(phash_jpeg(jpg, len, &h) == ESP_OK);
+    return h;
+}
+
+static phash_t hash_pixels(const uint8_t *rgb, int w, int h, int quality)
+{
+    uint8_t *jpg;
+    size_t len;
+    REQUIRE(jpeg_encode_rgb(rgb, w, h, quality, &jpg, &len));
+    phash_t hash = hash_of(jpg, len);
+    free(jpg);
+    return hash;
+}
+
+static phash_t hash_requant(const fixture_t *fx, int quality)
+{
+    uint8_t *jpg;
+    size_t len;
+    REQUIRE(jpg2jpg(fx->buf, fx->len, quality, &jpg, &len));
+    phash_t hash = hash_of(jpg, len);
+    free(jpg);
+    return hash;
+}
+
+static uint8_t clamp(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Each pixel times scale/100
+static uint8_t *scaled(const uint8_t *rgb, int w, int h, int scale)
+{
+    size_t n = (size_t)w * h * 3;
+    uint8_t *px = malloc(n);
+    REQUIRE(px);
+    for (size_t i = 0; i < n; i++) {
+        px[i] = clamp(rgb[i] * scale / 100);
+    }
+    return px;
+}
+
+// The scene moved dx pixels left, the right edge repeated
+static uint8_t *shifted(const uint8_t *rgb, int w, int h, int dx)
+{
+    uint8_t *px = malloc((size_t)w * h * 3);
+    REQUIRE(px);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            int sx = x + dx < w ? x + dx : w - 1;
+            memcpy(px + ((size_t)y * w + x) * 3, rgb + ((size_t)y * w + sx) * 3, 3);
+        }
+    }
+    return px;
+}
+
+// Uniform noise of +-amp on every sample
+static uint8_t *noisy(const uint8_t *rgb, int w, int h, int amp)
+{
+    size_t n = (size_t)w * h * 3;
+    uint8_t *px = malloc(n);
+    REQUIRE(px);
+    for (size_t i = 0; i < n; i++) {
+        px[i] = clamp(rgb[i] + rand() % (2 * amp + 1) - amp);
+    }
+    return px;
+}
+
+// Something new in the frame: a dark object over a quarter of it
+static uint8_t *with_object(const uint8_t *rgb, int w, int h)
+{
+    size_t n = (size_t)w * h * 3;
+    uint8_t *px = malloc(n);
+    REQUIRE(px);
+    memcpy(px, rgb, n);
+    for (int y = h / 4; y < h * 3 / 4; y++) {
+        for (int x = w / 8; x < w * 5 / 8; x++) {
+            uint8_t *p = px + ((size_t)y * w + x) * 3;
+            p[0] = 40;
+            p[1] = 30;
+            p[2] = 20;
+        }
+    }
+    return px;
+}
+
+// The DC map phash averages is the 1/8 scale luma image the decoder sees
+static void test_dc_map(void)
+{
+    static int16_t dc[PHASH_MAX_BLOCKS];
+    for (int i = 0; i < FIXTURE_COUNT; i++) {
+        fixture_t fx = fixture_load(i);
+        int w, h;
+        uint16_t bw, bh;
+        uint8_t *ref = jpeg_decode_rgb(fx.buf, fx.len, &w, &h);
+        REQUIRE(ref && jpg_dc_luma(fx.buf, fx.len, dc, PHASH_MAX_BLOCKS, &bw, &bh));
+        CHECK(bw >= (w + 7) / 8 && bh >= (h + 7) / 8);
+        // Blocks wholly inside the frame. Rounding in the decoder's colour
+        // conversion and in the luma below puts them a level or two apart.
+        int worst = 0;
+        double total = 0;
+        int n = 0;
+        for (int by = 0; by < h / 8; by++) {
+            for (int bx = 0; bx < w / 8; bx++) {
+                int sum = 0;
+                for (int y = 0; y < 8; y++) {
+                    const uint8_t *p = ref + ((size_t)(by * 8 + y) * w + bx * 8) * 3;
+                    for (int x = 0; x < 8; x++, p += 3) {
+                        sum += (299 * p[0] + 587 * p[1] + 114 * p[2]) / 1000;
+                    }
+                }
+                int d = abs(sum / 64 - (128 + dc[by * bw + bx] / 8));
+                worst = d > worst ? d : worst;
+                total += d;
+                n++;
+            }
+        }
+        printf("%-18s %ux%u blocks: mean error %.2f, worst %d levels\n", fixture_names[i], bw, bh, total / n, worst);
+        CHECK(total / n < 2);
+        CHECK(worst <= 3);
+        free(ref);
+        free(fx.buf);
+    }
+}
+
+static void test_same_scene(void)
+{
+    srand(1);
+    for (int i = 0; i < FIXTURE_COUNT; i++) {
+        fixture_t fx = fixture_load(i);
+        int w, h;
+        uint8_t *ref = jpeg_decode_rgb(fx.buf, fx.len, &w, &h);
+        REQUIRE(ref);
+        phash_t base = hash_of(fx.buf, fx.len);
+        uint8_t *brighter = scaled(ref, w, h, 115);
+        uint8_t *moved = shifted(ref, w, h, 3);
+        uint8_t *noise = noisy(ref, w, h, 8);
+        struct {
+            const char *name;
+            phash_t hash;
+        } same[] = {
+            { "requant q50", hash_requant(&fx, 50) },
+            { "requant q30", hash_requant(&fx, 30) },
+            { "re-encode q95", hash_pixels(ref, w, h, 95) },
+            { "re-encode q50", hash_pixels(ref, w, h, 50) },
+            { "+15% exposure", hash_pixels(brighter, w, h, 80) },
+            { "3 px shift", hash_pixels(moved, w, h, 80) },
+            { "noise +-8", hash_pixels(noise, w, h, 80) },
+        };
+        printf("%-18s", fixture_names[i]);
+        for (size_t k = 0; k < sizeof(same) / sizeof(same[0]); k++) {
+            int d = phash_distance(&base, &same[k].hash);
+            printf(" | %s %d", same[k].name, d);
+            CHECK(d <= SAME);
+        }
+        printf("\n");
+        CHECK(same[4].hash.luma > base.luma);
+        free(brighter);
+        free(moved);
+        free(noise);
+        free(ref);
+        free(fx.buf);
+    }
+}
+
+// A light switched on keeps the layout; only the brightness tells
+static void test_light_on(void)
+{
+    for (int i = 0; i < FIXTURE_COUNT; i++) {
+        fixture_t fx = fixture_load(i);
+        int w, h;
+        uint8_t *ref = jpeg_decode_rgb(fx.buf, fx.len, &w, &h);
+        REQUIRE(ref);
+        uint8_t *dark = scaled(ref, w, h, 30);
+        phash_t off = hash_pixels(dark, w, h, 80);
+        phash_t on = hash_of(fx.buf, fx.len);
+        int d = phash_distance(&off, &on);
+        printf("%-18s light on: %d bits, luma %u -> %u\n", fixture_names[i], d, off.luma, on.luma);
+        CHECK(d <= SAME);
+        CHECK(on.luma > off.luma + 40);
+        free(dark);
+        free(ref);
+        free(fx.buf);
+    }
+}
+
+static void test_changed_scene(void)
+{
+    phash_t base[FIXTURE_COUNT];
+    for (int i = 0; i < FIXTURE_COUNT; i++) {
+        fixture_t fx = fixture_load(i);
+        int w, h;
+        uint8_t *ref = jpeg_decode_rgb(fx.buf, fx.len, &w, &h);
+        REQUIRE(ref);
+        base[i] = hash_of(fx.buf, fx.len);
+        uint8_t *object = with_object(ref, w, h);
+        phash_t changed = hash_pixels(object, w, h, 80);
+        int d = phash_distance(&base[i], &changed);
+        printf("%-18s object appeared: %d bits\n", fixture_names[i], d);
+        CHECK(d > CHANGED);
+        free(object);
+        free(ref);
+        free(fx.buf);
+    }
+    for (int i = 0; i < FIXTURE_COUNT; i++) {
+        for (int j = i + 1; j < FIXTURE_COUNT; j++) {
+            int d = phash_distance(&base[i], &base[j]);
+            printf("%s vs %s: %d bits\n", fixture_names[i], fixture_names[j], d);
+            CHECK(d > CHANGED);
+        }
+    }
+}
+
+// The hash against the DC map under it, a requant and a full decode
+static void test_speed(void)
+{
+    static int16_t dc[PHASH_MAX_BLOCKS];
+    for (int i = 0; i < FIXTURE_COUNT; i++) {
+        fixture_t fx = fixture_load(i);
+        double hash_ms = 1e9, dc_ms = 1e9, requant_ms = 1e9, decode_ms = 1e9;
+        for (int k = 0; k < REPS; k++) {
+            phash_t hash;
+            double t0 = now_ms();
+            REQUIRE(phash_jpeg(fx.buf, fx.len, &hash) == ESP_OK);
+            hash_ms = fmin(hash_ms, now_ms() - t0);
+
+            uint16_t bw, bh;
+            t0 = now_ms();
+            REQUIRE(jpg_dc_luma(fx.buf, fx.len, dc, PHASH_MAX_BLOCKS, &bw, &bh));
+            dc_ms = fmin(dc_ms, now_ms() - t0);
+
+            uint8_t *out;
+            size_t len;
+            t0 = now_ms();
+            REQUIRE(jpg2jpg(fx.buf, fx.len, 50, &out, &len));
+            requant_ms = fmin(requant_ms, now_ms() - t0);
+            free(out);
+
+            int w, h;
+            t0 = now_ms();
+            uint8_t *px = jpeg_decode_rgb(fx.buf, fx.len, &w, &h);
+            decode_ms = fmin(decode_ms, now_ms() - t0);
+            REQUIRE(px);
+            free(px);
+        }
+        printf("%-18s %6zu B: phash %5.3f ms (DC map %5.3f ms) | requant q50 %5.3f ms | decode %5.3f ms\n",
+               fixture_names[i], fx.len, hash_ms, dc_ms, requant_ms, decode_ms);
+        // Most of the hash is the entropy decode behind the DC map
+        CHECK(hash_ms < dc_ms * 2);
+        CHECK(hash_ms * 3 < decode_ms);
+        free(fx.buf);
+    }
+}
+
+int main(void)
+{
+    RUN(test_dc_map);
+    RUN(test_same_scene);
+    RUN(test_light_on);
+    RUN(test_changed_scene);
+    RUN(test_speed);
+    return TEST_DONE();
+}
@@ -0,0 +1,318 @@
+// quality_ctl: the ladder follows a scripted uplink, drops straight to a
+// rung that fits, climbs one rung at a time with hysteresis, and programs
+// the sensor only when the rung changes. Photos sent through telegram.c to
+// a bandwidth-shaped fake server are delivered inside the target once the
+// controller has seen the link.
+#include <string.h>
+#include "test.h"
+#include "esp_camera.h"
+#include "esp_http_client.h"
+#include "jpeg_fixture.h"
+#include "quality_ctl.h"
+#include "telegram.h"
+#include "trace.h"
+
+#define TARGET_MS 3000
+
+void trace_event(trace_id_t id, trace_kind_t kind, uint32_t arg)
+{
+}
+
+// Fake camera: a mode switch may hand out a new sensor object, as a switch
+// that needs bigger buffers does on the device
+static sensor_t sensors[2];
+static int current_sensor;
+static framesize_t framesize;
+static int quality;
+static int switches, quality_sets;
+static esp_err_t switch_err;
+
+static int set_quality(sensor_t *s, int q)
+{
+    CHECK(s == &sensors[current_sensor]);
+    quality = q;
+    quality_sets++;
+    return 0;
+}
+
+esp_err_t esp_camera_switch_mode(framesize_t size)
+{
+    if (switch_err != ESP_OK) {
+        return switch_err;
+    }
+    framesize = size;
+    switches++;
+    current_sensor ^= 1;
+    return ESP_OK;
+}
+
+sensor_t *esp_camera_sensor_get(void)
+{
+    return &sensors[current_sensor];
+}
+
+static void reset(void)
+{
+    memset(sensors, 0, sizeof(sensors));
+    sensors[0].set_quality = set_quality;
+    sensors[1].set_quality = set_quality;
+    current_sensor = 0;
+    framesize = FRAMESIZE_INVALID;
+    quality = -1;
+    switches = quality_sets = 0;
+    switch_err = ESP_OK;
+    quality_ctl_init(TARGET_MS);
+}
+
+// JPEG size the fake sensor produces for the current mode
+static size_t frame_bytes(void)
+{
+    size_t pixels = (size_t)resolution[framesize].width * resolution[framesize].height;
+    return pixels * (quality <= 8 ? 60 : quality <= 10 ? 50 : 40) / 1000;
+}
+
+// One capture and upload over a link with the given throughput and setup
+// time. Returns the delivery time of that photo.
+static uint32_t shoot(uint32_t bps, uint32_t setup_ms)
+{
+    CHECK_EQ(quality_ctl_apply(esp_camera_sensor_get()), ESP_OK);
+    size_t bytes = frame_bytes();
+    quality_ctl_record_frame(bytes);
+    int64_t write_us = (int64_t)bytes * 1000000 / bps;
+    quality_ctl_record_upload(bytes, (int64_t)setup_ms * 1000, write_us);
+    return setup_ms + (uint32_t)(write_us / 1000);
+}
+
+static int rung(void)
+{
+    quality_ctl_status_t st;
+    quality_ctl_get_status(&st);
+    return st.step;
+}
+
+static void test_priors(void)
+{
+    reset();
+    quality_ctl_status_t st;
+    quality_ctl_get_status(&st);
+    CHECK_EQ(st.samples, 0);
+    CHECK_EQ(st.framesize, FRAMESIZE_XGA);
+    CHECK_EQ(st.quality, 8);
+    CHECK_EQ(st.target_ms, TARGET_MS);
+
+    // Nothing measured yet: the first apply programs the default rung
+    CHECK_EQ(quality_ctl_apply(esp_camera_sensor_get()), ESP_OK);
+    CHECK_EQ(framesize, FRAMESIZE_XGA);
+    CHECK_EQ(quality, 8);
+    CHECK_EQ(switches, 1);
+    // Same rung again: the sensor is left alone
+    CHECK_EQ(quality_ctl_apply(esp_camera_sensor_get()), ESP_OK);
+    CHECK_EQ(switches, 1);
+    CHECK_EQ(quality_sets, 1);
+    CHECK_EQ(quality_ctl_apply(NULL), ESP_ERR_INVALID_ARG);
+}
+
+static void test_drop_to_fit(void)
+{
+    reset();
+    shoot(100 * 1024, 500);
+    int before = rung();
+    // 15 KB/s: the first photo is late, and XGA no longer fits. Drop in one
+    // go to the best rung that does.
+    CHECK(shoot(15 * 1024, 500) > TARGET_MS);
+    CHECK_EQ(quality_ctl_apply(esp_camera_sensor_get()), ESP_OK);
+    quality_ctl_status_t st;
+    quality_ctl_get_status(&st);
+    CHECK(st.step < before);
+    CHECK(st.predicted_ms <= TARGET_MS);
+    CHECK_EQ(st.framesize, framesize);
+    CHECK_EQ(st.quality, quality);
+    // And it really delivers inside the target from the next photo on
+    for (int i = 0; i < 5; i++) {
+        CHECK(shoot(15 * 1024, 500) <= TARGET_MS);
+    }
+}
+
+static void test_climb(void)
+{
+    reset();
+    shoot(10 * 1024, 500);
+    shoot(10 * 1024, 500);
+    int low = rung();
+    CHECK(low < 4);
+    // Fast link: one rung at a time, and only after two agreeing captures
+    int prev = low;
+    int changes = 0;
+    for (int i = 0; i < 40; i++) {
+        shoot(400 * 1024, 300);
+        int now = rung();
+        CHECK(now - prev <= 1);
+        CHECK(now >= prev);
+        changes += now != prev;
+        prev = now;
+    }
+    quality_ctl_status_t st;
+    quality_ctl_get_status(&st);
+    CHECK_EQ(st.step, st.steps - 1);
+    CHECK_EQ(framesize, FRAMESIZE_UXGA);
+    CHECK_EQ(changes, st.steps - 1 - low);
+}
+
+static void test_hysteresis(void)
+{
+    reset();
+    for (int i = 0; i < 6; i++) {
+        shoot(20 * 1024, 500);
+    }
+    int settled = rung();
+    // One fast upload between slow ones never moves the ladder up
+    int changes = 0;
+    for (int i = 0; i < 30; i++) {
+        shoot(i % 3 == 0 ? 300 * 1024 : 20 * 1024, 500);
+        changes += rung() != settled;
+    }
+    CHECK(rung() <= settled);
+    CHECK_EQ(changes, 0);
+}
+
+static void test_frame_sizes_learned(void)
+{
+    reset();
+    CHECK_EQ(quality_ctl_apply(esp_camera_sensor_get()), ESP_OK);
+    quality_ctl_status_t st;
+    quality_ctl_get_status(&st);
+    uint32_t prior = st.expected_bytes;
+    // Frames twice the prior estimate pull it up, a quarter of the way each
+    for (int i = 0; i < 10; i++) {
+        quality_ctl_record_frame(prior * 2);
+    }
+    quality_ctl_get_status(&st);
+    CHECK(st.expected_bytes > prior * 3 / 2);
+    CHECK(st.expected_bytes <= prior * 2);
+    // Uploads with nothing measured are ignored
+    uint32_t samples = st.samples;
+    quality_ctl_record_upload(0, 1000, 1000);
+    quality_ctl_record_upload(1000, 1000, 0);
+    quality_ctl_get_status(&st);
+    CHECK_EQ(st.samples, samples);
+}
+
+static void test_switch_failure(void)
+{
+    reset();
+    shoot(100 * 1024, 500);
+    switch_err = ESP_FAIL;
+    // Slow link wants a smaller frame, but the switch fails
+    quality_ctl_record_upload(100000, 500000, 20000000);
+    CHECK_EQ(quality_ctl_apply(esp_camera_sensor_get()), ESP_FAIL);
+    framesize_t stuck = framesize;
+    // The next apply tries again
+    switch_err = ESP_OK;
+    CHECK_EQ(quality_ctl_apply(esp_camera_sensor_get()), ESP_OK);
+    CHECK(framesize != stuck);
+}
+
+// The bandwidth script the controller was tuned on: good, bad, middling,
+// good again. Every photo after the first at a new speed meets the target.
+static void test_script(void)
+{
+    static const uint32_t script[] = {
+        100000, 100000, 15000, 15000, 15000, 15000, 60000, 60000, 60000,
+        60000, 60000, 60000, 200000, 200000, 200000, 200000, 200000,
+    };
+    reset();
+    uint32_t last = 0;
+    for (size_t i = 0; i < sizeof(script) / sizeof(script[0]); i++) {
+        uint32_t ms = shoot(script[i], 500);
+        if (i > 0 && script[i] == last) {
+            CHECK(ms <= TARGET_MS);
+        }
+        last = script[i];
+    }
+    CHECK_EQ(framesize, FRAMESIZE_UXGA);
+}
+
+// The live run: a shorter target and a link scaled to match, so it runs
+// in seconds. Each photo is captured at the rung quality_ctl applied and
+// uploaded with telegram_send_photo(), whose timings feed the controller.
+#define LIVE_TARGET_MS  1000
+#define LIVE_OPEN_MS    150
+#define LIVE_REPLY_MS   20
+
+typedef struct {
+    long bytes_per_s;
+    int photos;
+} phase_t;
+
+static uint32_t deliver(void)
+{
+    CHECK_EQ(quality_ctl_apply(esp_camera_sensor_get()), ESP_OK);
+    camera_fb_t fb = {
+        .len = frame_bytes(),
+        .width = resolution[framesize].width,
+        .height = resolution[framesize].height,
+        .format = PIXFORMAT_JPEG,
+    };
+    fb.buf = malloc(fb.len);
+    REQUIRE(fb.buf);
+    memset(fb.buf, 0x55, fb.len);
+    fb.buf[0] = 0xFF;
+    fb.buf[1] = 0xD8;
+    quality_ctl_record_frame(fb.len);
+    double t0 = now_ms();
+    CHECK_EQ(telegram_send_photo("1000", &fb), ESP_OK);
+    uint32_t ms = (uint32_t)(now_ms() - t0);
+    free(fb.buf);
+    host_http_reset();
+    return ms;
+}
+
+static void test_delivery(void)
+{
+    // Good, bad, middling, good again
+    static const phase_t phases[] = {
+        { 200 * 1024, 3 },
+        { 30 * 1024, 3 },
+        { 120 * 1024, 3 },
+        { 400 * 1024, 6 },
+    };
+    reset();
+    quality_ctl_set_target(LIVE_TARGET_MS);
+    telegram_set_upload_observer(quality_ctl_record_upload);
+    int rungs[4];
+    for (size_t p = 0; p < sizeof(phases) / sizeof(phases[0]); p++) {
+        printf("%3ld KB/s:", phases[p].bytes_per_s / 1024);
+        for (int i = 0; i < phases[p].photos; i++) {
+            host_http_server.open_ms = LIVE_OPEN_MS;
+            host_http_server.response_ms = LIVE_REPLY_MS;
+            host_http_server.bytes_per_s = phases[p].bytes_per_s;
+            uint32_t ms = deliver();
+            printf(" %ux%u %u ms%s", resolution[framesize].width, resolution[framesize].height, (unsigned)ms,
+                   i + 1 < phases[p].photos ? "," : "\n");
+            // The first photo at a new speed was sized for the old one
+            if (i > 0) {
+                CHECK(ms <= LIVE_TARGET_MS);
+            }
+        }
+        rungs[p] = rung();
+    }
+    telegram_set_upload_observer(NULL);
+    // Down at once; back up only as the slowly recovering estimate allows
+    CHECK(rungs[1] < rungs[0]);
+    CHECK(rungs[2] >= rungs[1]);
+    CHECK(rungs[3] > rungs[2]);
+    CHECK_EQ(framesize, FRAMESIZE_UXGA);
+}
+
+int main(void)
+{
+    RUN(test_priors);
+    RUN(test_drop_to_fit);
+    RUN(test_climb);
+    RUN(test_hysteresis);
+    RUN(test_frame_sizes_learned);
+    RUN(test_switch_failure);
+    RUN(test_script);
+    RUN(test_delivery);
+    return TEST_DONE();
+}
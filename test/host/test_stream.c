@@ -0,0 +1,516 @@
+// stream: viewers on links of different speeds watch the MJPEG stream of a
+// fake camera with two frame buffers. Each gets whole, untorn frames, newest
+// first, at the rate it asked for; a viewer still sending skips frames
+// rather than holding up capture, and viewers slower than the camera share
+// one frame so the camera always has a buffer to fill.
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include "test.h"
+#include "esp_camera.h"
+#include "esp_http_server.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "stream_server.h"
+
+#define FRAME_US        40000
+#define FRAME_LEN       16000
+#define CAM_FBS         2
+#define MAX_FRAMES      256
+
+// The camera: a frame every FRAME_US into whichever buffer no one holds.
+// With both held at a frame start the frame is lost, a stall.
+static struct {
+    pthread_mutex_t lock;
+    camera_fb_t fb[CAM_FBS];
+    int refs[CAM_FBS];
+    uint32_t seq;
+    int64_t next_frame_us;
+    int stalls;
+} cam = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int fb_index(const camera_fb_t *fb)
+{
+    for (int i = 0; i < CAM_FBS; i++) {
+        if (fb == &cam.fb[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Buffer whose pixels buf points at
+static int buf_index(const char *buf)
+{
+    for (int i = 0; i < CAM_FBS; i++) {
+        if ((const uint8_t *)buf == cam.fb[i].buf) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Pixels that say which frame they belong to
+static uint8_t frame_byte(uint32_t seq, size_t k)
+{
+    return (seq * 131 + k * 7) >> 2;
+}
+
+camera_fb_t *esp_camera_fb_acquire(uint32_t timeout_ms)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t deadline = now + timeout_ms * 1000LL;
+    // Idle since the last frame: the next one takes a frame time
+    if (cam.next_frame_us < now - FRAME_US) {
+        cam.next_frame_us = now + FRAME_US;
+    }
+    while (cam.next_frame_us <= deadline) {
+        now = esp_timer_get_time();
+        if (cam.next_frame_us > now) {
+            usleep(cam.next_frame_us - now);
+        }
+        cam.next_frame_us += FRAME_US;
+
+        pthread_mutex_lock(&cam.lock);
+        int i = 0;
+        while (i < CAM_FBS && cam.refs[i]) {
+            i++;
+        }
+        if (i == CAM_FBS) {
+            cam.stalls++;
+            pthread_mutex_unlock(&cam.lock);
+            continue;
+        }
+        camera_fb_t *fb = &cam.fb[i];
+        uint32_t seq = ++cam.seq;
+        fb->buf[0] = 0xFF;
+        fb->buf[1] = 0xD8;
+        memcpy(fb->buf + 2, &seq, sizeof(seq));
+        for (size_t k = 6; k < FRAME_LEN; k++) {
+            fb->buf[k] = frame_byte(seq, k);
+        }
+        int64_t t = esp_timer_get_time();
+        fb->timestamp.tv_sec = t / 1000000;
+        fb->timestamp.tv_usec = t % 1000000;
+        cam.refs[i] = 1;
+        pthread_mutex_unlock(&cam.lock);
+        return fb;
+    }
+    usleep(deadline > now ? deadline - now : 0);
+    return NULL;
+}
+
+esp_err_t esp_camera_fb_retain(camera_fb_t *fb)
+{
+    int i = fb_index(fb);
+    REQUIRE(i >= 0);
+    pthread_mutex_lock(&cam.lock);
+    CHECK(cam.refs[i] > 0);
+    cam.refs[i]++;
+    pthread_mutex_unlock(&cam.lock);
+    return ESP_OK;
+}
+
+void esp_camera_fb_release(camera_fb_t *fb)
+{
+    int i = fb_index(fb);
+    REQUIRE(i >= 0);
+    pthread_mutex_lock(&cam.lock);
+    CHECK(cam.refs[i] > 0);
+    cam.refs[i]--;
+    pthread_mutex_unlock(&cam.lock);
+}
+
+// A viewer: the request it makes, its link, and what it received
+typedef struct {
+    const char *query;
+    long bytes_per_s;
+    bool slow;                  // Slower than the camera, by design of the test
+    bool leave;                 // Its next write fails, as when the page is closed
+
+    esp_err_t handler_err;
+    char status[32];            // Set for anything but 200
+    char type[96];
+    char framerate[8];
+    char text[32];              // A plain response body
+    char boundary[64];
+    bool preamble;
+    size_t part_len;            // From the part header, 0 before one
+    int frames;
+    uint32_t seqs[MAX_FRAMES];
+    int torn;                   // Frames the camera wrote over while they were sent
+    int bad_parts;
+    int sending;                // Buffer being sent, -1 for none
+    bool completed;             // The server got the request back
+} viewer_t;
+
+static pthread_mutex_t viewers_lock = PTHREAD_MUTEX_INITIALIZER;
+static viewer_t *viewers[8];
+static int viewer_count;
+// Times both buffers were held by slow viewers at once
+static int slow_pinned_both;
+
+static esp_err_t (*stream_handler)(httpd_req_t *req);
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config)
+{
+    CHECK_EQ(config->max_open_sockets, STREAM_MAX_CLIENTS + 1);
+    *handle = (httpd_handle_t)&stream_handler;
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler)
+{
+    CHECK(strcmp(uri_handler->uri, "/stream") == 0 && uri_handler->method == HTTP_GET);
+    stream_handler = uri_handler->handler;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type)
+{
+    viewer_t *v = r->aux;
+    snprintf(v->type, sizeof(v->type), "%s", type);
+    const char *b = strstr(type, "boundary=");
+    if (b) {
+        snprintf(v->boundary, sizeof(v->boundary), "--%s", b + 9);
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value)
+{
+    viewer_t *v = r->aux;
+    if (strcmp(field, "X-Framerate") == 0) {
+        snprintf(v->framerate, sizeof(v->framerate), "%s", value);
+    }
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status)
+{
+    viewer_t *v = r->aux;
+    snprintf(v->status, sizeof(v->status), "%s", status);
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_sendstr(httpd_req_t *r, const char *str)
+{
+    viewer_t *v = r->aux;
+    snprintf(v->text, sizeof(v->text), "%s", str);
+    return ESP_OK;
+}
+
+esp_err_t httpd_req_get_url_query_str(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    viewer_t *v = r->aux;
+    if (!v->query) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    snprintf(buf, buf_len, "%s", v->query);
+    return strlen(v->query) < buf_len ? ESP_OK : ESP_ERR_INVALID_SIZE;
+}
+
+esp_err_t httpd_query_key_value(const char *qry, const char *key, char *val, size_t val_size)
+{
+    size_t n = strlen(key);
+    for (const char *p = qry; p; p = strchr(p, '&'), p = p ? p + 1 : NULL) {
+        if (strncmp(p, key, n) == 0 && p[n] == '=') {
+            const char *end = strchr(p, '&');
+            size_t len = end ? (size_t)(end - p - n - 1) : strlen(p + n + 1);
+            snprintf(val, val_size, "%.*s", (int)len, p + n + 1);
+            return len < val_size ? ESP_OK : ESP_ERR_INVALID_SIZE;
+        }
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t httpd_req_async_handler_begin(httpd_req_t *r, httpd_req_t **out)
+{
+    *out = malloc(sizeof(**out));
+    REQUIRE(*out);
+    **out = *r;
+    return ESP_OK;
+}
+
+esp_err_t httpd_req_async_handler_complete(httpd_req_t *r)
+{
+    viewer_t *v = r->aux;
+    free(r);
+    v->completed = true;
+    return ESP_OK;
+}
+
+// Bytes on the viewer's link: multipart headers, checked, and frames, which
+// take their time to go out and must not change meanwhile
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t len)
+{
+    viewer_t *v = r->aux;
+    if (v->leave) {
+        return ESP_FAIL;
+    }
+    if (!v->preamble) {
+        CHECK(len == (ssize_t)strlen(v->boundary) + 2 && strncmp(buf, v->boundary, len - 2) == 0);
+        v->preamble = true;
+        return ESP_OK;
+    }
+    if (!v->part_len) {
+        char expect[160];
+        unsigned part_len;
+        const char *p = buf;
+        if (v->frames) {
+            snprintf(expect, sizeof(expect), "\r\n%s\r\n", v->boundary);
+            CHECK(strncmp(p, expect, strlen(expect)) == 0);
+            p += strlen(expect);
+        }
+        if (sscanf(p, "Content-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n", &part_len) != 1 ||
+            buf + len - 4 < p || memcmp(buf + len - 4, "\r\n\r\n", 4) != 0) {
+            v->bad_parts++;
+        }
+        v->part_len = part_len;
+        return ESP_OK;
+    }
+
+    int fb = buf_index(buf);
+    if (fb < 0 || (size_t)len != v->part_len || len != FRAME_LEN) {
+        v->bad_parts++;
+    }
+    v->part_len = 0;
+    REQUIRE(fb >= 0);
+
+    pthread_mutex_lock(&viewers_lock);
+    v->sending = fb;
+    if (v->slow) {
+        bool held[CAM_FBS] = { 0 };
+        for (int i = 0; i < viewer_count; i++) {
+            if (viewers[i]->slow && viewers[i]->sending >= 0) {
+                held[viewers[i]->sending] = true;
+            }
+        }
+        slow_pinned_both += held[0] && held[1];
+    }
+    pthread_mutex_unlock(&viewers_lock);
+
+    uint8_t *copy = malloc(len);
+    REQUIRE(copy);
+    memcpy(copy, buf, len);
+    usleep((int64_t)len * 1000000 / v->bytes_per_s);
+    uint32_t seq;
+    memcpy(&seq, copy + 2, sizeof(seq));
+    bool intact = memcmp(copy, buf, len) == 0;
+    for (size_t k = 6; k < (size_t)len && intact; k++) {
+        intact = copy[k] == frame_byte(seq, k);
+    }
+    v->torn += !intact;
+    free(copy);
+    if (v->frames < MAX_FRAMES) {
+        v->seqs[v->frames] = seq;
+    }
+    v->frames++;
+
+    pthread_mutex_lock(&viewers_lock);
+    v->sending = -1;
+    pthread_mutex_unlock(&viewers_lock);
+    return ESP_OK;
+}
+
+static void connect_viewer(viewer_t *v)
+{
+    v->sending = -1;
+    pthread_mutex_lock(&viewers_lock);
+    REQUIRE(viewer_count < (int)(sizeof(viewers) / sizeof(viewers[0])));
+    viewers[viewer_count++] = v;
+    pthread_mutex_unlock(&viewers_lock);
+    httpd_req_t req = { .method = HTTP_GET, .uri = "/stream", .aux = v };
+    v->handler_err = stream_handler(&req);
+}
+
+static void wait_left(viewer_t *v)
+{
+    v->leave = true;
+    for (int i = 0; i < 300 && !v->completed; i++) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    CHECK(v->completed);
+}
+
+// Everyone leaves; the server is idle again and the camera has its buffers back
+static void leave_all(void)
+{
+    for (int i = 0; i < viewer_count; i++) {
+        if (!viewers[i]->status[0]) {
+            wait_left(viewers[i]);
+        }
+    }
+    stream_server_stats_t stats;
+    for (int i = 0; i < 100; i++) {
+        stream_server_get_stats(&stats);
+        if (!stats.clients) {
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    CHECK_EQ(stats.clients, 0);
+    // The publisher drops the frame it may still have been waiting for
+    vTaskDelay(pdMS_TO_TICKS(2 * FRAME_US / 1000));
+    pthread_mutex_lock(&cam.lock);
+    for (int i = 0; i < CAM_FBS; i++) {
+        CHECK_EQ(cam.refs[i], 0);
+    }
+    pthread_mutex_unlock(&cam.lock);
+    viewer_count = 0;
+}
+
+// Whole frames, each newer than the last
+static void check_frames(const viewer_t *v)
+{
+    CHECK_EQ(v->handler_err, ESP_OK);
+    CHECK(strncmp(v->type, "multipart/x-mixed-replace;boundary=", 35) == 0);
+    CHECK_EQ(v->torn, 0);
+    CHECK_EQ(v->bad_parts, 0);
+    for (int i = 1; i < v->frames && i < MAX_FRAMES; i++) {
+        CHECK(v->seqs[i] > v->seqs[i - 1]);
+    }
+}
+
+static void run_for(int ms)
+{
+    vTaskDelay(pdMS_TO_TICKS(ms));
+}
+
+#define FAST_LINK   (16 * 1000 * 1000)
+#define RUN_MS      3000
+
+// Fast viewers get the rate they asked for, clamped, and skip nothing
+static void test_pacing(void)
+{
+    viewer_t v[3] = {
+        { .query = "fps=5", .bytes_per_s = FAST_LINK },
+        { .query = "fps=50", .bytes_per_s = FAST_LINK },
+        { .query = NULL, .bytes_per_s = FAST_LINK },
+    };
+    int stalls = cam.stalls;
+    for (int i = 0; i < 3; i++) {
+        connect_viewer(&v[i]);
+    }
+    run_for(RUN_MS);
+    stream_server_stats_t stats;
+    stream_server_get_stats(&stats);
+    REQUIRE(stats.clients == 3);
+    printf("%u published; fps 5: %d frames, fps 15: %d, default: %d\n",
+           (unsigned)stats.published, v[0].frames, v[1].frames, v[2].frames);
+    int want[3] = { 5, STREAM_MAX_FPS, STREAM_DEFAULT_FPS };
+    for (int i = 0; i < 3; i++) {
+        check_frames(&v[i]);
+        CHECK_EQ(atoi(v[i].framerate), want[i]);
+        int expected = want[i] * RUN_MS / 1000;
+        CHECK(v[i].frames >= expected * 85 / 100 && v[i].frames <= expected + 2);
+        CHECK_EQ(stats.client[i].fps, want[i]);
+        CHECK_EQ(stats.client[i].sent, v[i].frames);
+        CHECK_EQ(stats.client[i].skipped, 0);
+    }
+    CHECK(stats.published >= RUN_MS * 1000 / FRAME_US * 85 / 100);
+    CHECK_EQ(cam.stalls, stalls);
+    leave_all();
+}
+
+// Two viewers slower than the camera, at different speeds, next to a fast
+// one. They skip frames and start on the same one, so between them they
+// never hold both buffers; the camera never stalls and the fast viewer
+// keeps its rate.
+static void test_slow_viewers(void)
+{
+    viewer_t v[3] = {
+        { .query = "fps=15", .bytes_per_s = FRAME_LEN * 10, .slow = true },   // 100 ms a frame
+        { .query = "fps=15", .bytes_per_s = FRAME_LEN * 7, .slow = true },    // 143 ms
+        { .query = "fps=15", .bytes_per_s = FAST_LINK },
+    };
+    int stalls = cam.stalls;
+    slow_pinned_both = 0;
+    for (int i = 0; i < 3; i++) {
+        connect_viewer(&v[i]);
+    }
+    run_for(RUN_MS);
+    stream_server_stats_t stats;
+    stream_server_get_stats(&stats);
+    REQUIRE(stats.clients == 3);
+    int shared = 0;
+    for (int i = 0; i < v[0].frames && i < MAX_FRAMES; i++) {
+        for (int j = 0; j < v[1].frames && j < MAX_FRAMES; j++) {
+            shared += v[0].seqs[i] == v[1].seqs[j];
+        }
+    }
+    printf("slow: %d and %d frames, %d shared, %u and %u skipped, %u and %u ms a frame; fast: %d; "
+           "%d stalls, both buffers held by slow viewers %d times\n",
+           v[0].frames, v[1].frames, shared, (unsigned)stats.client[0].skipped, (unsigned)stats.client[1].skipped,
+           (unsigned)stats.client[0].send_ms, (unsigned)stats.client[1].send_ms, v[2].frames,
+           cam.stalls - stalls, slow_pinned_both);
+    for (int i = 0; i < 3; i++) {
+        check_frames(&v[i]);
+    }
+    CHECK_EQ(cam.stalls, stalls);
+    CHECK_EQ(slow_pinned_both, 0);
+    // The faster of the two waits for the slower one
+    CHECK(v[0].frames > 0 && shared >= v[0].frames - 1);
+    CHECK(stats.client[0].skipped > 0 && stats.client[1].skipped > 0);
+    CHECK(stats.client[0].send_ms > FRAME_US / 1000 && stats.client[1].send_ms > FRAME_US / 1000);
+    CHECK(v[2].frames >= STREAM_MAX_FPS * RUN_MS / 1000 * 85 / 100);
+    CHECK_EQ(stats.client[2].skipped, 0);
+    leave_all();
+}
+
+// A viewer over the limit is turned away; one leaving frees its slot
+static void test_limits(void)
+{
+    viewer_t v[STREAM_MAX_CLIENTS + 1];
+    memset(v, 0, sizeof(v));
+    for (int i = 0; i <= STREAM_MAX_CLIENTS; i++) {
+        v[i].query = i ? "fps=2&quality=hd" : "fps=0";
+        v[i].bytes_per_s = FAST_LINK;
+        connect_viewer(&v[i]);
+    }
+    stream_server_stats_t stats;
+    stream_server_get_stats(&stats);
+    CHECK_EQ(stats.clients, STREAM_MAX_CLIENTS);
+    CHECK_EQ(stats.rejected, 1);
+    viewer_t *over = &v[STREAM_MAX_CLIENTS];
+    CHECK_EQ(over->handler_err, ESP_OK);
+    CHECK(strcmp(over->status, "503 Service Unavailable") == 0);
+    CHECK(strcmp(over->text, "Too many viewers\n") == 0);
+    CHECK(!over->preamble);
+    CHECK(strcmp(v[0].framerate, "1") == 0);
+    CHECK(strcmp(v[1].framerate, "2") == 0);
+
+    run_for(1000);
+    wait_left(&v[1]);
+    stream_server_get_stats(&stats);
+    CHECK_EQ(stats.clients, STREAM_MAX_CLIENTS - 1);
+    viewer_t again = { .query = "fps=3", .bytes_per_s = FAST_LINK };
+    connect_viewer(&again);
+    CHECK(!again.status[0] && strcmp(again.framerate, "3") == 0);
+    run_for(1000);
+    stream_server_get_stats(&stats);
+    CHECK_EQ(stats.clients, STREAM_MAX_CLIENTS);
+    CHECK_EQ(stats.rejected, 1);
+    for (int i = 0; i < STREAM_MAX_CLIENTS; i++) {
+        check_frames(&v[i]);
+    }
+    check_frames(&again);
+    CHECK(again.frames >= 2);
+    leave_all();
+}
+
+int main(void)
+{
+    for (int i = 0; i < CAM_FBS; i++) {
+        cam.fb[i] = (camera_fb_t) { .buf = malloc(FRAME_LEN), .len = FRAME_LEN, .width = 1024, .height = 768,
+                                    .format = PIXFORMAT_JPEG };
+        REQUIRE(cam.fb[i].buf);
+    }
+    REQUIRE(stream_server_start() == ESP_OK);
+    REQUIRE(stream_handler);
+    RUN(test_pacing);
+    RUN(test_slow_viewers);
+    RUN(test_limits);
+    return TEST_DONE();
+}
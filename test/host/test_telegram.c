@@ -0,0 +1,778 @@
+// telegram: sendMediaGroup bodies are well-formed multipart forms whose
+// length matches the Content-Length sent ahead of them, with the frames
+// inside byte for byte, whether written directly or staged from PSRAM.
+// Over a link with handshake and server latency, one album beats sending
+// its frames one by one.
+// A photo fanned out to several chats is uploaded once and sent to the
+// rest by file_id; with a preview, every chat gets the preview first and
+// the full frame then replaces it.
+#include <string.h>
+#include "test.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_http_client.h"
+#include "esp_memory_utils.h"
+#include "jpeg_fixture.h"
+#include "preview.h"
+#include "telegram.h"
+#include "trace.h"
+
+#define BOUNDARY "--" TELEGRAM_BOUNDARY
+// telegram.c's staging chunk, one TLS record without the sdkconfig
+#define STAGE_CHUNK 4096
+
+void trace_event(trace_id_t id, trace_kind_t kind, uint32_t arg)
+{
+    (void)id;
+    (void)kind;
+    (void)arg;
+}
+
+typedef struct {
+    camera_fb_t fb[TELEGRAM_MEDIA_GROUP_MAX + 1];
+    const camera_fb_t *ptrs[TELEGRAM_MEDIA_GROUP_MAX + 1];
+} frames_t;
+
+// Frames "in PSRAM" are carved out of one block the stub reports as external
+static uint8_t *psram;
+static size_t psram_size, psram_used;
+
+static uint8_t *frame_alloc(size_t n)
+{
+    if (!psram) {
+        return malloc(n);
+    }
+    REQUIRE(psram_used + n <= psram_size);
+    psram_used += n;
+    return psram + psram_used - n;
+}
+
+static void make_frames(frames_t *f, size_t count, size_t len, uint32_t seed)
+{
+    for (size_t i = 0; i < count; i++) {
+        size_t n = len + i * 1001;
+        uint8_t *buf = frame_alloc(n);
+        uint32_t s = seed + i;
+        for (size_t k = 0; k < n; k++) {
+            s = s * 1103515245 + 12345;
+            buf[k] = s >> 16;
+        }
+        buf[0] = 0xFF;
+        buf[1] = 0xD8;
+        f->fb[i] = (camera_fb_t) { .buf = buf, .len = n, .width = 1024, .height = 768, .format = PIXFORMAT_JPEG };
+        f->ptrs[i] = &f->fb[i];
+    }
+}
+
+static void free_frames(frames_t *f, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (!esp_ptr_external_ram(f->fb[i].buf)) {
+            free(f->fb[i].buf);
+        }
+    }
+}
+
+static const uint8_t *find(const uint8_t *hay, size_t hay_len, const char *needle)
+{
+    size_t n = strlen(needle);
+    for (size_t i = 0; i + n <= hay_len; i++) {
+        if (memcmp(hay + i, needle, n) == 0) {
+            return hay + i;
+        }
+    }
+    return NULL;
+}
+
+// Data of the form part with the given name, up to the next delimiter
+static const uint8_t *part_data(const host_http_request_t *r, const char *name, size_t *len)
+{
+    char header[96];
+    snprintf(header, sizeof(header), "Content-Disposition: form-data; name=\"%s\"", name);
+    const uint8_t *end = r->body + r->body_len;
+    const uint8_t *p = find(r->body, r->body_len, header);
+    if (!p) {
+        return NULL;
+    }
+    p = find(p, end - p, "\r\n\r\n");
+    if (!p) {
+        return NULL;
+    }
+    p += 4;
+    const uint8_t *q = find(p, end - p, "\r\n" BOUNDARY);
+    if (!q) {
+        return NULL;
+    }
+    *len = q - p;
+    return p;
+}
+
+static int count_of(const host_http_request_t *r, const char *needle)
+{
+    int n = 0;
+    const uint8_t *p = r->body;
+    const uint8_t *end = r->body + r->body_len;
+    while ((p = find(p, end - p, needle)) != NULL) {
+        n++;
+        p++;
+    }
+    return n;
+}
+
+static const host_http_request_t *request_to(const char *chat_id)
+{
+    for (int i = 0; i < host_http_count; i++) {
+        size_t len;
+        const uint8_t *v = part_data(&host_http_requests[i], "chat_id", &len);
+        if (v && len == strlen(chat_id) && memcmp(v, chat_id, len) == 0) {
+            return &host_http_requests[i];
+        }
+    }
+    return NULL;
+}
+
+static void check_album(const host_http_request_t *r, const char *chat_id, const frames_t *f, size_t count)
+{
+    REQUIRE(r);
+    CHECK(strstr(r->url, "/sendMediaGroup") != NULL);
+    CHECK(strcmp(r->content_type, "multipart/form-data; boundary=" TELEGRAM_BOUNDARY) == 0);
+    CHECK_EQ(r->body_len, r->open_len);
+    CHECK(r->closed && r->cleaned_up);
+
+    static const char start[] = BOUNDARY "\r\n";
+    static const char end[] = "\r\n" BOUNDARY "--\r\n";
+    CHECK(r->body_len > sizeof(end) && memcmp(r->body, start, sizeof(start) - 1) == 0);
+    CHECK(memcmp(r->body + r->body_len - (sizeof(end) - 1), end, sizeof(end) - 1) == 0);
+    // chat_id, media and one part per photo, then the closing delimiter
+    CHECK_EQ(count_of(r, BOUNDARY "\r\n"), 2 + count);
+    CHECK_EQ(count_of(r, BOUNDARY "--\r\n"), 1);
+
+    size_t len;
+    const uint8_t *v = part_data(r, "chat_id", &len);
+    CHECK(v && len == strlen(chat_id) && memcmp(v, chat_id, len) == 0);
+
+    char media[768] = "[";
+    for (size_t i = 0; i < count; i++) {
+        snprintf(media + strlen(media), sizeof(media) - strlen(media),
+                 "%s{\"type\":\"photo\",\"media\":\"attach://p%u\"}", i ? "," : "", (unsigned)i);
+    }
+    strcat(media, "]");
+    v = part_data(r, "media", &len);
+    CHECK(v && len == strlen(media) && memcmp(v, media, len) == 0);
+
+    for (size_t i = 0; i < count; i++) {
+        char name[8];
+        char header[96];
+        snprintf(name, sizeof(name), "p%u", (unsigned)i);
+        snprintf(header, sizeof(header), "name=\"p%u\"; filename=\"p%u.jpg\"\r\nContent-Type: image/jpeg\r\n",
+                 (unsigned)i, (unsigned)i);
+        CHECK(find(r->body, r->body_len, header) != NULL);
+        v = part_data(r, name, &len);
+        CHECK(v && len == f->fb[i].len && memcmp(v, f->fb[i].buf, len) == 0);
+    }
+}
+
+static size_t observed_bytes;
+
+static void observer(size_t bytes, int64_t open_us, int64_t write_us)
+{
+    (void)open_us;
+    (void)write_us;
+    observed_bytes = bytes;
+}
+
+static void test_album(void)
+{
+    host_http_reset();
+    frames_t f;
+    make_frames(&f, 3, 20000, 1);
+    observed_bytes = 0;
+    CHECK_EQ(telegram_send_media_group("1000", f.ptrs, 3), ESP_OK);
+    CHECK_EQ(host_http_count, 1);
+    check_album(&host_http_requests[0], "1000", &f, 3);
+    CHECK_EQ(observed_bytes, host_http_requests[0].open_len);
+    free_frames(&f, 3);
+}
+
+static void test_largest_album(void)
+{
+    host_http_reset();
+    frames_t f;
+    make_frames(&f, TELEGRAM_MEDIA_GROUP_MAX, 1000, 2);
+    const char *chat = "-1001234567890123456";
+    CHECK_EQ(telegram_send_media_group(chat, f.ptrs, TELEGRAM_MEDIA_GROUP_MAX), ESP_OK);
+    check_album(&host_http_requests[0], chat, &f, TELEGRAM_MEDIA_GROUP_MAX);
+    free_frames(&f, TELEGRAM_MEDIA_GROUP_MAX);
+}
+
+static void test_counts(void)
+{
+    host_http_reset();
+    frames_t f;
+    make_frames(&f, TELEGRAM_MEDIA_GROUP_MAX + 1, 1000, 3);
+    CHECK_EQ(telegram_send_media_group("1000", f.ptrs, 0), ESP_ERR_INVALID_ARG);
+    CHECK_EQ(telegram_send_media_group("1000", f.ptrs, TELEGRAM_MEDIA_GROUP_MAX + 1), ESP_ERR_INVALID_ARG);
+    CHECK_EQ(host_http_count, 0);
+
+    // Telegram refuses one-item albums; a single frame goes out as sendPhoto
+    CHECK_EQ(telegram_send_media_group("1000", f.ptrs, 1), ESP_OK);
+    CHECK_EQ(host_http_count, 1);
+    const host_http_request_t *r = &host_http_requests[0];
+    CHECK(strstr(r->url, "/sendPhoto") != NULL);
+    CHECK_EQ(r->body_len, r->open_len);
+    size_t len;
+    const uint8_t *v = part_data(r, "photo", &len);
+    CHECK(v && len == f.fb[0].len && memcmp(v, f.fb[0].buf, len) == 0);
+    free_frames(&f, TELEGRAM_MEDIA_GROUP_MAX + 1);
+}
+
+static void test_failures(void)
+{
+    frames_t f;
+    make_frames(&f, 2, 5000, 4);
+
+    host_http_reset();
+    host_http_server.status = 400;
+    CHECK_EQ(telegram_send_media_group("1000", f.ptrs, 2), ESP_ERR_INVALID_RESPONSE);
+    host_http_server.status = 429;
+    CHECK_EQ(telegram_send_media_group("1000", f.ptrs, 2), ESP_FAIL);
+    host_http_server.status = 502;
+    CHECK_EQ(telegram_send_media_group("1000", f.ptrs, 2), ESP_FAIL);
+
+    host_http_server.status = 200;
+    host_http_server.fail_after = 3000;
+    CHECK(telegram_send_media_group("1000", f.ptrs, 2) != ESP_OK);
+    host_http_server.fail_after = -1;
+    host_http_server.open_err = ESP_ERR_TIMEOUT;
+    CHECK_EQ(telegram_send_media_group("1000", f.ptrs, 2), ESP_ERR_TIMEOUT);
+
+    // Every connection is released whatever went wrong
+    CHECK_EQ(host_http_count, 5);
+    for (int i = 0; i < host_http_count; i++) {
+        CHECK(host_http_requests[i].cleaned_up);
+    }
+    free_frames(&f, 2);
+}
+
+// A burst as one sendMediaGroup against the same frames as sendPhoto calls,
+// over a shaped link: each connection pays the handshake and the server's
+// reply time, and all of them share the uplink
+#define BURST_FRAMES    5
+#define BURST_OPEN_MS   200
+#define BURST_REPLY_MS  100
+#define BURST_BPS       (400 * 1024)
+
+static void test_burst_latency(void)
+{
+    frames_t f;
+    make_frames(&f, BURST_FRAMES, 40000, 9);
+    host_http_reset();
+    host_http_server.open_ms = BURST_OPEN_MS;
+    host_http_server.response_ms = BURST_REPLY_MS;
+    host_http_server.bytes_per_s = BURST_BPS;
+
+    double t0 = now_ms();
+    for (int i = 0; i < BURST_FRAMES; i++) {
+        CHECK_EQ(telegram_send_photo("1000", f.ptrs[i]), ESP_OK);
+    }
+    double sequential_ms = now_ms() - t0;
+    size_t sequential_bytes = 0;
+    for (int i = 0; i < host_http_count; i++) {
+        sequential_bytes += host_http_requests[i].body_len;
+    }
+    CHECK_EQ(host_http_count, BURST_FRAMES);
+
+    t0 = now_ms();
+    CHECK_EQ(telegram_send_media_group("1000", f.ptrs, BURST_FRAMES), ESP_OK);
+    double burst_ms = now_ms() - t0;
+    REQUIRE(host_http_count == BURST_FRAMES + 1);
+    const host_http_request_t *album = &host_http_requests[BURST_FRAMES];
+    check_album(album, "1000", &f, BURST_FRAMES);
+
+    // What the link alone costs each way
+    double sequential_link = BURST_FRAMES * (BURST_OPEN_MS + BURST_REPLY_MS) + sequential_bytes * 1e3 / BURST_BPS;
+    double burst_link = BURST_OPEN_MS + BURST_REPLY_MS + album->body_len * 1e3 / BURST_BPS;
+    printf("%d frames: sequential %.0f ms (link %.0f), %zu bytes; album %.0f ms (link %.0f), %zu bytes; %.1fx\n",
+           BURST_FRAMES, sequential_ms, sequential_link, sequential_bytes, burst_ms, burst_link,
+           album->body_len, sequential_ms / burst_ms);
+    CHECK(burst_ms >= burst_link && burst_ms < burst_link + 200);
+    CHECK(sequential_ms >= sequential_link);
+    CHECK(burst_ms < sequential_ms / 2);
+    // One form instead of five: the album carries less framing
+    CHECK(album->body_len < sequential_bytes);
+    host_http_reset();
+    free_frames(&f, BURST_FRAMES);
+}
+
+typedef struct {
+    const char *chat_id;
+    frames_t frames;
+    size_t count;
+    esp_err_t err;
+    SemaphoreHandle_t done;
+} upload_t;
+
+static void upload_task(void *arg)
+{
+    upload_t *u = arg;
+    u->err = telegram_send_media_group(u->chat_id, u->frames.ptrs, u->count);
+    xSemaphoreGive(u->done);
+    vTaskDelete(NULL);
+}
+
+// The Bot API as far as delivery needs it. Every stored photo gets the
+// file_id "F<request>" and every new message the id 100 + request.
+static struct {
+    const char *down_chat;      // Every request to it fails with a 502
+    uint64_t fail_requests;     // So do these, by index
+    const char *stale_id;       // A file_id Telegram no longer has
+    int locked_message;         // A message that can no longer be edited
+    bool no_file_id;            // Responses without the photo sizes
+} api;
+
+static bool is_method(const host_http_request_t *r, const char *method)
+{
+    const char *slash = strrchr(r->url, '/');
+    return slash && strcmp(slash + 1, method) == 0;
+}
+
+static bool is_upload(const host_http_request_t *r)
+{
+    return strncmp(r->content_type, "multipart/form-data", 19) == 0;
+}
+
+// Value of a form field, whichever encoding the request used
+static bool form_value(const host_http_request_t *r, const char *name, char *out, size_t size)
+{
+    size_t len = 0;
+    const uint8_t *v = NULL;
+    if (is_upload(r)) {
+        v = part_data(r, name, &len);
+    } else {
+        size_t n = strlen(name);
+        for (size_t i = 0; i + n < r->body_len && !v; i++) {
+            if ((i == 0 || r->body[i - 1] == '&') && memcmp(r->body + i, name, n) == 0 && r->body[i + n] == '=') {
+                v = r->body + i + n + 1;
+                const uint8_t *amp = memchr(v, '&', r->body + r->body_len - v);
+                len = (amp ? amp : r->body + r->body_len) - v;
+            }
+        }
+    }
+    if (!v || len >= size) {
+        return false;
+    }
+    memcpy(out, v, len);
+    out[len] = '\0';
+    return true;
+}
+
+static int bot_api(const host_http_request_t *r, char *response, size_t size)
+{
+    int idx = r - host_http_requests;
+    char chat[32] = "", message[16] = "";
+    form_value(r, "chat_id", chat, sizeof(chat));
+    form_value(r, "message_id", message, sizeof(message));
+    bool edit = is_method(r, "editMessageMedia");
+    if ((api.down_chat && strcmp(chat, api.down_chat) == 0) || (api.fail_requests >> idx & 1)) {
+        snprintf(response, size, "{\"ok\":false,\"error_code\":502}");
+        return 502;
+    }
+    if (api.stale_id && find(r->body, r->body_len, api.stale_id)) {
+        snprintf(response, size, "{\"ok\":false,\"description\":\"Bad Request: wrong file identifier\"}");
+        return 400;
+    }
+    if (edit && atoi(message) == api.locked_message) {
+        snprintf(response, size, "{\"ok\":false,\"description\":\"Bad Request: message can't be edited\"}");
+        return 400;
+    }
+    int message_id = edit ? atoi(message) : 100 + idx;
+    if (api.no_file_id) {
+        snprintf(response, size, "{\"ok\":true,\"result\":{\"message_id\":%d}}", message_id);
+    } else {
+        // The sizes smallest first, as Telegram lists them
+        snprintf(response, size,
+                 "{\"ok\":true,\"result\":{\"message_id\":%d,\"chat\":{\"id\":%s},\"photo\":["
+                 "{\"file_id\":\"S%d\",\"width\":90},{\"file_id\":\"F%d\",\"width\":1024}]}}",
+                 message_id, chat, idx, idx);
+    }
+    return 200;
+}
+
+static void api_reset(void)
+{
+    host_http_reset();
+    host_http_server.respond = bot_api;
+    memset(&api, 0, sizeof(api));
+}
+
+// Request i is an upload of fb to chat
+static void check_upload(int i, const char *method, const char *chat, const camera_fb_t *fb)
+{
+    REQUIRE(i < host_http_count);
+    const host_http_request_t *r = &host_http_requests[i];
+    char v[32];
+    CHECK(is_method(r, method) && is_upload(r));
+    CHECK(form_value(r, "chat_id", v, sizeof(v)) && strcmp(v, chat) == 0);
+    CHECK_EQ(r->body_len, r->open_len);
+    size_t len;
+    const uint8_t *photo = part_data(r, "photo", &len);
+    CHECK(photo && len == fb->len && memcmp(photo, fb->buf, len) == 0);
+}
+
+// Request i is exactly the urlencoded body given
+static void check_form(int i, const char *method, const char *body)
+{
+    REQUIRE(i < host_http_count);
+    const host_http_request_t *r = &host_http_requests[i];
+    CHECK(is_method(r, method) && !is_upload(r));
+    CHECK(strcmp(r->content_type, "application/x-www-form-urlencoded") == 0);
+    if (r->body_len != strlen(body) || memcmp(r->body, body, r->body_len) != 0) {
+        printf("request %d: %.*s, expected %s\n", i, (int)r->body_len, (const char *)r->body, body);
+        check_failures++;
+    }
+    CHECK_EQ(r->body_len, r->open_len);
+}
+
+#define FANOUT_CHATS 5
+
+static const char *const fanout_chats[FANOUT_CHATS] = { "3001", "3002", "3003", "3004", "3005" };
+
+// One upload, then every other chat gets the photo by the file_id of its
+// largest size
+static void test_fanout(void)
+{
+    frames_t f;
+    make_frames(&f, 1, 40000, 5);
+    const camera_fb_t *fb = &f.fb[0];
+    esp_err_t results[FANOUT_CHATS];
+
+    api_reset();
+    CHECK_EQ(telegram_send_photo_fanout(fanout_chats, FANOUT_CHATS, fb, NULL, NULL, 0, results), FANOUT_CHATS);
+    CHECK_EQ(host_http_count, FANOUT_CHATS);
+    check_upload(0, "sendPhoto", "3001", fb);
+    size_t bytes = host_http_requests[0].body_len;
+    for (int i = 1; i < FANOUT_CHATS; i++) {
+        char body[64];
+        snprintf(body, sizeof(body), "chat_id=%s&photo=F0", fanout_chats[i]);
+        check_form(i, "sendPhoto", body);
+        bytes += host_http_requests[i].body_len;
+        CHECK_EQ(results[i], ESP_OK);
+    }
+    // The frame went up once
+    printf("%u bytes sent for a %u-byte photo to %d chats\n", (unsigned)bytes, (unsigned)fb->len, FANOUT_CHATS);
+    CHECK(bytes < fb->len + 1024);
+
+    // The caller gets the file_id back for next time
+    char file_id[TELEGRAM_FILE_ID_MAX] = "";
+    api_reset();
+    CHECK_EQ(telegram_send_photo_fanout(fanout_chats, 2, fb, NULL, file_id, sizeof(file_id), NULL), 2);
+    CHECK(strcmp(file_id, "F0") == 0);
+
+    // and with it nothing is uploaded at all
+    api_reset();
+    CHECK_EQ(telegram_send_photo_fanout(fanout_chats, FANOUT_CHATS, fb, NULL, file_id, sizeof(file_id), NULL),
+             FANOUT_CHATS);
+    CHECK_EQ(host_http_count, FANOUT_CHATS);
+    for (int i = 0; i < FANOUT_CHATS; i++) {
+        char body[64];
+        snprintf(body, sizeof(body), "chat_id=%s&photo=F0", fanout_chats[i]);
+        check_form(i, "sendPhoto", body);
+    }
+    CHECK(strcmp(file_id, "F0") == 0);
+    free_frames(&f, 1);
+}
+
+// A file_id Telegram dropped costs one upload, whose file_id the rest
+// then get; a chat that fails passes the upload on to the next one
+static void test_fanout_failures(void)
+{
+    frames_t f;
+    make_frames(&f, 1, 30000, 6);
+    const camera_fb_t *fb = &f.fb[0];
+    esp_err_t results[FANOUT_CHATS];
+    char file_id[TELEGRAM_FILE_ID_MAX];
+
+    api_reset();
+    api.stale_id = "OLD";
+    strcpy(file_id, "OLD");
+    CHECK_EQ(telegram_send_photo_fanout(fanout_chats, FANOUT_CHATS, fb, NULL, file_id, sizeof(file_id), results),
+             FANOUT_CHATS);
+    CHECK_EQ(host_http_count, FANOUT_CHATS + 1);
+    check_form(0, "sendPhoto", "chat_id=3001&photo=OLD");
+    check_upload(1, "sendPhoto", "3001", fb);
+    for (int i = 1; i < FANOUT_CHATS; i++) {
+        char body[64];
+        snprintf(body, sizeof(body), "chat_id=%s&photo=F1", fanout_chats[i]);
+        check_form(i + 1, "sendPhoto", body);
+    }
+    CHECK(strcmp(file_id, "F1") == 0);
+
+    api_reset();
+    api.down_chat = "3001";
+    CHECK_EQ(telegram_send_photo_fanout(fanout_chats, FANOUT_CHATS, fb, NULL, NULL, 0, results), FANOUT_CHATS - 1);
+    CHECK_EQ(host_http_count, FANOUT_CHATS);
+    CHECK_EQ(results[0], ESP_FAIL);
+    check_upload(0, "sendPhoto", "3001", fb);
+    check_upload(1, "sendPhoto", "3002", fb);
+    for (int i = 2; i < FANOUT_CHATS; i++) {
+        char body[64];
+        snprintf(body, sizeof(body), "chat_id=%s&photo=F1", fanout_chats[i]);
+        check_form(i, "sendPhoto", body);
+        CHECK_EQ(results[i], ESP_OK);
+    }
+
+    // Without a file_id to reuse, every chat gets its own upload
+    api_reset();
+    api.no_file_id = true;
+    file_id[0] = '\0';
+    CHECK_EQ(telegram_send_photo_fanout(fanout_chats, 3, fb, NULL, file_id, sizeof(file_id), results), 3);
+    CHECK_EQ(host_http_count, 3);
+    for (int i = 0; i < 3; i++) {
+        check_upload(i, "sendPhoto", fanout_chats[i], fb);
+    }
+    CHECK_EQ(file_id[0], '\0');
+    free_frames(&f, 1);
+}
+
+// An XGA frame: the outdoor fixture scaled up, as the camera would send it
+static camera_fb_t *xga_frame(void)
+{
+    fixture_t fx = fixture_load(2);
+    int w, h;
+    uint8_t *small = jpeg_decode_rgb(fx.buf, fx.len, &w, &h);
+    REQUIRE(small);
+    uint8_t *rgb = malloc(1024 * 768 * 3);
+    REQUIRE(rgb);
+    for (int y = 0; y < 768; y++) {
+        for (int x = 0; x < 1024; x++) {
+            memcpy(rgb + (y * 1024 + x) * 3, small + (y * h / 768 * w + x * w / 1024) * 3, 3);
+        }
+    }
+    camera_fb_t *fb = calloc(1, sizeof(*fb));
+    REQUIRE(fb && jpeg_encode_rgb(rgb, 1024, 768, 40, &fb->buf, &fb->len));
+    fb->width = 1024;
+    fb->height = 768;
+    fb->format = PIXFORMAT_JPEG;
+    fb->timestamp.tv_sec = 1234;
+    free(rgb);
+    free(small);
+    free(fx.buf);
+    return fb;
+}
+
+static void free_frame(camera_fb_t *fb)
+{
+    free(fb->buf);
+    free(fb);
+}
+
+// The preview is the frame at 1/8 scale, a small fraction of its size
+static void test_preview(void)
+{
+    camera_fb_t *fb = xga_frame();
+    camera_fb_t *preview = NULL;
+    REQUIRE(preview_make(fb, &preview) == ESP_OK);
+    printf("%ux%u frame %u bytes, %ux%u preview %u bytes\n", (unsigned)fb->width, (unsigned)fb->height,
+           (unsigned)fb->len, (unsigned)preview->width, (unsigned)preview->height, (unsigned)preview->len);
+    CHECK_EQ(preview->width, 128);
+    CHECK_EQ(preview->height, 96);
+    CHECK_EQ(preview->format, PIXFORMAT_JPEG);
+    CHECK_EQ(preview->timestamp.tv_sec, 1234);
+    CHECK(preview->len <= PREVIEW_MAX_BYTES && preview->len * 10 < fb->len);
+
+    // It shows the same picture: against the frame's own 8x8 block means
+    int w, h, pw, ph;
+    uint8_t *full = jpeg_decode_rgb(fb->buf, fb->len, &w, &h);
+    uint8_t *small = jpeg_decode_rgb(preview->buf, preview->len, &pw, &ph);
+    REQUIRE(full && small && pw == 128 && ph == 96);
+    uint8_t *means = malloc(pw * ph * 3);
+    REQUIRE(means);
+    for (int y = 0; y < ph; y++) {
+        for (int x = 0; x < pw; x++) {
+            for (int c = 0; c < 3; c++) {
+                int sum = 0;
+                for (int k = 0; k < 64; k++) {
+                    sum += full[((y * 8 + k / 8) * w + x * 8 + k % 8) * 3 + c];
+                }
+                means[(y * pw + x) * 3 + c] = (sum + 32) / 64;
+            }
+        }
+    }
+    double db = psnr(means, small, pw * ph * 3);
+    printf("preview %.1f dB against the block means\n", db);
+    CHECK(db > 20);
+    free(means);
+    free(small);
+    free(full);
+
+    // Small frames keep at least PREVIEW_MIN_WIDTH where they can
+    static const int widths[FIXTURE_COUNT] = { 113, 160, 120 };
+    for (int i = 0; i < FIXTURE_COUNT; i++) {
+        fixture_t fx = fixture_load(i);
+        camera_fb_t in = { .buf = fx.buf, .len = fx.len, .format = PIXFORMAT_JPEG };
+        jpeg_decode_rgb(fx.buf, fx.len, &w, &h);
+        in.width = w;
+        in.height = h;
+        camera_fb_t *p = NULL;
+        CHECK_EQ(preview_make(&in, &p), ESP_OK);
+        CHECK(p && p->width == widths[i]);
+        preview_free(p);
+        free(fx.buf);
+    }
+
+    camera_fb_t raw = { .buf = fb->buf, .len = fb->len, .format = PIXFORMAT_RGB565 };
+    CHECK_EQ(preview_make(&raw, &preview), ESP_ERR_NOT_SUPPORTED);
+    preview_free(preview);
+    free_frame(fb);
+}
+
+// editMessageMedia by file_id for message_id in chat
+static void check_edit_id(int i, const char *chat, int message_id, const char *file_id)
+{
+    char body[192];
+    snprintf(body, sizeof(body),
+             "chat_id=%s&message_id=%d&media=%%7B%%22type%%22%%3A%%22photo%%22%%2C%%22media%%22%%3A%%22%s%%22%%7D",
+             chat, message_id, file_id);
+    check_form(i, "editMessageMedia", body);
+}
+
+// editMessageMedia that uploads fb into message_id in chat
+static void check_edit_upload(int i, const char *chat, int message_id, const camera_fb_t *fb)
+{
+    check_upload(i, "editMessageMedia", chat, fb);
+    char v[64], id[12];
+    snprintf(id, sizeof(id), "%d", message_id);
+    CHECK(form_value(&host_http_requests[i], "message_id", v, sizeof(v)) && strcmp(v, id) == 0);
+    CHECK(form_value(&host_http_requests[i], "media", v, sizeof(v)) &&
+          strcmp(v, "{\"type\":\"photo\",\"media\":\"attach://photo\"}") == 0);
+}
+
+#define PREVIEW_CHATS 3
+
+// Every chat has the preview before the full frame goes anywhere; then the
+// first chat's preview is replaced by the upload and the others' by its
+// file_id
+static void test_preview_fanout(void)
+{
+    camera_fb_t *fb = xga_frame();
+    camera_fb_t *preview = NULL;
+    REQUIRE(preview_make(fb, &preview) == ESP_OK);
+    esp_err_t results[PREVIEW_CHATS];
+
+    api_reset();
+    observed_bytes = 0;
+    CHECK_EQ(telegram_send_photo_fanout(fanout_chats, PREVIEW_CHATS, fb, preview, NULL, 0, results), PREVIEW_CHATS);
+    CHECK_EQ(host_http_count, 2 * PREVIEW_CHATS);
+    for (int i = 0; i < PREVIEW_CHATS; i++) {
+        check_upload(i, "sendPhoto", fanout_chats[i], preview);
+        CHECK_EQ(results[i], ESP_OK);
+    }
+    check_edit_upload(3, "3001", 100, fb);
+    check_edit_id(4, "3002", 101, "F3");
+    check_edit_id(5, "3003", 102, "F3");
+    // Only the full frame counts as an upload
+    CHECK_EQ(observed_bytes, host_http_requests[3].open_len);
+
+    // A chat whose preview failed gets the photo as a new message
+    api_reset();
+    api.fail_requests = 1 << 1;
+    CHECK_EQ(telegram_send_photo_fanout(fanout_chats, PREVIEW_CHATS, fb, preview, NULL, 0, results), PREVIEW_CHATS);
+    CHECK_EQ(host_http_count, 2 * PREVIEW_CHATS);
+    check_edit_upload(3, "3001", 100, fb);
+    check_form(4, "sendPhoto", "chat_id=3002&photo=F3");
+    check_edit_id(5, "3003", 102, "F3");
+
+    // So does one whose preview can't be edited, still by file_id
+    api_reset();
+    api.locked_message = 101;
+    CHECK_EQ(telegram_send_photo_fanout(fanout_chats, PREVIEW_CHATS, fb, preview, NULL, 0, results), PREVIEW_CHATS);
+    CHECK_EQ(host_http_count, 2 * PREVIEW_CHATS + 1);
+    check_edit_upload(3, "3001", 100, fb);
+    check_edit_id(4, "3002", 101, "F3");
+    check_form(5, "sendPhoto", "chat_id=3002&photo=F3");
+    check_edit_id(6, "3003", 102, "F3");
+
+    // A file_id Telegram lost is replaced by one upload into the first preview
+    char file_id[TELEGRAM_FILE_ID_MAX] = "OLD";
+    api_reset();
+    api.stale_id = "OLD";
+    CHECK_EQ(telegram_send_photo_fanout(fanout_chats, PREVIEW_CHATS, fb, preview, file_id, sizeof(file_id), results),
+             PREVIEW_CHATS);
+    CHECK_EQ(host_http_count, 2 * PREVIEW_CHATS + 2);
+    check_edit_id(3, "3001", 100, "OLD");
+    check_form(4, "sendPhoto", "chat_id=3001&photo=OLD");
+    check_edit_upload(5, "3001", 100, fb);
+    check_edit_id(6, "3002", 101, "F5");
+    check_edit_id(7, "3003", 102, "F5");
+    CHECK(strcmp(file_id, "F5") == 0);
+
+    preview_free(preview);
+    free_frame(fb);
+}
+
+#define STAGED_UPLOADS  4
+#define STAGED_ROUNDS   20
+
+// Frames in PSRAM go out through the copy helper, one record at a time and
+// never straight from external memory. More uploads than there are
+// connections share the helper, with frame lengths on either side of a
+// chunk boundary and a shaped uplink interleaving their writes; each must
+// get only its own copies.
+static void test_staged_concurrent(void)
+{
+    psram_size = 4 << 20;
+    psram = malloc(psram_size);
+    REQUIRE(psram);
+    host_psram_start = psram;
+    host_psram_end = psram + psram_size;
+    upload_t u[STAGED_UPLOADS] = {
+        { .chat_id = "2001", .count = 4 },
+        { .chat_id = "2002", .count = 3 },
+        { .chat_id = "2003", .count = 2 },
+        { .chat_id = "2004", .count = 2 },
+    };
+    for (int round = 0; round < STAGED_ROUNDS; round++) {
+        host_http_reset();
+        host_http_server.bytes_per_s = 40 * 1000 * 1000;
+        psram_used = 0;
+        // 2..6 chunks, one byte short, exact or one over
+        size_t len = STAGE_CHUNK * (2 + round % 5) + round % 3 - 1;
+        for (int i = 0; i < STAGED_UPLOADS; i++) {
+            make_frames(&u[i].frames, u[i].count, len + i * 7, 100 * i + round);
+            u[i].done = xSemaphoreCreateBinary();
+            u[i].err = ESP_FAIL;
+            REQUIRE(xTaskCreate(upload_task, "upload", 8192, &u[i], 5, NULL) == pdPASS);
+        }
+        for (int i = 0; i < STAGED_UPLOADS; i++) {
+            REQUIRE(xSemaphoreTake(u[i].done, pdMS_TO_TICKS(10000)));
+            vSemaphoreDelete(u[i].done);
+            CHECK_EQ(u[i].err, ESP_OK);
+            const host_http_request_t *r = request_to(u[i].chat_id);
+            check_album(r, u[i].chat_id, &u[i].frames, u[i].count);
+            CHECK_EQ(r->external_bytes, 0);
+            CHECK(r->largest_write <= STAGE_CHUNK);
+            free_frames(&u[i].frames, u[i].count);
+        }
+    }
+    host_psram_start = host_psram_end = NULL;
+    free(psram);
+    psram = NULL;
+}
+
+int main(void)
+{
+    telegram_set_upload_observer(observer);
+    RUN(test_album);
+    RUN(test_largest_album);
+    RUN(test_counts);
+    RUN(test_failures);
+    RUN(test_burst_latency);
+    RUN(test_fanout);
+    RUN(test_fanout_failures);
+    RUN(test_preview);
+    RUN(test_preview_fanout);
+    RUN(test_staged_concurrent);
+    host_http_reset();
+    return TEST_DONE();
+}
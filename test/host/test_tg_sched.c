@@ -0,0 +1,562 @@
+// tg_sched: the policy's slot and yield decisions, a replay of the policy
+// against a simulated uplink with a background upload, and the real
+// scheduler's coalescing, priority and pausing on threads
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_timer.h"
+#include "telegram.h"
+#include "tg_sched.h"
+
+// --- Policy ---
+
+static void test_policy_slots(void)
+{
+    tg_policy_t p = {0};
+    CHECK_EQ(tg_policy_next(&p), TG_CLASS_COUNT);
+
+    // Highest class waiting first
+    p.waiting[TG_CLASS_BULK] = 1;
+    p.waiting[TG_CLASS_STATUS] = 1;
+    CHECK_EQ(tg_policy_next(&p), TG_CLASS_STATUS);
+    p.waiting[TG_CLASS_INTERACTIVE] = 1;
+    CHECK_EQ(tg_policy_next(&p), TG_CLASS_INTERACTIVE);
+
+    // A class at its cap is passed over
+    p.running[TG_CLASS_STATUS] = 1;
+    p.waiting[TG_CLASS_INTERACTIVE] = 0;
+    CHECK_EQ(tg_policy_next(&p), TG_CLASS_BULK);
+    p.running[TG_CLASS_STATUS] = 0;
+    p.running[TG_CLASS_BULK] = 1;
+    p.waiting[TG_CLASS_STATUS] = 0;
+    CHECK_EQ(tg_policy_next(&p), TG_CLASS_COUNT);
+
+    // Connections cap across classes
+    p = (tg_policy_t){0};
+    p.running[TG_CLASS_BULK] = 1;
+    p.running[TG_CLASS_STATUS] = 1;
+    p.waiting[TG_CLASS_INTERACTIVE] = 3;
+    CHECK_EQ(tg_policy_next(&p), TG_CLASS_COUNT);
+    p.running[TG_CLASS_STATUS] = 0;
+    CHECK_EQ(tg_policy_next(&p), TG_CLASS_INTERACTIVE);
+    p.running[TG_CLASS_BULK] = 0;
+    p.running[TG_CLASS_INTERACTIVE] = 2;
+    CHECK_EQ(tg_policy_next(&p), TG_CLASS_COUNT);
+
+    // Interactive may take both slots, status and bulk one each
+    p = (tg_policy_t){0};
+    p.waiting[TG_CLASS_INTERACTIVE] = 1;
+    p.running[TG_CLASS_INTERACTIVE] = 1;
+    CHECK_EQ(tg_policy_next(&p), TG_CLASS_INTERACTIVE);
+    p = (tg_policy_t){0};
+    p.waiting[TG_CLASS_STATUS] = 2;
+    p.running[TG_CLASS_STATUS] = 1;
+    CHECK_EQ(tg_policy_next(&p), TG_CLASS_COUNT);
+}
+
+static void test_policy_yield(void)
+{
+    tg_policy_t p = {0};
+    for (int c = 0; c < TG_CLASS_COUNT; c++) {
+        CHECK(!tg_policy_should_yield(&p, c));
+    }
+    p.waiting[TG_CLASS_INTERACTIVE] = 1;
+    CHECK(tg_policy_should_yield(&p, TG_CLASS_BULK));
+    CHECK(!tg_policy_should_yield(&p, TG_CLASS_STATUS));
+    CHECK(!tg_policy_should_yield(&p, TG_CLASS_INTERACTIVE));
+    p = (tg_policy_t){0};
+    p.running[TG_CLASS_INTERACTIVE] = 1;
+    CHECK(tg_policy_should_yield(&p, TG_CLASS_BULK));
+    // Status traffic never stalls a bulk body
+    p = (tg_policy_t){0};
+    p.waiting[TG_CLASS_STATUS] = 1;
+    p.running[TG_CLASS_STATUS] = 1;
+    CHECK(!tg_policy_should_yield(&p, TG_CLASS_BULK));
+}
+
+// --- Simulation ---
+//
+// Mock server: shared uplink (processor sharing), fixed connection setup and
+// response latency per request, 1 ms ticks. Inline mode runs everything in
+// one FIFO on the bot task, as before the scheduler.
+
+#define LINK_BPS     (1000 * 1024)  // Uplink bytes/s
+#define OPEN_MS      350            // TCP + TLS handshake
+#define RESP_MS      150            // Server processing + response
+#define CHUNK        4096
+#define SIM_MS       (600 * 1000)
+#define NEXEC        3              // Bot task plus the workers
+#define SIM_QUEUE    256
+
+typedef enum { R_WAIT, R_OPEN, R_BODY, R_PAUSED, R_RESP } rstate_t;
+
+typedef struct {
+    size_t left;
+    size_t chunk_left;
+    int t;
+    int paused_at;
+    rstate_t st;
+} req_t;
+
+// A job is a list of requests run one after the other
+typedef struct {
+    tg_class_t cls;
+    int arrive;
+    int nreq;
+    size_t sizes[2];
+    int chat;
+} sim_job_t;
+
+typedef struct {
+    sim_job_t job;
+    int idx;
+    req_t req;
+    bool busy;
+} exec_t;
+
+typedef struct {
+    int photos;
+    int photo_p95;
+    int status_sent;
+    int status_submitted;
+    int bulk_done;
+    int max_pause;
+} sim_result_t;
+
+static bool sched_mode;
+static tg_policy_t pol;
+static int now_ms;
+static exec_t ex[NEXEC];
+static sim_job_t queue[SIM_QUEUE];
+static int nq;
+static int photo_lat[4096];
+static sim_result_t res;
+
+static void sim_submit(sim_job_t j)
+{
+    if (nq < SIM_QUEUE) {
+        queue[nq++] = j;
+    }
+}
+
+// Coalesced as tg_sched_status() does: a queued status for the same chat is replaced
+static void sim_status(int chat)
+{
+    res.status_submitted++;
+    if (sched_mode) {
+        for (int i = 0; i < nq; i++) {
+            if (queue[i].cls == TG_CLASS_STATUS && queue[i].chat == chat) {
+                return;
+            }
+        }
+    }
+    sim_submit((sim_job_t){ .cls = TG_CLASS_STATUS, .arrive = now_ms, .nreq = 1, .sizes = { 300 }, .chat = chat });
+}
+
+static void start_req(exec_t *e)
+{
+    e->req = (req_t){ .left = e->job.sizes[e->idx], .chunk_left = CHUNK, .st = R_WAIT };
+    if (sched_mode) {
+        pol.waiting[e->job.cls]++;
+    }
+}
+
+static int pick(bool bot)
+{
+    if (!sched_mode) {
+        return nq ? 0 : -1;
+    }
+    static const int lim[TG_CLASS_COUNT] = {
+        TG_SCHED_LIMIT_INTERACTIVE, TG_SCHED_LIMIT_STATUS, TG_SCHED_LIMIT_BULK,
+    };
+    int active[TG_CLASS_COUNT] = {0};
+    for (int i = 1; i < NEXEC; i++) {
+        if (ex[i].busy) {
+            active[ex[i].job.cls]++;
+        }
+    }
+    int best = -1;
+    for (int i = 0; i < nq; i++) {
+        // Interactive inline on the bot task, the rest on workers
+        if (bot != (queue[i].cls == TG_CLASS_INTERACTIVE)) {
+            continue;
+        }
+        if (!bot && active[queue[i].cls] >= lim[queue[i].cls]) {
+            continue;
+        }
+        if (best < 0 || queue[i].cls < queue[best].cls) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+static void step(void)
+{
+    // Executors pick jobs
+    for (int i = 0; i < (sched_mode ? NEXEC : 1); i++) {
+        if (ex[i].busy) {
+            continue;
+        }
+        int k = pick(i == 0);
+        if (k < 0) {
+            continue;
+        }
+        ex[i].job = queue[k];
+        memmove(&queue[k], &queue[k + 1], (--nq - k) * sizeof(queue[0]));
+        ex[i].busy = true;
+        ex[i].idx = 0;
+        start_req(&ex[i]);
+    }
+
+    // Grant slots in priority order
+    if (sched_mode) {
+        tg_class_t c;
+        while ((c = tg_policy_next(&pol)) != TG_CLASS_COUNT) {
+            int i = 0;
+            while (i < NEXEC && !(ex[i].busy && ex[i].req.st == R_WAIT && ex[i].job.cls == c)) {
+                i++;
+            }
+            REQUIRE(i < NEXEC);
+            pol.waiting[c]--;
+            pol.running[c]++;
+            ex[i].req.st = R_OPEN;
+            ex[i].req.t = OPEN_MS;
+        }
+    } else if (ex[0].busy && ex[0].req.st == R_WAIT) {
+        ex[0].req.st = R_OPEN;
+        ex[0].req.t = OPEN_MS;
+    }
+
+    // Chunk boundaries pause as tg_sched_checkpoint() does
+    int sending = 0;
+    for (int i = 0; i < NEXEC; i++) {
+        req_t *r = &ex[i].req;
+        if (!ex[i].busy) {
+            continue;
+        }
+        if (sched_mode && (r->st == R_BODY || r->st == R_PAUSED) && r->chunk_left == CHUNK) {
+            bool yield = tg_policy_should_yield(&pol, ex[i].job.cls);
+            if (yield && r->st == R_BODY) {
+                r->paused_at = now_ms;
+            }
+            if (yield && now_ms - r->paused_at >= TG_SCHED_MAX_PAUSE_MS) {
+                yield = false;
+            }
+            if (!yield && r->st == R_PAUSED && now_ms - r->paused_at > res.max_pause) {
+                res.max_pause = now_ms - r->paused_at;
+            }
+            r->st = yield ? R_PAUSED : R_BODY;
+        }
+        if (r->st == R_BODY) {
+            sending++;
+        }
+    }
+
+    // Advance requests
+    double share = sending ? LINK_BPS / 1000.0 / sending : 0;
+    for (int i = 0; i < NEXEC; i++) {
+        exec_t *e = &ex[i];
+        req_t *r = &e->req;
+        if (!e->busy) {
+            continue;
+        }
+        if (r->st == R_OPEN && --r->t <= 0) {
+            r->st = R_BODY;
+        } else if (r->st == R_BODY) {
+            size_t n = (size_t)(share + (rand() % 1000) / 1000.0);
+            if (n > r->left) {
+                n = r->left;
+            }
+            if (n > r->chunk_left) {
+                n = r->chunk_left;
+            }
+            r->left -= n;
+            r->chunk_left -= n;
+            if (!r->chunk_left) {
+                r->chunk_left = CHUNK;
+            }
+            if (!r->left) {
+                r->st = R_RESP;
+                r->t = RESP_MS;
+            }
+        } else if (r->st == R_RESP && --r->t <= 0) {
+            if (sched_mode) {
+                pol.running[e->job.cls]--;
+            }
+            if (++e->idx < e->job.nreq) {
+                start_req(e);
+                continue;
+            }
+            e->busy = false;
+            if (e->job.cls == TG_CLASS_INTERACTIVE) {
+                photo_lat[res.photos++] = now_ms - e->job.arrive;
+            } else if (e->job.cls == TG_CLASS_STATUS) {
+                res.status_sent++;
+            } else {
+                res.bulk_done++;
+            }
+        }
+    }
+}
+
+static sim_result_t simulate(bool scheduler, double bulk_mb)
+{
+    sched_mode = scheduler;
+    pol = (tg_policy_t){0};
+    memset(ex, 0, sizeof(ex));
+    nq = 0;
+    res = (sim_result_t){0};
+    srand(7);
+
+    // Workload: a background video upload every 60 s, /photo about every
+    // 15 s, a progress status for the video every 500 ms while one is live
+    int next_photo = 5000, next_bulk = 1000, next_progress = 1000;
+    for (now_ms = 0; now_ms < SIM_MS; now_ms++) {
+        if (now_ms == next_bulk) {
+            sim_submit((sim_job_t){ .cls = TG_CLASS_BULK, .arrive = now_ms, .nreq = 1,
+                                    .sizes = { (size_t)(bulk_mb * 1024 * 1024) }, .chat = 1 });
+            next_bulk += 60000;
+        }
+        if (now_ms == next_photo) {
+            sim_submit((sim_job_t){ .cls = TG_CLASS_INTERACTIVE, .arrive = now_ms, .nreq = 2,
+                                    .sizes = { 4 * 1024, 60 * 1024 }, .chat = 2 });
+            sim_status(2);
+            next_photo += 5000 + rand() % 20000;
+        }
+        if (now_ms == next_progress) {
+            bool bulk_live = false;
+            for (int i = 0; i < nq; i++) {
+                bulk_live |= queue[i].cls == TG_CLASS_BULK;
+            }
+            for (int i = 0; i < NEXEC; i++) {
+                bulk_live |= ex[i].busy && ex[i].job.cls == TG_CLASS_BULK;
+            }
+            if (bulk_live) {
+                sim_status(1);
+            }
+            next_progress += 500;
+        }
+        step();
+    }
+    qsort(photo_lat, res.photos, sizeof(int), cmp_int);
+    res.photo_p95 = res.photos ? photo_lat[res.photos * 95 / 100] : 0;
+    return res;
+}
+
+static void test_simulation(void)
+{
+    static const double bulk_mb[] = { 3, 8 };
+    for (int i = 0; i < 2; i++) {
+        sim_result_t before = simulate(false, bulk_mb[i]);
+        sim_result_t after = simulate(true, bulk_mb[i]);
+        printf("  bulk %.0f MB: /photo p95 %d ms inline, %d ms scheduled; status %d/%d sent; "
+               "longest pause %d ms\n", bulk_mb[i], before.photo_p95, after.photo_p95,
+               after.status_sent, after.status_submitted, after.max_pause);
+        // A photo no longer waits behind the clip
+        CHECK(after.photos > 30);
+        CHECK(after.photo_p95 < 2000);
+        CHECK(after.photo_p95 < before.photo_p95);
+        // The clips still go out, and no pause outlasts the cap
+        CHECK_EQ(after.bulk_done, 10);
+        CHECK(after.max_pause <= TG_SCHED_MAX_PAUSE_MS);
+        // Queued progress messages collapse
+        CHECK(after.status_sent < after.status_submitted);
+        CHECK(after.status_sent < before.status_sent);
+    }
+}
+
+// --- Scheduler on threads ---
+
+// Stands in for telegram.c: one slot per message, optionally held until released
+static SemaphoreHandle_t sent_sem;
+static SemaphoreHandle_t hold_sem;
+static volatile bool hold_next;
+static char sent[16][TG_SCHED_STATUS_MAX];
+static volatile int nsent;
+
+esp_err_t telegram_send_message(const char *chat_id, const char *text)
+{
+    tg_sched_acquire();
+    bool hold = hold_next;
+    hold_next = false;
+    if (nsent < 16) {
+        snprintf(sent[nsent], sizeof(sent[0]), "%s:%s", chat_id, text);
+    }
+    nsent++;
+    xSemaphoreGive(sent_sem);
+    if (hold) {
+        xSemaphoreTake(hold_sem, portMAX_DELAY);
+    }
+    tg_sched_release();
+    return ESP_OK;
+}
+
+static void wait_sent(int n)
+{
+    while (nsent < n) {
+        REQUIRE(xSemaphoreTake(sent_sem, pdMS_TO_TICKS(5000)) == pdTRUE);
+    }
+}
+
+static void test_status_coalesced(void)
+{
+    nsent = 0;
+    hold_next = true;
+    CHECK_EQ(tg_sched_status("1", "clip 10%"), ESP_OK);
+    wait_sent(1);
+    // The first is on the wire; these queue behind it and merge per chat
+    CHECK_EQ(tg_sched_status("1", "clip 20%"), ESP_OK);
+    CHECK_EQ(tg_sched_status("1", "clip 30%"), ESP_OK);
+    CHECK_EQ(tg_sched_status("2", "Photo captured!"), ESP_OK);
+    CHECK_EQ(tg_sched_status("1", "clip 40%"), ESP_OK);
+    xSemaphoreGive(hold_sem);
+    wait_sent(3);
+    vTaskDelay(pdMS_TO_TICKS(100));
+    CHECK_EQ(nsent, 3);
+    CHECK(strcmp(sent[0], "1:clip 10%") == 0);
+    CHECK(strcmp(sent[1], "1:clip 40%") == 0);
+    CHECK(strcmp(sent[2], "2:Photo captured!") == 0);
+}
+
+typedef struct {
+    SemaphoreHandle_t done;
+    int64_t started;
+    int64_t checkpoint;
+    esp_err_t err;
+} bulk_job_t;
+
+static esp_err_t bulk_job(void *arg)
+{
+    bulk_job_t *b = arg;
+    tg_sched_acquire();
+    b->started = esp_timer_get_time();
+    tg_sched_checkpoint();
+    b->checkpoint = esp_timer_get_time();
+    tg_sched_release();
+    return ESP_FAIL;
+}
+
+static void bulk_done(void *arg, esp_err_t err)
+{
+    bulk_job_t *b = arg;
+    b->err = err;
+    xSemaphoreGive(b->done);
+}
+
+static void test_bulk_pauses(void)
+{
+    bulk_job_t b = { .done = xSemaphoreCreateBinary() };
+    // Interactive work holds a slot: bulk gets the other but pauses its body
+    tg_sched_acquire();
+    int64_t held = esp_timer_get_time();
+    CHECK_EQ(tg_sched_submit(TG_CLASS_BULK, bulk_job, &b, bulk_done), ESP_OK);
+    CHECK(xSemaphoreTake(b.done, pdMS_TO_TICKS(300)) == pdFALSE);
+    CHECK(b.started != 0);
+    int64_t released = esp_timer_get_time();
+    tg_sched_release();
+    REQUIRE(xSemaphoreTake(b.done, pdMS_TO_TICKS(5000)) == pdTRUE);
+    CHECK(b.started - held < 200 * 1000);
+    CHECK(b.checkpoint >= released);
+    CHECK_EQ(b.err, ESP_FAIL);
+
+    // Without interactive work the checkpoint passes straight through
+    b.started = b.checkpoint = 0;
+    CHECK_EQ(tg_sched_submit(TG_CLASS_BULK, bulk_job, &b, bulk_done), ESP_OK);
+    REQUIRE(xSemaphoreTake(b.done, pdMS_TO_TICKS(5000)) == pdTRUE);
+    CHECK(b.checkpoint - b.started < 50 * 1000);
+    vSemaphoreDelete(b.done);
+}
+
+static void test_priority(void)
+{
+    bulk_job_t b = { .done = xSemaphoreCreateBinary() };
+    // Interactive holds both slots; status and bulk wait on the workers
+    tg_sched_acquire();
+    tg_sched_acquire();
+    nsent = 0;
+    CHECK_EQ(tg_sched_submit(TG_CLASS_BULK, bulk_job, &b, bulk_done), ESP_OK);
+    vTaskDelay(pdMS_TO_TICKS(50));
+    CHECK_EQ(tg_sched_status("1", "queued after the clip"), ESP_OK);
+    vTaskDelay(pdMS_TO_TICKS(100));
+    CHECK_EQ(nsent, 0);
+    CHECK_EQ(b.started, 0);
+    // The freed slot goes to status although bulk asked first
+    hold_next = true;
+    tg_sched_release();
+    wait_sent(1);
+    vTaskDelay(pdMS_TO_TICKS(100));
+    CHECK_EQ(b.started, 0);
+    xSemaphoreGive(hold_sem);
+    REQUIRE(xSemaphoreTake(b.done, pdMS_TO_TICKS(5000)) == pdFALSE);
+    // Bulk still pauses behind the remaining interactive slot
+    CHECK(b.started != 0);
+    CHECK_EQ(b.checkpoint, 0);
+    tg_sched_release();
+    REQUIRE(xSemaphoreTake(b.done, pdMS_TO_TICKS(5000)) == pdTRUE);
+    CHECK(b.checkpoint != 0);
+    vSemaphoreDelete(b.done);
+}
+
+static esp_err_t noop_job(void *arg)
+{
+    return ESP_OK;
+}
+
+static esp_err_t slot_job(void *arg)
+{
+    tg_sched_acquire();
+    tg_sched_release();
+    return ESP_OK;
+}
+
+static void test_queue_full(void)
+{
+    // Both slots held here, so the one bulk job a worker may start blocks
+    // and the rest stay queued
+    tg_sched_acquire();
+    tg_sched_acquire();
+    CHECK_EQ(tg_sched_submit(TG_CLASS_BULK, slot_job, NULL, NULL), ESP_OK);
+    vTaskDelay(pdMS_TO_TICKS(50));
+    int queued = 0;
+    while (tg_sched_submit(TG_CLASS_BULK, noop_job, NULL, NULL) == ESP_OK) {
+        REQUIRE(++queued <= TG_SCHED_QUEUE);
+    }
+    CHECK_EQ(queued, TG_SCHED_QUEUE);
+    CHECK_EQ(tg_sched_status("3", "no room"), ESP_ERR_NO_MEM);
+    CHECK_EQ(tg_sched_submit(TG_CLASS_COUNT, noop_job, NULL, NULL), ESP_ERR_INVALID_STATE);
+    tg_sched_release();
+    tg_sched_release();
+    // Drains once the slots are free
+    vTaskDelay(pdMS_TO_TICKS(200));
+    CHECK_EQ(tg_sched_submit(TG_CLASS_BULK, noop_job, NULL, NULL), ESP_OK);
+}
+
+int main(void)
+{
+    RUN(test_policy_slots);
+    RUN(test_policy_yield);
+    RUN(test_simulation);
+
+    sent_sem = xSemaphoreCreateCounting(64, 0);
+    hold_sem = xSemaphoreCreateBinary();
+    // Before init everything runs inline
+    nsent = 0;
+    CHECK_EQ(tg_sched_status("1", "inline"), ESP_OK);
+    CHECK_EQ(nsent, 1);
+    CHECK_EQ(tg_sched_submit(TG_CLASS_BULK, noop_job, NULL, NULL), ESP_ERR_INVALID_STATE);
+    REQUIRE(tg_sched_init() == ESP_OK);
+    RUN(test_status_coalesced);
+    RUN(test_bulk_pauses);
+    RUN(test_priority);
+    RUN(test_queue_full);
+    return TEST_DONE();
+}
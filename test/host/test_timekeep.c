@@ -0,0 +1,204 @@
+// timekeep: the clock comes back from RTC memory after a software reset
+// and from NVS after power loss, never moves backwards, and reports the
+// right source and drift bound. The wall clock is faked by wrapping
+// time() and settimeofday() at link time.
+#include <string.h>
+#include <sys/time.h>
+#include "test.h"
+#include "esp_system.h"
+#include "esp_sntp.h"
+#include "nvs.h"
+#include "timekeep.h"
+
+#define SYNC_TIME   1760000000      // Some time in October 2025
+
+static time_t wall;                 // Fake system clock, seconds
+static int clock_sets;
+
+time_t __wrap_time(time_t *out)
+{
+    if (out) {
+        *out = wall;
+    }
+    return wall;
+}
+
+int __wrap_settimeofday(const struct timeval *tv, const void *tz)
+{
+    (void)tz;
+    wall = tv->tv_sec;
+    clock_sets++;
+    return 0;
+}
+
+// What the SNTP client does on a sync: set the clock, then notify
+static void sntp_sync(time_t now)
+{
+    wall = now;
+    host_sntp_sync(now);
+}
+
+static void reboot(esp_reset_reason_t reason, time_t clock)
+{
+    host_reset_reason = reason;
+    wall = clock;
+    clock_sets = 0;
+}
+
+static int64_t saved_sync(void)
+{
+    nvs_handle_t nvs;
+    int64_t t = 0;
+    if (nvs_open("timekeep", NVS_READONLY, &nvs) == ESP_OK) {
+        nvs_get_i64(nvs, "last_sync", &t);
+        nvs_close(nvs);
+    }
+    return t;
+}
+
+static void test_first_boot(void)
+{
+    reboot(ESP_RST_POWERON, 0);
+    CHECK_EQ(timekeep_restore(), ESP_OK);
+    timekeep_status_t st;
+    timekeep_get_status(&st);
+    CHECK_EQ(st.source, TIMEKEEP_NONE);
+    CHECK_EQ(st.last_sync, 0);
+    CHECK_EQ(st.uncertainty_ms, -1);
+    CHECK_EQ(clock_sets, 0);
+    CHECK(!timekeep_wait_sync(pdMS_TO_TICKS(20)));
+}
+
+static void test_sync(void)
+{
+    timekeep_start_sync();
+    CHECK(host_sntp_running);
+    CHECK(host_sntp_server && strcmp(host_sntp_server, "pool.ntp.org") == 0);
+
+    sntp_sync(SYNC_TIME);
+    CHECK(timekeep_wait_sync(0));
+    CHECK_EQ(saved_sync(), SYNC_TIME);
+    timekeep_status_t st;
+    timekeep_get_status(&st);
+    CHECK_EQ(st.source, TIMEKEEP_SNTP);
+    CHECK_EQ(st.last_sync, SYNC_TIME);
+    CHECK_EQ(st.uncertainty_ms, 0);
+
+    // 500 ppm over 1000 s
+    wall = SYNC_TIME + 1000;
+    timekeep_get_status(&st);
+    CHECK_EQ(st.uncertainty_ms, 500);
+}
+
+static void test_software_reset(void)
+{
+    // The RTC kept counting through the reset: keep the clock as it is
+    reboot(ESP_RST_SW, SYNC_TIME + 3600);
+    CHECK_EQ(timekeep_restore(), ESP_OK);
+    CHECK_EQ(clock_sets, 0);
+    CHECK_EQ(wall, SYNC_TIME + 3600);
+    timekeep_status_t st;
+    timekeep_get_status(&st);
+    CHECK_EQ(st.source, TIMEKEEP_RTC);
+    CHECK_EQ(st.last_sync, SYNC_TIME);
+    CHECK_EQ(st.uncertainty_ms, 3600 * TIMEKEEP_DRIFT_PPM / 1000);
+
+    // A panic or watchdog reset keeps the RTC just the same
+    reboot(ESP_RST_TASK_WDT, SYNC_TIME + 7200);
+    CHECK_EQ(timekeep_restore(), ESP_OK);
+    timekeep_get_status(&st);
+    CHECK_EQ(st.source, TIMEKEEP_RTC);
+    CHECK_EQ(clock_sets, 0);
+}
+
+static void test_power_loss(void)
+{
+    // The clock starts over at 1970; the saved sync is a lower bound
+    reboot(ESP_RST_POWERON, 5);
+    CHECK_EQ(timekeep_restore(), ESP_OK);
+    CHECK_EQ(clock_sets, 1);
+    CHECK_EQ(wall, SYNC_TIME);
+    timekeep_status_t st;
+    timekeep_get_status(&st);
+    CHECK_EQ(st.source, TIMEKEEP_RESTORED);
+    CHECK_EQ(st.last_sync, SYNC_TIME);
+    CHECK_EQ(st.uncertainty_ms, -1);
+
+    // No sync since: after a software reset the RTC copy is not trusted,
+    // the clock comes from NVS again
+    reboot(ESP_RST_SW, SYNC_TIME + 60);
+    CHECK_EQ(timekeep_restore(), ESP_OK);
+    timekeep_get_status(&st);
+    CHECK_EQ(st.source, TIMEKEEP_RESTORED);
+    // Already past the saved time: never set the clock backwards
+    CHECK_EQ(clock_sets, 0);
+    CHECK_EQ(wall, SYNC_TIME + 60);
+}
+
+static void test_brownout(void)
+{
+    sntp_sync(SYNC_TIME + 86400);
+    // A brownout may have corrupted RTC memory even if the magic survived
+    reboot(ESP_RST_BROWNOUT, 0);
+    CHECK_EQ(timekeep_restore(), ESP_OK);
+    timekeep_status_t st;
+    timekeep_get_status(&st);
+    CHECK_EQ(st.source, TIMEKEEP_RESTORED);
+    CHECK_EQ(wall, SYNC_TIME + 86400);
+}
+
+static void test_rtc_behind_sync(void)
+{
+    sntp_sync(SYNC_TIME + 2 * 86400);
+    // Clock earlier than the last sync after a reset: the RTC did not keep
+    // it, fall back to NVS and move forward
+    reboot(ESP_RST_SW, SYNC_TIME);
+    CHECK_EQ(timekeep_restore(), ESP_OK);
+    timekeep_status_t st;
+    timekeep_get_status(&st);
+    CHECK_EQ(st.source, TIMEKEEP_RESTORED);
+    CHECK_EQ(wall, SYNC_TIME + 2 * 86400);
+}
+
+static void test_nvs_errors(void)
+{
+    reboot(ESP_RST_POWERON, 0);
+    host_nvs_open_err = ESP_ERR_NO_MEM;
+    CHECK_EQ(timekeep_restore(), ESP_ERR_NO_MEM);
+    CHECK_EQ(clock_sets, 0);
+    // A sync that cannot be saved still counts
+    sntp_sync(SYNC_TIME + 3 * 86400);
+    timekeep_status_t st;
+    timekeep_get_status(&st);
+    CHECK_EQ(st.source, TIMEKEEP_SNTP);
+    host_nvs_open_err = ESP_OK;
+    CHECK_EQ(saved_sync(), SYNC_TIME + 2 * 86400);
+
+    host_nvs_erase();
+    reboot(ESP_RST_POWERON, 0);
+    CHECK_EQ(timekeep_restore(), ESP_OK);
+    CHECK_EQ(clock_sets, 0);
+}
+
+static void test_source_names(void)
+{
+    CHECK(strcmp(timekeep_source_name(TIMEKEEP_NONE), "none") == 0);
+    CHECK(strcmp(timekeep_source_name(TIMEKEEP_RESTORED), "restored") == 0);
+    CHECK(strcmp(timekeep_source_name(TIMEKEEP_RTC), "rtc") == 0);
+    CHECK(strcmp(timekeep_source_name(TIMEKEEP_SNTP), "sntp") == 0);
+}
+
+int main(void)
+{
+    // Each step is a boot following the one before, RTC memory and NVS
+    // carried over
+    RUN(test_first_boot);
+    RUN(test_sync);
+    RUN(test_software_reset);
+    RUN(test_power_loss);
+    RUN(test_brownout);
+    RUN(test_rtc_behind_sync);
+    RUN(test_nvs_errors);
+    RUN(test_source_names);
+    return TEST_DONE();
+}
@@ -0,0 +1,259 @@
+// trace: events on both cores across the 32-bit timestamp wrap, more than
+// the rings hold, go through tools/trace2json.py once as the binary dump
+// and once as the base64 log. Both must give the same JSON, holding
+// exactly the events the rings kept, in time order on the widened clock.
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "test.h"
+#include "esp_camera.h"
+#include "freertos/FreeRTOS.h"
+#include "trace.h"
+
+// The low 32 bits wrap 60 ms in, inside what both rings keep
+#define CLOCK_START     (0x100000000LL - 60000)
+#define TICK_US         37
+#define ROUNDS          300
+#define MAX_EVENTS      (ROUNDS * 6 + 1)
+
+typedef struct {
+    int64_t ts;
+    int core;
+    trace_id_t id;
+    trace_kind_t kind;
+    uint32_t arg;
+} event_t;
+
+static int64_t clock_us = CLOCK_START;
+static int core;
+static event_t sent[MAX_EVENTS];
+static int sent_count;
+
+int64_t __wrap_esp_timer_get_time(void)
+{
+    return clock_us;
+}
+
+BaseType_t __wrap_xPortGetCoreID(void)
+{
+    return core;
+}
+
+static camera_trace_cb_t camera_cb;
+
+void esp_camera_set_trace_cb(camera_trace_cb_t cb)
+{
+    camera_cb = cb;
+}
+
+static void emit(int on_core, trace_id_t id, trace_kind_t kind, uint32_t arg)
+{
+    clock_us += TICK_US;
+    core = on_core;
+    if (id >= TRACE_CAM_FRAME_START) {
+        camera_cb(id - TRACE_CAM_FRAME_START + CAMERA_TRACE_FRAME_START, arg);
+    } else {
+        trace_event(id, kind, arg);
+    }
+    REQUIRE(sent_count < MAX_EVENTS);
+    sent[sent_count++] = (event_t){ clock_us, on_core, id, kind, arg };
+}
+
+// A photo span that begins on one core and ends on the other, with the
+// driver and the upload logging in between
+static void record(void)
+{
+    trace_attach_camera();
+    REQUIRE(camera_cb);
+    for (int i = 0; i < ROUNDS; i++) {
+        emit(i & 1, TRACE_PHOTO, TRACE_BEGIN, i);
+        emit(1, TRACE_CAM_FRAME_START, TRACE_INSTANT, i % 3);
+        emit(1, TRACE_CAM_FRAME_DROP, TRACE_INSTANT, CAMERA_DROP_NO_EOI);
+        emit(0, TRACE_BYTES_WRITTEN, TRACE_COUNTER, i * 100);
+        emit(1, TRACE_RESPONSE, TRACE_INSTANT, 200);
+        emit(!(i & 1), TRACE_PHOTO, TRACE_END, 1);
+    }
+    // The dump reads the clock once more
+    clock_us += TICK_US;
+}
+
+static void write_file(const char *path, const void *buf, size_t len)
+{
+    FILE *f = fopen(path, "wb");
+    REQUIRE(f && fwrite(buf, 1, len, f) == len);
+    fclose(f);
+}
+
+static char *read_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    REQUIRE(f);
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    rewind(f);
+    char *buf = malloc(len + 1);
+    REQUIRE(buf && fread(buf, 1, len, f) == (size_t)len);
+    buf[len] = 0;
+    fclose(f);
+    return buf;
+}
+
+static char *trace2json(const char *input, const char *output)
+{
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "%s %s %s -o %s", PYTHON, TRACE2JSON, input, output);
+    REQUIRE(system(cmd) == 0);
+    return read_file(output);
+}
+
+// The events the rings still hold: the newest TRACE_RING_EVENTS per core
+static bool kept(int i)
+{
+    int newer = 0;
+    for (int j = i + 1; j < sent_count; j++) {
+        newer += sent[j].core == sent[i].core;
+    }
+    return newer < TRACE_RING_EVENTS;
+}
+
+static char *binary_json, *log_json;
+
+static void test_dump_formats(void)
+{
+    record();
+    size_t cap = trace_dump_size();
+    uint8_t *buf = malloc(cap);
+    REQUIRE(buf);
+    CHECK_EQ(trace_dump(buf, cap - 1), 0);
+    size_t len = trace_dump(buf, cap);
+    CHECK(len > 0 && len <= cap);
+    write_file("trace.bin", buf, len);
+
+    // The console dump, amid other log lines as a serial monitor sees it
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    FILE *log = freopen("trace.log", "w", stdout);
+    REQUIRE(log);
+    printf("I (1234) main: unrelated line\n");
+    REQUIRE(trace_dump_log() == ESP_OK);
+    printf("I (1240) main: another one\n");
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    binary_json = trace2json("trace.bin", "trace_bin.json");
+    log_json = trace2json("trace.log", "trace_log.json");
+    CHECK(strcmp(binary_json, log_json) == 0);
+    free(buf);
+}
+
+// Value of "key": after p, in the object p is in
+static bool field(const char *p, const char *end, const char *key, long long *value)
+{
+    char pat[32];
+    snprintf(pat, sizeof(pat), "\"%s\": ", key);
+    const char *at = strstr(p, pat);
+    return at && at < end && sscanf(at + strlen(pat), "%lld", value) == 1;
+}
+
+static void test_events(void)
+{
+    REQUIRE(binary_json);
+    // A full ring lost everything before its oldest record, so spans are
+    // only drawn from the newest of those on
+    int64_t complete_from = 0;
+    for (int c = 0; c < portNUM_PROCESSORS; c++) {
+        int count = 0;
+        int64_t oldest = 0;
+        for (int i = sent_count - 1; i >= 0; i--) {
+            if (sent[i].core == c && ++count == TRACE_RING_EVENTS) {
+                oldest = sent[i].ts;
+            }
+        }
+        if (count >= TRACE_RING_EVENTS && oldest > complete_from) {
+            complete_from = oldest;
+        }
+    }
+    // Instants and counters come out one per kept record, in time order
+    int want_points = 0, want_spans = 0;
+    for (int i = 0; i < sent_count; i++) {
+        if (!kept(i)) {
+            continue;
+        }
+        if (sent[i].kind == TRACE_INSTANT || sent[i].kind == TRACE_COUNTER) {
+            want_points++;
+        } else if (sent[i].kind == TRACE_END) {
+            // Its begin is five events back
+            want_spans += kept(i - 5) && sent[i - 5].ts >= complete_from;
+        }
+    }
+
+    int points = 0, spans = 0, next = 0;
+    long long first_ts = 0, last_ts = 0;
+    for (const char *p = strstr(binary_json, "\"ph\": \""); p; p = strstr(p + 1, "\"ph\": \"")) {
+        const char *end = strchr(p, '}');
+        char ph = p[7];
+        long long ts, dur, tid;
+        if (ph == 'M') {
+            continue;
+        }
+        REQUIRE(end && field(p, end, "ts", &ts) && field(p, end, "tid", &tid));
+        if (ph == 'X') {
+            REQUIRE(field(p, end, "dur", &dur));
+            CHECK_EQ(dur, 5 * TICK_US);
+            CHECK(ts > CLOCK_START);
+            spans++;
+            continue;
+        }
+        CHECK(ph == 'i' || ph == 'C');
+        // The next kept instant or counter that was sent
+        while (next < sent_count && (!kept(next) || sent[next].kind == TRACE_BEGIN || sent[next].kind == TRACE_END)) {
+            next++;
+        }
+        REQUIRE(next < sent_count);
+        if (ts != sent[next].ts || tid != sent[next].core) {
+            printf("event %d: ts %lld on core %lld, sent at %lld on core %d\n", points, ts, tid,
+                   (long long)sent[next].ts, sent[next].core);
+            check_failures++;
+        }
+        CHECK(ts >= last_ts);
+        first_ts = points ? first_ts : ts;
+        last_ts = ts;
+        next++;
+        points++;
+    }
+    printf("%d events sent, %d instants and counters and %d spans decoded, %lld-%lld us\n",
+           sent_count, points, spans, first_ts, last_ts);
+    CHECK_EQ(points, want_points);
+    CHECK_EQ(spans, want_spans);
+    // The kept events straddle the wrap
+    CHECK(first_ts < 0x100000000LL && last_ts > 0x100000000LL);
+    CHECK(strstr(binary_json, "\"reason\": \"no_eoi\""));
+}
+
+static void test_clear(void)
+{
+    trace_clear();
+    size_t cap = trace_dump_size();
+    uint8_t *buf = malloc(cap);
+    REQUIRE(buf);
+    size_t len = trace_dump(buf, cap);
+    // Header and names, then an empty count per core
+    uint32_t count;
+    memcpy(&count, buf + len - 4, 4);
+    CHECK_EQ(count, 0);
+    memcpy(&count, buf + len - 8, 4);
+    CHECK_EQ(count, 0);
+    // An event after a clear is dumped again, as one 16-byte record
+    emit(0, TRACE_POLL, TRACE_BEGIN, 0);
+    CHECK_EQ(trace_dump(buf, cap), len + 16);
+    free(buf);
+}
+
+int main(void)
+{
+    RUN(test_dump_formats);
+    RUN(test_events);
+    RUN(test_clear);
+    return TEST_DONE();
+}
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""Convert an ESP32-CAM trace dump into a Chrome/Perfetto JSON timeline.
+
+The input is either the binary file sent by the /trace command or a serial
+log containing the base64 block printed by /trace log. Open the output in
+chrome://tracing or https://ui.perfetto.dev.
+
+    tools/trace2json.py trace.bin -o trace.json
+    tools/trace2json.py monitor.log > trace.json
+"""
+
+import argparse
+import base64
+import json
+import struct
+import sys
+
+MAGIC = b"TRC1"
+RECORD = struct.Struct("<IIIBBH")    # seq, ts_us, arg, id, kind, reserved
+HEADER = struct.Struct("<4sBBHIq")   # magic, version, cores, names, ring size, now_us
+
+KINDS = ("i", "B", "E", "C")
+SPAN_TID = 100
+
+# camera_drop_reason_t in components/esp32-camera/driver/include/esp_camera.h
+DROP_REASONS = ("event_ovf", "fb_ovf", "dma_ovf", "no_soi", "no_eoi", "fb_size", "fbq_full",
+                "dma_overrun")
+
+
+def extract(data):
+    """Return the raw dump from a binary file or a serial log."""
+    if data.startswith(MAGIC):
+        return data
+    lines = data.decode("utf-8", "replace").splitlines()
+    try:
+        begin = next(i for i, l in enumerate(lines) if "BEGIN TRACE" in l)
+        end = next(i for i, l in enumerate(lines) if "END TRACE" in l and i > begin)
+    except StopIteration:
+        sys.exit("no trace found in input")
+    return base64.b64decode("".join(l.strip() for l in lines[begin + 1:end]))
+
+
+def parse(dump):
+    """Return the events in time order, and the time from which no core has
+    lost any: a full ring has dropped everything before its oldest record."""
+    magic, version, cores, name_count, ring, now_us = HEADER.unpack_from(dump, 0)
+    if magic != MAGIC or version != 1:
+        sys.exit("unsupported trace format")
+    pos = HEADER.size
+    names = []
+    for _ in range(name_count):
+        end = dump.index(b"\0", pos)
+        names.append(dump[pos:end].decode())
+        pos = end + 1
+
+    events = []
+    complete_from = None
+    for core in range(cores):
+        (count,) = struct.unpack_from("<I", dump, pos)
+        pos += 4
+        oldest = None
+        for _ in range(count):
+            _seq, ts, arg, ev_id, kind, _ = RECORD.unpack_from(dump, pos)
+            pos += RECORD.size
+            # Timestamps are the low 32 bits; every event happened before now_us
+            full = now_us - ((now_us - ts) & 0xFFFFFFFF)
+            name = names[ev_id] if ev_id < len(names) else "event_%d" % ev_id
+            events.append((full, core, name, kind, arg))
+            oldest = full if oldest is None else min(oldest, full)
+        if count == ring and (complete_from is None or oldest > complete_from):
+            complete_from = oldest
+    events.sort(key=lambda e: e[0])
+    return events, complete_from
+
+
+def to_chrome(events, complete_from=None):
+    """Instants and counters go on the track of the core that logged them.
+
+    Tasks are not pinned, so a span can begin on one core and end on the
+    other; begin/end pairs are matched by name and drawn as complete events
+    on a shared "spans" track instead. A begin from before complete_from may
+    have lost its end to another core's ring, and is not matched.
+    """
+    out = []
+    open_spans = {}
+    for ts, core, name, kind, arg in events:
+        if kind == 1:
+            if complete_from is None or ts >= complete_from:
+                open_spans.setdefault(name, []).append((ts, arg))
+            continue
+        if kind == 2:
+            if not open_spans.get(name):
+                continue    # Began before the oldest record still in the ring
+            begin, begin_arg = open_spans[name].pop()
+            out.append({"name": name, "ph": "X", "ts": begin, "dur": ts - begin,
+                        "pid": 0, "tid": SPAN_TID, "args": {"arg": begin_arg, "result": arg}})
+            continue
+        ev = {"name": name, "ph": KINDS[kind], "ts": ts, "pid": 0, "tid": core}
+        if kind == 3:
+            ev["args"] = {name: arg}
+        else:
+            ev["s"] = "t"
+            if name == "cam_frame_drop" and arg < len(DROP_REASONS):
+                ev["args"] = {"reason": DROP_REASONS[arg]}
+            else:
+                ev["args"] = {"arg": arg}
+        out.append(ev)
+
+    tracks = {c: "core %d" % c for c in {e[1] for e in events}}
+    tracks[SPAN_TID] = "spans"
+    meta = [{"name": "thread_name", "ph": "M", "pid": 0, "tid": tid, "args": {"name": label}}
+            for tid, label in sorted(tracks.items())]
+    return {"traceEvents": meta + out, "displayTimeUnit": "ms"}
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument("input", help="trace.bin or serial log")
+    ap.add_argument("-o", "--output", help="output file (default stdout)")
+    args = ap.parse_args()
+
+    with open(args.input, "rb") as f:
+        events, complete_from = parse(extract(f.read()))
+    result = json.dumps(to_chrome(events, complete_from), indent=1)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(result)
+    else:
+        print(result)
+
+
+if __name__ == "__main__":
+    main()